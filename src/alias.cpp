@@ -23,8 +23,7 @@ extern CAliasDB *paliasdb;
 
 
 map<vector<unsigned char>, uint256> mapMyAliases;
-map<vector<unsigned char>, set<uint256> > mapAliasesPending;
-list<CAliasFee> lstAliasFees;
+CFeeWindow aliasFeeWindow(60 * 60 * 12);
 
 #ifdef GUI
 extern std::map<uint160, std::vector<unsigned char> > mapMyNameHashes;
@@ -59,8 +58,6 @@ extern bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey,
 		int nHashType);
 extern bool IsConflictedAliasTx(CBlockTreeDB& txdb, const CTransaction& tx,
 		vector<unsigned char>& name);
-extern void rescanforaliases(CBlockIndex *pindexRescan);
-extern void rescanforoffers(CBlockIndex *pindexRescan);
 //extern Value sendtoaddress(const Array& params, bool fHelp);
 
 CScript RemoveAliasScriptPrefix(const CScript& scriptIn);
@@ -68,50 +65,6 @@ int GetAliasExpirationDepth(int nHeight);
 int64 GetAliasNetFee(const CTransaction& tx);
 bool CheckAliasTxPos(const vector<CAliasIndex> &vtxPos, const int txPos);
 
-void RemoveAliasTxnFromMemoryPool(const CTransaction& tx) {
-	if (tx.nVersion != SYSCOIN_TX_VERSION)
-		return;
-
-	if (tx.vout.size() < 1)
-		return;
-
-	vector<vector<unsigned char> > vvch;
-
-	int op;
-	int nOut;
-
-	if (!DecodeAliasTx(tx, op, nOut, vvch, -1))
-		return;
-
-	if (op != OP_ALIAS_NEW) {
-		{
-			TRY_LOCK(cs_main, cs_trymain);
-			std::map<std::vector<unsigned char>, std::set<uint256> >::iterator mi =
-					mapAliasesPending.find(vvch[0]);
-			if (mi != mapAliasesPending.end())
-				mi->second.erase(tx.GetHash());
-		}
-	}
-}
-
-void PutToAliasList(std::vector<CAliasIndex> &aliasList, CAliasIndex& index) {
-	int i = aliasList.size() - 1;
-	BOOST_REVERSE_FOREACH(CAliasIndex &o, aliasList) {
-        if(index.nHeight != 0 && o.nHeight == index.nHeight) {
-        	aliasList[i] = index;
-            return;
-        }
-        else if(o.txHash != 0 && o.txHash == index.txHash) {
-        	aliasList[i] = index;
-            return;
-        }
-        i--;
-	}
-    aliasList.push_back(index);
-}
-
-
-
 int GetMinActivateDepth() {
 	if (fCakeNet)
 		return MIN_ACTIVATE_DEPTH_CAKENET;
@@ -126,74 +79,26 @@ bool IsAliasOp(int op) {
 
 bool InsertAliasFee(CBlockIndex *pindex, uint256 hash, uint64 vValue) {
 	TRY_LOCK(cs_main, cs_trymain);
-	list<CAliasFee> txnDup;
-	CAliasFee txnVal(hash, pindex->nTime, pindex->nHeight, vValue);
-	bool bFound = false;
-
-	BOOST_FOREACH(CAliasFee &nmTxnValue, lstAliasFees) {
-		if (txnVal.hash == nmTxnValue.hash
-				&& txnVal.nHeight == nmTxnValue.nHeight) {
-			nmTxnValue = txnVal;
-			bFound = true;
-			break;
-		}
-	}
-	if (!bFound)
-		lstAliasFees.push_front(txnVal);
-	return bFound;
+	return aliasFeeWindow.Insert(hash, pindex->nHeight, pindex->nTime, vValue, true);
 }
 
 bool RemoveAliasFee(CAliasFee &txnVal) {
 	TRY_LOCK(cs_main, cs_trymain);
-	CAliasFee *theval = NULL;
-	if(lstAliasFees.size()==0) return false;
-
-	BOOST_FOREACH(CAliasFee &nmTxnValue, lstAliasFees) {
-		if (txnVal.hash == nmTxnValue.hash
-		 && txnVal.nHeight == nmTxnValue.nHeight) {
-			theval = &nmTxnValue;
-			break;
-		}
-	}
+	return aliasFeeWindow.Remove(txnVal.hash, txnVal.nHeight);
+}
 
-	if(theval)
-		lstAliasFees.remove(*theval);
-	return theval != NULL;
+void SetAliasFees(const vector<CAliasFee> &vFees) {
+	vector<CFeeWindowEntry> vEntries;
+	BOOST_FOREACH(const CAliasFee &fee, vFees)
+		vEntries.push_back(CFeeWindowEntry(fee.hash, fee.nHeight, fee.nBlockTime, fee.nValue));
+	aliasFeeWindow.SetEntries(vEntries);
 }
 
 uint64 GetAliasFeeSubsidy(unsigned int nHeight) {
-	uint64 hr1 = 1, hr12 = 1;
+	uint64 hr1, hr12;
 	{
 		TRY_LOCK(cs_main, cs_trymain);
-
-		unsigned int h12 = 60 * 60 * 12;
-		unsigned int nTargetTime = 0;
-		unsigned int nTarget1hrTime = 0;
-		unsigned int blk1hrht = nHeight - 1, blk12hrht = nHeight - 1;
-		bool bFound = false;
-
-		BOOST_FOREACH(CAliasFee &nmTxnValue, lstAliasFees) {
-			if (nmTxnValue.nHeight <= nHeight)
-				bFound = true;
-			if (bFound) {
-				if (nTargetTime == 0) {
-					hr1 = hr12 = 0;
-					nTargetTime = nmTxnValue.nBlockTime - h12;
-					nTarget1hrTime = nmTxnValue.nBlockTime - (h12 / 12);
-				}
-				if (nmTxnValue.nBlockTime > nTargetTime) {
-					hr12 += nmTxnValue.nValue;
-					blk12hrht = nmTxnValue.nHeight;
-					if (nmTxnValue.nBlockTime > nTarget1hrTime) {
-						hr1 += nmTxnValue.nValue;
-						blk1hrht = nmTxnValue.nHeight;
-					}
-				}
-			}
-		}
-		hr12 /= (nHeight - blk12hrht) + 1;
-		hr1 /= (nHeight - blk1hrht) + 1;
-	//	printf("GetAliasFeeSubsidy() : Alias fee mining reward for height %d: %llu\n", nHeight, nSubsidyOut);
+		aliasFeeWindow.GetAverages(nHeight, hr1, hr12);
 	}
 	return (hr12 + hr1) / 2;
 }
@@ -242,13 +147,10 @@ int64 GetAliasNetFee(const CTransaction& tx) {
 }
 
 int GetAliasHeight(vector<unsigned char> vchName) {
-	vector<CAliasIndex> vtxPos;
+	CAliasIndex txPos;
 	if (paliasdb->ExistsAlias(vchName)) {
-		if (!paliasdb->ReadAlias(vchName, vtxPos))
+		if (!paliasdb->ReadAlias(vchName, txPos))
 			return error("GetAliasHeight() : failed to read from alias DB");
-		if (vtxPos.empty())
-			return -1;
-		CAliasIndex& txPos = vtxPos.back();
 		return txPos.nHeight;
 	}
 	return -1;
@@ -350,10 +252,11 @@ bool CheckAliasInputs(CBlockIndex *pindexBlock, const CTransaction &tx,
 		}
 
 		// decode alias info from transaction
-		vector<vector<unsigned char> > vvchArgs;
-		int op, nOut, nPrevHeight;
+		const CServiceOp &alias = tx.GetServiceOps().alias;
+		const vector<vector<unsigned char> > &vvchArgs = alias.vvch;
+		int op = alias.op, nPrevHeight;
 		int64 nDepth;
-		if (!DecodeAliasTx(tx, op, nOut, vvchArgs, -1))
+		if (!alias.fDecoded)
 			return error(
 					"CheckAliasInputs() : could not decode syscoin alias info from tx %s",
 					tx.GetHash().GetHex().c_str());
@@ -489,9 +392,9 @@ bool CheckAliasInputs(CBlockIndex *pindexBlock, const CTransaction &tx,
 			if (op != OP_ALIAS_NEW) {
 
 				// get the alias from the DB
-				vector<CAliasIndex> vtxPos;
+				CAliasIndex txPos;
 				if (paliasdb->ExistsAlias(vvchArgs[0])) {
-					if (!paliasdb->ReadAlias(vvchArgs[0], vtxPos)
+					if (!paliasdb->ReadAlias(vvchArgs[0], txPos)
 							&& op == OP_ALIAS_UPDATE && !fJustCheck)
 						return error(
 								"CheckAliasInputs() : failed to read from alias DB");
@@ -517,12 +420,10 @@ bool CheckAliasInputs(CBlockIndex *pindexBlock, const CTransaction &tx,
 					txPos2.txHash = tx.GetHash();
 					txPos2.txPrevOut = *prevOutput;
 
-					PutToAliasList(vtxPos, txPos2);
-
 					{
 					TRY_LOCK(cs_main, cs_trymain);
 
-					if (!paliasdb->WriteName(vvchArgs[0], vtxPos))
+					if (!paliasdb->WriteName(vvchArgs[0], txPos2))
 						return error( "CheckAliasInputs() :  failed to write to alias DB");
 					mapTestPool[vvchArgs[0]] = tx.GetHash();
 
@@ -532,16 +433,6 @@ bool CheckAliasInputs(CBlockIndex *pindexBlock, const CTransaction &tx,
 					if (nTheFee != 0)
 						printf( "ALIAS FEES: Added %lf in fees to track for regeneration.\n",
 								(double) nTheFee / COIN);
-
-					vector<CAliasFee> vAliasFees(lstAliasFees.begin(),
-							lstAliasFees.end());
-					if (!paliasdb->WriteAliasTxFees(vAliasFees))
-						return error( "CheckOfferInputs() : failed to write fees to alias DB");
-					
-						std::map<std::vector<unsigned char>, std::set<uint256> >::iterator mi =
-								mapAliasesPending.find(vvchArgs[0]);
-						if (mi != mapAliasesPending.end())
-							mi->second.erase(tx.GetHash());
 					}
 
 					printf(
@@ -645,12 +536,9 @@ bool CAliasDB::ScanNames(const std::vector<unsigned char>& vchName,
 				CDataStream ssValue(slValue.data(),
 						slValue.data() + slValue.size(), SER_DISK,
 						CLIENT_VERSION);
-				vector<CAliasIndex> vtxPos;
-				ssValue >> vtxPos;
-				CAliasIndex txPos;
-				if (!vtxPos.empty())
-					txPos = vtxPos.back();
-				nameScan.push_back(make_pair(vchName, txPos));
+				CServiceVersion<CAliasIndex> head;
+				ssValue >> head;
+				nameScan.push_back(make_pair(vchName, head.value));
 			}
 			if (nameScan.size() >= nMax)
 				break;
@@ -664,87 +552,184 @@ bool CAliasDB::ScanNames(const std::vector<unsigned char>& vchName,
 	return true;
 }
 
-void rescanforaliases(CBlockIndex *pindexRescan) {
-	printf("Scanning blockchain for names to create fast index...\n");
-	paliasdb->ReconstructNameIndex(pindexRescan);
+// height at which an alias last updated at nHeight expires
+static int64 GetAliasExpiryHeight(int64 nHeight) {
+	return nHeight + GetAliasDisplayExpirationDepth(nHeight);
 }
 
-bool CAliasDB::ReconstructNameIndex(CBlockIndex *pindexRescan) {
-	CDiskTxPos txindex;
-	CBlockIndex* pindex = pindexRescan;
+bool CAliasDB::WriteName(const std::vector<unsigned char>& name, const CAliasIndex& txPos) {
+	CAliasIndex txPosOld;
+	if (ReadAlias(name, txPosOld))
+		EraseExpiry(string("namex"), GetAliasExpiryHeight(txPosOld.nHeight), name);
+	return PutVersion(string("namei"), string("nameh"), name, txPos.nHeight, txPos)
+		&& WriteExpiry(string("namex"), GetAliasExpiryHeight(txPos.nHeight), name);
+}
 
-	{
-		TRY_LOCK(pwalletMain->cs_wallet, cs_trylock);
-		while (pindex) {
-			CBlock block;
-			block.ReadFromDisk(pindex);
-			int nHeight = pindex->nHeight;
-			uint256 txblkhash;
+bool CAliasDB::PopName(const std::vector<unsigned char>& name, const uint256& txHash) {
+	CServiceVersion<CAliasIndex> head;
+	if (!ReadHead(string("namei"), name, head))
+		return false;
+	// only the transaction that wrote the head can take it off
+	if (head.value.txHash != txHash)
+		return true;
+	EraseExpiry(string("namex"), GetAliasExpiryHeight(head.nHeight), name);
+	if (!PopVersion(string("namei"), string("nameh"), name, head))
+		return false;
+	CAliasIndex txPos;
+	if (ReadAlias(name, txPos))
+		return WriteExpiry(string("namex"), GetAliasExpiryHeight(txPos.nHeight), name);
+	return true;
+}
 
-			BOOST_FOREACH(CTransaction& tx, block.vtx) {
+bool CAliasDB::EraseName(const std::vector<unsigned char>& name) {
+	CAliasIndex txPosOld;
+	if (ReadAlias(name, txPosOld))
+		EraseExpiry(string("namex"), GetAliasExpiryHeight(txPosOld.nHeight), name);
+	return EraseHistory(string("namei"), string("nameh"), name);
+}
 
-				if (tx.nVersion != SYSCOIN_TX_VERSION)
-					continue;
+bool CAliasDB::BuildAliasExpiry() {
+	int nVersion = 0;
+	if (Read(make_pair(string("namea"), string("nameexp")), nVersion) && nVersion >= 1)
+		return true;
 
-				vector<vector<unsigned char> > vvchArgs;
-				int op, nOut;
+	printf("Building alias expiry index...\n");
+	vector<unsigned char> vchName;
+	vector<pair<vector<unsigned char>, CAliasIndex> > nameScan;
+	if (!ScanNames(vchName, 100000000, nameScan))
+		return error("BuildAliasExpiry() : scan failed");
+	pair<vector<unsigned char>, CAliasIndex> pairScan;
+	BOOST_FOREACH(pairScan, nameScan)
+		WriteExpiry(string("namex"), GetAliasExpiryHeight(pairScan.second.nHeight), pairScan.first);
+	if (!Write(make_pair(string("namea"), string("nameexp")), 1))
+		return false;
+	printf("Alias expiry index: %"PRIszu" aliases\n", nameScan.size());
+	return Flush();
+}
 
-				// decode the alias op
-				bool o = DecodeAliasTx(tx, op, nOut, vvchArgs, -1);
-				if (!o || !IsAliasOp(op))
-					continue;
-				if (op == OP_ALIAS_NEW)
-					continue;
+bool CAliasDB::ScanNamesSince(int nHeight,
+		std::vector<std::pair<std::vector<unsigned char>, CAliasIndex> >& nameScan) {
+	// the expiry height only grows with the update height
+	return ReadHeadsExpiring(string("namei"), string("namex"),
+			GetAliasExpiryHeight(max(nHeight, 0)), nameScan);
+}
 
-				const vector<unsigned char> &vchName = vvchArgs[0];
-				const vector<unsigned char> &vchValue = vvchArgs[
-						op == OP_ALIAS_ACTIVATE ? 2 : 1];
+unsigned int CAliasDB::PruneNames(int nPruneHeight, unsigned int nMax) {
+	vector<vector<unsigned char> > vchNames;
+	if (!ReadExpiring(string("namex"), 0, nPruneHeight + 1, vchNames, nMax))
+		return 0;
 
-				if (!GetTransaction(tx.GetHash(), tx, txblkhash, true))
-					continue;
+	unsigned int nPruned = 0;
+	BOOST_FOREACH(const vector<unsigned char> &vchName, vchNames) {
+		CAliasIndex txPos;
+		if (!ReadAlias(vchName, txPos))
+			continue;
+		// validation takes an alias missing from the database for an
+		// expired one, so once it is expired at a height no reorg goes
+		// below, nothing needs it any more
+		if (nPruneHeight - txPos.nHeight <= GetAliasExpirationDepth(nPruneHeight))
+			continue;
+		if (EraseName(vchName))
+			nPruned++;
+	}
+	return nPruned;
+}
 
-				// if name exists in DB, read it to verify
-				vector<CAliasIndex> vtxPos;
-				if (ExistsAlias(vchName)) {
-					if (!ReadAlias(vchName, vtxPos))
-						return error(
-								"ReconstructNameIndex() : failed to read from alias DB");
-				}
+static bool CompareAliasHeight(const CAliasIndex &a, const CAliasIndex &b) {
+	return a.nHeight < b.nHeight;
+}
 
-				// rebuild the alias object, store to DB
-				CAliasIndex txName;
-				txName.nHeight = nHeight;
-				txName.vValue = vchValue;
-				txName.txHash = tx.GetHash();
+bool CAliasDB::UpgradeAliasHistory() {
+	int nVersion = 0;
+	if (Read(make_pair(string("namea"), string("namehist")), nVersion) && nVersion >= 1)
+		return true;
 
-				PutToAliasList(vtxPos, txName);
+	printf("Moving alias records to versions...\n");
+	leveldb::Iterator *pcursor = NewIterator();
+	CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+	ssKeySet << make_pair(string("namei"), vector<unsigned char>());
+	pcursor->Seek(ssKeySet.str());
 
-				if (!WriteName(vchName, vtxPos))
-					return error(
-							"ReconstructNameIndex() : failed to write to alias DB");
-
-				// get fees for txn and add them to regenerate list
-				int64 nTheFee = GetAliasNetFee(tx);
-				InsertAliasFee(pindex, tx.GetHash(), nTheFee);
-				vector<CAliasFee> vAliasFees(lstAliasFees.begin(),
-					lstAliasFees.end());
-				if (!paliasdb->WriteAliasTxFees(vAliasFees))
-					return error(
-							"CheckOfferInputs() : failed to write fees to alias DB");
+	unsigned int nNames = 0;
+	while (pcursor->Valid()) {
+		try {
+			leveldb::Slice slKey = pcursor->key();
+			CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+			string strType;
+			ssKey >> strType;
+			if (strType != "namei")
+				break;
+			vector<unsigned char> vchName;
+			ssKey >> vchName;
+			leveldb::Slice slValue = pcursor->value();
+			CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+			vector<CAliasIndex> vtxPos;
+			ssValue >> vtxPos;
+			stable_sort(vtxPos.begin(), vtxPos.end(), CompareAliasHeight);
+			Erase(make_pair(string("namei"), vchName));
+			BOOST_FOREACH(const CAliasIndex &txPos, vtxPos)
+				PutVersion(string("namei"), string("nameh"), vchName, txPos.nHeight, txPos);
+			nNames++;
+		} catch (std::exception &e) {
+			delete pcursor;
+			return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+		}
+		pcursor->Next();
+	}
+	delete pcursor;
 
+	// all in one batch, so the upgrade is never left half done
+	if (!Write(make_pair(string("namea"), string("namehist")), 1))
+		return false;
+	printf("Alias records moved: %u names\n", nNames);
+	return Flush();
+}
 
-				printf(
-						"RECONSTRUCT ALIAS: op=%s alias=%s value=%s hash=%s height=%d fees=%llu\n",
-						aliasFromOp(op).c_str(), stringFromVch(vchName).c_str(),
-						stringFromVch(vchValue).c_str(),
-						tx.GetHash().ToString().c_str(), nHeight,
-						nTheFee / COIN);
-
-			} /* TX */
-			pindex = pindex->pnext;
-		} /* BLOCK */
-		Flush();
-	} /* LOCK */
+bool CAliasDB::ReconstructNameIndex(CBlockIndex *pindex, const CBlock &block) {
+	int nHeight = pindex->nHeight;
+
+	BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+
+		if (tx.nVersion != SYSCOIN_TX_VERSION)
+			continue;
+
+		vector<vector<unsigned char> > vvchArgs;
+		int op, nOut;
+
+		// decode the alias op
+		bool o = DecodeAliasTx(tx, op, nOut, vvchArgs, -1);
+		if (!o || !IsAliasOp(op))
+			continue;
+		if (op == OP_ALIAS_NEW)
+			continue;
+
+		const vector<unsigned char> &vchName = vvchArgs[0];
+		const vector<unsigned char> &vchValue = vvchArgs[
+				op == OP_ALIAS_ACTIVATE ? 2 : 1];
+
+		// rebuild the alias object, store to DB
+		CAliasIndex txName;
+		txName.nHeight = nHeight;
+		txName.vValue = vchValue;
+		txName.txHash = tx.GetHash();
+
+		if (!WriteName(vchName, txName))
+			return error(
+					"ReconstructNameIndex() : failed to write to alias DB");
+
+		// get fees for txn and add them to regenerate list
+		int64 nTheFee = GetAliasNetFee(tx);
+		InsertAliasFee(pindex, tx.GetHash(), nTheFee);
+
+
+		printf(
+				"RECONSTRUCT ALIAS: op=%s alias=%s value=%s hash=%s height=%d fees=%llu\n",
+				aliasFromOp(op).c_str(), stringFromVch(vchName).c_str(),
+				stringFromVch(vchValue).c_str(),
+				tx.GetHash().ToString().c_str(), nHeight,
+				nTheFee / COIN);
+
+	} /* TX */
 	return true;
 }
 
@@ -793,19 +778,7 @@ int GetAliasDisplayExpirationDepth(int nHeight) {
 }
 
 int GetNameTxPosHeight(const CDiskTxPos& txPos) {
-	// Read block header
-	CBlock block;
-	if (!block.ReadFromDisk(txPos))
-		return 0;
-	// Find the block in the index
-	map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(
-			block.GetHash());
-	if (mi == mapBlockIndex.end())
-		return 0;
-	CBlockIndex* pindex = (*mi).second;
-	if (!pindex || !pindex->IsInMainChain())
-		return 0;
-	return pindex->nHeight;
+	return GetTxPosHeight(txPos);
 }
 
 int GetNameTxPosHeight2(const CDiskTxPos& txPos, int nHeight) {
@@ -1046,9 +1019,7 @@ string SendMoneyWithInputTx(CScript scriptPubKey, int64 nValue, int64 nNetFee,
 }
 
 int64 GetAliasTxHashHeight(const uint256 txHash) {
-	CDiskTxPos postx;
-	pblocktree->ReadTxIndex(txHash, postx);
-	return GetNameTxPosHeight(postx);
+	return GetTxHeight(txHash);
 }
 
 bool GetValueOfAliasTxHash(const uint256 &txHash, vector<unsigned char>& vchValue, uint256& hash, int& nHeight) {
@@ -1068,11 +1039,10 @@ bool GetValueOfAliasTxHash(const uint256 &txHash, vector<unsigned char>& vchValu
 
 bool GetValueOfName(CAliasDB& dbName, const vector<unsigned char> &vchName,
 		vector<unsigned char>& vchValue, int& nHeight) {
-	vector<CAliasIndex> vtxPos;
-	if (!paliasdb->ReadAlias(vchName, vtxPos) || vtxPos.empty())
+	CAliasIndex txPos;
+	if (!paliasdb->ReadAlias(vchName, txPos))
 		return false;
 
-	CAliasIndex& txPos = vtxPos.back();
 	nHeight = txPos.nHeight;
 	vchValue = txPos.vValue;
 	return true;
@@ -1080,10 +1050,9 @@ bool GetValueOfName(CAliasDB& dbName, const vector<unsigned char> &vchName,
 
 bool GetTxOfAlias(CAliasDB& dbName, const vector<unsigned char> &vchName,
 		CTransaction& tx) {
-	vector<CAliasIndex> vtxPos;
-	if (!paliasdb->ReadAlias(vchName, vtxPos) || vtxPos.empty())
+	CAliasIndex txPos;
+	if (!paliasdb->ReadAlias(vchName, txPos))
 		return false;
-	CAliasIndex& txPos = vtxPos.back();
 	int nHeight = txPos.nHeight;
 	if (nHeight + GetAliasExpirationDepth(pindexBest->nHeight)
 			< pindexBest->nHeight) {
@@ -1132,17 +1101,15 @@ void GetAliasValue(const std::string& strName, std::string& strAddress) {
 			throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Alias not found");
 
 		// check for alias existence in DB
-		vector<CAliasIndex> vtxPos;
-		if (!paliasdb->ReadAlias(vchName, vtxPos))
+		CAliasIndex txPos;
+		if (!paliasdb->ReadAlias(vchName, txPos))
 			throw JSONRPCError(RPC_WALLET_ERROR,
 					"failed to read from alias DB");
-		if (vtxPos.size() < 1)
-			throw JSONRPCError(RPC_WALLET_ERROR, "no alias result returned");
 
 		// get transaction pointed to by alias
 		uint256 blockHash;
 		CTransaction tx;
-		uint256 txHash = vtxPos.back().txHash;
+		uint256 txHash = txPos.txHash;
 		if (!GetTransaction(txHash, tx, blockHash, true))
 			throw JSONRPCError(RPC_WALLET_ERROR,
 					"failed to read transaction from disk");
@@ -1410,12 +1377,12 @@ Value aliasactivate(const Array& params, bool fHelp) {
 
 	{
 
-		if (mapAliasesPending.count(vchName)
-				&& mapAliasesPending[vchName].size()) {
+		set<uint256> setPending;
+		if (mempool.GetServiceTxs(SERVICE_ALIAS, vchName, setPending)) {
 			error(
 					"aliasactivate() : there are %d pending operations on that alias, including %s",
-					(int) mapAliasesPending[vchName].size(),
-					mapAliasesPending[vchName].begin()->GetHex().c_str());
+					(int) setPending.size(),
+					setPending.begin()->GetHex().c_str());
 			throw runtime_error("there are pending operations on that alias");
 		}
 
@@ -1527,12 +1494,12 @@ Value aliasupdate(const Array& params, bool fHelp) {
 
 	{
 
-		if (mapAliasesPending.count(vchName)
-				&& mapAliasesPending[vchName].size()) {
+		set<uint256> setPending;
+		if (mempool.GetServiceTxs(SERVICE_ALIAS, vchName, setPending)) {
 			error(
 					"aliasupdate() : there are %d pending operations on that alias, including %s",
-					(int) mapAliasesPending[vchName].size(),
-					mapAliasesPending[vchName].begin()->GetHex().c_str());
+					(int) setPending.size(),
+					setPending.begin()->GetHex().c_str());
 			throw runtime_error("there are pending operations on that alias");
 		}
 
@@ -1630,36 +1597,32 @@ Value aliaslist(const Array& params, bool fHelp) {
 			if (vNamesI.find(vchName) != vNamesI.end() && (nHeight < vNamesI[vchName] || vNamesI[vchName] < 0))
 				continue;
 
-			// Read the database for the latest alias (vtxPos.back()) and ensure it is not transferred (isaliasmine).. 
+			// Read the database for the latest alias and ensure it is not transferred (isaliasmine).. 
 			// if it IS transferred then skip over this alias whenever it is found(above vNamesI check) in your mapwallet
 			// check for alias existence in DB
 			// will only read the alias from the db once per name to ensure that it is not mine.
-			vector<CAliasIndex> vtxPos;
-			if (vNamesI.find(vchName) == vNamesI.end() && paliasdb->ReadAlias(vchName, vtxPos))
+			CAliasIndex txPos;
+			if (vNamesI.find(vchName) == vNamesI.end() && paliasdb->ReadAlias(vchName, txPos))
 			{
-				if (vtxPos.size() > 0)
+				// get transaction pointed to by alias
+				uint256 txHash = txPos.txHash;
+				if(GetTransaction(txHash, dbtx, blockHash, true))
 				{
-					// get transaction pointed to by alias
-					uint256 txHash = vtxPos.back().txHash;
-					if(GetTransaction(txHash, dbtx, blockHash, true))
+				
+					nHeight = GetAliasTxHashHeight(txHash);
+					// Is the latest alais in the db transferred?
+					if(!IsAliasMine(dbtx))
+					{	
+						// by setting this to -1, subsequent aliases with the same name won't be read from disk (optimization) 
+						// because the latest alias tx doesn't belong to us anymore
+						vNamesI[vchName] = -1;
+						continue;
+					}
+					else
 					{
-					
-						nHeight = GetAliasTxHashHeight(txHash);
-						// Is the latest alais in the db transferred?
-						if(!IsAliasMine(dbtx))
-						{	
-							// by setting this to -1, subsequent aliases with the same name won't be read from disk (optimization) 
-							// because the latest alias tx doesn't belong to us anymore
-							vNamesI[vchName] = -1;
-							continue;
-						}
-						else
-						{
-							// get the value of the alias txn of the latest alias (from db)
-							GetValueOfAliasTx(dbtx, vchValue);
-						}
+						// get the value of the alias txn of the latest alias (from db)
+						GetValueOfAliasTx(dbtx, vchValue);
 					}
-					
 				}
 			}
 			else
@@ -1699,6 +1662,8 @@ Value aliasinfo(const Array& params, bool fHelp) {
 	if (fHelp || 1 != params.size())
 		throw runtime_error("aliasinfo <aliasname>\n"
 				"Show values of an alias.\n");
+
+	CServiceReadView view;
 	vector<unsigned char> vchName = vchFromValue(params[0]);
 	CTransaction tx;
 	Object oShowResult;
@@ -1706,16 +1671,19 @@ Value aliasinfo(const Array& params, bool fHelp) {
 	{
 
 		// check for alias existence in DB
-		vector<CAliasIndex> vtxPos;
-		if (!paliasdb->ReadAlias(vchName, vtxPos))
+		CAliasIndex txPos;
+		if (!paliasdb->ReadAlias(vchName, txPos))
 			throw JSONRPCError(RPC_WALLET_ERROR,
 					"failed to read from alias DB");
-		if (vtxPos.size() < 1)
-			throw JSONRPCError(RPC_WALLET_ERROR, "no result returned");
+
+		// the alias came from the snapshot, the chain and the wallet are
+		// only locked for the lookups that follow
+		LOCK2(cs_main, pwalletMain->cs_wallet);
+		LOCK(mempool.cs);
 
 		// get transaction pointed to by alias
 		uint256 blockHash;
-		uint256 txHash = vtxPos.back().txHash;
+		uint256 txHash = txPos.txHash;
 		if (!GetTransaction(txHash, tx, blockHash, true))
 			throw JSONRPCError(RPC_WALLET_ERROR,
 					"failed to read transaction from disk");
@@ -1739,14 +1707,22 @@ Value aliasinfo(const Array& params, bool fHelp) {
 			oName.push_back(Pair("ismine", fMine));
             oName.push_back(Pair("lastupdate_height", nHeight));
             oName.push_back(Pair("expires_on", nHeight + GetAliasDisplayExpirationDepth(nHeight)));
-            oName.push_back(Pair("expires_in", nHeight + GetAliasDisplayExpirationDepth(nHeight)- pindexBest->nHeight ));
+            oName.push_back(Pair("expires_in", nHeight + GetAliasDisplayExpirationDepth(nHeight)- view.nHeight ));
 			if (nHeight + GetAliasDisplayExpirationDepth(nHeight)
-					- pindexBest->nHeight <= 0) {
+					- view.nHeight <= 0) {
 				oName.push_back(Pair("expired", 1));
 			}
 			if (tx.data.size())
 				oName.push_back(Pair("data", tx.GetBase64Data()));
 
+			// updates still in the memory pool
+			set<uint256> setPending;
+			Array aoPending;
+			mempool.GetServiceTxs(SERVICE_ALIAS, vchName, setPending);
+			BOOST_FOREACH(const uint256 &hashPending, setPending)
+				aoPending.push_back(hashPending.GetHex());
+			oName.push_back(Pair("pending", aoPending));
+
 			oShowResult = oName;
 		}
 	}
@@ -1763,13 +1739,15 @@ Value aliashistory(const Array& params, bool fHelp) {
 	if (fHelp || 1 != params.size())
 		throw runtime_error("aliashistory <aliasname>\n"
 				"List all stored values of an alias.\n");
+
+	CServiceReadView view;
 	Array oRes;
 	vector<unsigned char> vchName = vchFromValue(params[0]);
 	string name = stringFromVch(vchName);
 
 	{
 		vector<CAliasIndex> vtxPos;
-		if (!paliasdb->ReadAlias(vchName, vtxPos))
+		if (!paliasdb->ReadAliasHistory(vchName, vtxPos))
 			throw JSONRPCError(RPC_WALLET_ERROR,
 					"failed to read from alias DB");
 
@@ -1777,6 +1755,7 @@ Value aliashistory(const Array& params, bool fHelp) {
 		uint256 txHash;
 		uint256 blockHash;
 		BOOST_FOREACH(txPos2, vtxPos) {
+			LOCK2(cs_main, mempool.cs);
 			txHash = txPos2.txHash;
 			CTransaction tx;
 			if (!GetTransaction(txHash, tx, blockHash, true)) {
@@ -1798,9 +1777,9 @@ Value aliashistory(const Array& params, bool fHelp) {
 				oName.push_back(Pair("address", strAddress));
 	            oName.push_back(Pair("lastupdate_height", nHeight));
 	            oName.push_back(Pair("expires_on", nHeight + GetAliasDisplayExpirationDepth(nHeight)));
-	            oName.push_back(Pair("expires_in", nHeight + GetAliasDisplayExpirationDepth(nHeight)- pindexBest->nHeight ));
+	            oName.push_back(Pair("expires_in", nHeight + GetAliasDisplayExpirationDepth(nHeight)- view.nHeight ));
 				if (nHeight + GetAliasDisplayExpirationDepth(nHeight)
-						- pindexBest->nHeight <= 0) {
+						- view.nHeight <= 0) {
 					oName.push_back(Pair("expired", 1));
 				}
 				oRes.push_back(oName);
@@ -1830,6 +1809,8 @@ Value aliasfilter(const Array& params, bool fHelp) {
 						"aliasfilter \"^name\" # list all aliases starting with \"name\"\n"
 						"aliasfilter 36000 0 0 stat # display stats (number of names) on active aliases\n");
 
+	CServiceReadView view;
+
 	string strRegexp;
 	int nFrom = 0;
 	int nNb = 0;
@@ -1855,9 +1836,11 @@ Value aliasfilter(const Array& params, bool fHelp) {
 
 	Array oRes;
 
+	// with a max age only the aliases the expiry index has as recent
 	vector<unsigned char> vchName;
 	vector<pair<vector<unsigned char>, CAliasIndex> > nameScan;
-	if (!paliasdb->ScanNames(vchName, 100000000, nameScan))
+	if (nMaxAge != 0 ? !paliasdb->ScanNamesSince(view.nHeight - nMaxAge + 1, nameScan)
+			: !paliasdb->ScanNames(vchName, 100000000, nameScan))
 		throw JSONRPCError(RPC_WALLET_ERROR, "scan failed");
 
 	pair<vector<unsigned char>, CAliasIndex> pairScan;
@@ -1875,7 +1858,7 @@ Value aliasfilter(const Array& params, bool fHelp) {
 		int nHeight = txName.nHeight;
 
 		// max age
-		if (nMaxAge != 0 && pindexBest->nHeight - nHeight >= nMaxAge)
+		if (nMaxAge != 0 && view.nHeight - nHeight >= nMaxAge)
 			continue;
 
 		// from limits
@@ -1885,13 +1868,14 @@ Value aliasfilter(const Array& params, bool fHelp) {
 
 
 
+		LOCK2(cs_main, mempool.cs);
 		Object oName;
 		oName.push_back(Pair("name", name));
 		CTransaction tx;
 		uint256 blockHash;
 		uint256 txHash = txName.txHash;
 		if ((nHeight + GetAliasDisplayExpirationDepth(nHeight)
-				- pindexBest->nHeight <= 0)
+				- view.nHeight <= 0)
 				|| !GetTransaction(txHash, tx, blockHash, true)) {
 			oName.push_back(Pair("expired", 1));
 		} else {
@@ -1902,7 +1886,7 @@ Value aliasfilter(const Array& params, bool fHelp) {
 			oName.push_back(Pair("txid", txHash.GetHex()));
             oName.push_back(Pair("lastupdate_height", nHeight));
             oName.push_back(Pair("expires_on", nHeight + GetAliasDisplayExpirationDepth(nHeight)));
-            oName.push_back(Pair("expires_in", nHeight + GetAliasDisplayExpirationDepth(nHeight)- pindexBest->nHeight ));
+            oName.push_back(Pair("expires_in", nHeight + GetAliasDisplayExpirationDepth(nHeight)- view.nHeight ));
 		}
 		oRes.push_back(oName);
 
@@ -1914,7 +1898,7 @@ Value aliasfilter(const Array& params, bool fHelp) {
 
 	if (fStat) {
 		Object oStat;
-		oStat.push_back(Pair("blocks", (int) nBestHeight));
+		oStat.push_back(Pair("blocks", view.nHeight));
 		oStat.push_back(Pair("count", (int) oRes.size()));
 		return oStat;
 	}
@@ -1934,6 +1918,8 @@ Value aliasscan(const Array& params, bool fHelp) {
 				"aliasscan [<start-name>] [<max-returned>]\n"
 						"scan all aliases, starting at start-name and returning a maximum number of entries (default 500)\n");
 
+	CServiceReadView view;
+
 	vector<unsigned char> vchName;
 	int nMax = 500;
 	if (params.size() > 0)
@@ -1952,6 +1938,7 @@ Value aliasscan(const Array& params, bool fHelp) {
 
 	pair<vector<unsigned char>, CAliasIndex> pairScan;
 	BOOST_FOREACH(pairScan, nameScan) {
+		LOCK2(cs_main, mempool.cs);
 		Object oName;
 		string name = stringFromVch(pairScan.first);
 		oName.push_back(Pair("name", name));
@@ -1962,7 +1949,7 @@ Value aliasscan(const Array& params, bool fHelp) {
 		int nHeight = txName.nHeight;
 		vector<unsigned char> vchValue = txName.vValue;
 		if ((nHeight + GetAliasDisplayExpirationDepth(nHeight)
-				- pindexBest->nHeight <= 0)
+				- view.nHeight <= 0)
 				|| !GetTransaction(txName.txHash, tx, blockHash, true)) {
 			oName.push_back(Pair("expired", 1));
 		} else {
@@ -1971,7 +1958,7 @@ Value aliasscan(const Array& params, bool fHelp) {
 			oName.push_back(Pair("value", value));
             oName.push_back(Pair("lastupdate_height", nHeight));
             oName.push_back(Pair("expires_on", nHeight + GetAliasDisplayExpirationDepth(nHeight)));
-            oName.push_back(Pair("expires_in", nHeight + GetAliasDisplayExpirationDepth(nHeight)- pindexBest->nHeight ));
+            oName.push_back(Pair("expires_in", nHeight + GetAliasDisplayExpirationDepth(nHeight)- view.nHeight ));
 		}
 		oRes.push_back(oName);
 	}
@@ -2053,15 +2040,6 @@ Value aliasclean(const Array& params, bool fHelp) {
 			UnspendInputs(wtx);
 			wtx.RemoveFromMemoryPool();
 			pwalletMain->EraseFromWallet(wtx.GetHash());
-			vector<unsigned char> vchName;
-			if (GetAliasOfTx(wtx, vchName)
-					&& mapAliasesPending.count(vchName)) {
-				string name = stringFromVch(vchName);
-				printf("name_clean() : erase %s from pending of name %s",
-						wtx.GetHash().GetHex().c_str(), name.c_str());
-				if (!mapAliasesPending[vchName].erase(wtx.GetHash()))
-					error("name_clean() : erase but it was not pending");
-			}
 			wtx.print();
 		}
 		printf("-----------------------------\n");
@@ -2230,12 +2208,12 @@ Value dataactivate(const Array& params, bool fHelp) {
 	wtx.nVersion = SYSCOIN_TX_VERSION;
 
 	{
-		if (mapAliasesPending.count(vchName)
-				&& mapAliasesPending[vchName].size()) {
+		set<uint256> setPending;
+		if (mempool.GetServiceTxs(SERVICE_ALIAS, vchName, setPending)) {
 			error(
 					"dataactivate() : there are %d pending operations on that data, including %s",
-					(int) mapAliasesPending[vchName].size(),
-					mapAliasesPending[vchName].begin()->GetHex().c_str());
+					(int) setPending.size(),
+					setPending.begin()->GetHex().c_str());
 			throw runtime_error("there are pending operations on that data");
 		}
 
@@ -2354,12 +2332,12 @@ Value dataupdate(const Array& params, bool fHelp) {
 
 	{
 
-		if (mapAliasesPending.count(vchName)
-				&& mapAliasesPending[vchName].size()) {
+		set<uint256> setPending;
+		if (mempool.GetServiceTxs(SERVICE_ALIAS, vchName, setPending)) {
 			error(
 					"dataupdate() : there are %d pending operations on that data, including %s",
-					(int) mapAliasesPending[vchName].size(),
-					mapAliasesPending[vchName].begin()->GetHex().c_str());
+					(int) setPending.size(),
+					setPending.begin()->GetHex().c_str());
 			throw runtime_error("there are pending operations on that data");
 		}
 
@@ -2,7 +2,8 @@
 #define NAMEDB_H
 
 #include "bitcoinrpc.h"
-#include "leveldb.h"
+#include "servicedb.h"
+#include "feewindow.h"
 
 class CAliasIndex {
 public:
@@ -83,33 +84,70 @@ public:
         return !(a == b);
     }
 };
-extern std::list<CAliasFee> lstAliasFees;
+extern CFeeWindow aliasFeeWindow;
+void SetAliasFees(const std::vector<CAliasFee> &vFees);
 
-class CAliasDB : public CLevelDB {
+class CAliasDB : public CServiceDB {
 public:
-    CAliasDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDB(GetDataDir() / "aliases", nCacheSize, fMemory, fWipe) {
+    CAliasDB(size_t nCacheSize, bool fMemory, bool fWipe) : CServiceDB(GetDataDir() / "aliases", nCacheSize, fMemory, fWipe) {
     }
 
-	bool WriteName(const std::vector<unsigned char>& name, std::vector<CAliasIndex>& vtxPos) {
-		return Write(make_pair(std::string("namei"), name), vtxPos);
-	}
+	// the latest version of an alias is kept under "namei", and each
+	// version under "nameh" by height. "namex" indexes the aliases by the
+	// height their latest version expires at.
+
+	bool WriteName(const std::vector<unsigned char>& name, const CAliasIndex& txPos);
 
-	bool EraseName(const std::vector<unsigned char>& name) {
-	    return Erase(make_pair(std::string("namei"), name));
+	bool EraseName(const std::vector<unsigned char>& name);
+	bool ReadAlias(const std::vector<unsigned char>& name, CAliasIndex& txPos) {
+		CServiceVersion<CAliasIndex> head;
+		if (!ReadHead(std::string("namei"), name, head))
+			return false;
+		txPos = head.value;
+		return true;
 	}
-	bool ReadAlias(const std::vector<unsigned char>& name, std::vector<CAliasIndex>& vtxPos) {
-		return Read(make_pair(std::string("namei"), name), vtxPos);
+	bool ReadAliasHistory(const std::vector<unsigned char>& name, std::vector<CAliasIndex>& vtxPos) {
+		return ReadHistory(std::string("nameh"), name, vtxPos);
 	}
 	bool ExistsAlias(const std::vector<unsigned char>& name) {
 	    return Exists(make_pair(std::string("namei"), name));
 	}
-
-	bool WriteAliasTxFees(std::vector<CAliasFee>& vtxPos) {
-		return Write(std::string("nametxf"), vtxPos);
+	// key of the latest version, for Preload
+	static std::string AliasKey(const std::vector<unsigned char>& name) {
+		return KeyString(make_pair(std::string("namei"), name));
 	}
+
+	// take off the version a transaction wrote
+	bool PopName(const std::vector<unsigned char>& name, const uint256& txHash);
+
+	// move the alias records of older databases to versions
+	bool UpgradeAliasHistory();
+
+	// index the aliases of a database written before the expiry index existed
+	bool BuildAliasExpiry();
+
+	// the latest versions of the aliases updated at nHeight or later, along
+	// with some older ones, in the order of ScanNames
+	bool ScanNamesSince(int nHeight, std::vector<std::pair<std::vector<unsigned char>, CAliasIndex> >& nameScan);
+
+	// erase up to about nMax aliases that are expired for good at
+	// nPruneHeight, returning how many were
+	unsigned int PruneNames(int nPruneHeight, unsigned int nMax);
+
+	// fee list as stored before fees were kept one per record
 	bool ReadAliasTxFees(std::vector<CAliasFee>& vtxPos) {
 		return Read(std::string("nametxf"), vtxPos);
 	}
+	bool EraseAliasTxFees() {
+		return Erase(std::string("nametxf"));
+	}
+
+	bool WriteAliasFees(CFeeWindow& window) {
+		return window.Write(*this, std::string("namefee"));
+	}
+	bool ReadAliasFees(CFeeWindow& window) {
+		return window.Read(*this, std::string("namefee"));
+	}
 
     bool WriteAliasIndex(std::vector<std::vector<unsigned char> >& vtxIndex) {
         return Write(std::string("namendx"), vtxIndex);
@@ -123,13 +161,13 @@ public:
             unsigned int nMax,
             std::vector<std::pair<std::vector<unsigned char>, CAliasIndex> >& nameScan);
 
-    bool ReconstructNameIndex(CBlockIndex *pindexRescan);
+    // apply the aliases of a main chain block to the index when rebuilding it
+    bool ReconstructNameIndex(CBlockIndex *pindex, const CBlock &block);
 };
 
 
 
 extern std::map<std::vector<unsigned char>, uint256> mapMyAliases;
-extern std::map<std::vector<unsigned char>, std::set<uint256> > mapAliasesPending;
 
 std::string stringFromVch(const std::vector<unsigned char> &vch);
 std::vector<unsigned char> vchFromValue(const json_spirit::Value& value);
@@ -150,7 +188,6 @@ bool CheckAliasInputs(
 bool ExtractAliasAddress(const CScript& script, std::string& address);
 bool IsAliasMine(const CTransaction& tx);
 bool IsAliasMine2(const CTransaction& tx);
-void RemoveAliasTxnFromMemoryPool(const CTransaction& tx);
 bool IsAliasMine(const CTransaction& tx, const CTxOut& txout, bool ignore_aliasnew = false);
 bool IsAliasOp(int op);
 
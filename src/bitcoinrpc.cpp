@@ -248,13 +248,13 @@ static const CRPCCommand vRPCCommands[] =
     { "listaddressgroupings",   &listaddressgroupings,   false,     false,      true },
     { "signmessage",            &signmessage,            false,     false,      true },
     { "verifymessage",          &verifymessage,          false,     false,      false },
-    { "getwork",                &getwork,                true,      false,      true },
-    { "getworkaux",             &getworkaux,             true,      false,      true },
-    { "getworkex",              &getworkex,              true,      false,      true },
+    { "getwork",                &getwork,                true,      true,       true },
+    { "getworkaux",             &getworkaux,             true,      true,       true },
+    { "getworkex",              &getworkex,              true,      true,       true },
     { "listaccounts",           &listaccounts,           false,     false,      true },
     { "settxfee",               &settxfee,               false,     false,      true },
-    { "getblocktemplate",       &getblocktemplate,       true,      false,      false },
-    { "getauxblock",            &getauxblock,            true,      false,      true },
+    { "getblocktemplate",       &getblocktemplate,       true,      true,       false },
+    { "getauxblock",            &getauxblock,            true,      true,       true },
     { "submitblock",            &submitblock,            false,     false,      false },
     { "setmininput",            &setmininput,            false,     false,      false },
     { "listsinceblock",         &listsinceblock,         false,     false,      true },
@@ -281,10 +281,10 @@ static const CRPCCommand vRPCCommands[] =
     { "aliasactivate",     &aliasactivate,     false,      false,      true },
     { "aliasupdate",       &aliasupdate,       false,      false,      true },
     { "aliaslist",         &aliaslist,         false,      false,      true },
-    { "aliasinfo",         &aliasinfo,         false,      false,      true },
-    { "aliashistory",      &aliashistory,      false,      false,      true },
-    { "aliasfilter",       &aliasfilter,       false,      false,      true },
-    { "aliasscan",         &aliasscan,         false,      false,      true },
+    { "aliasinfo",         &aliasinfo,         false,      true,       true },
+    { "aliashistory",      &aliashistory,      false,      true,       true },
+    { "aliasfilter",       &aliasfilter,       false,      true,       true },
+    { "aliasscan",         &aliasscan,         false,      true,       true },
     { "aliasclean",        &aliasclean,         false,      false,      true },
     { "getaliasfees",      &getaliasfees,         false,      false,      true },
 
@@ -305,11 +305,12 @@ static const CRPCCommand vRPCCommands[] =
     { "offerpay",         &offerpay,       false,      false,      true },
     { "offerlist",        &offerlist,      false,      false,      true },
     { "offeracceptlist",  &offeracceptlist,false,      false,      true },
-    { "offerinfo",        &offerinfo,      false,      false,      true },
-    { "offerhistory",     &offerhistory,   false,      false,      true },
-    { "offerscan",        &offerscan,      false,      false,      true },
+    { "offerinfo",        &offerinfo,      false,      true,       true },
+    { "offerhistory",     &offerhistory,   false,      true,       true },
+    { "offerscan",        &offerscan,      false,      true,       true },
+    { "offersearch",      &offersearch,    false,      true,       true },
     { "offerclean",       &offerclean,     false,      false,      true },
-    { "offerfilter",      &offerfilter,    false,      false,      true },
+    { "offerfilter",      &offerfilter,    false,      true,       true },
     { "getofferfees",      &getofferfees,         false,      false,      true },
 
   // use the blockchain as a certificate issuance platform
@@ -319,12 +320,13 @@ static const CRPCCommand vRPCCommands[] =
   { "certnew",               &certnew,           false,      false,      true },
   { "certtransfer",          &certtransfer,      false,      false,      true },
   { "certissuerlist",        &certissuerlist,    false,      false,      true },
-  { "certissuerinfo",        &certissuerinfo,    false,      false,      true },
-  { "certinfo",              &certinfo,          false,      false,      true },
-  { "certissuerhistory",     &certissuerhistory, false,      false,      true },
-  { "certissuerscan",        &certissuerscan,    false,      false,      true },
+  { "certissuerinfo",        &certissuerinfo,    false,      true,       true },
+  { "certinfo",              &certinfo,          false,      true,       true },
+  { "certlist",              &certlist,          false,      true,       true },
+  { "certissuerhistory",     &certissuerhistory, false,      true,       true },
+  { "certissuerscan",        &certissuerscan,    false,      true,       true },
   { "certissuerclean",       &certissuerclean,   false,      false,      true },
-  { "certissuerfilter",      &certissuerfilter,  false,      false,      true },
+  { "certissuerfilter",      &certissuerfilter,  false,      true,       true },
   { "getcertfees",           &getcertfees,        false,      false,      true },
 
 };
@@ -790,6 +792,106 @@ static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol,
     }
 }
 
+// -blocknotifyport: every connection on the loopback port gets a line with
+// the hash and height of each new best block. The sockets are only touched
+// on block_notify_strand.
+static asio::io_service::strand* block_notify_strand = NULL;
+static std::list<boost::shared_ptr<ip::tcp::socket> > listBlockNotifySockets;
+static CCriticalSection cs_blockNotify;
+
+static void BlockNotifyListen(boost::shared_ptr<ip::tcp::acceptor> acceptor);
+
+static void BlockNotifyAcceptHandler(boost::shared_ptr<ip::tcp::acceptor> acceptor,
+                                     boost::shared_ptr<ip::tcp::socket> socket,
+                                     const boost::system::error_code& error)
+{
+    if (error == asio::error::operation_aborted || !acceptor->is_open())
+        return;
+    if (!error)
+    {
+        boost::system::error_code ec;
+        socket->non_blocking(true, ec);
+        if (!ec)
+            listBlockNotifySockets.push_back(socket);
+    }
+    BlockNotifyListen(acceptor);
+}
+
+static void BlockNotifyListen(boost::shared_ptr<ip::tcp::acceptor> acceptor)
+{
+    boost::shared_ptr<ip::tcp::socket> socket(new ip::tcp::socket(acceptor->get_io_service()));
+    acceptor->async_accept(*socket, block_notify_strand->wrap(
+            boost::bind(&BlockNotifyAcceptHandler, acceptor, socket, boost::asio::placeholders::error)));
+}
+
+// A listener that does not keep up with a line per block is dropped
+static void BlockNotifySend(boost::shared_ptr<std::string> pstrLine)
+{
+    std::list<boost::shared_ptr<ip::tcp::socket> >::iterator it = listBlockNotifySockets.begin();
+    while (it != listBlockNotifySockets.end())
+    {
+        boost::system::error_code ec;
+        size_t nWritten = asio::write(**it, asio::buffer(*pstrLine), ec);
+        if (ec || nWritten != pstrLine->size())
+        {
+            (*it)->close(ec);
+            it = listBlockNotifySockets.erase(it);
+        }
+        else
+            ++it;
+    }
+}
+
+static void BlockNotify(const uint256& hash, int nHeight)
+{
+    LOCK(cs_blockNotify);
+    if (block_notify_strand == NULL)
+        return;
+    boost::shared_ptr<std::string> pstrLine(new std::string(strprintf("%s %d\n", hash.GetHex().c_str(), nHeight)));
+    block_notify_strand->post(boost::bind(&BlockNotifySend, pstrLine));
+}
+
+static bool StartBlockNotify(asio::io_service& io_service, unsigned short nPort)
+{
+    ip::tcp::endpoint endpoint(asio::ip::address_v4::loopback(), nPort);
+    boost::shared_ptr<ip::tcp::acceptor> acceptor(new ip::tcp::acceptor(io_service));
+    try
+    {
+        acceptor->open(endpoint.protocol());
+        acceptor->set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+        acceptor->bind(endpoint);
+        acceptor->listen(socket_base::max_connections);
+    }
+    catch(boost::system::system_error &e)
+    {
+        printf("StartBlockNotify() : cannot listen on port %u: %s\n", nPort, e.what());
+        return false;
+    }
+
+    {
+        LOCK(cs_blockNotify);
+        block_notify_strand = new asio::io_service::strand(io_service);
+    }
+    BlockNotifyListen(acceptor);
+    uiInterface.NotifyBestChain.connect(&BlockNotify);
+    return true;
+}
+
+static void StopBlockNotify()
+{
+    uiInterface.NotifyBestChain.disconnect(&BlockNotify);
+    LOCK(cs_blockNotify);
+    listBlockNotifySockets.clear();
+    delete block_notify_strand; block_notify_strand = NULL;
+}
+
+static bool fRPCRunning = false;
+
+bool IsRPCRunning()
+{
+    return fRPCRunning;
+}
+
 void StartRPCThreads()
 {
     strRPCUserColonPass = mapArgs["-rpcuser"] + ":" + mapArgs["-rpcpassword"];
@@ -904,6 +1006,15 @@ void StartRPCThreads()
         return;
     }
 
+    if (mapArgs.count("-blocknotifyport") && !StartBlockNotify(*rpc_io_service, GetArg("-blocknotifyport", 0)))
+    {
+        uiInterface.ThreadSafeMessageBox(strprintf(_("Unable to listen on block notification port %s"), mapArgs["-blocknotifyport"].c_str()),
+                                         "", CClientUIInterface::MSG_ERROR);
+        StartShutdown();
+        return;
+    }
+
+    fRPCRunning = true;
     rpc_worker_group = new boost::thread_group();
     for (int i = 0; i < GetArg("-rpcthreads", 4); i++)
         rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
@@ -913,8 +1024,16 @@ void StopRPCThreads()
 {
     if (rpc_io_service == NULL) return;
 
+    // Release the long polls
+    fRPCRunning = false;
+    {
+        boost::lock_guard<boost::mutex> lock(csBestBlock);
+        cvBlockChange.notify_all();
+    }
+
     rpc_io_service->stop();
     rpc_worker_group->join_all();
+    StopBlockNotify();
     delete rpc_worker_group; rpc_worker_group = NULL;
     delete rpc_ssl_context; rpc_ssl_context = NULL;
     delete rpc_io_service; rpc_io_service = NULL;
@@ -125,6 +125,7 @@ public:
 
 extern const CRPCTable tableRPC;
 
+extern bool IsRPCRunning();
 extern void InitRPCMining();
 extern void ShutdownRPCMining();
 
@@ -246,6 +247,7 @@ extern json_spirit::Value offeracceptlist(const json_spirit::Array& params, bool
 extern json_spirit::Value offerhistory(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value offerfilter(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value offerscan(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value offersearch(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value offerclean(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getofferfees(const json_spirit::Array& params, bool fHelp);
 
@@ -256,6 +258,7 @@ extern json_spirit::Value certnew(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value certtransfer(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value certissuerinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value certinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value certlist(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value certissuerlist(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value certissuerhistory(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value certissuerfilter(const json_spirit::Array& params, bool fHelp);
@@ -18,9 +18,7 @@ template<typename T> void ConvertTo(Value& value, bool fAllowNull = false);
 
 std::map<std::vector<unsigned char>, uint256> mapMyCertIssuers;
 std::map<std::vector<unsigned char>, uint256> mapMyCertItems;
-std::map<std::vector<unsigned char>, std::set<uint256> > mapCertIssuerPending;
-std::map<std::vector<unsigned char>, std::set<uint256> > mapCertItemPending;
-std::list<CCertFee> lstCertIssuerFees;
+CFeeWindow certFeeWindow(360 * 12);
 
 #ifdef GUI
 extern std::map<uint160, std::vector<unsigned char> > mapMyCertIssuerHashes;
@@ -172,12 +170,9 @@ bool CCertDB::ScanCertIssuers(const std::vector<unsigned char>& vchCertIssuer, u
                 ssKey >> vchCertIssuer;
                 leveldb::Slice slValue = pcursor->value();
                 CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                vector<CCertIssuer> vtxPos;
-                ssValue >> vtxPos;
-                CCertIssuer txPos;
-                if (!vtxPos.empty())
-                    txPos = vtxPos.back();
-                certissuerScan.push_back(make_pair(vchCertIssuer, txPos));
+                CServiceVersion<CCertIssuer> head;
+                ssValue >> head;
+                certissuerScan.push_back(make_pair(vchCertIssuer, head.value));
             }
             if (certissuerScan.size() >= nMax)
                 break;
@@ -191,126 +186,359 @@ bool CCertDB::ScanCertIssuers(const std::vector<unsigned char>& vchCertIssuer, u
     return true;
 }
 
-/**
- * [CCertDB::ReconstructCertIndex description]
- * @param  pindexRescan [description]
- * @return              [description]
- */
-bool CCertDB::ReconstructCertIndex(CBlockIndex *pindexRescan) {
-    CBlockIndex* pindex = pindexRescan;
-
-    {
-    TRY_LOCK(pwalletMain->cs_wallet, cs_trylock);
-    while (pindex) {
-
-        int nHeight = pindex->nHeight;
-        CBlock block;
-        block.ReadFromDisk(pindex);
-        uint256 txblkhash;
+bool CCertDB::ReadCertItemRecord(const vector<unsigned char>& vchCertIssuer, const vector<unsigned char>& vchCertItem, CCertItem& certItem) {
+    vector<CCertItem> vtxPos;
+    if (!ReadCertItemRecord(vchCertIssuer, vchCertItem, vtxPos) || vtxPos.empty())
+        return false;
+    certItem = vtxPos.back();
+    return true;
+}
 
-        BOOST_FOREACH(CTransaction& tx, block.vtx) {
+bool CCertDB::PutCertItem(const vector<unsigned char>& vchCertIssuer, CCertIssuer& certIssuer, const CCertItem& certItem) {
+    vector<CCertItem> vtxPos;
+    if (!ReadCertItemRecord(vchCertIssuer, certItem.vchRand, vtxPos) || vtxPos.empty())
+        certIssuer.nCerts++;
+    if (!vtxPos.empty() && vtxPos.back().txHash == certItem.txHash)
+        vtxPos.back() = certItem;
+    else
+        vtxPos.push_back(certItem);
+    return WriteCertItemRecord(vchCertIssuer, certItem.vchRand, vtxPos);
+}
 
-            if (tx.nVersion != SYSCOIN_TX_VERSION)
-                continue;
+bool CCertDB::PopCertItem(const vector<unsigned char>& vchCertIssuer, const vector<unsigned char>& vchCertItem, const uint256& txHash) {
+    vector<CCertItem> vtxPos;
+    if (!ReadCertItemRecord(vchCertIssuer, vchCertItem, vtxPos))
+        return true;
+    while (!vtxPos.empty() && vtxPos.back().txHash == txHash)
+        vtxPos.pop_back();
+    if (vtxPos.empty())
+        return EraseCertItemRecord(vchCertIssuer, vchCertItem);
+    return WriteCertItemRecord(vchCertIssuer, vchCertItem, vtxPos);
+}
 
-            vector<vector<unsigned char> > vvchArgs;
-            int op, nOut;
+bool CCertDB::ScanCertItems(const vector<unsigned char>& vchCertIssuer, const vector<unsigned char>& vchStart,
+        unsigned int nMax, vector<CCertItem>& vCertItems, vector<unsigned char>& vchNext) {
+    vchNext.clear();
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << make_pair(string("certitem"), vchCertIssuer);
+    string strPrefix = ssPrefix.str();
+    CDataStream ssStart(SER_DISK, CLIENT_VERSION);
+    ssStart << make_pair(string("certitem"), make_pair(vchCertIssuer, vchStart));
 
-            // decode the certissuer op, params, height
-            bool o = DecodeCertTx(tx, op, nOut, vvchArgs, nHeight);
-            if (!o || !IsCertOp(op)) continue;
-            if (op == OP_CERTISSUER_NEW) continue;
+    leveldb::Iterator *pcursor = NewIterator();
+    pcursor->Seek(ssStart.str());
 
-            vector<unsigned char> vchCertIssuer = vvchArgs[0];
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        leveldb::Slice slKey = pcursor->key();
+        if (!slKey.starts_with(strPrefix))
+            break;
+        try {
+            if (nMax != 0 && vCertItems.size() >= nMax) {
+                CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+                pair<string, pair<vector<unsigned char>, vector<unsigned char> > > key;
+                ssKey >> key;
+                vchNext = key.second.second;
+                break;
+            }
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            vector<CCertItem> vtxPos;
+            ssValue >> vtxPos;
+            if (!vtxPos.empty())
+                vCertItems.push_back(vtxPos.back());
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+        pcursor->Next();
+    }
+    delete pcursor;
+    return true;
+}
 
-            // get the transaction
-            if(!GetTransaction(tx.GetHash(), tx, txblkhash, true))
-                continue;
+bool CCertDB::UpgradeCertItems() {
+    int nVersion = 0;
+    if (Read(make_pair(string("certissuera"), string("certitems")), nVersion) && nVersion >= 1)
+        return true;
 
-            // attempt to read certissuer from txn
-            CCertIssuer txCertIssuer;
-            CCertItem txCA;
-            if(!txCertIssuer.UnserializeFromTx(tx))
-                return error("ReconstructCertIndex() : failed to unserialize certissuer from tx");
+    printf("Moving cert items to records of their own...\n");
+    leveldb::Iterator *pcursor = NewIterator();
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair(string("certissueri"), vector<unsigned char>());
+    pcursor->Seek(ssKeySet.str());
 
-            // save serialized certissuer
-            CCertIssuer serializedCertIssuer = txCertIssuer;
+    unsigned int nIssuers = 0, nItems = 0;
+    while (pcursor->Valid()) {
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            string strType;
+            ssKey >> strType;
+            if (strType != "certissueri")
+                break;
+            vector<unsigned char> vchCertIssuer;
+            ssKey >> vchCertIssuer;
 
-            // read certissuer from DB if it exists
+            // records of older versions still hold the cert items, as in the network form
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_NETWORK, CLIENT_VERSION);
             vector<CCertIssuer> vtxPos;
-            if (ExistsCertIssuer(vchCertIssuer)) {
-                if (!ReadCertIssuer(vchCertIssuer, vtxPos))
-                    return error("ReconstructCertIndex() : failed to read certissuer from DB");
-                if(vtxPos.size()!=0) {
-                    txCertIssuer.nHeight = nHeight;
-                    txCertIssuer.GetCertFromList(vtxPos);
+            ssValue >> vtxPos;
+
+            // every issuer version holds a copy of each item, so the item
+            // versions are the changes from one issuer version to the next
+            map<vector<unsigned char>, vector<CCertItem> > mapItems;
+            BOOST_FOREACH(CCertIssuer &certIssuer, vtxPos) {
+                BOOST_FOREACH(const CCertItem &certItem, certIssuer.certs) {
+                    vector<CCertItem> &vItem = mapItems[certItem.vchRand];
+                    if (vItem.empty() || vItem.back() != certItem)
+                        vItem.push_back(certItem);
                 }
+                certIssuer.nCerts = certIssuer.certs.size();
+                certIssuer.certs.clear();
             }
-
-            // read the certissuer certitem from db if exists
-            if(op == OP_CERT_NEW || op == OP_CERT_TRANSFER) {
-                bool bReadCertIssuer = false;
-                vector<unsigned char> vchCertItem = vvchArgs[1];
-                if (ExistsCertItem(vchCertItem)) {
-                    if (!ReadCertItem(vchCertItem, vchCertIssuer))
-                        printf("ReconstructCertIndex() : warning - failed to read certissuer certitem from certissuer DB\n");
-                    else bReadCertIssuer = true;
-                }
-                if(!bReadCertIssuer && !txCertIssuer.GetCertItemByHash(vchCertItem, txCA))
-                    printf("ReconstructCertIndex() : failed to read certissuer certitem from certissuer\n");
-
-                // add txn-specific values to certissuer certitem object
-                txCA.vchRand = vvchArgs[1];
-                txCA.nTime = pindex->nTime;
-                txCA.txHash = tx.GetHash();
-                txCA.nHeight = nHeight;
-                txCertIssuer.PutCertItem(txCA);
+            for (map<vector<unsigned char>, vector<CCertItem> >::iterator it = mapItems.begin(); it != mapItems.end(); it++) {
+                WriteCertItemRecord(vchCertIssuer, it->first, it->second);
+                nItems++;
             }
+            Write(make_pair(string("certissueri"), vchCertIssuer), vtxPos);
+            nIssuers++;
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+        pcursor->Next();
+    }
+    delete pcursor;
 
-            // use the txn certissuer as master on updates,
-            // but grab the certitems from the DB first
-            if(op == OP_CERTISSUER_UPDATE) {
-                serializedCertIssuer.certs = txCertIssuer.certs;
-                txCertIssuer = serializedCertIssuer;
-            }
+    // all in one batch, so the upgrade is never left half done
+    if (!Write(make_pair(string("certissuera"), string("certitems")), 1))
+        return false;
+    printf("Cert items moved: %u issuers, %u items\n", nIssuers, nItems);
+    return Flush();
+}
 
-            if(op != OP_CERTISSUER_NEW) {
-                // txn-specific values to certissuer object
-                txCertIssuer.vchRand = vvchArgs[0];
-                txCertIssuer.txHash = tx.GetHash();
-                txCertIssuer.nHeight = nHeight;
-                txCertIssuer.nTime = pindex->nTime;
-                txCertIssuer.PutToCertIssuerList(vtxPos);
+// height at which an issuer last updated at nHeight expires
+static int64 GetCertIssuerExpiryHeight(int64 nHeight) {
+    return nHeight + GetCertDisplayExpirationDepth(nHeight);
+}
 
-                if (!WriteCertIssuer(vchCertIssuer, vtxPos))
-                    return error("ReconstructCertIndex() : failed to write to certissuer DB");
-            }
+bool CCertDB::WriteCertIssuer(const vector<unsigned char>& name, const CCertIssuer& certIssuer) {
+    CCertIssuer certIssuerOld;
+    if (ReadCertIssuer(name, certIssuerOld))
+        EraseExpiry(string("certissuerx"), GetCertIssuerExpiryHeight(certIssuerOld.nHeight), name);
+    return PutVersion(string("certissueri"), string("certissuerh"), name, certIssuer.nHeight, certIssuer)
+        && WriteExpiry(string("certissuerx"), GetCertIssuerExpiryHeight(certIssuer.nHeight), name);
+}
 
-            if(op == OP_CERT_NEW || op == OP_CERT_TRANSFER)
-                if (!WriteCertItem(vvchArgs[1], vvchArgs[0]))
-                    return error("ReconstructCertIndex() : failed to write to certissuer DB");
-
-            // insert certissuers fees to regenerate list, write certissuer to
-            // master index
-            int64 nTheFee = GetCertNetFee(tx);
-            InsertCertFee(pindex, tx.GetHash(), nTheFee);
-			vector<CCertFee> vCertFees(lstCertIssuerFees.begin(),
-				lstCertIssuerFees.end());
-			if (!pcertdb->WriteCertFees(vCertFees))
-				return error("CheckOfferInputs() : failed to write fees to alias DB");
-
-
-            printf( "RECONSTRUCT CERT: op=%s certissuer=%s title=%s hash=%s height=%d fees=%llu\n",
-                    certissuerFromOp(op).c_str(),
-                    stringFromVch(vvchArgs[0]).c_str(),
-                    stringFromVch(txCertIssuer.vchTitle).c_str(),
-                    tx.GetHash().ToString().c_str(),
-                    nHeight,
-                    nTheFee);
+bool CCertDB::PopCertIssuer(const vector<unsigned char>& name, const uint256& txHash) {
+    CServiceVersion<CCertIssuer> head;
+    if (!ReadHead(string("certissueri"), name, head) || head.value.txHash != txHash)
+        return true;
+    EraseExpiry(string("certissuerx"), GetCertIssuerExpiryHeight(head.value.nHeight), name);
+    if (!PopVersion(string("certissueri"), string("certissuerh"), name, head))
+        return false;
+    CCertIssuer certIssuer;
+    if (ReadCertIssuer(name, certIssuer))
+        return WriteExpiry(string("certissuerx"), GetCertIssuerExpiryHeight(certIssuer.nHeight), name);
+    return true;
+}
+
+bool CCertDB::EraseCertIssuer(const vector<unsigned char>& name) {
+    CCertIssuer certIssuerOld;
+    if (ReadCertIssuer(name, certIssuerOld))
+        EraseExpiry(string("certissuerx"), GetCertIssuerExpiryHeight(certIssuerOld.nHeight), name);
+    return EraseHistory(string("certissueri"), string("certissuerh"), name);
+}
+
+bool CCertDB::BuildCertIssuerExpiry() {
+    int nVersion = 0;
+    if (Read(make_pair(string("certissuera"), string("certissuerexp")), nVersion) && nVersion >= 1)
+        return true;
+
+    printf("Building cert issuer expiry index...\n");
+    vector<unsigned char> vchCertIssuer;
+    vector<pair<vector<unsigned char>, CCertIssuer> > certissuerScan;
+    if (!ScanCertIssuers(vchCertIssuer, 100000000, certissuerScan))
+        return error("BuildCertIssuerExpiry() : scan failed");
+    pair<vector<unsigned char>, CCertIssuer> pairScan;
+    BOOST_FOREACH(pairScan, certissuerScan)
+        WriteExpiry(string("certissuerx"), GetCertIssuerExpiryHeight(pairScan.second.nHeight), pairScan.first);
+    if (!Write(make_pair(string("certissuera"), string("certissuerexp")), 1))
+        return false;
+    printf("Cert issuer expiry index: %"PRIszu" issuers\n", certissuerScan.size());
+    return Flush();
+}
+
+bool CCertDB::ScanCertIssuersSince(int nHeight, vector<pair<vector<unsigned char>, CCertIssuer> >& certissuerScan) {
+    // the expiry height only grows with the update height
+    return ReadHeadsExpiring(string("certissueri"), string("certissuerx"),
+            GetCertIssuerExpiryHeight(max(nHeight, 0)), certissuerScan);
+}
+
+unsigned int CCertDB::PruneCertIssuers(int nPruneHeight, unsigned int nMax) {
+    vector<vector<unsigned char> > vchCertIssuers;
+    if (!ReadExpiring(string("certissuerx"), 0, nPruneHeight + 1, vchCertIssuers, nMax))
+        return 0;
+
+    unsigned int nPruned = 0;
+    BOOST_FOREACH(const vector<unsigned char> &vchCertIssuer, vchCertIssuers) {
+        CCertIssuer certIssuer;
+        if (!ReadCertIssuer(vchCertIssuer, certIssuer))
+            continue;
+        if ((int64)nPruneHeight - (int64)certIssuer.nHeight <= (int64)GetCertExpirationDepth(nPruneHeight))
+            continue;
+        // the latest version and the items stay, a certtransfer can still
+        // refer to them. The older versions and the index entry go.
+        EraseExpiry(string("certissuerx"), GetCertIssuerExpiryHeight(certIssuer.nHeight), vchCertIssuer);
+        if (CompactHistory<CCertIssuer>(string("certissueri"), string("certissuerh"), vchCertIssuer))
+            nPruned++;
+    }
+    return nPruned;
+}
+
+static bool CompareCertIssuerHeight(const CCertIssuer &a, const CCertIssuer &b) {
+    return a.nHeight < b.nHeight;
+}
+
+bool CCertDB::UpgradeCertIssuerHistory() {
+    int nVersion = 0;
+    if (Read(make_pair(string("certissuera"), string("certissuerhist")), nVersion) && nVersion >= 1)
+        return true;
+
+    printf("Moving cert issuer records to versions...\n");
+    leveldb::Iterator *pcursor = NewIterator();
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair(string("certissueri"), vector<unsigned char>());
+    pcursor->Seek(ssKeySet.str());
+
+    unsigned int nIssuers = 0;
+    while (pcursor->Valid()) {
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            string strType;
+            ssKey >> strType;
+            if (strType != "certissueri")
+                break;
+            vector<unsigned char> vchCertIssuer;
+            ssKey >> vchCertIssuer;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            vector<CCertIssuer> vtxPos;
+            ssValue >> vtxPos;
+            stable_sort(vtxPos.begin(), vtxPos.end(), CompareCertIssuerHeight);
+            Erase(make_pair(string("certissueri"), vchCertIssuer));
+            BOOST_FOREACH(const CCertIssuer &certIssuer, vtxPos)
+                PutVersion(string("certissueri"), string("certissuerh"), vchCertIssuer, certIssuer.nHeight, certIssuer);
+            nIssuers++;
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
         }
-        pindex = pindex->pnext;
-        Flush();
+        pcursor->Next();
     }
+    delete pcursor;
+
+    // all in one batch, so the upgrade is never left half done
+    if (!Write(make_pair(string("certissuera"), string("certissuerhist")), 1))
+        return false;
+    printf("Cert issuer records moved: %u issuers\n", nIssuers);
+    return Flush();
+}
+
+/**
+ * [CCertDB::ReconstructCertIndex description]
+ * @param  pindex [main chain block index]
+ * @param  block  [the block read from disk]
+ * @return        [description]
+ */
+bool CCertDB::ReconstructCertIndex(CBlockIndex *pindex, const CBlock &block) {
+    int nHeight = pindex->nHeight;
+
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+
+        if (tx.nVersion != SYSCOIN_TX_VERSION)
+            continue;
+
+        vector<vector<unsigned char> > vvchArgs;
+        int op, nOut;
+
+        // decode the certissuer op, params, height
+        bool o = DecodeCertTx(tx, op, nOut, vvchArgs, nHeight);
+        if (!o || !IsCertOp(op)) continue;
+        if (op == OP_CERTISSUER_NEW) continue;
+
+        vector<unsigned char> vchCertIssuer = vvchArgs[0];
+
+        // attempt to read certissuer from txn
+        CCertIssuer txCertIssuer;
+        CCertItem txCA;
+        if(!txCertIssuer.UnserializeFromTx(tx))
+            return error("ReconstructCertIndex() : failed to unserialize certissuer from tx");
+
+        // save serialized certissuer
+        CCertIssuer serializedCertIssuer = txCertIssuer;
+
+        // read certissuer from DB if it exists
+        if (ExistsCertIssuer(vchCertIssuer)) {
+            if (!ReadCertIssuerAt(vchCertIssuer, nHeight, txCertIssuer))
+                return error("ReconstructCertIndex() : failed to read certissuer from DB");
+        }
+
+        // read the certissuer certitem from db if exists
+        if(op == OP_CERT_NEW || op == OP_CERT_TRANSFER) {
+            vector<unsigned char> vchCertItem = vvchArgs[1];
+            // the txn carries the certitem, as CheckCertInputs takes it
+            if(!serializedCertIssuer.GetCertItemByHash(vchCertItem, txCA)
+                    && !ReadCertItemRecord(vchCertIssuer, vchCertItem, txCA))
+                printf("ReconstructCertIndex() : failed to read certissuer certitem from certissuer\n");
+
+            // add txn-specific values to certissuer certitem object
+            txCA.vchRand = vvchArgs[1];
+            txCA.nTime = pindex->nTime;
+            txCA.txHash = tx.GetHash();
+            txCA.nHeight = nHeight;
+            if (!PutCertItem(vchCertIssuer, txCertIssuer, txCA))
+                return error("ReconstructCertIndex() : failed to write certitem to certissuer DB");
+        }
+
+        // use the txn certissuer as master on updates,
+        // but grab the certitems from the DB first
+        if(op == OP_CERTISSUER_UPDATE) {
+            serializedCertIssuer.nCerts = txCertIssuer.nCerts;
+            txCertIssuer = serializedCertIssuer;
+        }
+
+        if(op != OP_CERTISSUER_NEW) {
+            // txn-specific values to certissuer object
+            txCertIssuer.vchRand = vvchArgs[0];
+            txCertIssuer.txHash = tx.GetHash();
+            txCertIssuer.nHeight = nHeight;
+            txCertIssuer.nTime = pindex->nTime;
+
+            if (!WriteCertIssuer(vchCertIssuer, txCertIssuer))
+                return error("ReconstructCertIndex() : failed to write to certissuer DB");
+        }
+
+        if(op == OP_CERT_NEW || op == OP_CERT_TRANSFER)
+            if (!WriteCertItem(vvchArgs[1], vvchArgs[0]))
+                return error("ReconstructCertIndex() : failed to write to certissuer DB");
+
+        // insert certissuers fees to regenerate list, write certissuer to
+        // master index
+        int64 nTheFee = GetCertNetFee(tx);
+        InsertCertFee(pindex, tx.GetHash(), nTheFee);
+
+
+        printf( "RECONSTRUCT CERT: op=%s certissuer=%s title=%s hash=%s height=%d fees=%llu\n",
+                certissuerFromOp(op).c_str(),
+                stringFromVch(vvchArgs[0]).c_str(),
+                stringFromVch(txCertIssuer.vchTitle).c_str(),
+                tx.GetHash().ToString().c_str(),
+                nHeight,
+                nTheFee);
     }
     return true;
 }
@@ -328,85 +556,33 @@ int CheckCertIssuerTransactionAtRelativeDepth(CBlockIndex* pindexBlock,
 }
 
 int GetCertTxHashHeight(const uint256 txHash) {
-	CDiskTxPos postx;
-	pblocktree->ReadTxIndex(txHash, postx);
-	return GetCertTxPosHeight(postx);
+	return GetTxHeight(txHash);
 }
 
 uint64 GetCertFeeSubsidy(unsigned int nHeight) {
-
-    unsigned int h12 = 360 * 12;
-    unsigned int nTargetTime = 0;
-    unsigned int nTarget1hrTime = 0;
-    unsigned int blk1hrht = nHeight - 1;
-    unsigned int blk12hrht = nHeight - 1;
-    bool bFound = false;
-    uint64 hr1 = 1, hr12 = 1;
-
-    BOOST_FOREACH(CCertFee &nmFee, lstCertIssuerFees) {
-        if(nmFee.nHeight <= nHeight)
-            bFound = true;
-        if(bFound) {
-            if(nTargetTime==0) {
-                hr1 = hr12 = 0;
-                nTargetTime = nmFee.nTime - h12;
-                nTarget1hrTime = nmFee.nTime - (h12/12);
-            }
-            if(nmFee.nTime > nTargetTime) {
-                hr12 += nmFee.nFee;
-                blk12hrht = nmFee.nHeight;
-                if(nmFee.nTime > nTarget1hrTime) {
-                    hr1 += nmFee.nFee;
-                    blk1hrht = nmFee.nHeight;
-                }
-            }
-        }
-    }
-    hr12 /= (nHeight - blk12hrht) + 1;
-    hr1 /= (nHeight - blk1hrht) + 1;
+    uint64 hr1, hr12;
+    certFeeWindow.GetAverages(nHeight, hr1, hr12);
     uint64 nSubsidyOut = hr1 > hr12 ? hr1 : hr12;
     return nSubsidyOut;
 }
 
 bool RemoveCertFee(CCertFee &txnVal) {
 	TRY_LOCK(cs_main, cs_trymain);
-
-	CCertFee *theval = NULL;
-
-	BOOST_FOREACH(CCertFee &nmTxnValue, lstCertIssuerFees) {
-		if (txnVal.hash == nmTxnValue.hash
-		 && txnVal.nHeight == nmTxnValue.nHeight) {
-			theval = &nmTxnValue;
-			break;
-		}
-	}
-
-	if(theval)
-		lstCertIssuerFees.remove(*theval);
-
-	return theval != NULL;
+	return certFeeWindow.Remove(txnVal.hash, txnVal.nHeight);
 }
 
 bool InsertCertFee(CBlockIndex *pindex, uint256 hash, uint64 nValue) {
 	TRY_LOCK(cs_main, cs_trymain);
-    list<CCertFee> txnDup;
-    CCertFee oFee;
-    oFee.nTime = pindex->nTime;
-    oFee.nHeight = pindex->nHeight;
-    oFee.nFee = nValue;
-    bool bFound = false;
-
-    BOOST_FOREACH(CCertFee &nmFee, lstCertIssuerFees) {
-        if (oFee.hash == nmFee.hash
-                && oFee.nHeight == nmFee.nHeight) {
-            bFound = true;
-            break;
-        }
-    }
-    if (!bFound)
-        lstCertIssuerFees.push_front(oFee);
+    // cert fees have always been tracked without their tx hash, so only the
+    // first fee at each height counts; the block subsidy depends on this
+    return certFeeWindow.Insert(0, pindex->nHeight, pindex->nTime, nValue, false);
+}
 
-    return bFound;
+void SetCertFees(const vector<CCertFee> &vFees) {
+    vector<CFeeWindowEntry> vEntries;
+    BOOST_FOREACH(const CCertFee &oFee, vFees)
+        vEntries.push_back(CFeeWindowEntry(oFee.hash, oFee.nHeight, oFee.nTime, oFee.nFee));
+    certFeeWindow.SetEntries(vEntries);
 }
 
 int64 GetCertNetFee(const CTransaction& tx) {
@@ -420,12 +596,10 @@ int64 GetCertNetFee(const CTransaction& tx) {
 }
 
 int GetCertHeight(vector<unsigned char> vchCertIssuer) {
-    vector<CCertIssuer> vtxPos;
+    CCertIssuer txPos;
     if (pcertdb->ExistsCertIssuer(vchCertIssuer)) {
-        if (!pcertdb->ReadCertIssuer(vchCertIssuer, vtxPos))
+        if (!pcertdb->ReadCertIssuer(vchCertIssuer, txPos))
             return error("GetCertHeight() : failed to read from certissuer DB");
-        if (vtxPos.empty()) return -1;
-        CCertIssuer& txPos = vtxPos.back();
         return txPos.nHeight;
     }
     return -1;
@@ -575,11 +749,10 @@ bool GetValueOfCertIssuerTxHash(const uint256 &txHash,
 
 bool GetValueOfCertIssuer(CCertDB& dbCert, const vector<unsigned char> &vchCertIssuer,
         vector<unsigned char>& vchValue, int& nHeight) {
-    vector<CCertIssuer> vtxPos;
-    if (!pcertdb->ReadCertIssuer(vchCertIssuer, vtxPos) || vtxPos.empty())
+    CCertIssuer txPos;
+    if (!pcertdb->ReadCertIssuer(vchCertIssuer, txPos))
         return false;
 
-    CCertIssuer& txPos = vtxPos.back();
     nHeight = txPos.nHeight;
     vchValue = txPos.vchRand;
     return true;
@@ -587,10 +760,9 @@ bool GetValueOfCertIssuer(CCertDB& dbCert, const vector<unsigned char> &vchCertI
 
 bool GetTxOfCertIssuer(CCertDB& dbCert, const vector<unsigned char> &vchCertIssuer,
         CTransaction& tx) {
-    vector<CCertIssuer> vtxPos;
-    if (!pcertdb->ReadCertIssuer(vchCertIssuer, vtxPos) || vtxPos.empty())
+    CCertIssuer txPos;
+    if (!pcertdb->ReadCertIssuer(vchCertIssuer, txPos))
         return false;
-    CCertIssuer& txPos = vtxPos.back();
     int nHeight = txPos.nHeight;
     if (nHeight + GetCertExpirationDepth(pindexBest->nHeight)
             < pindexBest->nHeight) {
@@ -608,11 +780,9 @@ bool GetTxOfCertIssuer(CCertDB& dbCert, const vector<unsigned char> &vchCertIssu
 
 bool GetTxOfCertItem(CCertDB& dbCert, const vector<unsigned char> &vchCertItem,
         CCertIssuer &txPos, CTransaction& tx) {
-    vector<CCertIssuer> vtxPos;
     vector<unsigned char> vchCertIssuer;
     if (!pcertdb->ReadCertItem(vchCertItem, vchCertIssuer)) return false;
-    if (!pcertdb->ReadCertIssuer(vchCertIssuer, vtxPos)) return false;
-    txPos = vtxPos.back();
+    if (!pcertdb->ReadCertIssuer(vchCertIssuer, txPos)) return false;
     int nHeight = txPos.nHeight;
     if (nHeight + GetCertExpirationDepth(pindexBest->nHeight)
             < pindexBest->nHeight) {
@@ -1016,20 +1186,18 @@ bool CheckCertInputs(CBlockIndex *pindexBlock, const CTransaction &tx,
             return true;
         }
 
-        vector<vector<unsigned char> > vvchArgs;
-        int op;
-        int nOut;
-        bool good = DecodeCertTx(tx, op, nOut, vvchArgs, pindexBlock->nHeight);
-        if (!good)
+        const CServiceOps &ops = tx.GetServiceOps();
+        const vector<vector<unsigned char> > &vvchArgs = ops.cert.vvch;
+        int op = ops.cert.op;
+        if (!ops.cert.fDecoded)
             return error("CheckCertInputs() : could not decode a syscoin tx");
         int nPrevHeight;
         int nDepth;
         int64 nNetFee;
 
         // unserialize certissuer object from txn, check for valid
-        CCertIssuer theCertIssuer;
+        CCertIssuer theCertIssuer(*ops.pcertissuer);
         CCertItem theCertItem;
-        theCertIssuer.UnserializeFromTx(tx);
         if (theCertIssuer.IsNull())
             error("CheckCertInputs() : null certissuer object");
 
@@ -1244,11 +1412,11 @@ bool CheckCertInputs(CBlockIndex *pindexBlock, const CTransaction &tx,
         // save serialized certissuer for later use
         CCertIssuer serializedCertIssuer = theCertIssuer;
 
-        // if not an certissuernew, load the certissuer data from the DB
-        vector<CCertIssuer> vtxPos;
+        // if not an certissuernew, make sure the certissuer data can be loaded from the DB
         if(op != OP_CERTISSUER_NEW)
             if (pcertdb->ExistsCertIssuer(vvchArgs[0])) {
-                if (!pcertdb->ReadCertIssuer(vvchArgs[0], vtxPos))
+                CCertIssuer dbCertIssuer;
+                if (!pcertdb->ReadCertIssuer(vvchArgs[0], dbCertIssuer))
                     return error(
                             "CheckCertInputs() : failed to read from certissuer DB");
             }
@@ -1271,13 +1439,13 @@ bool CheckCertInputs(CBlockIndex *pindexBlock, const CTransaction &tx,
 
                     // get the latest certissuer from the db
                     theCertIssuer.nHeight = nHeight;
-                    theCertIssuer.GetCertFromList(vtxPos);
+                    pcertdb->ReadCertIssuerAt(vvchArgs[0], nHeight, theCertIssuer);
 
                     // If update, we make the serialized certissuer the master
                     // but first we assign the certitems from the DB since
                     // they are not shipped in an update txn to keep size down
                     if(op == OP_CERTISSUER_UPDATE) {
-                        serializedCertIssuer.certs = theCertIssuer.certs;
+                        serializedCertIssuer.nCerts = theCertIssuer.nCerts;
                         theCertIssuer = serializedCertIssuer;
                     }
 
@@ -1291,7 +1459,8 @@ bool CheckCertInputs(CBlockIndex *pindexBlock, const CTransaction &tx,
                         theCertItem.txHash = tx.GetHash();
                         theCertItem.nTime = pindexBlock->nTime;
                         theCertItem.nHeight = nHeight;
-                        theCertIssuer.PutCertItem(theCertItem);
+                        if (!pcertdb->PutCertItem(vvchArgs[0], theCertIssuer, theCertItem))
+                            return error( "CheckCertInputs() : failed to write certitem to cert DB");
 
                         if (!pcertdb->WriteCertItem(vvchArgs[1], vvchArgs[0]))
                             return error( "CheckCertInputs() : failed to write to cert DB");
@@ -1305,10 +1474,9 @@ bool CheckCertInputs(CBlockIndex *pindexBlock, const CTransaction &tx,
                     theCertIssuer.vchRand = vvchArgs[0];
                     theCertIssuer.txHash = tx.GetHash();
                     theCertIssuer.nTime = pindexBlock->nTime;
-                    theCertIssuer.PutToCertIssuerList(vtxPos);
 
                     // write cert issuer 
-                    if (!pcertdb->WriteCertIssuer(vvchArgs[0], vtxPos))
+                    if (!pcertdb->WriteCertIssuer(vvchArgs[0], theCertIssuer))
                         return error( "CheckCertInputs() : failed to write to cert DB");
                     mapTestPool[vvchArgs[0]] = tx.GetHash();
                     
@@ -1317,30 +1485,6 @@ bool CheckCertInputs(CBlockIndex *pindexBlock, const CTransaction &tx,
                     int64 nTheFee = GetCertNetFee(tx);
                     InsertCertFee(pindexBlock, tx.GetHash(), nTheFee);
                     if(nTheFee > 0) printf("CERT FEES: Added %lf in fees to track for regeneration.\n", (double) nTheFee / COIN);
-                    vector<CCertFee> vCertIssuerFees(lstCertIssuerFees.begin(), lstCertIssuerFees.end());
-                    if (!pcertdb->WriteCertFees(vCertIssuerFees))
-                        return error( "CheckCertInputs() : failed to write fees to certissuer DB");
-
-                    // remove certissuer from pendings
-
-                    // activate or update - seller txn
-                    if (op == OP_CERTISSUER_NEW || op == OP_CERTISSUER_ACTIVATE || op == OP_CERTISSUER_UPDATE) {
-                        vector<unsigned char> vchCertIssuer = op == OP_CERTISSUER_NEW ?
-                                    vchFromString(HexStr(vvchArgs[0])) : vvchArgs[0];
-                        TRY_LOCK(cs_main, cs_trymain);
-                        std::map<std::vector<unsigned char>, std::set<uint256> >::iterator
-                                mi = mapCertIssuerPending.find(vchCertIssuer);
-                        if (mi != mapCertIssuerPending.end())
-                            mi->second.erase(tx.GetHash());
-                    }
-
-                    // certitem or pay - buyer txn
-                    else {
-                        TRY_LOCK(cs_main, cs_trymain);
-                        std::map<std::vector<unsigned char>, std::set<uint256> >::iterator mi = mapCertItemPending.find(vvchArgs[1]);
-                        if (mi != mapCertItemPending.end())
-                            mi->second.erase(tx.GetHash());
-                    }
 
                     // debug
                     printf( "CONNECTED CERT: op=%s certissuer=%s title=%s hash=%s height=%d fees=%llu\n",
@@ -1385,21 +1529,8 @@ bool ExtractCertIssuerAddress(const CScript& script, string& address) {
     return true;
 }
 
-void rescanforcertissuers(CBlockIndex *pindexRescan) {
-    printf("Scanning blockchain for certissuers to create fast index...\n");
-    pcertdb->ReconstructCertIndex(pindexRescan);
-}
-
 int GetCertTxPosHeight(const CDiskTxPos& txPos) {
-    // Read block header
-    CBlock block;
-    if (!block.ReadFromDisk(txPos)) return 0;
-    // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
-    if (mi == mapBlockIndex.end()) return 0;
-    CBlockIndex* pindex = (*mi).second;
-    if (!pindex || !pindex->IsInMainChain()) return 0;
-    return pindex->nHeight;
+    return GetTxPosHeight(txPos);
 }
 
 int GetCertTxPosHeight2(const CDiskTxPos& txPos, int nHeight) {
@@ -1520,11 +1651,11 @@ Value certissueractivate(const Array& params, bool fHelp) {
     // check for existing pending certissuers
     {
         LOCK2(cs_main, pwalletMain->cs_wallet);
-        if (mapCertIssuerPending.count(vchCertIssuer)
-                && mapCertIssuerPending[vchCertIssuer].size()) {
+        set<uint256> setPending;
+        if (mempool.GetServiceTxs(SERVICE_CERT_ISSUER, vchCertIssuer, setPending)) {
             error( "certissueractivate() : there are %d pending operations on that certificate issuer, including %s",
-                   (int) mapCertIssuerPending[vchCertIssuer].size(),
-                   mapCertIssuerPending[vchCertIssuer].begin()->GetHex().c_str());
+                   (int) setPending.size(),
+                   setPending.begin()->GetHex().c_str());
             throw runtime_error("there are pending operations on that certissuer");
         }
 
@@ -1660,8 +1791,8 @@ Value certissuerupdate(const Array& params, bool fHelp) {
     {
         LOCK2(cs_main, pwalletMain->cs_wallet);
 
-        if (mapCertIssuerPending.count(vchCertIssuer)
-                && mapCertIssuerPending[vchCertIssuer].size())
+        set<uint256> setPending;
+        if (mempool.GetServiceTxs(SERVICE_CERT_ISSUER, vchCertIssuer, setPending))
             throw runtime_error("there are pending operations on that certificate issuer");
 
         EnsureWalletIsUnlocked();
@@ -1682,10 +1813,8 @@ Value certissuerupdate(const Array& params, bool fHelp) {
             throw runtime_error("cannot unserialize certissuer from txn");
 
         // get the certissuer from DB
-        vector<CCertIssuer> vtxPos;
-        if (!pcertdb->ReadCertIssuer(vchCertIssuer, vtxPos))
+        if (!pcertdb->ReadCertIssuer(vchCertIssuer, theCertIssuer))
             throw runtime_error("could not read certissuer from DB");
-        theCertIssuer = vtxPos.back();
         theCertIssuer.certs.clear();
 
         // calculate network fees
@@ -1757,11 +1886,11 @@ Value certnew(const Array& params, bool fHelp) {
     {
         LOCK2(cs_main, pwalletMain->cs_wallet);
 
-        if (mapCertIssuerPending.count(vchCertIssuer)
-                && mapCertIssuerPending[vchCertIssuer].size()) {
+        set<uint256> setPending;
+        if (mempool.GetServiceTxs(SERVICE_CERT_ISSUER, vchCertIssuer, setPending)) {
             error(  "certnew() : there are %d pending operations on that certificate issuer, including %s",
-                    (int) mapCertIssuerPending[vchCertIssuer].size(),
-                    mapCertIssuerPending[vchCertIssuer].begin()->GetHex().c_str());
+                    (int) setPending.size(),
+                    setPending.begin()->GetHex().c_str());
             throw runtime_error("there are pending operations on that certificate issuer");
         }
 
@@ -1778,10 +1907,8 @@ Value certnew(const Array& params, bool fHelp) {
             throw runtime_error("could not unserialize certificate issuer from txn");
 
         // get the certissuer id from DB
-        vector<CCertIssuer> vtxPos;
-        if (!pcertdb->ReadCertIssuer(vchCertIssuer, vtxPos))
+        if (!pcertdb->ReadCertIssuer(vchCertIssuer, theCertIssuer))
             throw runtime_error("could not read certificate issuer with this key from DB");
-        theCertIssuer = vtxPos.back();
 
         // create certitem object
         CCertItem txCertItem;
@@ -1831,8 +1958,8 @@ Value certtransfer(const Array& params, bool fHelp) {
     {
     LOCK2(cs_main, pwalletMain->cs_wallet);
 
-    if (mapCertItemPending.count(vchCertKey)
-            && mapCertItemPending[vchCertKey].size())
+    set<uint256> setPending;
+    if (mempool.GetServiceTxs(SERVICE_CERT_ITEM, vchCertKey, setPending))
         throw runtime_error( "certtransfer() : there are pending operations on that certificate" );
 
     EnsureWalletIsUnlocked();
@@ -1860,19 +1987,19 @@ Value certtransfer(const Array& params, bool fHelp) {
 
     // get the certissuer id from DB
     vector<unsigned char> vchCertIssuer;
-    vector<CCertIssuer> vtxPos;
+    CCertIssuer dbCertIssuer;
     if (!pcertdb->ReadCertItem(vchCertKey, vchCertIssuer))
         throw runtime_error("could not read certificate from DB");
-    if (!pcertdb->ReadCertIssuer(vchCertIssuer, vtxPos))
+    if (!pcertdb->ReadCertIssuer(vchCertIssuer, dbCertIssuer))
         throw runtime_error("could not read certificate issuer with this key from DB");
 
     // hashes should match
-    if(vtxPos.back().vchRand != theCertIssuer.vchRand)
+    if(dbCertIssuer.vchRand != theCertIssuer.vchRand)
         throw runtime_error("certificate issuer hash mismatch.");
 
     // use the certissuer and certificate from the DB as basis
-    theCertIssuer = vtxPos.back();
-    if(!theCertIssuer.GetCertItemByHash(vchCertKey, theCertItem))
+    theCertIssuer = dbCertIssuer;
+    if(!pcertdb->ReadCertItemRecord(vchCertIssuer, vchCertKey, theCertItem))
         throw runtime_error("could not find a certificate with this hash in DB");
 
     // get a key from our wallet set dest as ourselves
@@ -1915,31 +2042,24 @@ Value certissuerinfo(const Array& params, bool fHelp) {
         throw runtime_error("certissuerinfo <guid>\n"
                 "Show stored values of an certificate issuer.\n");
 
+    CServiceReadView view;
+
     Object oLastCertIssuer;
     vector<unsigned char> vchCertIssuer = vchFromValue(params[0]);
     string certissuer = stringFromVch(vchCertIssuer);
     {
-        vector<CCertIssuer> vtxPos;
-        if (!pcertdb->ReadCertIssuer(vchCertIssuer, vtxPos))
+        CCertIssuer theCertIssuer;
+        if (!pcertdb->ReadCertIssuer(vchCertIssuer, theCertIssuer))
             throw JSONRPCError(RPC_WALLET_ERROR,
                     "failed to read from certissuer DB");
-        if (vtxPos.size() < 1)
-            throw JSONRPCError(RPC_WALLET_ERROR, "no result returned");
-
-        // get transaction pointed to by alias
-        CTransaction tx;
-        uint256 blockHash;
-        uint256 txHash = vtxPos.back().txHash;
-        if (!GetTransaction(txHash, tx, blockHash, true))
-            throw JSONRPCError(RPC_WALLET_ERROR, "failed to read transaction from disk");
 
-        CCertIssuer theCertIssuer = vtxPos.back();
-
-        Object oCertIssuer;
-        vector<unsigned char> vchValue;
         Array aoCertItems;
-        for(unsigned int i=0;i<theCertIssuer.certs.size();i++) {
-            CCertItem ca = theCertIssuer.certs[i];
+        vector<CCertItem> vCertItems;
+        vector<unsigned char> vchNext;
+        if (!pcertdb->ScanCertItems(vchCertIssuer, vector<unsigned char>(), 0, vCertItems, vchNext))
+            throw JSONRPCError(RPC_WALLET_ERROR, "failed to read certificates from certissuer DB");
+        for(unsigned int i=0;i<vCertItems.size();i++) {
+            const CCertItem &ca = vCertItems[i];
             Object oCertItem;
             string sTime = strprintf("%llu", ca.nTime);
             string sHeight = strprintf("%llu", ca.nHeight);
@@ -1953,6 +2073,20 @@ Value certissuerinfo(const Array& params, bool fHelp) {
             oCertItem.push_back(Pair("data", stringFromVch(ca.vchData)));
             aoCertItems.push_back(oCertItem);
         }
+
+        // the issuer and its certificates came from the snapshot, the chain
+        // is only locked for the lookups that follow
+        LOCK2(cs_main, mempool.cs);
+
+        // get transaction pointed to by alias
+        CTransaction tx;
+        uint256 blockHash;
+        uint256 txHash = theCertIssuer.txHash;
+        if (!GetTransaction(txHash, tx, blockHash, true))
+            throw JSONRPCError(RPC_WALLET_ERROR, "failed to read transaction from disk");
+
+        Object oCertIssuer;
+        vector<unsigned char> vchValue;
         int nHeight;
         uint256 certissuerHash;
         if (GetValueOfCertIssuerTxHash(txHash, vchValue, certissuerHash, nHeight)) {
@@ -1965,14 +2099,22 @@ Value certissuerinfo(const Array& params, bool fHelp) {
             oCertIssuer.push_back(
                     Pair("expires_in",
                             nHeight + GetCertDisplayExpirationDepth(nHeight)
-                                    - pindexBest->nHeight));
+                                    - view.nHeight));
             if (nHeight + GetCertDisplayExpirationDepth(nHeight)
-                    - pindexBest->nHeight <= 0) {
+                    - view.nHeight <= 0) {
                 oCertIssuer.push_back(Pair("expired", 1));
             }
             oCertIssuer.push_back(Pair("title", stringFromVch(theCertIssuer.vchTitle)));
             oCertIssuer.push_back(Pair("data", stringFromVch(theCertIssuer.vchData)));
             oCertIssuer.push_back(Pair("certificates", aoCertItems));
+
+            // updates still in the memory pool
+            set<uint256> setPending;
+            Array aoPending;
+            mempool.GetServiceTxs(SERVICE_CERT_ISSUER, vchCertIssuer, setPending);
+            BOOST_FOREACH(const uint256 &hashPending, setPending)
+                aoPending.push_back(hashPending.GetHex());
+            oCertIssuer.push_back(Pair("pending", aoPending));
             oLastCertIssuer = oCertIssuer;
         }
     }
@@ -1985,9 +2127,14 @@ Value certinfo(const Array& params, bool fHelp) {
         throw runtime_error("certissuerinfo <guid>\n"
                 "Show stored values of a single certificate and its issuer.\n");
 
+    CServiceReadView view;
+
     vector<unsigned char> vchCertRand = ParseHex(params[0].get_str());
     Object oCertItem;
 
+    // one certificate: the chain stays locked for its few lookups
+    LOCK2(cs_main, mempool.cs);
+
     // look for a transaction with this key, also returns
     // an certissuer object if it is found
     CTransaction tx;
@@ -1998,7 +2145,7 @@ Value certinfo(const Array& params, bool fHelp) {
     uint256 txHash = tx.GetHash();
 
     {
-        if(!theCertIssuer.GetCertItemByHash(vchCertRand, theCertItem))
+        if(!pcertdb->ReadCertItemRecord(theCertIssuer.vchRand, vchCertRand, theCertItem))
             throw runtime_error("could not find a certificate with this hash in DB");
 
         Object oCertIssuer;
@@ -2015,6 +2162,14 @@ Value certinfo(const Array& params, bool fHelp) {
         oCertItem.push_back(Pair("title", stringFromVch(ca.vchTitle)));
         oCertItem.push_back(Pair("data", stringFromVch(ca.vchData)));
 
+        // transfers still in the memory pool
+        set<uint256> setPending;
+        Array aoPending;
+        mempool.GetServiceTxs(SERVICE_CERT_ITEM, vchCertRand, setPending);
+        BOOST_FOREACH(const uint256 &hashPending, setPending)
+            aoPending.push_back(hashPending.GetHex());
+        oCertItem.push_back(Pair("pending", aoPending));
+
         int nHeight;
         uint256 certissuerHash;
         if (GetValueOfCertIssuerTxHash(txHash, vchValue, certissuerHash, nHeight)) {
@@ -2027,9 +2182,9 @@ Value certinfo(const Array& params, bool fHelp) {
             oCertIssuer.push_back(
                     Pair("expires_in",
                             nHeight + GetCertDisplayExpirationDepth(nHeight)
-                                    - pindexBest->nHeight));
+                                    - view.nHeight));
             if (nHeight + GetCertDisplayExpirationDepth(nHeight)
-                    - pindexBest->nHeight <= 0) {
+                    - view.nHeight <= 0) {
                 oCertIssuer.push_back(Pair("expired", 1));
             }
             oCertIssuer.push_back(Pair("title", stringFromVch(theCertIssuer.vchTitle)));
@@ -2040,6 +2195,54 @@ Value certinfo(const Array& params, bool fHelp) {
     return oCertItem;
 }
 
+Value certlist(const Array& params, bool fHelp) {
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error("certlist <certissuer> [<start>] [<count>]\n"
+                "list the certificates of a certificate issuer, count (default 100) at a time.\n"
+                "<start> certificate guidkey to list from, the \"next\" value of the previous page.\n");
+
+    CServiceReadView view;
+
+    vector<unsigned char> vchCertIssuer = vchFromValue(params[0]);
+    vector<unsigned char> vchStart;
+    if (params.size() > 1)
+        vchStart = ParseHex(params[1].get_str());
+    unsigned int nCount = 100;
+    if (params.size() > 2) {
+        Value vCount = params[2];
+        ConvertTo<double>(vCount);
+        nCount = (unsigned int) vCount.get_real();
+        if (nCount == 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "count must be positive");
+    }
+
+    if (!pcertdb->ExistsCertIssuer(vchCertIssuer))
+        throw JSONRPCError(RPC_WALLET_ERROR, "could not find a certificate issuer with this name");
+
+    vector<CCertItem> vCertItems;
+    vector<unsigned char> vchNext;
+    if (!pcertdb->ScanCertItems(vchCertIssuer, vchStart, nCount, vCertItems, vchNext))
+        throw JSONRPCError(RPC_WALLET_ERROR, "failed to read certificates from certissuer DB");
+
+    Array aoCertItems;
+    BOOST_FOREACH(const CCertItem &ca, vCertItems) {
+        Object oCertItem;
+        oCertItem.push_back(Pair("id", HexStr(ca.vchRand)));
+        oCertItem.push_back(Pair("txid", ca.txHash.GetHex()));
+        oCertItem.push_back(Pair("height", strprintf("%llu", ca.nHeight)));
+        oCertItem.push_back(Pair("time", strprintf("%llu", ca.nTime)));
+        oCertItem.push_back(Pair("fee", ValueFromAmount(ca.nFee)));
+        oCertItem.push_back(Pair("title", stringFromVch(ca.vchTitle)));
+        aoCertItems.push_back(oCertItem);
+    }
+
+    Object oRes;
+    oRes.push_back(Pair("certificates", aoCertItems));
+    if (!vchNext.empty())
+        oRes.push_back(Pair("next", HexStr(vchNext)));
+    return oRes;
+}
+
 Value certissuerlist(const Array& params, bool fHelp) {
     if (fHelp || 1 < params.size())
         throw runtime_error("certissuerlist [<certissuer>]\n"
@@ -2135,13 +2338,15 @@ Value certissuerhistory(const Array& params, bool fHelp) {
         throw runtime_error("certissuerhistory <certissuer>\n"
                 "List all stored values of an certissuer.\n");
 
+    CServiceReadView view;
+
     Array oRes;
     vector<unsigned char> vchCertIssuer = vchFromValue(params[0]);
     string certissuer = stringFromVch(vchCertIssuer);
 
     {
         vector<CCertIssuer> vtxPos;
-        if (!pcertdb->ReadCertIssuer(vchCertIssuer, vtxPos))
+        if (!pcertdb->ReadCertIssuerHistory(vchCertIssuer, vtxPos))
             throw JSONRPCError(RPC_WALLET_ERROR,
                     "failed to read from certissuer DB");
 
@@ -2149,6 +2354,7 @@ Value certissuerhistory(const Array& params, bool fHelp) {
         uint256 txHash;
         uint256 blockHash;
         BOOST_FOREACH(txPos2, vtxPos) {
+            LOCK2(cs_main, mempool.cs);
             txHash = txPos2.txHash;
             CTransaction tx;
             if (!GetTransaction(txHash, tx, blockHash, true)) {
@@ -2171,9 +2377,9 @@ Value certissuerhistory(const Array& params, bool fHelp) {
                 oCertIssuer.push_back(
                         Pair("expires_in",
                                 nHeight + GetCertDisplayExpirationDepth(nHeight)
-                                        - pindexBest->nHeight));
+                                        - view.nHeight));
                 if (nHeight + GetCertDisplayExpirationDepth(nHeight)
-                        - pindexBest->nHeight <= 0) {
+                        - view.nHeight <= 0) {
                     oCertIssuer.push_back(Pair("expired", 1));
                 }
                 oRes.push_back(oCertIssuer);
@@ -2197,6 +2403,8 @@ Value certissuerfilter(const Array& params, bool fHelp) {
                         "certissuerfilter \"^certissuer\" # list all certissueres starting with \"certissuer\"\n"
                         "certissuerfilter 36000 0 0 stat # display stats (number of certissuers) on active certissueres\n");
 
+    CServiceReadView view;
+
     string strRegexp;
     int nFrom = 0;
     int nNb = 0;
@@ -2223,9 +2431,11 @@ Value certissuerfilter(const Array& params, bool fHelp) {
     //CCertDB dbCert("r");
     Array oRes;
 
+    // with a max age only the issuers the expiry index has as recent
     vector<unsigned char> vchCertIssuer;
     vector<pair<vector<unsigned char>, CCertIssuer> > certissuerScan;
-    if (!pcertdb->ScanCertIssuers(vchCertIssuer, 100000000, certissuerScan))
+    if (nMaxAge != 0 ? !pcertdb->ScanCertIssuersSince(view.nHeight - nMaxAge + 1, certissuerScan)
+            : !pcertdb->ScanCertIssuers(vchCertIssuer, 100000000, certissuerScan))
         throw JSONRPCError(RPC_WALLET_ERROR, "scan failed");
 
     pair<vector<unsigned char>, CCertIssuer> pairScan;
@@ -2243,7 +2453,7 @@ Value certissuerfilter(const Array& params, bool fHelp) {
         int nHeight = txCertIssuer.nHeight;
 
         // max age
-        if (nMaxAge != 0 && pindexBest->nHeight - nHeight >= nMaxAge)
+        if (nMaxAge != 0 && view.nHeight - nHeight >= nMaxAge)
             continue;
 
         // from limits
@@ -2251,12 +2461,13 @@ Value certissuerfilter(const Array& params, bool fHelp) {
         if (nCountFrom < nFrom + 1)
             continue;
 
+        LOCK2(cs_main, mempool.cs);
         Object oCertIssuer;
         oCertIssuer.push_back(Pair("certissuer", certissuer));
         CTransaction tx;
         uint256 blockHash;
         uint256 txHash = txCertIssuer.txHash;
-        if ((nHeight + GetCertDisplayExpirationDepth(nHeight) - pindexBest->nHeight
+        if ((nHeight + GetCertDisplayExpirationDepth(nHeight) - view.nHeight
                 <= 0) || !GetTransaction(txHash, tx, blockHash, true)) {
             oCertIssuer.push_back(Pair("expired", 1));
         } else {
@@ -2266,7 +2477,7 @@ Value certissuerfilter(const Array& params, bool fHelp) {
             oCertIssuer.push_back(
                     Pair("expires_in",
                             nHeight + GetCertDisplayExpirationDepth(nHeight)
-                                    - pindexBest->nHeight));
+                                    - view.nHeight));
         }
         oRes.push_back(oCertIssuer);
 
@@ -2278,7 +2489,7 @@ Value certissuerfilter(const Array& params, bool fHelp) {
 
     if (fStat) {
         Object oStat;
-        oStat.push_back(Pair("blocks", (int) nBestHeight));
+        oStat.push_back(Pair("blocks", view.nHeight));
         oStat.push_back(Pair("count", (int) oRes.size()));
         //oStat.push_back(Pair("sha256sum", SHA256(oRes), true));
         return oStat;
@@ -2293,6 +2504,8 @@ Value certissuerscan(const Array& params, bool fHelp) {
                 "certissuerscan [<start-certissuer>] [<max-returned>]\n"
                         "scan all certissuers, starting at start-certissuer and returning a maximum number of entries (default 500)\n");
 
+    CServiceReadView view;
+
     vector<unsigned char> vchCertIssuer;
     int nMax = 500;
     if (params.size() > 0) {
@@ -2314,6 +2527,7 @@ Value certissuerscan(const Array& params, bool fHelp) {
 
     pair<vector<unsigned char>, CCertIssuer> pairScan;
     BOOST_FOREACH(pairScan, certissuerScan) {
+        LOCK2(cs_main, mempool.cs);
         Object oCertIssuer;
         string certissuer = stringFromVch(pairScan.first);
         oCertIssuer.push_back(Pair("certissuer", certissuer));
@@ -2323,7 +2537,7 @@ Value certissuerscan(const Array& params, bool fHelp) {
 
         int nHeight = txCertIssuer.nHeight;
         vector<unsigned char> vchValue = txCertIssuer.vchTitle;
-        if ((nHeight + GetCertDisplayExpirationDepth(nHeight) - pindexBest->nHeight
+        if ((nHeight + GetCertDisplayExpirationDepth(nHeight) - view.nHeight
                 <= 0) || !GetTransaction(txCertIssuer.txHash, tx, blockHash, true)) {
             oCertIssuer.push_back(Pair("expired", 1));
         } else {
@@ -2336,7 +2550,7 @@ Value certissuerscan(const Array& params, bool fHelp) {
             oCertIssuer.push_back(
                     Pair("expires_in",
                             nHeight + GetCertDisplayExpirationDepth(nHeight)
-                                    - pindexBest->nHeight));
+                                    - view.nHeight));
         }
         oRes.push_back(oCertIssuer);
     }
@@ -2398,15 +2612,6 @@ Value certissuerscan(const Array& params, bool fHelp) {
              UnspendInputs(wtx);
              wtx.RemoveFromMemoryPool();
              pwalletMain->EraseFromWallet(wtx.GetHash());
-             vector<unsigned char> vchCertIssuer;
-             if (GetNameOfCertIssuerTx(wtx, vchCertIssuer) && mapCertIssuerPending.count(vchCertIssuer))
-             {
-                 string certissuer = stringFromVch(vchCertIssuer);
-                 printf("certissuer_clean() : erase %s from pending of certissuer %s",
-                 wtx.GetHash().GetHex().c_str(), certissuer.c_str());
-                 if (!mapCertIssuerPending[vchCertIssuer].erase(wtx.GetHash()))
-                     error("certissuer_clean() : erase but it was not pending");
-             }
              wtx.print();
          }
 
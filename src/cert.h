@@ -2,9 +2,11 @@
 #define CERT_H
 
 #include "bitcoinrpc.h"
-#include "leveldb.h"
+#include "servicedb.h"
+#include "feewindow.h"
 
 class CTransaction;
+class CBlock;
 class CTxOut;
 class CValidationState;
 class CCoinsViewCache;
@@ -42,8 +44,6 @@ std::string certissuerFromOp(int op);
 
 extern std::map<std::vector<unsigned char>, uint256> mapMyCertIssuers;
 extern std::map<std::vector<unsigned char>, uint256> mapMyCertItems;
-extern std::map<std::vector<unsigned char>, std::set<uint256> > mapCertIssuerPending;
-extern std::map<std::vector<unsigned char>, std::set<uint256> > mapCertItemPending;
 
 class CBitcoinAddress;
 
@@ -118,6 +118,7 @@ public:
     uint64 n;
     uint64 nFee;
     std::vector<CCertItem>certs;
+    uint64 nCerts; // number of cert items, kept on disk instead of them
 
     CCertIssuer() {
         SetNull();
@@ -138,7 +139,11 @@ public:
         READWRITE(hash);
         READWRITE(n);
         READWRITE(nFee);
-        READWRITE(certs);
+        // the database keeps each cert item in a record of its own
+        if (nType & SER_DISK)
+            READWRITE(nCerts);
+        else
+            READWRITE(certs);
     )
 
     bool GetCertItemByHash(std::vector<unsigned char> ahash, CCertItem &ca) {
@@ -198,6 +203,7 @@ public:
         && a.nHeight == b.nHeight
         && a.nTime == b.nTime
         && a.certs == b.certs
+        && a.nCerts == b.nCerts
         );
     }
 
@@ -212,6 +218,7 @@ public:
         nHeight = b.nHeight;
         nTime = b.nTime;
         certs = b.certs;
+        nCerts = b.nCerts;
         return *this;
     }
 
@@ -219,7 +226,7 @@ public:
         return !(a == b);
     }
 
-    void SetNull() { nHeight = n = 0; txHash = hash = 0; certs.clear(); vchRand.clear(); vchTitle.clear(); vchData.clear(); }
+    void SetNull() { nHeight = n = nCerts = 0; txHash = hash = 0; certs.clear(); vchRand.clear(); vchTitle.clear(); vchData.clear(); }
     bool IsNull() const { return (n == 0 && txHash == 0 && hash == 0 && nHeight == 0 && vchRand.size() == 0); }
 
     bool UnserializeFromTx(const CTransaction &tx);
@@ -268,27 +275,66 @@ public:
 };
 bool RemoveCertFee(CCertFee &txnVal);
 
-class CCertDB : public CLevelDB {
+class CCertDB : public CServiceDB {
 public:
-    CCertDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDB(GetDataDir() / "certificates", nCacheSize, fMemory, fWipe) {}
+    CCertDB(size_t nCacheSize, bool fMemory, bool fWipe) : CServiceDB(GetDataDir() / "certificates", nCacheSize, fMemory, fWipe) {}
 
-    bool WriteCertIssuer(const std::vector<unsigned char>& name, std::vector<CCertIssuer>& vtxPos) {
-        return Write(make_pair(std::string("certissueri"), name), vtxPos);
+    // the latest version of an issuer is kept under "certissueri", and each
+    // version under "certissuerh" by height. "certissuerx" indexes the
+    // issuers by the height their latest version expires at.
+
+    bool WriteCertIssuer(const std::vector<unsigned char>& name, const CCertIssuer& certIssuer);
+
+    // take off the version a transaction wrote
+    bool PopCertIssuer(const std::vector<unsigned char>& name, const uint256& txHash);
+
+    bool EraseCertIssuer(const std::vector<unsigned char>& name);
+
+    bool ReadCertIssuer(const std::vector<unsigned char>& name, CCertIssuer& certIssuer) {
+        CServiceVersion<CCertIssuer> head;
+        if (!ReadHead(std::string("certissueri"), name, head))
+            return false;
+        certIssuer = head.value;
+        return true;
     }
 
-    bool EraseCertIssuer(const std::vector<unsigned char>& name) {
-        return Erase(make_pair(std::string("certissueri"), name));
+    // the version at nHeight if there is one, else the latest
+    bool ReadCertIssuerAt(const std::vector<unsigned char>& name, int64 nHeight, CCertIssuer& certIssuer) {
+        CServiceVersion<CCertIssuer> version;
+        if (!ReadVersion(std::string("certissuerh"), name, nHeight, version)
+                && !ReadHead(std::string("certissueri"), name, version))
+            return false;
+        certIssuer = version.value;
+        return true;
     }
 
-    bool ReadCertIssuer(const std::vector<unsigned char>& name, std::vector<CCertIssuer>& vtxPos) {
-        return Read(make_pair(std::string("certissueri"), name), vtxPos);
+    bool ReadCertIssuerHistory(const std::vector<unsigned char>& name, std::vector<CCertIssuer>& vtxPos) {
+        return ReadHistory(std::string("certissuerh"), name, vtxPos);
     }
 
+    // move the issuer records of older databases to versions
+    bool UpgradeCertIssuerHistory();
+
+    // index the issuers of a database written before the expiry index existed
+    bool BuildCertIssuerExpiry();
+
+    // the latest versions of the issuers updated at nHeight or later, along
+    // with some older ones, in the order of ScanCertIssuers
+    bool ScanCertIssuersSince(int nHeight, std::vector<std::pair<std::vector<unsigned char>, CCertIssuer> >& certissuerScan);
+
+    // compact up to about nMax issuers that are expired for good at
+    // nPruneHeight, returning how many were
+    unsigned int PruneCertIssuers(int nPruneHeight, unsigned int nMax);
+
     bool ExistsCertIssuer(const std::vector<unsigned char>& name) {
         return Exists(make_pair(std::string("certissueri"), name));
     }
+    // key of the latest version, for Preload
+    static std::string CertIssuerKey(const std::vector<unsigned char>& name) {
+        return KeyString(make_pair(std::string("certissueri"), name));
+    }
 
-    bool WriteCertItem(const std::vector<unsigned char>& name, std::vector<unsigned char>& vchValue) {
+    bool WriteCertItem(const std::vector<unsigned char>& name, const std::vector<unsigned char>& vchValue) {
         return Write(make_pair(std::string("certissuera"), name), vchValue);
     }
 
@@ -304,22 +350,63 @@ public:
         return Exists(make_pair(std::string("certissuera"), name));
     }
 
-    bool WriteCertFees(std::vector<CCertFee>& vtxPos) {
-        return Write(make_pair(std::string("certissuera"), std::string("certissuertxf")), vtxPos);
+    // the versions of a cert item, one record per item under its issuer
+
+    bool WriteCertItemRecord(const std::vector<unsigned char>& vchCertIssuer, const std::vector<unsigned char>& vchCertItem, std::vector<CCertItem>& vtxPos) {
+        return Write(make_pair(std::string("certitem"), make_pair(vchCertIssuer, vchCertItem)), vtxPos);
+    }
+
+    bool EraseCertItemRecord(const std::vector<unsigned char>& vchCertIssuer, const std::vector<unsigned char>& vchCertItem) {
+        return Erase(make_pair(std::string("certitem"), make_pair(vchCertIssuer, vchCertItem)));
     }
 
+    bool ReadCertItemRecord(const std::vector<unsigned char>& vchCertIssuer, const std::vector<unsigned char>& vchCertItem, std::vector<CCertItem>& vtxPos) {
+        return Read(make_pair(std::string("certitem"), make_pair(vchCertIssuer, vchCertItem)), vtxPos);
+    }
+
+    // the latest version of a cert item
+    bool ReadCertItemRecord(const std::vector<unsigned char>& vchCertIssuer, const std::vector<unsigned char>& vchCertItem, CCertItem& certItem);
+
+    // store a new version of a cert item, counting new items in the issuer
+    bool PutCertItem(const std::vector<unsigned char>& vchCertIssuer, CCertIssuer& certIssuer, const CCertItem& certItem);
+
+    // take the version a transaction wrote off a cert item
+    bool PopCertItem(const std::vector<unsigned char>& vchCertIssuer, const std::vector<unsigned char>& vchCertItem, const uint256& txHash);
+
+    // up to nMax (0 for all) cert items of an issuer from vchStart on; vchNext
+    // is the item to continue from, or empty at the end
+    bool ScanCertItems(const std::vector<unsigned char>& vchCertIssuer, const std::vector<unsigned char>& vchStart,
+            unsigned int nMax, std::vector<CCertItem>& vCertItems, std::vector<unsigned char>& vchNext);
+
+    // move the cert items out of the issuer records of older databases
+    bool UpgradeCertItems();
+
+    // fee list as stored before fees were kept one per record
+
     bool ReadCertFees(std::vector<CCertFee>& vtxPos) {
         return Read(make_pair(std::string("certissuera"), std::string("certissuertxf")), vtxPos);
     }
+    bool EraseCertFees() {
+        return Erase(make_pair(std::string("certissuera"), std::string("certissuertxf")));
+    }
+
+    bool WriteCertIssuerFees(CFeeWindow& window) {
+        return window.Write(*this, std::string("certissuerfee"));
+    }
+    bool ReadCertIssuerFees(CFeeWindow& window) {
+        return window.Read(*this, std::string("certissuerfee"));
+    }
 
     bool ScanCertIssuers(
             const std::vector<unsigned char>& vchName,
             unsigned int nMax,
             std::vector<std::pair<std::vector<unsigned char>, CCertIssuer> >& certIssuerScan);
 
-    bool ReconstructCertIndex(CBlockIndex *pindexRescan);
+    // apply the certs of a main chain block to the index when rebuilding it
+    bool ReconstructCertIndex(CBlockIndex *pindex, const CBlock &block);
 };
-extern std::list<CCertFee> lstCertIssuerFees;
+extern CFeeWindow certFeeWindow;
+void SetCertFees(const std::vector<CCertFee> &vFees);
 
 
 bool GetTxOfCertIssuer(CCertDB& dbCertIssuer, const std::vector<unsigned char> &vchCertIssuer, CTransaction& tx);
@@ -0,0 +1,366 @@
+// Copyright (c) 2014 Syscoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+//
+
+#include "feewindow.h"
+#include "servicedb.h"
+#include "util.h"
+
+#include <algorithm>
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+CFeeWindow::CFeeWindow(unsigned int nSpanIn) {
+    nSpan = nSpanIn;
+    // keep some slack, so a later block with an earlier timestamp
+    // still sees everything the original window saw
+    nPruneAge = 2 * (uint64)nSpan + 2 * 60 * 60;
+    nNextSeq = 1;
+}
+
+void CFeeWindow::Clear() {
+    lstEntries.clear();
+    mapEntries.clear();
+    mapDuplicates.clear();
+    mapByTime.clear();
+    mapDirty.clear();
+    setErased.clear();
+    sumLong = CSum();
+    sumShort = CSum();
+    nNextSeq = 1;
+}
+
+void CFeeWindow::SetDirty(const CEntry &entry) {
+    entry_key key(entry.hash, entry.nHeight);
+    mapDirty[key] = entry;
+    setErased.erase(key);
+}
+
+void CFeeWindow::Join(CSum &sum, const CEntry &entry) {
+    sum.nValue += entry.nValue;
+    sum.mapHeights[entry.nSeq] = entry.nHeight;
+}
+
+void CFeeWindow::Leave(CSum &sum, const CEntry &entry) {
+    sum.nValue -= entry.nValue;
+    sum.mapHeights.erase(entry.nSeq);
+}
+
+void CFeeWindow::MoveBound(CSum &sum, uint64 nBound) {
+    if (nBound > sum.nBound) {
+        multimap<uint64, entry_iterator>::iterator it = mapByTime.upper_bound(sum.nBound);
+        for (; it != mapByTime.end() && it->first <= nBound; ++it)
+            Leave(sum, *it->second);
+    } else if (nBound < sum.nBound) {
+        multimap<uint64, entry_iterator>::iterator it = mapByTime.upper_bound(nBound);
+        for (; it != mapByTime.end() && it->first <= sum.nBound; ++it)
+            Join(sum, *it->second);
+    }
+    sum.nBound = nBound;
+}
+
+// Anchor both windows at the newest entry. The bounds are truncated to 32
+// bits the same way the subsidy calculation always has.
+void CFeeWindow::Retarget() {
+    if (lstEntries.empty()) {
+        MoveBound(sumLong, ~(uint64)0);
+        MoveBound(sumShort, ~(uint64)0);
+        return;
+    }
+    uint64 nTime = lstEntries.front().nTime;
+    MoveBound(sumLong, (unsigned int)(nTime - nSpan));
+    MoveBound(sumShort, (unsigned int)(nTime - (nSpan / 12)));
+}
+
+void CFeeWindow::Link(entry_iterator it) {
+    mapByTime.insert(make_pair(it->nTime, it));
+    if (it->nTime > sumLong.nBound)
+        Join(sumLong, *it);
+    if (it->nTime > sumShort.nBound)
+        Join(sumShort, *it);
+}
+
+void CFeeWindow::Unlink(entry_iterator it) {
+    if (it->nTime > sumLong.nBound)
+        Leave(sumLong, *it);
+    if (it->nTime > sumShort.nBound)
+        Leave(sumShort, *it);
+    pair<multimap<uint64, entry_iterator>::iterator, multimap<uint64, entry_iterator>::iterator> range = mapByTime.equal_range(it->nTime);
+    for (multimap<uint64, entry_iterator>::iterator mi = range.first; mi != range.second; ++mi) {
+        if (mi->second == it) {
+            mapByTime.erase(mi);
+            break;
+        }
+    }
+}
+
+void CFeeWindow::Erase(entry_iterator it) {
+    bool fFront = (it == lstEntries.begin());
+    pair<uint256, uint64> key(it->hash, it->nHeight);
+    Unlink(it);
+    map<pair<uint256, uint64>, entry_iterator>::iterator mi = mapEntries.find(key);
+    bool fIndexed = (mi != mapEntries.end() && mi->second == it);
+    if (fIndexed)
+        mapEntries.erase(mi);
+    lstEntries.erase(it);
+    map<entry_key, unsigned int>::iterator di = mapDuplicates.find(key);
+    if (di != mapDuplicates.end()) {
+        if (--di->second == 0)
+            mapDuplicates.erase(di);
+        if (fIndexed) {
+            // the newest duplicate is now the one lookups see
+            for (entry_iterator dup = lstEntries.begin(); dup != lstEntries.end(); ++dup) {
+                if (dup->hash == key.first && dup->nHeight == key.second) {
+                    mapEntries[key] = dup;
+                    break;
+                }
+            }
+        }
+    }
+    if (fFront)
+        Retarget();
+}
+
+void CFeeWindow::PushFront(const CFeeWindowEntry &entry) {
+    CEntry newEntry(entry);
+    if (newEntry.nSeq == 0) {
+        newEntry.nSeq = nNextSeq;
+        SetDirty(newEntry);
+    }
+    nNextSeq = max(nNextSeq, newEntry.nSeq + 1);
+    lstEntries.push_front(newEntry);
+    entry_iterator it = lstEntries.begin();
+    pair<map<entry_key, entry_iterator>::iterator, bool> ret = mapEntries.insert(make_pair(make_pair(it->hash, it->nHeight), it));
+    if (!ret.second) {
+        ret.first->second = it;
+        mapDuplicates[ret.first->first]++;
+    }
+    Link(it);
+    Retarget();
+}
+
+void CFeeWindow::Prune() {
+    if (lstEntries.empty())
+        return;
+    uint64 nTime = lstEntries.front().nTime;
+    while (mapByTime.size() > 1 && lstEntries.back().nTime + nPruneAge <= nTime)
+        Erase(--lstEntries.end());
+}
+
+bool CFeeWindow::Exists(const uint256 &hash, uint64 nHeight) const {
+    return mapEntries.count(make_pair(hash, nHeight)) > 0;
+}
+
+bool CFeeWindow::Insert(const uint256 &hash, uint64 nHeight, uint64 nTime, uint64 nValue, bool fReplace) {
+    map<pair<uint256, uint64>, entry_iterator>::iterator mi = mapEntries.find(make_pair(hash, nHeight));
+    if (mi != mapEntries.end()) {
+        if (fReplace) {
+            entry_iterator it = mi->second;
+            Unlink(it);
+            it->nTime = nTime;
+            it->nValue = nValue;
+            Link(it);
+            SetDirty(*it);
+            if (it == lstEntries.begin())
+                Retarget();
+        }
+        return true;
+    }
+    PushFront(CFeeWindowEntry(hash, nHeight, nTime, nValue));
+    Prune();
+    return false;
+}
+
+bool CFeeWindow::Remove(const uint256 &hash, uint64 nHeight) {
+    map<pair<uint256, uint64>, entry_iterator>::iterator mi = mapEntries.find(make_pair(hash, nHeight));
+    if (mi == mapEntries.end())
+        return false;
+    entry_key key = mi->first;
+    Erase(mi->second);
+    if (!mapEntries.count(key)) {
+        mapDirty.erase(key);
+        setErased.insert(key);
+    }
+    return true;
+}
+
+bool CFeeWindow::ZeroFirstInRange(uint64 nStartHeight, uint64 nEndHeight) {
+    for (entry_iterator it = lstEntries.begin(); it != lstEntries.end(); ++it) {
+        if (it->nHeight >= nStartHeight && it->nHeight < nEndHeight) {
+            Unlink(it);
+            it->nValue = 0;
+            Link(it);
+            SetDirty(*it);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Fees left above nHeight by a reorganization can make the block count wrap
+// to zero, which used to bring the node down with a division by zero
+static uint64 PerBlock(uint64 nSum, unsigned int nHeight, unsigned int nFirstHeight) {
+    unsigned int nBlocks = (nHeight - nFirstHeight) + 1;
+    if (nBlocks == 0)
+        nBlocks = 1;
+    return nSum / nBlocks;
+}
+
+// The subsidy calculation as it was done over the fee lists: windows are
+// anchored at the newest fee at or below nHeight. Used when that is not the
+// newest fee overall, which only happens while reorganizing.
+void CFeeWindow::GetAveragesSlow(unsigned int nHeight, uint64 &nShort, uint64 &nLong) const {
+    uint64 hr1 = 1, hr12 = 1;
+    unsigned int nTargetTime = 0;
+    unsigned int nTarget1hrTime = 0;
+    unsigned int blk1hrht = nHeight - 1, blk12hrht = nHeight - 1;
+    bool bFound = false;
+
+    for (list<CEntry>::const_iterator it = lstEntries.begin(); it != lstEntries.end(); ++it) {
+        if (it->nHeight <= nHeight)
+            bFound = true;
+        if (bFound) {
+            if (nTargetTime == 0) {
+                hr1 = hr12 = 0;
+                nTargetTime = it->nTime - nSpan;
+                nTarget1hrTime = it->nTime - (nSpan / 12);
+            }
+            if (it->nTime > nTargetTime) {
+                hr12 += it->nValue;
+                blk12hrht = it->nHeight;
+                if (it->nTime > nTarget1hrTime) {
+                    hr1 += it->nValue;
+                    blk1hrht = it->nHeight;
+                }
+            }
+        }
+    }
+    nLong = PerBlock(hr12, nHeight, blk12hrht);
+    nShort = PerBlock(hr1, nHeight, blk1hrht);
+}
+
+void CFeeWindow::GetAverages(unsigned int nHeight, uint64 &nShort, uint64 &nLong) const {
+    // the running sums are anchored at the newest entry; a zero or
+    // wrapped bound would have been treated differently by the list walk
+    if (lstEntries.empty() || lstEntries.front().nHeight > nHeight
+     || sumLong.nBound == 0 || lstEntries.front().nTime <= nSpan
+     || lstEntries.front().nTime > 0xffffffff) {
+        GetAveragesSlow(nHeight, nShort, nLong);
+        return;
+    }
+    unsigned int blk1hrht = nHeight - 1, blk12hrht = nHeight - 1;
+    // the oldest entry in a window is the last one the list walk visits
+    if (!sumLong.mapHeights.empty())
+        blk12hrht = sumLong.mapHeights.begin()->second;
+    if (!sumShort.mapHeights.empty())
+        blk1hrht = sumShort.mapHeights.begin()->second;
+    nLong = PerBlock(sumLong.nValue, nHeight, blk12hrht);
+    nShort = PerBlock(sumShort.nValue, nHeight, blk1hrht);
+}
+
+void CFeeWindow::GetEntries(vector<CFeeWindowEntry> &vEntries) const {
+    vEntries.clear();
+    vEntries.reserve(mapByTime.size());
+    for (list<CEntry>::const_iterator it = lstEntries.begin(); it != lstEntries.end(); ++it)
+        vEntries.push_back(*it);
+}
+
+void CFeeWindow::SetEntries(const vector<CFeeWindowEntry> &vEntries) {
+    Clear();
+    for (vector<CFeeWindowEntry>::const_reverse_iterator it = vEntries.rbegin(); it != vEntries.rend(); ++it)
+        PushFront(*it);
+    Prune();
+}
+
+void CFeeWindow::GetChanges(vector<CFeeWindowEntry> &vWrite, vector<CFeeWindowEntry> &vErase) {
+    vWrite.clear();
+    vErase.clear();
+    for (map<entry_key, CFeeWindowEntry>::iterator it = mapDirty.begin(); it != mapDirty.end(); ++it)
+        vWrite.push_back(it->second);
+    BOOST_FOREACH(const entry_key &key, setErased)
+        vErase.push_back(CFeeWindowEntry(key.first, key.second, 0, 0));
+    mapDirty.clear();
+    setErased.clear();
+}
+
+void CFeeWindow::GetSnapshot(CSnapshot &snapshot) const {
+    GetEntries(snapshot.vEntries);
+    snapshot.mapDirty = mapDirty;
+    snapshot.setErased = setErased;
+    snapshot.nNextSeq = nNextSeq;
+}
+
+void CFeeWindow::Restore(const CSnapshot &snapshot) {
+    // every entry is numbered, so none of them is marked changed again
+    SetEntries(snapshot.vEntries);
+    mapDirty = snapshot.mapDirty;
+    setErased = snapshot.setErased;
+    nNextSeq = snapshot.nNextSeq;
+}
+
+bool CFeeWindow::Write(CServiceDB &db, const string &strPrefix) {
+    vector<CFeeWindowEntry> vWrite, vErase;
+    GetChanges(vWrite, vErase);
+    if (vWrite.empty() && vErase.empty())
+        return true;
+    CLevelDBBatch batch;
+    BOOST_FOREACH(const CFeeWindowEntry &entry, vErase)
+        batch.Erase(make_pair(strPrefix, CFeeKey(entry.nHeight, entry.hash)));
+    BOOST_FOREACH(const CFeeWindowEntry &entry, vWrite)
+        batch.Write(make_pair(strPrefix, CFeeKey(entry.nHeight, entry.hash)), entry);
+    return db.WriteBatch(batch);
+}
+
+static bool CompareFeeSeqDesc(const CFeeWindowEntry &a, const CFeeWindowEntry &b) {
+    return a.nSeq > b.nSeq;
+}
+
+bool CFeeWindow::Read(CLevelDB &db, const string &strPrefix) {
+    vector<CFeeWindowEntry> vEntries;
+    leveldb::Iterator *pcursor = db.NewIterator();
+
+    // walk down from the highest fee under the prefix
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair(strPrefix, CFeeKey(~(uint64)0, ~uint256(0)));
+    pcursor->Seek(ssKeySet.str());
+    if (pcursor->Valid())
+        pcursor->Prev();
+    else
+        pcursor->SeekToLast();
+
+    // The window is pruned relative to its newest fee, not to the chain tip,
+    // so the load is anchored there. Fees up to twice the prune age back are
+    // read, and pruning them as the window would leaves what it held.
+    uint64 nNewestTime = 0;
+    while (pcursor->Valid()) {
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            string strType;
+            ssKey >> strType;
+            if (strType != strPrefix)
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CFeeWindowEntry entry;
+            ssValue >> entry;
+            if (vEntries.empty())
+                nNewestTime = entry.nTime;
+            else if (entry.nTime + 2 * nPruneAge <= nNewestTime)
+                break;
+            vEntries.push_back(entry);
+            pcursor->Prev();
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+    }
+    delete pcursor;
+
+    // rebuild the window in the order the fees were added
+    stable_sort(vEntries.begin(), vEntries.end(), CompareFeeSeqDesc);
+    SetEntries(vEntries);
+    return true;
+}
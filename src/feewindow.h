@@ -0,0 +1,186 @@
+// Copyright (c) 2014 Syscoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+//
+#ifndef FEEWINDOW_H
+#define FEEWINDOW_H
+
+#include "uint256.h"
+#include "serialize.h"
+
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+
+class CLevelDB;
+class CServiceDB;
+
+/** A service fee as tracked by CFeeWindow */
+class CFeeWindowEntry {
+public:
+    uint256 hash;
+    uint64 nHeight;
+    uint64 nTime;
+    uint64 nValue;
+    uint64 nSeq; // insertion order, the newest entry has the highest
+
+    CFeeWindowEntry() {
+        hash = 0; nHeight = 0; nTime = 0; nValue = 0; nSeq = 0;
+    }
+
+    CFeeWindowEntry(const uint256 &hashIn, uint64 nHeightIn, uint64 nTimeIn, uint64 nValueIn) {
+        hash = hashIn;
+        nHeight = nHeightIn;
+        nTime = nTimeIn;
+        nValue = nValueIn;
+        nSeq = 0;
+    }
+
+    IMPLEMENT_SERIALIZE (
+        READWRITE(hash);
+        READWRITE(nHeight);
+        READWRITE(nTime);
+        READWRITE(nValue);
+        READWRITE(nSeq);
+    )
+};
+
+/** Database key of a stored fee. The height is written big endian so that
+ *  the fees under a prefix are ordered by height and can be range scanned. */
+class CFeeKey {
+public:
+    uint64 nHeight;
+    uint256 hash;
+
+    CFeeKey() {
+        nHeight = 0; hash = 0;
+    }
+
+    CFeeKey(uint64 nHeightIn, const uint256 &hashIn) {
+        nHeight = nHeightIn;
+        hash = hashIn;
+    }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        return sizeof(nHeight) + hash.GetSerializeSize(nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const {
+        unsigned char buf[sizeof(nHeight)];
+        for (unsigned int i = 0; i < sizeof(nHeight); i++)
+            buf[i] = (nHeight >> (8 * (sizeof(nHeight) - 1 - i))) & 0xff;
+        s.write((char*)buf, sizeof(buf));
+        hash.Serialize(s, nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        unsigned char buf[sizeof(nHeight)];
+        s.read((char*)buf, sizeof(buf));
+        nHeight = 0;
+        for (unsigned int i = 0; i < sizeof(nHeight); i++)
+            nHeight = (nHeight << 8) | buf[i];
+        hash.Unserialize(s, nType, nVersion);
+    }
+};
+
+/** Moving window over the fees paid by alias, offer or cert transactions,
+ *  used to compute the fee subsidy of a block.
+ *
+ *  Entries are kept newest first, in the same order as the fee lists this
+ *  replaces. Running sums over the long and short (1/12th) windows ending at
+ *  the newest entry are updated as entries come and go, so the subsidy of the
+ *  next block can be read without walking the history. Entries that have
+ *  fallen well out of the long window are pruned.
+ */
+class CFeeWindow {
+protected:
+    typedef CFeeWindowEntry CEntry;
+    typedef std::list<CEntry>::iterator entry_iterator;
+    typedef std::pair<uint256, uint64> entry_key;
+
+    class CSum {
+    public:
+        uint64 nBound; // entries with nTime > nBound are in the window
+        uint64 nValue;
+        std::map<uint64, uint64> mapHeights; // nSeq -> nHeight of the entries in the window
+
+        CSum() { nBound = ~(uint64)0; nValue = 0; }
+    };
+
+    unsigned int nSpan;
+    uint64 nPruneAge;
+    uint64 nNextSeq;
+    std::list<CEntry> lstEntries;
+    std::map<entry_key, entry_iterator> mapEntries;
+    // number of further entries with the same key as one in mapEntries,
+    // only present where there are any
+    std::map<entry_key, unsigned int> mapDuplicates;
+    std::multimap<uint64, entry_iterator> mapByTime;
+    CSum sumLong;
+    CSum sumShort;
+    // changes not yet written to the database
+    std::map<entry_key, CFeeWindowEntry> mapDirty;
+    std::set<entry_key> setErased;
+
+    void Join(CSum &sum, const CEntry &entry);
+    void Leave(CSum &sum, const CEntry &entry);
+    void MoveBound(CSum &sum, uint64 nBound);
+    void Retarget();
+    void Link(entry_iterator it);
+    void Unlink(entry_iterator it);
+    void Erase(entry_iterator it);
+    void SetDirty(const CEntry &entry);
+    void PushFront(const CFeeWindowEntry &entry);
+    void Prune();
+    void GetAveragesSlow(unsigned int nHeight, uint64 &nShort, uint64 &nLong) const;
+
+public:
+    /** nSpanIn is the length in seconds of the long window */
+    CFeeWindow(unsigned int nSpanIn);
+
+    void Clear();
+    unsigned int size() const { return mapByTime.size(); }
+    bool empty() const { return lstEntries.empty(); }
+    /** Age, relative to the newest entry, at which entries are pruned */
+    uint64 GetPruneAge() const { return nPruneAge; }
+
+    bool Exists(const uint256 &hash, uint64 nHeight) const;
+    /** Add a fee in front, or if one with the same hash and height exists
+     *  overwrite it when fReplace is set. Returns whether it existed. */
+    bool Insert(const uint256 &hash, uint64 nHeight, uint64 nTime, uint64 nValue, bool fReplace);
+    bool Remove(const uint256 &hash, uint64 nHeight);
+    /** Zero the value of the newest fee with a height in [nStartHeight, nEndHeight) */
+    bool ZeroFirstInRange(uint64 nStartHeight, uint64 nEndHeight);
+
+    /** Per-block average of the fees in the short and long windows, as seen by block nHeight */
+    void GetAverages(unsigned int nHeight, uint64 &nShort, uint64 &nLong) const;
+
+    /** Entries newest first */
+    void GetEntries(std::vector<CFeeWindowEntry> &vEntries) const;
+    /** Replace the contents with vEntries, newest first. Entries without a
+     *  sequence number are numbered in that order and marked changed. */
+    void SetEntries(const std::vector<CFeeWindowEntry> &vEntries);
+    /** Take the entries changed or removed since the last call */
+    void GetChanges(std::vector<CFeeWindowEntry> &vWrite, std::vector<CFeeWindowEntry> &vErase);
+
+    /** The entries and the changes not yet written, to go back to */
+    class CSnapshot {
+    public:
+        std::vector<CFeeWindowEntry> vEntries;
+        std::map<entry_key, CFeeWindowEntry> mapDirty;
+        std::set<entry_key> setErased;
+        uint64 nNextSeq;
+    };
+    void GetSnapshot(CSnapshot &snapshot) const;
+    void Restore(const CSnapshot &snapshot);
+
+    /** Stage the changed entries in db, one record per fee under strPrefix */
+    bool Write(CServiceDB &db, const std::string &strPrefix);
+    /** Load the fees stored under strPrefix that the window held when they were written */
+    bool Read(CLevelDB &db, const std::string &strPrefix);
+};
+
+#endif // FEEWINDOW_H
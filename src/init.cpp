@@ -8,6 +8,7 @@
 #include "bitcoinrpc.h"
 #include "net.h"
 #include "init.h"
+#include "rebuild.h"
 #include "util.h"
 #include "ui_interface.h"
 
@@ -29,9 +30,6 @@ extern CAliasDB *paliasdb;
 extern COfferDB *pofferdb;
 extern CCertDB *pcertdb;
 
-void rescanforaliases(CBlockIndex *pindexRescan);
-void rescanforoffers(CBlockIndex *pindexRescan);
-void rescanforcertissuers(CBlockIndex *pindexRescan);
 
 CWallet* pwalletMain;
 CClientUIInterface uiInterface;
@@ -119,12 +117,15 @@ void Shutdown()
             pblocktree->Flush();
         if (pcoinsTip)
             pcoinsTip->Flush();
+        // the service databases are at the same block as the coins
+        uint256 hashFlushed = pindexBest ? pindexBest->GetBlockHash() : 0;
         if (paliasdb)
-            paliasdb->Flush();        
+            paliasdb->Flush(hashFlushed);
         if (pofferdb)
-            pofferdb->Flush(); 
+            pofferdb->Flush(hashFlushed);
         if (pcertdb)
-            pcertdb->Flush();   
+            pcertdb->Flush(hashFlushed);
+        CServiceSnapshot::Release();
         delete pcoinsTip; pcoinsTip = NULL;
         delete pcoinsdbview; pcoinsdbview = NULL;
         delete pblocktree; pblocktree = NULL;
@@ -337,6 +338,7 @@ std::string HelpMessage()
         "  -listen                " + _("Accept connections from outside (default: 1 if no -proxy or -connect)") + "\n" +
         "  -bind=<addr>           " + _("Bind to given address and always listen on it. Use [host]:port notation for IPv6") + "\n" +
         "  -dnsseed               " + _("Find peers using DNS lookup (default: 1 unless -connect)") + "\n" +
+        "  -headersfirst          " + _("Download headers first and blocks from several peers at once when far behind (default: 1)") + "\n" +
         "  -banscore=<n>          " + _("Threshold for disconnecting misbehaving peers (default: 100)") + "\n" +
         "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
@@ -376,6 +378,7 @@ std::string HelpMessage()
 #endif
         "  -rpcthreads=<n>        " + _("Set the number of threads to service RPC calls (default: 4)") + "\n" +
         "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n" +
+        "  -blocknotifyport=<port> " + _("Send the hash and height of each new best block to connections on 127.0.0.1:<port>") + "\n" +
         "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n" +
         "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received (%s in cmd is replaced by message)") + "\n" +
         "  -upgradewallet         " + _("Upgrade wallet to latest format") + "\n" +
@@ -386,6 +389,7 @@ std::string HelpMessage()
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 288, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-4, default: 3)") + "\n" +
         "  -txindex               " + _("Maintain a full transaction index (default: 1)") + "\n" +
+        "  -pruneservices         " + _("Compact alias, offer and certificate records long expired (default: 1)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + "\n" +
         "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + "\n" +
         "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
@@ -683,9 +687,12 @@ bool AppInit2(boost::thread_group& threadGroup)
         fprintf(stdout, "Syscoin server starting\n");
 
     if (nScriptCheckThreads) {
-        printf("Using %u threads for script verification\n", nScriptCheckThreads);
-        for (int i=0; i<nScriptCheckThreads-1; i++)
+        printf("Using %u threads for script and proof-of-work verification and block prefetch\n", nScriptCheckThreads);
+        for (int i=0; i<nScriptCheckThreads-1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadPoWCheck);
+            threadGroup.create_thread(&ThreadPrefetch);
+        }
     }
 
     int64 nStart;
@@ -895,6 +902,7 @@ bool AppInit2(boost::thread_group& threadGroup)
         do {
             try {
                 UnloadBlockIndex();
+                CServiceSnapshot::Release();
                 delete pcoinsTip;
                 delete pcoinsdbview;
                 delete pblocktree;
@@ -911,6 +919,27 @@ bool AppInit2(boost::thread_group& threadGroup)
 
                 if (fReindex) pblocktree->WriteReindexing(true);
 
+                if (!pofferdb->UpgradeOfferAccepts()) {
+                    strLoadError = _("Error upgrading offer database");
+                    break;
+                }
+                if (!pcertdb->UpgradeCertItems()) {
+                    strLoadError = _("Error upgrading certificate database");
+                    break;
+                }
+                if (!paliasdb->UpgradeAliasHistory()) {
+                    strLoadError = _("Error upgrading alias database");
+                    break;
+                }
+                if (!pofferdb->UpgradeOfferHistory()) {
+                    strLoadError = _("Error upgrading offer database");
+                    break;
+                }
+                if (!pcertdb->UpgradeCertIssuerHistory()) {
+                    strLoadError = _("Error upgrading certificate database");
+                    break;
+                }
+
                 if (!LoadBlockIndex()) {
                     strLoadError = _("Error loading block database");
                     break;
@@ -939,6 +968,20 @@ bool AppInit2(boost::thread_group& threadGroup)
                     strLoadError = _("Corrupted block database detected");
                     break;
                 }
+
+                if (!pofferdb->BuildOfferSearch()) {
+                    strLoadError = _("Error building offer search indexes");
+                    break;
+                }
+                if (!paliasdb->BuildAliasExpiry() || !pofferdb->BuildOfferExpiry()
+                        || !pcertdb->BuildCertIssuerExpiry()) {
+                    strLoadError = _("Error building service expiry indexes");
+                    break;
+                }
+                if (!CheckServiceBestBlock()) {
+                    strLoadError = _("Service databases do not match the coin database");
+                    break;
+                }
             } catch(std::exception &e) {
                 strLoadError = _("Error opening block database");
                 break;
@@ -1105,10 +1148,12 @@ bool AppInit2(boost::thread_group& threadGroup)
             pwalletMain->ScanForWalletTransactions(pindexRescan, true);
             printf(" rescan      %15"PRI64d"ms\n", GetTimeMillis() - nStart);
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
-    		rescanforaliases(pindexRescan);
-    		rescanforoffers(pindexRescan);
-    		rescanforcertissuers(pindexRescan);
+            RebuildServiceIndexes(pindexRescan);
             nWalletDBUpdated++;
+        } else if (pindexBest && IsServiceRebuildPending()) {
+            // finish a service index rebuild that was interrupted
+            uiInterface.InitMessage(_("Rescanning..."));
+            RebuildServiceIndexes(pindexBest);
         }
     } // (!fDisableWallet)
 
@@ -1159,6 +1204,9 @@ bool AppInit2(boost::thread_group& threadGroup)
     printf("mapWallet.size() = %"PRIszu"\n",       pwalletMain ? pwalletMain->mapWallet.size() : 0);
     printf("mapAddressBook.size() = %"PRIszu"\n",  pwalletMain ? pwalletMain->mapAddressBook.size() : 0);
 
+    // the query RPCs read the service databases as loaded until the next block
+    PublishServiceSnapshot(nBestHeight);
+
     StartNode(threadGroup);
 
     // InitRPCMining is needed here so getwork/getblocktemplate in the GUI debug console works properly.
@@ -1166,6 +1214,9 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (fServer)
         StartRPCThreads();
 
+    // Compact expired service records in the background
+    threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "svcprune", &PruneServices, SERVICE_PRUNE_INTERVAL * 1000));
+
     // Generate coins in the background
     if (pwalletMain)
         GenerateBitcoins(GetBoolArg("-gen", false), pwalletMain);
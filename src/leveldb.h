@@ -10,6 +10,7 @@
 #include <leveldb/write_batch.h>
 
 #include <boost/filesystem/path.hpp>
+#include <boost/shared_ptr.hpp>
 
 class leveldb_error : public std::runtime_error
 {
@@ -23,6 +24,7 @@ void HandleError(const leveldb::Status &status) throw(leveldb_error);
 class CLevelDBBatch
 {
     friend class CLevelDB;
+    friend class CServiceDB;
 
 private:
     leveldb::WriteBatch batch;
@@ -52,6 +54,24 @@ public:
     }
 };
 
+// A read-only view of a CLevelDB as it was when taken, held until the last
+// copy of the pointer to it goes away
+class CLevelDBSnapshot
+{
+    friend class CLevelDB;
+
+private:
+    leveldb::DB *pdb;
+    const leveldb::Snapshot *psnapshot;
+
+    CLevelDBSnapshot(leveldb::DB *pdbIn) : pdb(pdbIn), psnapshot(pdbIn->GetSnapshot()) {}
+
+public:
+    ~CLevelDBSnapshot() {
+        pdb->ReleaseSnapshot(psnapshot);
+    }
+};
+
 class CLevelDB
 {
 private:
@@ -103,6 +123,21 @@ public:
         return true;
     }
 
+    // the value under an already serialized key, as of psnapshot if given
+    bool ReadSerialized(const std::string &strKey, std::string &strValue, const CLevelDBSnapshot *psnapshot = NULL) throw(leveldb_error) {
+        leveldb::ReadOptions options = readoptions;
+        if (psnapshot)
+            options.snapshot = psnapshot->psnapshot;
+        leveldb::Status status = pdb->Get(options, strKey, &strValue);
+        if (!status.ok()) {
+            if (status.IsNotFound())
+                return false;
+            printf("LevelDB read failure: %s\n", status.ToString().c_str());
+            HandleError(status);
+        }
+        return true;
+    }
+
     template<typename K, typename V> bool Write(const K& key, const V& value, bool fSync = false) throw(leveldb_error) {
         CLevelDBBatch batch;
         batch.Write(key, value);
@@ -145,8 +180,15 @@ public:
     }
 
     // not exactly clean encapsulation, but it's easiest for now
-    leveldb::Iterator *NewIterator() {
-        return pdb->NewIterator(iteroptions);
+    leveldb::Iterator *NewIterator(const CLevelDBSnapshot *psnapshot = NULL) {
+        leveldb::ReadOptions options = iteroptions;
+        if (psnapshot)
+            options.snapshot = psnapshot->psnapshot;
+        return pdb->NewIterator(options);
+    }
+
+    boost::shared_ptr<CLevelDBSnapshot> GetSnapshot() {
+        return boost::shared_ptr<CLevelDBSnapshot>(new CLevelDBSnapshot(pdb));
     }
 };
 
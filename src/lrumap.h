@@ -0,0 +1,92 @@
+// Copyright (c) 2014 Syscoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_LRUMAP_H
+#define BITCOIN_LRUMAP_H
+
+#include <map>
+#include <list>
+
+/** STL-like map container that only keeps the N most recently used elements. */
+template <typename K, typename V> class lrumap
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<key_type, mapped_type> value_type;
+    typedef typename std::list<value_type>::size_type size_type;
+
+protected:
+    // most recently used element first; sizes are taken from the map since
+    // std::list::size() is not constant time before C++11
+    std::list<value_type> items;
+    typedef typename std::list<value_type>::iterator list_iterator;
+    std::map<K, list_iterator> map;
+    typedef typename std::map<K, list_iterator>::iterator iterator;
+    size_type nMaxSize;
+
+public:
+    lrumap(size_type nMaxSizeIn = 0) { nMaxSize = nMaxSizeIn; }
+    size_type size() const { return map.size(); }
+    bool empty() const { return map.empty(); }
+    size_type count(const key_type& k) const { return map.count(k); }
+
+    // look up k, marking it as most recently used
+    bool get(const key_type& k, mapped_type& v)
+    {
+        iterator it = map.find(k);
+        if (it == map.end())
+            return false;
+        items.splice(items.begin(), items, it->second);
+        v = it->second->second;
+        return true;
+    }
+
+    void insert(const key_type& k, const mapped_type& v)
+    {
+        iterator it = map.find(k);
+        if (it != map.end())
+        {
+            it->second->second = v;
+            items.splice(items.begin(), items, it->second);
+            return;
+        }
+        items.push_front(value_type(k, v));
+        map.insert(std::make_pair(k, items.begin()));
+        if (nMaxSize && map.size() > nMaxSize)
+        {
+            map.erase(items.back().first);
+            items.pop_back();
+        }
+    }
+
+    void erase(const key_type& k)
+    {
+        iterator it = map.find(k);
+        if (it == map.end())
+            return;
+        items.erase(it->second);
+        map.erase(it);
+    }
+
+    void clear()
+    {
+        items.clear();
+        map.clear();
+    }
+
+    size_type max_size() const { return nMaxSize; }
+    size_type max_size(size_type s)
+    {
+        if (s)
+            while (map.size() > s)
+            {
+                map.erase(items.back().first);
+                items.pop_back();
+            }
+        nMaxSize = s;
+        return nMaxSize;
+    }
+};
+
+#endif
@@ -13,6 +13,7 @@
 #include "message.h"
 #include "ui_interface.h"
 #include "checkqueue.h"
+#include "lrumap.h"
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -31,6 +32,8 @@ CCriticalSection cs_main;
 
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
+boost::mutex csBestBlock;
+boost::condition_variable cvBlockChange;
 map<uint256, CBlockIndex*> mapBlockIndex;
 uint256 hashGenesisBlock(
 		"0xc84c8d0f52a7418b28a24e7b5354d6febed47c8cc33b3fa20fdbe4b3a1fcd9c4");
@@ -62,7 +65,6 @@ extern bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey,
 		const CTransaction& txTo, unsigned int nIn, unsigned int flags,
 		int nHashType);
 
-extern map<vector<unsigned char>, set<uint256> > mapAliasesPending;
 
 //todo go back and address fees
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
@@ -75,6 +77,37 @@ CMedianFilter<int> cPeerBlockCounts(8, 0); // Amount of blocks that other nodes
 
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
+static unsigned int nOrphanBlockBytes = 0;
+
+// Headers-first sync: index entries for checked headers whose blocks we do not
+// have yet, kept apart from mapBlockIndex; the tip of the best header chain and
+// the blocks along it still to fetch; and the blocks asked for, with the peer
+// asked and when
+static bool fHeadersFirstSync = false;
+static bool fHeadersComplete = false;
+static map<uint256, CBlockIndex*> mapHeaderIndex;
+static CBlockIndex* pindexBestHeader = NULL;
+static deque<CBlockIndex*> dequeBlocksToFetch;
+static map<uint256, pair<CNode*, int64> > mapBlocksInFlight;
+static int64 nWindowFullSince = 0;
+
+// Blocks rebuilt from a "cmpctblock" that wait on the "blocktxn" for the
+// transactions the memory pool did not have, by hash
+// and the peer they were asked of
+struct CPartialBlock
+{
+	CBlock block;
+	vector<unsigned int> vMissing;
+	CNode* pfrom;
+	int64 nTime;
+};
+static map<uint256, CPartialBlock> mapPartialBlocks;
+static const unsigned int MAX_PARTIAL_BLOCKS = 8;
+// seconds a peer has to answer a "getblocktxn" before another peer's
+// compact block may take its place
+static const int64 BLOCKTXN_TIMEOUT = 10;
+// a "getblocktxn" this far below the tip gets the whole block instead
+static const int MAX_BLOCKTXN_DEPTH = 10;
 
 map<uint256, CTransaction> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
@@ -331,6 +364,18 @@ unsigned int CCoinsViewCache::GetCacheSize() {
 	return cacheCoins.size();
 }
 
+bool CCoinsViewCache::HaveCoinsInCache(const uint256 &txid) const {
+	return cacheCoins.count(txid) > 0;
+}
+
+void CCoinsViewCache::CacheCoins(const uint256 &txid, CCoins &coins) {
+	std::map<uint256, CCoins>::iterator it = cacheCoins.lower_bound(txid);
+	if (it != cacheCoins.end() && it->first == txid)
+		return;
+	it = cacheCoins.insert(it, std::make_pair(txid, CCoins()));
+	coins.swap(it->second);
+}
+
 /** CCoinsView that brings transactions from a memorypool into view.
  It does not check for spendings by memory pool transactions. */
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView &baseIn, CTxMemPool &mempoolIn) :
@@ -893,6 +938,29 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx,
 		}
 	}
 
+	// Pending operations on a service name form one line, each spending the
+	// one before; a transaction beside them would conflict once mined
+	CServiceKey key;
+	if (GetServiceKey(tx, key)) {
+		LOCK(cs);
+		map<CServiceKey, set<uint256> >::const_iterator mi = mapServiceTx.find(key);
+		if (mi != mapServiceTx.end()) {
+			bool fBuildsOn = false;
+			BOOST_FOREACH(const CTxIn &txin, tx.vin)
+				if (mi->second.count(txin.prevout.hash))
+					fBuildsOn = true;
+			// one brought back from a disconnected block is built on instead
+			for (unsigned int i = 0; i < tx.vout.size() && !fBuildsOn; i++) {
+				map<COutPoint, CInPoint>::const_iterator it = mapNextTx.find(COutPoint(hash, i));
+				if (it != mapNextTx.end() && mi->second.count(it->second.ptx->GetHash()))
+					fBuildsOn = true;
+			}
+			if (!fBuildsOn)
+				return error("CTxMemPool::accept() : %s conflicts with pending service transaction %s",
+						hash.ToString().c_str(), mi->second.begin()->ToString().c_str());
+		}
+	}
+
 	if (fCheckInputs) {
 		CCoinsView dummy;
 		CCoinsViewCache view(dummy);
@@ -972,36 +1040,6 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx,
 						dFreeCount + nSize);
 			dFreeCount += nSize;
 		}
-      vector<vector<unsigned char> > vvch;
-	    int op, nOut;
-		if(DecodeAliasTx(tx, op, nOut, vvch, -1)) {
-			if(IsAliasOp(op)) {
-				TRY_LOCK(cs_main, cs_maintry);
-	            mapAliasesPending[vvch[0]].insert(tx.GetHash());
-		        printf("AcceptToMemoryPool() : Added alias transaction '%s' to memory pool.\n",
-	                stringFromVch(vvch[0]).c_str());
-		    } 
-			else if(IsOfferOp(op)) {
-				TRY_LOCK(cs_main, cs_maintry);
-	            if(op == OP_OFFER_ACCEPT || op == OP_OFFER_PAY)
-					mapOfferAcceptPending[vvch[1]].insert(tx.GetHash());
-				else
-	                mapOfferPending[op == OP_OFFER_NEW ? vchFromString(HexStr(vvch[0]))
-	                    : vvch[0]].insert(tx.GetHash());
-				printf("AcceptToMemoryPool() : Added offer transaction '%s' to memory pool.\n", 
-	                stringFromVch(vvch[0]).c_str());
-			} 
-			else if(IsCertOp(op)) {
-				TRY_LOCK(cs_main, cs_maintry);
-				if(op == OP_CERT_TRANSFER)
-					mapCertItemPending[vvch[1]].insert(tx.GetHash());
-				else
-	                mapCertIssuerPending[op == OP_CERTISSUER_NEW ? vchFromString(HexStr(vvch[0]))
-	                    : vvch[0]].insert(tx.GetHash());
-				printf("AcceptToMemoryPool() : Added cert transaction '%s' to memory pool.\n", 
-	                stringFromVch(vvch[0]).c_str());
-		    }
-		}
 
 		// Check against previous transactions
 		// This is done last to help prevent CPU exhaustion denial-of-service attacks.
@@ -1057,14 +1095,56 @@ bool CTransaction::RemoveFromMemoryPool(bool fRecursive) {
 	}
 }
 
+bool GetServiceKey(const CTransaction &tx, CServiceKey &key) {
+	// this is a misnomer - the alias decode finds every service op
+	const CServiceOp &alias = tx.GetServiceOps().alias;
+	if (!alias.fDecoded)
+		return false;
+	const vector<vector<unsigned char> > &vvch = alias.vvch;
+	int op = alias.op;
+	if (IsAliasOp(op))
+		key = CServiceKey(SERVICE_ALIAS, vvch[0]);
+	else if (op == OP_OFFER_ACCEPT || op == OP_OFFER_PAY)
+		key = CServiceKey(SERVICE_OFFER_ACCEPT, vvch[1]);
+	else if (IsOfferOp(op))
+		key = CServiceKey(SERVICE_OFFER, op == OP_OFFER_NEW ? vchFromString(HexStr(vvch[0])) : vvch[0]);
+	else if (op == OP_CERT_TRANSFER)
+		key = CServiceKey(SERVICE_CERT_ITEM, vvch[1]);
+	else if (IsCertOp(op))
+		key = CServiceKey(SERVICE_CERT_ISSUER, op == OP_CERTISSUER_NEW ? vchFromString(HexStr(vvch[0])) : vvch[0]);
+	else
+		return false;
+	return true;
+}
+
+// Bumped with every notification, for the miner threads, which cannot sleep
+// on cvBlockChange while they hash
+static volatile unsigned int nBlockChangeSeq = 0;
+
+// Wake whoever waits on cvBlockChange
+static void NotifyBlockChange() {
+	boost::lock_guard<boost::mutex> lock(csBestBlock);
+	nBlockChangeSeq++;
+	cvBlockChange.notify_all();
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTransaction &tx) {
 	// Add to memory pool without checking anything.  Don't call this directly,
 	// call CTxMemPool::accept to properly check the transaction first.
 	{
+		removeEntry(hash);
 		mapTx[hash] = tx;
+		setEntryNew.insert(hash);
 		for (unsigned int i = 0; i < tx.vin.size(); i++)
 			mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+		CServiceKey key;
+		if (GetServiceKey(tx, key)) {
+			mapServiceTx[key].insert(hash);
+			printf("CTxMemPool::addUnchecked() : pending service transaction '%s'\n",
+					stringFromVch(key.second).c_str());
+		}
 		nTransactionsUpdated++;
+		NotifyBlockChange();
 	}
 	return true;
 }
@@ -1086,8 +1166,19 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive) {
 		if (mapTx.count(hash)) {
 			BOOST_FOREACH(const CTxIn& txin, tx.vin)
 				mapNextTx.erase(txin.prevout);
+			CServiceKey key;
+			if (GetServiceKey(tx, key)) {
+				map<CServiceKey, set<uint256> >::iterator mi = mapServiceTx.find(key);
+				if (mi != mapServiceTx.end()) {
+					mi->second.erase(hash);
+					if (mi->second.empty())
+						mapServiceTx.erase(mi);
+				}
+			}
+			removeEntry(hash);
 			mapTx.erase(hash);
 			nTransactionsUpdated++;
+			NotifyBlockChange();
 		}
 	}
 	return true;
@@ -1112,9 +1203,114 @@ void CTxMemPool::clear() {
 	LOCK(cs);
 	mapTx.clear();
 	mapNextTx.clear();
+	mapServiceTx.clear();
+	mapEntry.clear();
+	setEntryNew.clear();
+	setByPriority.clear();
+	setByFee.clear();
+	pindexEntries = NULL;
+	nEntriesHeight = -1;
 	++nTransactionsUpdated;
 }
 
+void CTxMemPool::removeEntry(const uint256 &hash) {
+	setEntryNew.erase(hash);
+	map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hash);
+	if (mi == mapEntry.end())
+		return;
+	const CTxMemPoolEntry &entry = mi->second;
+	setByPriority.erase(CEntryKey(make_pair(entry.dPriority, entry.dFeePerKb), hash));
+	setByFee.erase(CEntryKey(make_pair(entry.dFeePerKb, entry.dPriority), hash));
+	mapEntry.erase(mi);
+}
+
+// Bring the block assembly index up to date for a block on top of
+// pindexPrev. Only transactions added since the last call, or whose inputs
+// may have moved with the tip, have their inputs read. Requires cs_main and cs.
+void CTxMemPool::UpdateEntries(CBlockIndex *pindexPrev, CCoinsViewCache &view) {
+	if (pindexPrev != pindexEntries || pindexPrev->nHeight != nEntriesHeight) {
+		// When the new tip extends the old one, inputs already in the chain
+		// stay where they were and only their age moves
+		bool fExtends = pindexEntries && pindexPrev->pprev == pindexEntries
+				&& pindexPrev->nHeight == nEntriesHeight + 1;
+		setByPriority.clear();
+		setByFee.clear();
+		map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.begin();
+		while (mi != mapEntry.end()) {
+			CTxMemPoolEntry &entry = mi->second;
+			if (!fExtends || !entry.setDependsOn.empty()) {
+				setEntryNew.insert(mi->first);
+				mapEntry.erase(mi++);
+				continue;
+			}
+			entry.dPriority = entry.GetPriority(pindexPrev->nHeight);
+			entry.nChecked = 0;
+			entry.vvchTestPool.clear();
+			setByPriority.insert(CEntryKey(make_pair(entry.dPriority, entry.dFeePerKb), mi->first));
+			setByFee.insert(CEntryKey(make_pair(entry.dFeePerKb, entry.dPriority), mi->first));
+			++mi;
+		}
+		pindexEntries = pindexPrev;
+		nEntriesHeight = pindexPrev->nHeight;
+	}
+
+	set<uint256> setRetry;
+	BOOST_FOREACH(const uint256 &hash, setEntryNew) {
+		map<uint256, CTransaction>::const_iterator mt = mapTx.find(hash);
+		if (mt == mapTx.end() || mt->second.IsCoinBase())
+			continue;
+		const CTransaction &tx = mt->second;
+
+		CTxMemPoolEntry entry;
+		int64 nTotalIn = 0;
+		bool fMissingInputs = false;
+		BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+			// Read prev transaction
+			if (!view.HaveCoins(txin.prevout.hash)) {
+				// This should never happen; all transactions in the memory
+				// pool should connect to either transactions in the chain
+				// or other transactions in the memory pool.
+				map<uint256, CTransaction>::const_iterator mi = mapTx.find(txin.prevout.hash);
+				if (mi == mapTx.end()) {
+					printf("ERROR: mempool transaction missing input\n");
+					if (fDebug)
+						assert("mempool transaction missing input" == 0);
+					fMissingInputs = true;
+					break;
+				}
+
+				// Has to wait for dependencies
+				entry.setDependsOn.insert(txin.prevout.hash);
+				nTotalIn += mi->second.vout[txin.prevout.n].nValue;
+				continue;
+			}
+			const CCoins &coins = view.GetCoins(txin.prevout.hash);
+
+			int64 nValueIn = coins.vout[txin.prevout.n].nValue;
+			nTotalIn += nValueIn;
+			entry.vInChain.push_back(make_pair(nValueIn, coins.nHeight));
+		}
+		if (fMissingInputs) {
+			setRetry.insert(hash);
+			continue;
+		}
+
+		entry.nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+		entry.nFee = nTotalIn - tx.GetValueOut();
+		entry.dPriority = entry.GetPriority(pindexPrev->nHeight);
+
+		// This is a more accurate fee-per-kilobyte than is used by the client code, because the
+		// client code rounds up the size to the nearest 1K. That's good, because it gives an
+		// incentive to create smaller transactions.
+		entry.dFeePerKb = double(entry.nFee) / (double(entry.nTxSize) / 1000.0);
+
+		mapEntry[hash] = entry;
+		setByPriority.insert(CEntryKey(make_pair(entry.dPriority, entry.dFeePerKb), hash));
+		setByFee.insert(CEntryKey(make_pair(entry.dFeePerKb, entry.dPriority), hash));
+	}
+	setEntryNew.swap(setRetry);
+}
+
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid) {
 	vtxid.clear();
 
@@ -1243,6 +1439,70 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
 	return false;
 }
 
+// recently looked up confirmation heights, so that repeated queries for the
+// same service transactions do not go to disk
+static const unsigned int MAX_TX_HEIGHT_CACHE = 20000;
+static CCriticalSection cs_txHeightCache;
+static lrumap<uint256, CDiskTxHeight> mapTxHeightCache(MAX_TX_HEIGHT_CACHE);
+
+static int GetMainChainHeight(const CDiskTxHeight &txHeight) {
+	map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(txHeight.hashBlock);
+	if (mi == mapBlockIndex.end())
+		return 0;
+	CBlockIndex* pindex = (*mi).second;
+	if (!pindex || !pindex->IsInMainChain())
+		return 0;
+	return pindex->nHeight;
+}
+
+static bool ReadTxPosHeight(const CDiskTxPos &txPos, CDiskTxHeight &txHeight) {
+	// only the header is needed to identify the block
+	CAutoFile file(OpenBlockFile(txPos, true), SER_DISK, CLIENT_VERSION);
+	if (!file)
+		return false;
+	CBlockHeader header;
+	try {
+		file >> header;
+	} catch (std::exception &e) {
+		return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+	}
+	uint256 hashBlock = header.GetHash();
+	map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+	if (mi == mapBlockIndex.end() || !(*mi).second)
+		return false;
+	txHeight = CDiskTxHeight((*mi).second->nHeight, hashBlock);
+	return true;
+}
+
+int GetTxPosHeight(const CDiskTxPos &txPos) {
+	CDiskTxHeight txHeight;
+	if (!ReadTxPosHeight(txPos, txHeight))
+		return 0;
+	return GetMainChainHeight(txHeight);
+}
+
+int GetTxHeight(const uint256 &txid) {
+	CDiskTxHeight txHeight;
+	bool fCached;
+	{
+		LOCK(cs_txHeightCache);
+		fCached = mapTxHeightCache.get(txid, txHeight);
+	}
+	if (!fCached) {
+		if (!pblocktree->ReadTxHeight(txid, txHeight)) {
+			// transaction indexed before height records were kept
+			CDiskTxPos txPos;
+			if (!pblocktree->ReadTxIndex(txid, txPos))
+				return 0;
+			if (!ReadTxPosHeight(txPos, txHeight))
+				return 0;
+		}
+		LOCK(cs_txHeightCache);
+		mapTxHeightCache.insert(txid, txHeight);
+	}
+	return GetMainChainHeight(txHeight);
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // CBlock and CBlockIndex
@@ -1275,6 +1535,26 @@ bool CBlock::ReadFromDisk(const CBlockIndex* pindex) {
 	return true;
 }
 
+// scrypt hashes of recently seen headers by header hash, so that a block is
+// hashed once on its way through ProcessBlock, ReadFromDisk and ConnectBlock
+static const unsigned int MAX_POW_HASH_CACHE = 10000;
+static CCriticalSection cs_powHashCache;
+static lrumap<uint256, uint256> mapPoWHashCache(MAX_POW_HASH_CACHE);
+
+uint256 CBlockHeader::GetPoWHash() const {
+	uint256 hash = GetHash();
+	uint256 thash;
+	{
+		LOCK(cs_powHashCache);
+		if (mapPoWHashCache.get(hash, thash))
+			return thash;
+	}
+	scrypt_1024_1_1_256(BEGIN(nVersion), BEGIN(thash));
+	LOCK(cs_powHashCache);
+	mapPoWHashCache.insert(hash, thash);
+	return thash;
+}
+
 void CBlockHeader::SetAuxPow(CAuxPow* pow) {
 	if (pow != NULL)
 		nVersion |= BLOCK_VERSION_AUXPOW;
@@ -1376,6 +1656,37 @@ unsigned int ComputeMinWork(unsigned int nBase, int64 nTime) {
 	return bnResult.GetCompact();
 }
 
+static const uint64 KGW_PAST_BLOCKS_MAX = 98;
+
+// EventHorizonDeviation for every block mass the main net's window can reach,
+// computed once with the same expression the loop below used to evaluate
+struct CKGWDeviationTable {
+	double vFast[KGW_PAST_BLOCKS_MAX + 1];
+	double vSlow[KGW_PAST_BLOCKS_MAX + 1];
+
+	CKGWDeviationTable() {
+		vFast[0] = vSlow[0] = 0;
+		for (uint64 nMass = 1; nMass <= KGW_PAST_BLOCKS_MAX; nMass++)
+			Compute(nMass, vFast[nMass], vSlow[nMass]);
+	}
+
+	static void Compute(uint64 nMass, double &dFast, double &dSlow) {
+		double EventHorizonDeviation = 1
+				+ (0.7084 * pow((double(nMass) / double(144)), -1.228));
+		dFast = EventHorizonDeviation;
+		dSlow = 1 / EventHorizonDeviation;
+	}
+
+	void Get(uint64 nMass, double &dFast, double &dSlow) const {
+		if (nMass <= KGW_PAST_BLOCKS_MAX) {
+			dFast = vFast[nMass];
+			dSlow = vSlow[nMass];
+		} else
+			Compute(nMass, dFast, dSlow);
+	}
+};
+static const CKGWDeviationTable kgwDeviation;
+
 unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast,
 		const CBlockHeader *pblock, uint64 TargetBlocksSpacingSeconds,
 		uint64 PastBlocksMin, uint64 PastBlocksMax) {
@@ -1383,19 +1694,16 @@ unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast,
 	const CBlockIndex *BlockLastSolved = pindexLast;
 	const CBlockIndex *BlockReading = pindexLast;
 
-	//todo look at orig code about that wierd = = that was here
-
 	uint64 PastBlocksMass = 0;
 	int64 PastRateActualSeconds = 0;
 	int64 PastRateTargetSeconds = 0;
 	double PastRateAdjustmentRatio = double(1);
-	CBigNum PastDifficultyAverage;
-	CBigNum PastDifficultyAveragePrev;
-	double EventHorizonDeviation;
+	uint256 PastDifficultyAverage;
 	double EventHorizonDeviationFast;
 	double EventHorizonDeviationSlow;
 
-	CBigNum bnPOWLimit = fCakeNet ? bnProofOfWorkLimitCake : bnProofOfWorkLimit;
+	uint256 bnPOWLimit = fCakeNet ? bnProofOfWorkLimitCake.getuint256()
+			: bnProofOfWorkLimit.getuint256();
 	if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0
 			|| (uint64) BlockLastSolved->nHeight < PastBlocksMin) {
 		return bnPOWLimit.GetCompact();
@@ -1407,14 +1715,21 @@ unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast,
 
 		PastBlocksMass++;
 
+		// running mean; the step is truncated towards zero as BN_div does
+		uint256 bnReading;
+		bnReading.SetCompact(BlockReading->nBits);
 		if (i == 1)
-			PastDifficultyAverage.SetCompact(BlockReading->nBits);
-		else
-			PastDifficultyAverage = ((CBigNum().SetCompact(BlockReading->nBits)
-					- PastDifficultyAveragePrev) / i)
-					+ PastDifficultyAveragePrev;
+			PastDifficultyAverage = bnReading;
+		else if (bnReading >= PastDifficultyAverage) {
+			bnReading -= PastDifficultyAverage;
+			bnReading /= i;
+			PastDifficultyAverage += bnReading;
+		} else {
+			uint256 bnStep = PastDifficultyAverage - bnReading;
+			bnStep /= i;
+			PastDifficultyAverage -= bnStep;
+		}
 
-		PastDifficultyAveragePrev = PastDifficultyAverage;
 		PastRateActualSeconds = BlockLastSolved->GetBlockTime()
 				- BlockReading->GetBlockTime();
 		PastRateTargetSeconds = TargetBlocksSpacingSeconds * PastBlocksMass;
@@ -1426,13 +1741,8 @@ unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast,
 			PastRateAdjustmentRatio = double(PastRateTargetSeconds)
 					/ double(PastRateActualSeconds);
 
-		EventHorizonDeviation =
-				1
-						+ (0.7084
-								* pow((double(PastBlocksMass) / double(144)),
-										-1.228));
-		EventHorizonDeviationFast = EventHorizonDeviation;
-		EventHorizonDeviationSlow = 1 / EventHorizonDeviation;
+		kgwDeviation.Get(PastBlocksMass, EventHorizonDeviationFast,
+				EventHorizonDeviationSlow);
 
 		if (PastBlocksMass >= PastBlocksMin) {
 			if ((PastRateAdjustmentRatio <= EventHorizonDeviationSlow)
@@ -1448,10 +1758,31 @@ unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast,
 		BlockReading = BlockReading->pprev;
 	}
 
-	CBigNum bnNew(PastDifficultyAverage);
+	uint256 bnNew(PastDifficultyAverage);
 	if (PastRateActualSeconds != 0 && PastRateTargetSeconds != 0) {
-		bnNew *= PastRateActualSeconds;
-		bnNew /= PastRateTargetSeconds;
+		// floor(avg * actual / target) without a 288-bit intermediate:
+		// avg = q * target + r, so the result is q * actual + r * actual / target.
+		// Block times are 32-bit, so actual fits in 32 bits; the target is
+		// the spacing times at most PastBlocksMax blocks.
+		uint32_t nActual = (uint32_t) PastRateActualSeconds;
+		uint32_t nTarget = (uint32_t) PastRateTargetSeconds;
+		uint256 bnQuot = PastDifficultyAverage;
+		bnQuot /= nTarget;
+		uint256 bnRem = bnQuot;
+		bnRem *= nTarget;
+		uint64 nRem = (PastDifficultyAverage - bnRem).Get64();
+		uint256 bnQuotMax = ~uint256(0);
+		bnQuotMax /= nActual;
+		if (bnQuot > bnQuotMax)
+			bnNew = bnPOWLimit; // past 2^256, so over any limit
+		else {
+			bnNew = bnQuot;
+			bnNew *= nActual;
+			uint256 bnProduct = bnNew;
+			bnNew += (nRem * nActual) / nTarget;
+			if (bnNew < bnProduct)
+				bnNew = bnPOWLimit;
+		}
 	}
 
 	if (bnNew > bnPOWLimit)
@@ -1460,15 +1791,21 @@ unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast,
 	return bnNew.GetCompact();
 }
 
-// Using KGW
-unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast,
+// Using KGW; the answer depends only on the chain up to pindexLast, so it
+// is kept on the index and computed once per block
+unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast,
 		const CBlockHeader *pblock) {
 	static const int64 BlocksTargetSpacing = 60;
 	uint64 PastBlocksMin = 7;
-	uint64 PastBlocksMax = 98;
+	uint64 PastBlocksMax = KGW_PAST_BLOCKS_MAX;
 
-	return KimotoGravityWell(pindexLast, pblock, BlocksTargetSpacing,
-			PastBlocksMin, PastBlocksMax);
+	if (pindexLast == NULL)
+		return KimotoGravityWell(pindexLast, pblock, BlocksTargetSpacing,
+				PastBlocksMin, PastBlocksMax);
+	if (pindexLast->nNextBits == 0)
+		pindexLast->nNextBits = KimotoGravityWell(pindexLast, pblock,
+				BlocksTargetSpacing, PastBlocksMin, PastBlocksMax);
+	return pindexLast->nNextBits;
 }
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits) {
@@ -1525,7 +1862,7 @@ void static InvalidChainFound(CBlockIndex* pindexNew) {
 	if (pindexBest
 			&& nBestInvalidWork
 					> nBestChainWork
-							+ (pindexBest->GetBlockWork() * 6).getuint256())
+							+ pindexBest->GetBlockWork() * 6)
 		printf(
 				"InvalidChainFound: Warning: Displayed transactions may not be correct! You may need to upgrade, or other nodes may need to upgrade.\n");
 }
@@ -1541,39 +1878,65 @@ void static InvalidBlockFound(CBlockIndex *pindex) {
 	}
 }
 
+void PruneServices() {
+	if (!GetBoolArg("-pruneservices", true) || IsInitialBlockDownload())
+		return;
+	TRY_LOCK(cs_main, cs_maintry);
+	if (!cs_maintry || pindexBest == NULL)
+		return;
+
+	// the changes are staged, and written with the next block
+	int nPruneHeight = pindexBest->nHeight - SERVICE_PRUNE_DEPTH;
+	if (nPruneHeight <= 0)
+		return;
+	unsigned int nAliases = paliasdb->PruneNames(nPruneHeight, SERVICE_PRUNE_BATCH);
+	unsigned int nOffers = pofferdb->PruneOffers(nPruneHeight, SERVICE_PRUNE_BATCH);
+	unsigned int nCertIssuers = pcertdb->PruneCertIssuers(nPruneHeight, SERVICE_PRUNE_BATCH);
+	if (nAliases + nOffers + nCertIssuers > 0)
+		printf("PruneServices() : %u aliases, %u offers, %u cert issuers expired before %d\n",
+				nAliases, nOffers, nCertIssuers, nPruneHeight);
+}
+
+void PublishServiceSnapshot(int nHeight) {
+	vector<CLevelDB*> vpdb;
+	vpdb.push_back(paliasdb);
+	vpdb.push_back(pofferdb);
+	vpdb.push_back(pcertdb);
+	CServiceSnapshot::Publish(vpdb, nHeight);
+}
+
 bool LoadSyscoinFees() {
 	TRY_LOCK(cs_main, cs_maintry);
-    // read alias and offer indexes
 
-    // read alias network fees
-    lstAliasFees.clear();
+    // read alias network fees, converting the fee list of older versions
     vector<CAliasFee> va;
-    paliasdb->ReadAliasTxFees(va);
-    list<CAliasFee> lAF(va.begin(), va.end());
-    lstAliasFees = lAF;
-	BOOST_FOREACH(CAliasFee& fee, lstAliasFees) {
-		printf("Alias Fee - height: %llu \t value: %llu\n", fee.nHeight, fee.nValue);
-	}
+    if (paliasdb->ReadAliasTxFees(va)) {
+        SetAliasFees(va);
+        if (!paliasdb->WriteAliasFees(aliasFeeWindow) || !paliasdb->EraseAliasTxFees() || !paliasdb->Flush())
+            return error("LoadSyscoinFees() : failed to convert alias fees");
+    } else if (!paliasdb->ReadAliasFees(aliasFeeWindow))
+        return error("LoadSyscoinFees() : failed to read alias fees");
+    printf("Alias Fees: %u in window\n", aliasFeeWindow.size());
 
     // read offer network fees
-    lstOfferFees.clear();
     vector<COfferFee> vo;
-    pofferdb->ReadOfferTxFees(vo);
-    list<COfferFee> lOF(vo.begin(), vo.end());
-    lstOfferFees = lOF;
-	BOOST_FOREACH(COfferFee& fee, lstOfferFees) {
-		printf("Offer Fee - height: %llu \t value: %llu\n", fee.nHeight, fee.nFee);
-	}
+    if (pofferdb->ReadOfferTxFees(vo)) {
+        SetOfferFees(vo);
+        if (!pofferdb->WriteOfferFees(offerFeeWindow) || !pofferdb->EraseOfferTxFees() || !pofferdb->Flush())
+            return error("LoadSyscoinFees() : failed to convert offer fees");
+    } else if (!pofferdb->ReadOfferFees(offerFeeWindow))
+        return error("LoadSyscoinFees() : failed to read offer fees");
+    printf("Offer Fees: %u in window\n", offerFeeWindow.size());
 
     // read cert issuer network fees
-    lstCertIssuerFees.clear();
     vector<CCertFee> vc;
-    pcertdb->ReadCertFees(vc);
-    list<CCertFee> lCF(vc.begin(), vc.end());
-    lstCertIssuerFees = lCF;
-	BOOST_FOREACH(CCertFee& fee, lstCertIssuerFees) {
-		printf("Cert Fee - height: %llu \t value: %llu\n", fee.nHeight, fee.nFee);
-	}
+    if (pcertdb->ReadCertFees(vc)) {
+        SetCertFees(vc);
+        if (!pcertdb->WriteCertIssuerFees(certFeeWindow) || !pcertdb->EraseCertFees() || !pcertdb->Flush())
+            return error("LoadSyscoinFees() : failed to convert cert fees");
+    } else if (!pcertdb->ReadCertIssuerFees(certFeeWindow))
+        return error("LoadSyscoinFees() : failed to read cert fees");
+    printf("Cert Fees: %u in window\n", certFeeWindow.size());
 
     return true;
 }
@@ -1728,6 +2091,25 @@ bool VerifySignature(const CCoins& txFrom, const CTransaction& txTo,
 	return CScriptCheck(txFrom, txTo, nIn, flags, nHashType)();
 }
 
+static CCriticalSection cs_serviceOps;
+
+const CServiceOps &CTransaction::GetServiceOps() const {
+	LOCK(cs_serviceOps);
+	if (!pserviceops) {
+		CServiceOps *pops = new CServiceOps();
+		CServiceOp &alias = pops->alias, &offer = pops->offer, &cert = pops->cert;
+		alias.fDecoded = DecodeAliasTx(*this, alias.op, alias.nOut, alias.vvch, -1);
+		offer.fDecoded = DecodeOfferTx(*this, offer.op, offer.nOut, offer.vvch, -1);
+		cert.fDecoded = DecodeCertTx(*this, cert.op, cert.nOut, cert.vvch, -1);
+		if (offer.fDecoded)
+			pops->poffer.reset(new COffer(*this));
+		if (cert.fDecoded)
+			pops->pcertissuer.reset(new CCertIssuer(*this));
+		pserviceops.reset(pops);
+	}
+	return *pserviceops;
+}
+
 bool CTransaction::CheckInputs(CBlockIndex *pindex, CValidationState &state, CCoinsViewCache &inputs,
 		bool fScriptChecks, unsigned int flags, std::map<std::vector<unsigned char>,uint256> &mapTestPool,
 		std::vector<CScriptCheck> *pvChecks, bool bJustCheck, bool fBlock, bool fMiner) const {
@@ -1769,24 +2151,18 @@ bool CTransaction::CheckInputs(CBlockIndex *pindex, CValidationState &state, CCo
 						error("CheckInputs() : txin values out of range"));
 		}
 
-		vector<vector<unsigned char> > vvchArgs;
-		int op;
-		int nOut;
-
-		bool bGood = DecodeAliasTx(*this, op, nOut, vvchArgs, -1);
-		if(bGood && IsAliasOp(op)) {
+		const CServiceOps &ops = GetServiceOps();
+		if(ops.alias.fDecoded && IsAliasOp(ops.alias.op)) {
 			if (!CheckAliasInputs(pindex, *this, state, inputs, mapTestPool, fBlock, fMiner, bJustCheck))
 				return false;
 		}
 		
-		bGood = DecodeOfferTx(*this, op, nOut, vvchArgs, pindex->nHeight);
-		if (bGood && IsOfferOp(op)) {
+		if (ops.offer.fDecoded && IsOfferOp(ops.offer.op)) {
 			if (!CheckOfferInputs(pindex, *this, state, inputs, mapTestPool, fBlock, fMiner, bJustCheck))
 				return false;
 		} 
 		
-		bGood = DecodeCertTx(*this, op, nOut, vvchArgs, pindex->nHeight);
-		if (bGood && IsCertOp(op)) {
+		if (ops.cert.fDecoded && IsCertOp(ops.cert.op)) {
 			if (!CheckCertInputs(pindex, *this, state, inputs, mapTestPool, fBlock, fMiner, bJustCheck))
 				return false;
 		}
@@ -1852,29 +2228,22 @@ bool CTransaction::CheckInputs(CBlockIndex *pindex, CValidationState &state, CCo
 	return true;
 }
 
-bool DisconnectAlias( CBlockIndex *pindex, const CTransaction &tx, int op, vector<vector<unsigned char> > &vvchArgs ) {
+bool DisconnectAlias( CBlockIndex *pindex, const CTransaction &tx, int op, const vector<vector<unsigned char> > &vvchArgs ) {
 
 	if(op != OP_ALIAS_NEW) {
 
 		string opName = aliasFromOp(op);
-		vector<CAliasIndex> vtxPos;
-		if (!paliasdb->ReadAlias(vvchArgs[0], vtxPos))
+		if (!paliasdb->ExistsAlias(vvchArgs[0]))
 			return error("DisconnectBlock() : failed to read from alias DB for %s %s\n",
 					opName.c_str(), stringFromVch(vvchArgs[0]).c_str());
 
-		// vtxPos might be empty if we pruned expired transactions.  However, it should normally still not
-		// be empty, since a reorg cannot go that far back.  Be safe anyway and do not try to pop if empty.
-		if (vtxPos.size()) {
-			CDiskTxPos txindex;
-			if (!pblocktree->ReadTxIndex(tx.GetHash(), txindex))
-				return error("DisconnectBlock() : failed to read tx index for %s %s %s\n",
-						opName.c_str(), stringFromVch(vvchArgs[0]).c_str(), tx.GetHash().ToString().c_str());
-			if (vtxPos.back().txHash == tx.GetHash())
-				vtxPos.pop_back();
-			// TODO validate that the first pos is the current tx pos
-		}
+		CDiskTxPos txindex;
+		if (!pblocktree->ReadTxIndex(tx.GetHash(), txindex))
+			return error("DisconnectBlock() : failed to read tx index for %s %s %s\n",
+					opName.c_str(), stringFromVch(vvchArgs[0]).c_str(), tx.GetHash().ToString().c_str());
 
-		if(!paliasdb->WriteName(vvchArgs[0], vtxPos))
+		// take off the version this txn wrote
+		if(!paliasdb->PopName(vvchArgs[0], tx.GetHash()))
 			return error("DisconnectBlock() : failed to write to alias DB");
 
 		CAliasFee theFeeObject;
@@ -1883,9 +2252,6 @@ bool DisconnectAlias( CBlockIndex *pindex, const CTransaction &tx, int op, vecto
 		theFeeObject.nValue = 0;
 		//RemoveAliasFee(theFeeObject);
 		InsertAliasFee(pindex, tx.GetHash(), 0);
-		vector<CAliasFee> vAliasFees(lstAliasFees.begin(), lstAliasFees.end());
-		if (!paliasdb->WriteAliasTxFees(vAliasFees))
-			return error( "DisconnectBlock() : failed to write fees to alias DB");
 
 	}
 
@@ -1898,7 +2264,7 @@ bool DisconnectAlias( CBlockIndex *pindex, const CTransaction &tx, int op, vecto
 	return true;
 }
 
-bool DisconnectOffer( CBlockIndex *pindex, const CTransaction &tx, int op, vector<vector<unsigned char> > &vvchArgs ) {
+bool DisconnectOffer( CBlockIndex *pindex, const CTransaction &tx, int op, const vector<vector<unsigned char> > &vvchArgs ) {
     string opName = offerFromOp(op);
 
 	COffer theOffer(tx);
@@ -1907,8 +2273,7 @@ bool DisconnectOffer( CBlockIndex *pindex, const CTransaction &tx, int op, vecto
 
     if(op != OP_OFFER_NEW) {
         // make sure a DB record exists for this offer
-        vector<COffer> vtxPos;
-        if (!pofferdb->ReadOffer(vvchArgs[0], vtxPos))
+        if (!pofferdb->ExistsOffer(vvchArgs[0]))
             return error("DisconnectBlock() : failed to read from offer DB for %s %s\n",
             		opName.c_str(), stringFromVch(vvchArgs[0]).c_str());
 
@@ -1924,22 +2289,24 @@ bool DisconnectOffer( CBlockIndex *pindex, const CTransaction &tx, int op, vecto
 	        // make sure offer accept db record already exists
 	        if (pofferdb->ExistsOfferAccept(vvchOfferAccept))
 	        	pofferdb->EraseOfferAccept(vvchOfferAccept);
-        }
-
-        // vtxPos might be empty if we pruned expired transactions.  However, it should normally still not
-        // be empty, since a reorg cannot go that far back.  Be safe anyway and do not try to pop if empty.
-        if (vtxPos.size()) {
-            CDiskTxPos txindex;
-            if (!pblocktree->ReadTxIndex(tx.GetHash(), txindex))
-                return error("DisconnectBlock() : failed to read tx index for offer %s %s %s\n",
-                		opName.c_str(), stringFromVch(vvchArgs[0]).c_str(), tx.GetHash().ToString().c_str());
 
-            while(vtxPos.back().txHash == tx.GetHash())
-                vtxPos.pop_back();
+	        // the accept goes with its accept tx, and is unpaid again without its pay tx
+	        if(op == OP_OFFER_ACCEPT)
+	        	pofferdb->EraseOfferAcceptRecord(vvchArgs[0], vvchOfferAccept);
+	        else if(pofferdb->ReadOfferAcceptRecord(vvchArgs[0], vvchOfferAccept, theOfferAccept)) {
+	        	theOfferAccept.bPaid = false;
+	        	theOfferAccept.txPayId = 0;
+	        	pofferdb->WriteOfferAcceptRecord(vvchArgs[0], theOfferAccept);
+	        }
         }
 
-        // write new offer state to db
-		if(!pofferdb->WriteOffer(vvchArgs[0], vtxPos))
+        CDiskTxPos txindex;
+        if (!pblocktree->ReadTxIndex(tx.GetHash(), txindex))
+            return error("DisconnectBlock() : failed to read tx index for offer %s %s %s\n",
+            		opName.c_str(), stringFromVch(vvchArgs[0]).c_str(), tx.GetHash().ToString().c_str());
+
+        // take off the version this txn wrote
+		if(!pofferdb->PopOffer(vvchArgs[0], tx.GetHash()))
 			return error("DisconnectBlock() : failed to write to offer DB");
 
 		COfferFee theFeeObject;
@@ -1947,9 +2314,6 @@ bool DisconnectOffer( CBlockIndex *pindex, const CTransaction &tx, int op, vecto
 		theFeeObject.nHeight = pindex->nHeight;
 		//RemoveOfferFee(theFeeObject);
 		InsertOfferFee(pindex, tx.GetHash(), 0);
-		vector<COfferFee> vOfferFees(lstOfferFees.begin(), lstOfferFees.end());
-		if (!pofferdb->WriteOfferTxFees(vOfferFees))
-			return error( "DisconnectBlock() : failed to write fees to offer DB");
 	}
 
 	printf("DISCONNECTED offer TXN: offer=%s op=%s hash=%s  height=%d\n",
@@ -1961,7 +2325,7 @@ bool DisconnectOffer( CBlockIndex *pindex, const CTransaction &tx, int op, vecto
 	return true;
 }
 
-bool DisconnectCertificate( CBlockIndex *pindex, const CTransaction &tx, int op, vector<vector<unsigned char> > &vvchArgs ) {
+bool DisconnectCertificate( CBlockIndex *pindex, const CTransaction &tx, int op, const vector<vector<unsigned char> > &vvchArgs ) {
 	string opName = certissuerFromOp(op);
 
 	CCertIssuer theIssuer(tx);
@@ -1970,8 +2334,7 @@ bool DisconnectCertificate( CBlockIndex *pindex, const CTransaction &tx, int op,
 
 	if(op != OP_CERTISSUER_NEW) {
 		// make sure a DB record exists for this cert
-		vector<CCertIssuer> vtxPos;
-		if (!pcertdb->ReadCertIssuer(vvchArgs[0], vtxPos))
+		if (!pcertdb->ExistsCertIssuer(vvchArgs[0]))
 			return error("DisconnectBlock() : failed to read from certificate DB for %s %s\n",
 					opName.c_str(), stringFromVch(vvchArgs[0]).c_str());
 
@@ -1987,22 +2350,19 @@ bool DisconnectCertificate( CBlockIndex *pindex, const CTransaction &tx, int op,
 			// make sure offer accept db record already exists
 			if (pcertdb->ExistsCertItem(vvchCert))
 				pcertdb->EraseCertItem(vvchCert);
-		}
 
-		// vtxPos might be empty if we pruned expired transactions.  However, it should normally still not
-		// be empty, since a reorg cannot go that far back.  Be safe anyway and do not try to pop if empty.
-		if (vtxPos.size()) {
-			CDiskTxPos txindex;
-			if (!pblocktree->ReadTxIndex(tx.GetHash(), txindex))
-				return error("DisconnectBlock() : failed to read tx index for offer %s %s %s\n",
-						opName.c_str(), stringFromVch(vvchArgs[0]).c_str(), tx.GetHash().ToString().c_str());
-			while(vtxPos.back().txHash == tx.GetHash())
-				vtxPos.pop_back();
-			// TODO validate that the first pos is the current tx pos
+			// drop the version of the cert item this txn wrote
+			if (!pcertdb->PopCertItem(vvchArgs[0], vvchCert, tx.GetHash()))
+				return error("DisconnectBlock() : failed to write cert item to certificate DB");
 		}
 
-		// write new offer state to db
-		if(!pcertdb->WriteCertIssuer(vvchArgs[0], vtxPos))
+		CDiskTxPos txindex;
+		if (!pblocktree->ReadTxIndex(tx.GetHash(), txindex))
+			return error("DisconnectBlock() : failed to read tx index for offer %s %s %s\n",
+					opName.c_str(), stringFromVch(vvchArgs[0]).c_str(), tx.GetHash().ToString().c_str());
+
+		// take off the version this txn wrote
+		if(!pcertdb->PopCertIssuer(vvchArgs[0], tx.GetHash()))
 			return error("DisconnectBlock() : failed to write to offer DB");
 
 		CCertFee theFeeObject;
@@ -2011,9 +2371,6 @@ bool DisconnectCertificate( CBlockIndex *pindex, const CTransaction &tx, int op,
 		theFeeObject.nFee = 0;
 		//RemoveCertFee(theFeeObject);
 		InsertCertFee(pindex, tx.GetHash(), 0);
-		vector<CCertFee> vCertIssuerFees(lstCertIssuerFees.begin(), lstCertIssuerFees.end());
-		if (!pcertdb->WriteCertFees(vCertIssuerFees))
-			return error( "DisconnectBlock() : failed to write fees to certissuer DB");
 	}
 
 	printf("DISCONNECTED CERT TXN: title=%s hash=%s height=%d\n",
@@ -2071,14 +2428,12 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
 		outs = CCoins();
 
 	    if (tx.nVersion == SYSCOIN_TX_VERSION) {
-		    vector<vector<unsigned char> > vvchArgs;
-		    int op, nOut;
 			// TODO CB refactor into apropriate files
-
-			if(DecodeAliasTx(tx, op, nOut, vvchArgs, -1)) {
-				if (IsAliasOp(op)) DisconnectAlias(pindex, tx, op, vvchArgs);
-				else if (IsOfferOp(op)) DisconnectOffer(pindex, tx, op, vvchArgs);
-				else if (IsCertOp(op)) DisconnectCertificate(pindex, tx, op, vvchArgs);
+			const CServiceOp &alias = tx.GetServiceOps().alias;
+			if(alias.fDecoded) {
+				if (IsAliasOp(alias.op)) DisconnectAlias(pindex, tx, alias.op, alias.vvch);
+				else if (IsOfferOp(alias.op)) DisconnectOffer(pindex, tx, alias.op, alias.vvch);
+				else if (IsCertOp(alias.op)) DisconnectCertificate(pindex, tx, alias.op, alias.vvch);
 			}
 	    }
 
@@ -2174,6 +2529,139 @@ void ThreadScriptCheck() {
 	scriptcheckqueue.Thread();
 }
 
+static CCheckQueue<CPoWCheck> powcheckqueue(16);
+
+void ThreadPoWCheck() {
+	RenameThread("bitcoin-powch");
+	powcheckqueue.Thread();
+}
+
+bool CPoWCheck::operator()() const {
+	// the header fields from nVersion to nNonce are the 80 bytes hashed
+	vector<char> vData(80 * vpheader.size());
+	vector<uint256> vHash(vpheader.size());
+	for (unsigned int i = 0; i < vpheader.size(); i++)
+		memcpy(&vData[80 * i], BEGIN(vpheader[i]->nVersion), 80);
+	scrypt_1024_1_1_256_multi(&vData[0], BEGIN(vHash[0]), vpheader.size());
+
+	LOCK(cs_powHashCache);
+	for (unsigned int i = 0; i < vpheader.size(); i++)
+		mapPoWHashCache.insert(vpheader[i]->GetHash(), vHash[i]);
+	return true;
+}
+
+// the proof-of-work queue takes one master at a time, and both the import
+// thread and the message handler hash ahead
+static CCriticalSection cs_powcheckqueue;
+
+// Hash the proof-of-work headers of a run of blocks, a block's own or the
+// parent header of its auxpow, in groups sized to the multi-lane scrypt kernel
+// and on the proof-of-work threads when there are any, so that the checks that
+// follow find the hashes cached
+static void PrehashPoW(const vector<const CBlock*> &vpblock) {
+	vector<CPoWCheck> vChecks;
+	vector<const CBlockHeader *> vpheader;
+	unsigned int nWays = scrypt_multi_ways();
+	for (unsigned int i = 0; i < vpblock.size(); i++) {
+		const CBlock &block = *vpblock[i];
+		vpheader.push_back(block.auxpow.get() != NULL ? &block.auxpow->parentBlockHeader : &block);
+		if (vpheader.size() == nWays || i + 1 == vpblock.size()) {
+			vChecks.push_back(CPoWCheck(vpheader));
+			vpheader.clear();
+		}
+	}
+
+	if (nScriptCheckThreads == 0) {
+		BOOST_FOREACH(const CPoWCheck &check, vChecks)
+			check();
+		return;
+	}
+	LOCK(cs_powcheckqueue);
+	CCheckQueueControl<CPoWCheck> control(&powcheckqueue);
+	control.Add(vChecks);
+	control.Wait();
+}
+
+static CCheckQueue<CPrefetchCheck> prefetchqueue(64);
+
+void ThreadPrefetch() {
+	RenameThread("bitcoin-prefetch");
+	prefetchqueue.Thread();
+}
+
+bool CPrefetchCheck::operator()() const {
+	// a read that fails is left to the lookup that wanted it to report
+	try {
+		if (pcoinsview != NULL)
+			*pfFound = pcoinsview->GetCoins(hash, *pcoins);
+		if (pservicedb != NULL)
+			pservicedb->Preload(strKey);
+	} catch (std::exception &e) {
+	}
+	return true;
+}
+
+// Read what connecting a block looks up on the prefetch threads, all at once
+// rather than one synchronous read after the other: the coins its
+// transactions spend that pcoinsTip does not hold yet, straight from the coin
+// database under it, and the latest versions of the aliases, offers and certs
+// its syscoin transactions name. That leaves the serial pass in ConnectBlock
+// with the order-dependent work. Runs with cs_main held, which keeps it the
+// only master of its queue.
+static void PrefetchBlock(const CBlock &block, const CBlockIndex *pindex) {
+	if (nScriptCheckThreads == 0)
+		return;
+
+	set<uint256> setCreated, setSeen;
+	for (unsigned int i = 0; i < block.vtx.size(); i++)
+		setCreated.insert(block.GetTxHash(i));
+	vector<uint256> vTxid;
+	BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+		if (tx.IsCoinBase())
+			continue;
+		BOOST_FOREACH(const CTxIn &txin, tx.vin) {
+			const uint256 &hash = txin.prevout.hash;
+			if (!setCreated.count(hash) && setSeen.insert(hash).second
+					&& !pcoinsTip->HaveCoinsInCache(hash))
+				vTxid.push_back(hash);
+		}
+	}
+
+	vector<CCoins> vCoins(vTxid.size());
+	vector<char> vFound(vTxid.size(), 0);
+	vector<CPrefetchCheck> vChecks;
+	CCoinsView &coinsdb = pcoinsTip->GetBackend();
+	for (unsigned int i = 0; i < vTxid.size(); i++)
+		vChecks.push_back(CPrefetchCheck(&coinsdb, vTxid[i], &vCoins[i], &vFound[i]));
+
+	paliasdb->ClearPreload();
+	pofferdb->ClearPreload();
+	pcertdb->ClearPreload();
+	BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+		if (tx.nVersion != SYSCOIN_TX_VERSION)
+			continue;
+		const CServiceOps &ops = tx.GetServiceOps();
+		if (ops.alias.fDecoded && IsAliasOp(ops.alias.op)
+				&& ops.alias.op != OP_ALIAS_NEW)
+			vChecks.push_back(CPrefetchCheck(paliasdb, CAliasDB::AliasKey(ops.alias.vvch[0])));
+		if (ops.offer.fDecoded && IsOfferOp(ops.offer.op))
+			vChecks.push_back(CPrefetchCheck(pofferdb, COfferDB::OfferKey(ops.offer.vvch[0])));
+		if (ops.cert.fDecoded && IsCertOp(ops.cert.op))
+			vChecks.push_back(CPrefetchCheck(pcertdb, CCertDB::CertIssuerKey(ops.cert.vvch[0])));
+	}
+	if (vChecks.empty())
+		return;
+
+	{
+		CCheckQueueControl<CPrefetchCheck> control(&prefetchqueue);
+		control.Add(vChecks);
+		control.Wait();
+	}
+	for (unsigned int i = 0; i < vTxid.size(); i++)
+		if (vFound[i])
+			pcoinsTip->CacheCoins(vTxid[i], vCoins[i]);
+}
+
 bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex,
 		CCoinsViewCache &view, bool fJustCheck) {
 //	printf( "*** ConnectBlock height %d %s\n", pindex->nHeight, fJustCheck ? "JUSTCHECK" : "" );
@@ -2195,6 +2683,11 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex,
 
 	bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
 
+	int64 nStartPrefetch = GetTimeMicros();
+	PrefetchBlock(*this, pindex);
+	if (fBenchmark)
+		printf("- Prefetch: %.2fms\n", 0.001 * (GetTimeMicros() - nStartPrefetch));
+
 	// Do not allow blocks that contain transactions which 'overwrite' older transactions,
 	// unless those are already completely spent.
 	// If such overwrites are allowed, coinbases and transactions depending upon those
@@ -2353,9 +2846,14 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex,
 			return state.Abort(_("Failed to write block index"));
 	}
 
-	if (fTxIndex)
-		if (!pblocktree->WriteTxIndex(vPos))
+	if (fTxIndex) {
+		if (!pblocktree->WriteTxIndex(vPos, CDiskTxHeight(pindex->nHeight, pindex->GetBlockHash())))
 			return state.Abort(_("Failed to write transaction index"));
+		// a transaction confirmed again after a reorg moves to a new block
+		LOCK(cs_txHeightCache);
+		for (unsigned int i = 0; i < vPos.size(); i++)
+			mapTxHeightCache.erase(vPos[i].first);
+	}
 
 	// add this block to the view's block chain
 	assert(view.SetBestBlock(pindex));
@@ -2366,10 +2864,39 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex,
 
 	return true;
 }
+CServiceTxn::CServiceTxn() : fCommitted(false) {
+	paliasdb->TxnBegin();
+	pofferdb->TxnBegin();
+	pcertdb->TxnBegin();
+	aliasFeeWindow.GetSnapshot(aliasFees);
+	offerFeeWindow.GetSnapshot(offerFees);
+	certFeeWindow.GetSnapshot(certFees);
+}
+
+void CServiceTxn::Commit() {
+	paliasdb->TxnCommit();
+	pofferdb->TxnCommit();
+	pcertdb->TxnCommit();
+	fCommitted = true;
+}
+
+CServiceTxn::~CServiceTxn() {
+	if (fCommitted)
+		return;
+	paliasdb->TxnAbort();
+	pofferdb->TxnAbort();
+	pcertdb->TxnAbort();
+	aliasFeeWindow.Restore(aliasFees);
+	offerFeeWindow.Restore(offerFees);
+	certFeeWindow.Restore(certFees);
+}
+
 bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew) {
 	// All modifications to the coin state will be done in this cache.
 	// Only when all have succeeded, we push it to pcoinsTip.
 	CCoinsViewCache view(*pcoinsTip, true);
+	// Likewise for the service databases
+	CServiceTxn txnServices;
 
 	// Find the fork (typically, there is none)
 	CBlockIndex* pfork = view.GetBestBlock();
@@ -2455,9 +2982,12 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew) {
 	int64 nStart = GetTimeMicros();
 	int nModified = view.GetCacheSize();
 	assert(view.Flush());
-	assert(paliasdb->Flush());
-	assert(pofferdb->Flush());
-	assert(pcertdb->Flush());
+	// the fee changes of the blocks above join the rest of their service changes
+	if (!paliasdb->WriteAliasFees(aliasFeeWindow)
+			|| !pofferdb->WriteOfferFees(offerFeeWindow)
+			|| !pcertdb->WriteCertIssuerFees(certFeeWindow))
+		return state.Abort(_("Failed to write service fees"));
+	txnServices.Commit();
 	int64 nTime = GetTimeMicros() - nStart;
 	if (fBenchmark)
 		printf("- Flush %i transactions: %.2fms (%.4fms/tx)\n", nModified,
@@ -2465,7 +2995,8 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew) {
 
 	// Make sure it's successfully written to disk before changing memory structure
 	bool fIsInitialDownload = IsInitialBlockDownload();
-	if (!fIsInitialDownload || pcoinsTip->GetCacheSize() > nCoinCacheSize) {
+	unsigned int nServiceCacheSize = paliasdb->GetCacheSize() + pofferdb->GetCacheSize() + pcertdb->GetCacheSize();
+	if (!fIsInitialDownload || pcoinsTip->GetCacheSize() > nCoinCacheSize || nServiceCacheSize > nCoinCacheSize) {
 		// Typical CCoins structures on disk are around 100 bytes in size.
 		// Pushing a new one to the database can cause it to be written
 		// twice (once in the log, and once in the tables). This is already
@@ -2477,6 +3008,11 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew) {
 		pblocktree->Sync();
 		if (!pcoinsTip->Flush())
 			return state.Abort(_("Failed to write to coin database"));
+		// the service databases are written along with the coins, one batch each
+		uint256 hashFlushed = pindexNew->GetBlockHash();
+		if (!paliasdb->Flush(hashFlushed) || !pofferdb->Flush(hashFlushed) || !pcertdb->Flush(hashFlushed))
+			return state.Abort(_("Failed to write to service database"));
+		PublishServiceSnapshot(pindexNew->nHeight);
 	}
 
 	// At this point, all changes have been done to the database.
@@ -2521,6 +3057,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew) {
 	nBestChainWork = pindexNew->nChainWork;
 	nTimeBestReceived = GetTime();
 	nTransactionsUpdated++;
+	NotifyBlockChange();
 	printf(
 			"SetBestChain: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f\n",
 			hashBestChain.ToString().c_str(), nBestHeight,
@@ -2555,6 +3092,8 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew) {
 		boost::replace_all(strCmd, "%s", hashBestChain.GetHex());
 		boost::thread t(runCommand, strCmd); // thread runs free
 	}
+	if (!fIsInitialDownload)
+		uiInterface.NotifyBestChain(hashBestChain, nBestHeight);
 
 	return true;
 }
@@ -2583,7 +3122,7 @@ bool CBlock::AddToBlockIndex(CValidationState &state,
 	pindexNew->nTx = vtx.size();
 	pindexNew->nChainWork =
 			(pindexNew->pprev ? pindexNew->pprev->nChainWork : 0)
-					+ pindexNew->GetBlockWork().getuint256();
+					+ pindexNew->GetBlockWork();
 	pindexNew->nChainTx = (pindexNew->pprev ? pindexNew->pprev->nChainTx : 0)
 			+ pindexNew->nTx;
 	pindexNew->nFile = pos.nFile;
@@ -2593,9 +3132,9 @@ bool CBlock::AddToBlockIndex(CValidationState &state,
 	setBlockIndexValid.insert(pindexNew);
 
 	/* write both the immutible data (CDiskBlockIndex) and the mutable data (BlockIndex) */
-	if (!pblocktree->WriteDiskBlockIndex(
-			CDiskBlockIndex(pindexNew, this->auxpow))
-			|| !pblocktree->WriteBlockIndex(*pindexNew))
+	if (!pblocktree->WriteDiskBlockIndex(CDiskBlockIndex(pindexNew))
+			|| !pblocktree->WriteBlockIndex(*pindexNew)
+			|| (auxpow.get() != NULL && !pblocktree->WriteAuxPow(hash, *auxpow)))
 		return state.Abort(_("Failed to write block index"));
 
 	// New best?
@@ -2997,11 +3536,14 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock,
 		if (pfrom) {
 			CBlock* pblock2 = new CBlock(*pblock);
 			mapOrphanBlocks.insert(make_pair(hash, pblock2));
+			nOrphanBlockBytes += ::GetSerializeSize(*pblock2, SER_NETWORK, PROTOCOL_VERSION);
 			mapOrphanBlocksByPrev.insert(
 					make_pair(pblock2->hashPrevBlock, pblock2));
 
-			// Ask this guy to fill in what we're missing
-			pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
+			// Ask this guy to fill in what we're missing, unless headers-first
+			// sync is fetching the chain already
+			if (!fHeadersFirstSync)
+				pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
 		}
 		return true;
 	}
@@ -3024,6 +3566,7 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock,
 			if (pblockOrphan->AcceptBlock(stateDummy))
 				vWorkQueue.push_back(pblockOrphan->GetHash());
 			mapOrphanBlocks.erase(pblockOrphan->GetHash());
+			nOrphanBlockBytes -= ::GetSerializeSize(*pblockOrphan, SER_NETWORK, PROTOCOL_VERSION);
 			delete pblockOrphan;
 		}
 		mapOrphanBlocksByPrev.erase(hashPrev);
@@ -3054,6 +3597,93 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter) {
 	txn = CPartialMerkleTree(vHashes, vMatch);
 }
 
+CCompactBlock::CCompactBlock(const CBlock& block, CNode* pto) {
+	header = block.GetBlockHeader();
+	nNonce = GetRand(std::numeric_limits<uint64>::max());
+	uint256 hashSalt = GetSalt();
+
+	for (unsigned int i = 0; i < block.vtx.size(); i++) {
+		const CTransaction &tx = block.vtx[i];
+		uint256 hash = tx.GetHash();
+		bool fPrefill = tx.IsCoinBase();
+		if (!fPrefill && pto) {
+			LOCK(pto->cs_inventory);
+			fPrefill = !pto->setInventoryKnown.count(CInv(MSG_TX, hash));
+		}
+		if (fPrefill)
+			vPrefilled.push_back(make_pair(i, tx));
+		else
+			vShortId.push_back(GetShortId(hashSalt, hash));
+	}
+}
+
+uint256 CCompactBlock::GetSalt() const {
+	uint256 hashBlock = header.GetHash();
+	return Hash(BEGIN(hashBlock), END(hashBlock), BEGIN(nNonce), END(nNonce));
+}
+
+uint64 CCompactBlock::GetShortId(const uint256& hashSalt, const uint256& txid) {
+	return Hash(BEGIN(hashSalt), END(hashSalt), BEGIN(txid), END(txid)).Get64();
+}
+
+bool CCompactBlock::FillBlock(CBlock& block, std::vector<unsigned int>& vMissing,
+		CTxMemPool& pool) const {
+	unsigned int nTx = GetTxCount();
+	block = CBlock(header);
+	block.vtx.resize(nTx);
+	vMissing.clear();
+
+	vector<bool> vHave(nTx, false);
+	for (unsigned int i = 0; i < vPrefilled.size(); i++) {
+		unsigned int nIndex = vPrefilled[i].first;
+		if (nIndex >= nTx || (i > 0 && nIndex <= vPrefilled[i - 1].first))
+			return false;
+		block.vtx[nIndex] = vPrefilled[i].second;
+		vHave[nIndex] = true;
+	}
+
+	// short id -> position in the block, -1 where two ids are the same
+	map<uint64, int> mapIndex;
+	for (unsigned int i = 0, j = 0; i < nTx; i++) {
+		if (vHave[i])
+			continue;
+		pair<map<uint64, int>::iterator, bool> ret = mapIndex.insert(
+				make_pair(vShortId[j++], (int) i));
+		if (!ret.second)
+			ret.first->second = -1;
+	}
+
+	// a pool transaction matching an id another one already did leaves the
+	// position to be asked for
+	vector<bool> vAmbiguous(nTx, false);
+	uint256 hashSalt = GetSalt();
+	{
+		LOCK(pool.cs);
+		for (map<uint256, CTransaction>::iterator mi = pool.mapTx.begin();
+				mi != pool.mapTx.end() && !mapIndex.empty(); ++mi) {
+			map<uint64, int>::iterator it = mapIndex.find(
+					GetShortId(hashSalt, (*mi).first));
+			if (it == mapIndex.end() || (*it).second < 0)
+				continue;
+			int nIndex = (*it).second;
+			if (vHave[nIndex])
+				vAmbiguous[nIndex] = true;
+			else {
+				block.vtx[nIndex] = (*mi).second;
+				vHave[nIndex] = true;
+			}
+		}
+	}
+
+	for (unsigned int i = 0; i < nTx; i++) {
+		if (!vHave[i] || vAmbiguous[i]) {
+			block.vtx[i].SetNull();
+			vMissing.push_back(i);
+		}
+	}
+	return true;
+}
+
 uint256 CPartialMerkleTree::CalcHash(int height, unsigned int pos,
 		const std::vector<uint256> &vTxid) {
 	if (height == 0) {
@@ -3261,18 +3891,29 @@ bool static LoadBlockIndexDB() {
 
 	boost::this_thread::interruption_point();
 
-	// Calculate nChainWork
-	vector<pair<int, CBlockIndex*> > vSortedByHeight;
-	vSortedByHeight.reserve(mapBlockIndex.size());
-	BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex) {
-		CBlockIndex* pindex = item.second;
-		vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-	}
-	sort(vSortedByHeight.begin(), vSortedByHeight.end());
-	BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight) {
-		CBlockIndex* pindex = item.second;
-		pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0)
-				+ pindex->GetBlockWork().getuint256();
+	// Calculate nChainTx, and nChainWork where the record predates
+	// CHAINWORK_VERSION, parents first. The blocks are bucketed by height in
+	// linear passes rather than sorted.
+	int nMaxHeight = -1;
+	BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+		nMaxHeight = max(nMaxHeight, item.second->nHeight);
+	vector<unsigned int> vHeightStart(nMaxHeight + 2, 0);
+	BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+		vHeightStart[item.second->nHeight + 1]++;
+	for (int nHeight = 0; nHeight <= nMaxHeight; nHeight++)
+		vHeightStart[nHeight + 1] += vHeightStart[nHeight];
+	vector<CBlockIndex*> vByHeight(mapBlockIndex.size());
+	BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+		vByHeight[vHeightStart[item.second->nHeight]++] = item.second;
+	vector<unsigned int>().swap(vHeightStart);
+
+	vector<CBlockIndex*> vUpgrade;
+	BOOST_FOREACH(CBlockIndex* pindex, vByHeight) {
+		if (pindex->nChainWork == 0) {
+			pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0)
+					+ pindex->GetBlockWork();
+			vUpgrade.push_back(pindex);
+		}
 		pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0)
 				+ pindex->nTx;
 		if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS
@@ -3280,6 +3921,15 @@ bool static LoadBlockIndexDB() {
 			setBlockIndexValid.insert(pindex);
 	}
 
+	// Store the work of records written by older versions, so the next
+	// start reads it instead
+	if (!vUpgrade.empty()) {
+		if (!pblocktree->WriteBlockIndexes(vUpgrade))
+			return error("LoadBlockIndexDB() : failed to store chain work");
+		printf("LoadBlockIndexDB(): stored the chain work of %"PRIszu" blocks\n",
+				vUpgrade.size());
+	}
+
 	// Load block file info
 	pblocktree->ReadLastBlockFile(nLastBlockFile);
 	printf("LoadBlockIndexDB(): last block file = %i\n", nLastBlockFile);
@@ -3339,6 +3989,7 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth) {
 	nCheckLevel = std::max(0, std::min(4, nCheckLevel));
 	printf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
 	CCoinsViewCache coins(*pcoinsTip, true);
+	CServiceTxn txnServices; // never committed, like coins
 	CBlockIndex* pindexState = pindexBest;
 	CBlockIndex* pindexFailure = NULL;
 	int nGoodTransactions = 0;
@@ -3632,10 +4283,38 @@ void PrintBlockTree() {
 	}
 }
 
+// blocks read from a file ahead of processing, for their headers to be hashed
+// on the proof-of-work threads meanwhile
+static const unsigned int MAX_IMPORT_BATCH = 64;
+
+// hash the headers of a batch of blocks in parallel, then process them in
+// order. False if processing has to stop.
+static bool ProcessBlockBatch(vector<pair<CBlock, uint64> > &vBatch, CDiskBlockPos *dbp, int &nLoaded) {
+	vector<const CBlock*> vpblock;
+	for (unsigned int i = 0; i < vBatch.size(); i++)
+		vpblock.push_back(&vBatch[i].first);
+	PrehashPoW(vpblock);
+
+	bool fOk = true;
+	for (unsigned int i = 0; i < vBatch.size() && fOk; i++) {
+		LOCK(cs_main);
+		if (dbp)
+			dbp->nPos = vBatch[i].second;
+		CValidationState state;
+		if (ProcessBlock(state, NULL, &vBatch[i].first, dbp))
+			nLoaded++;
+		if (state.IsError())
+			fOk = false;
+	}
+	vBatch.clear();
+	return fOk;
+}
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp) {
 	int64 nStart = GetTimeMillis();
 
 	int nLoaded = 0;
+	vector<pair<CBlock, uint64> > vBatch;
 	try {
 		CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SIZE, MAX_BLOCK_SIZE + 8,
 				SER_DISK, CLIENT_VERSION);
@@ -3680,15 +4359,10 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp) {
 				blkdat >> block;
 				nRewind = blkdat.GetPos();
 
-				// process block
+				// queue block for processing
 				if (nBlockPos >= nStartByte) {
-					LOCK(cs_main);
-					if (dbp)
-						dbp->nPos = nBlockPos;
-					CValidationState state;
-					if (ProcessBlock(state, NULL, &block, dbp))
-						nLoaded++;
-					if (state.IsError())
+					vBatch.push_back(make_pair(block, nBlockPos));
+					if (vBatch.size() >= MAX_IMPORT_BATCH && !ProcessBlockBatch(vBatch, dbp, nLoaded))
 						break;
 				}
 			} catch (std::exception &e) {
@@ -3696,6 +4370,7 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp) {
 						__PRETTY_FUNCTION__);
 			}
 		}
+		ProcessBlockBatch(vBatch, dbp, nLoaded);
 		fclose(fileIn);
 	} catch (std::runtime_error &e) {
 		AbortNode(_("Error: system error: ") + e.what());
@@ -3737,7 +4412,7 @@ string GetWarnings(string strFor) {
 	if (pindexBest
 			&& nBestInvalidWork
 					> nBestChainWork
-							+ (pindexBest->GetBlockWork() * 6).getuint256()) {
+							+ pindexBest->GetBlockWork() * 6) {
 		nPriority = 2000;
 		strStatusBar =
 				strRPC =
@@ -3765,6 +4440,248 @@ string GetWarnings(string strFor) {
 	return "error";
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Headers-first sync
+//
+
+// the tip of the best header chain, or of the block chain when it has more work
+CBlockIndex* GetBestHeader() {
+	if (pindexBestHeader != NULL
+			&& pindexBestHeader->nChainWork > pindexBest->nChainWork)
+		return pindexBestHeader;
+	return pindexBest;
+}
+
+// Make pindexNew the tip of the best header chain and line up the blocks along
+// it that are still to be fetched
+static void SetBestHeader(CBlockIndex* pindexNew) {
+	if (!dequeBlocksToFetch.empty()
+			&& pindexNew->pprev == dequeBlocksToFetch.back())
+		dequeBlocksToFetch.push_back(pindexNew);
+	else {
+		// another branch: walk back to where we have the blocks
+		dequeBlocksToFetch.clear();
+		for (CBlockIndex* pindex = pindexNew;
+				pindex != NULL && !mapBlockIndex.count(pindex->GetBlockHash());
+				pindex = pindex->pprev)
+			dequeBlocksToFetch.push_front(pindex);
+	}
+	pindexBestHeader = pindexNew;
+}
+
+// Check a header against its parent the way AcceptBlock checks a block, and
+// index it with the other headers whose blocks are still to come. The checks
+// against the parent come before the proof of work, the costly one.
+bool AcceptBlockHeader(CValidationState &state,
+		const CBlockHeader &header, CBlockIndex** ppindex) {
+	// Check for duplicate
+	uint256 hash = header.GetHash();
+	map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+	if (mi != mapBlockIndex.end()) {
+		*ppindex = (*mi).second;
+		return true;
+	}
+	mi = mapHeaderIndex.find(hash);
+	if (mi != mapHeaderIndex.end()) {
+		*ppindex = (*mi).second;
+		return true;
+	}
+
+	// Get prev block index, from either index
+	CBlockIndex* pindexPrev = NULL;
+	mi = mapBlockIndex.find(header.hashPrevBlock);
+	if (mi != mapBlockIndex.end())
+		pindexPrev = (*mi).second;
+	else {
+		mi = mapHeaderIndex.find(header.hashPrevBlock);
+		if (mi != mapHeaderIndex.end())
+			pindexPrev = (*mi).second;
+	}
+	if (pindexPrev == NULL)
+		return state.DoS(10,
+				error("AcceptBlockHeader() : prev block not found"));
+	int nHeight = pindexPrev->nHeight + 1;
+
+	// Check the difficulty
+	if (header.nBits != GetNextWorkRequired(pindexPrev, &header))
+		return state.DoS(100,
+				error("AcceptBlockHeader() : incorrect proof of work"));
+
+	// Check timestamp
+	if (header.GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
+		return state.Invalid(
+				error("AcceptBlockHeader() : block timestamp too far in the future"));
+	if (header.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+		return state.Invalid(
+				error("AcceptBlockHeader() : block's timestamp is too early"));
+
+	// Check that the header chain matches the known block chain up to a checkpoint
+	if (!Checkpoints::CheckBlock(nHeight, hash))
+		return state.DoS(100,
+				error("AcceptBlockHeader() : rejected by checkpoint lock-in at %d",
+						nHeight));
+	CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+	if (pcheckpoint && nHeight < pcheckpoint->nHeight)
+		return state.DoS(100,
+				error("AcceptBlockHeader() : forked chain older than last checkpoint (height %d)",
+						nHeight));
+
+	// Check proof of work, scrypt or auxpow
+	if (!header.CheckProofOfWork(nHeight))
+		return state.DoS(50,
+				error("AcceptBlockHeader() : proof of work failed"));
+
+	CBlockIndex* pindexNew = new CBlockIndex(header);
+	mi = mapHeaderIndex.insert(make_pair(hash, pindexNew)).first;
+	pindexNew->phashBlock = &((*mi).first);
+	pindexNew->pprev = pindexPrev;
+	pindexNew->nHeight = nHeight;
+	pindexNew->nChainWork = pindexPrev->nChainWork
+			+ pindexNew->GetBlockWork();
+	pindexNew->nStatus = BLOCK_VALID_TREE;
+
+	if (pindexNew->nChainWork > GetBestHeader()->nChainWork)
+		SetBestHeader(pindexNew);
+	*ppindex = pindexNew;
+	return true;
+}
+
+static void StartHeadersSync(CNode* pnode) {
+	if (!fHeadersFirstSync)
+		printf("starting headers-first sync from %d\n", nBestHeight);
+	fHeadersFirstSync = true;
+	fHeadersComplete = false;
+	pnode->PushMessage("getheaders", CBlockLocator(GetBestHeader()), uint256(0));
+}
+
+// Leave headers-first sync once the blocks along the best header chain are all
+// in, or one of them turns out invalid; blocks then come in the usual way
+void EndHeadersSync(const char* pszReason) {
+	printf("headers-first sync ended at %d: %s\n", nBestHeight, pszReason);
+	fHeadersFirstSync = false;
+	fHeadersComplete = false;
+	pindexBestHeader = NULL;
+	dequeBlocksToFetch.clear();
+	mapBlocksInFlight.clear();
+	nWindowFullSince = 0;
+	// mapBlockIndex entries never point at these, AddToBlockIndex links
+	// blocks to their parents in mapBlockIndex
+	BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapHeaderIndex)
+		delete item.second;
+	mapHeaderIndex.clear();
+
+	LOCK(cs_vNodes);
+	BOOST_FOREACH(CNode* pnode, vNodes)
+		pnode->setBlocksInFlight.clear();
+}
+
+// Forget the blocks asked of a peer, for the other peers to fetch
+static void ReleaseBlocksInFlight(CNode* pnode) {
+	BOOST_FOREACH(const uint256& hash, pnode->setBlocksInFlight) {
+		map<uint256, pair<CNode*, int64> >::iterator mi =
+				mapBlocksInFlight.find(hash);
+		if (mi != mapBlocksInFlight.end() && (*mi).second.first == pnode)
+			mapBlocksInFlight.erase(mi);
+	}
+	pnode->setBlocksInFlight.clear();
+}
+
+// Ask pto for the next blocks along the best header chain that nobody is
+// fetching, inside the download window, and drop it when it holds the window
+// back or sits on a block for too long
+static void FetchBlocks(CNode* pto) {
+	// Move the window past the blocks that made it into the index
+	while (!dequeBlocksToFetch.empty()
+			&& mapBlockIndex.count(dequeBlocksToFetch.front()->GetBlockHash())) {
+		dequeBlocksToFetch.pop_front();
+		nWindowFullSince = 0;
+	}
+	if (dequeBlocksToFetch.empty()) {
+		if (fHeadersComplete)
+			EndHeadersSync("all blocks fetched");
+		return;
+	}
+	if (pto->fClient || pto->fDisconnect || !pto->fSuccessfullyConnected)
+		return;
+
+	int64 nNow = GetTime();
+	set<CNode*> setNodes;
+	{
+		LOCK(cs_vNodes);
+		setNodes.insert(vNodes.begin(), vNodes.end());
+	}
+
+	// Forget what was delivered, or handed to another peer meanwhile
+	for (set<uint256>::iterator it = pto->setBlocksInFlight.begin();
+			it != pto->setBlocksInFlight.end();) {
+		map<uint256, pair<CNode*, int64> >::iterator mi =
+				mapBlocksInFlight.find(*it);
+		if (mi == mapBlocksInFlight.end() || (*mi).second.first != pto)
+			pto->setBlocksInFlight.erase(it++);
+		else
+			++it;
+	}
+
+	// Stalling the window or timing out loses the peer its blocks
+	const char* pszDrop = NULL;
+	BOOST_FOREACH(const uint256& hash, pto->setBlocksInFlight) {
+		int64 nRequested = mapBlocksInFlight[hash].second;
+		if (hash == dequeBlocksToFetch.front()->GetBlockHash()
+				&& nWindowFullSince != 0
+				&& nNow - max(nRequested, nWindowFullSince) > BLOCK_STALLING_TIMEOUT)
+			pszDrop = "stalling block download";
+		else if (nNow - nRequested > BLOCK_DOWNLOAD_TIMEOUT)
+			pszDrop = "timed out on a block";
+		if (pszDrop)
+			break;
+	}
+	if (pszDrop) {
+		printf("peer %s %s, disconnecting\n", pto->addr.ToString().c_str(),
+				pszDrop);
+		ReleaseBlocksInFlight(pto);
+		pto->fDisconnect = true;
+		return;
+	}
+
+	vector<CInv> vGetData;
+	unsigned int nWindow = min((unsigned int) dequeBlocksToFetch.size(),
+			BLOCK_DOWNLOAD_WINDOW);
+	// Past the orphan byte limit only the block the chain waits on is asked
+	// for, the rest are held back until the blocks waiting on it go in
+	if (nOrphanBlockBytes >= MAX_ORPHAN_BLOCK_BYTES)
+		nWindow = 1;
+	unsigned int i = 0;
+	for (; i < nWindow
+			&& pto->setBlocksInFlight.size() < MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+			i++) {
+		CBlockIndex* pindex = dequeBlocksToFetch[i];
+		// the rest is higher than the peer is known to have
+		if (pindex->nHeight > pto->nBestKnownHeight)
+			break;
+		uint256 hash = pindex->GetBlockHash();
+		if (mapOrphanBlocks.count(hash))
+			continue;
+		map<uint256, pair<CNode*, int64> >::iterator mi =
+				mapBlocksInFlight.find(hash);
+		if (mi != mapBlocksInFlight.end() && setNodes.count((*mi).second.first)
+				&& (*mi).second.first->setBlocksInFlight.count(hash))
+			continue;
+		vGetData.push_back(CInv(MSG_BLOCK, hash));
+		mapBlocksInFlight[hash] = make_pair(pto, nNow);
+		pto->setBlocksInFlight.insert(hash);
+	}
+
+	// A peer with room to spare and nothing left to ask for means the window
+	// is full, held back by whoever has its first block
+	if (i == nWindow && vGetData.empty() && nWindowFullSince == 0
+			&& pto->setBlocksInFlight.size() < MAX_BLOCKS_IN_TRANSIT_PER_PEER)
+		nWindowFullSince = nNow;
+
+	if (!vGetData.empty())
+		pto->PushMessage("getdata", vGetData);
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Messages
@@ -3782,6 +4699,7 @@ bool static AlreadyHave(const CInv& inv) {
 				|| pcoinsTip->HaveCoins(inv.hash);
 	}
 	case MSG_BLOCK:
+	case MSG_CMPCT_BLOCK:
 		return mapBlockIndex.count(inv.hash) || mapOrphanBlocks.count(inv.hash);
 	}
 	// Don't know what it is, just say we already got one
@@ -3814,7 +4732,8 @@ void static ProcessGetData(CNode* pfrom) {
 			boost::this_thread::interruption_point();
 			it++;
 
-			if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK) {
+			if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK
+					|| inv.type == MSG_CMPCT_BLOCK) {
 				bool send = true;
 				map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(
 						inv.hash);
@@ -3841,6 +4760,9 @@ void static ProcessGetData(CNode* pfrom) {
 					block.ReadFromDisk((*mi).second);
 					if (inv.type == MSG_BLOCK)
 						pfrom->PushMessage("block", block);
+					else if (inv.type == MSG_CMPCT_BLOCK)
+						pfrom->PushMessage("cmpctblock",
+								CCompactBlock(block, pfrom));
 					else // MSG_FILTERED_BLOCK)
 					{
 						LOCK(pfrom->cs_filter);
@@ -3905,7 +4827,8 @@ void static ProcessGetData(CNode* pfrom) {
 			// Track requests for our stuff.
 			Inventory(inv.hash);
 
-			if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+			if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK
+					|| inv.type == MSG_CMPCT_BLOCK)
 				break;
 		}
 	}
@@ -3924,6 +4847,51 @@ void static ProcessGetData(CNode* pfrom) {
 	}
 }
 
+// Hand a block a peer sent, in full or rebuilt from a compact block, to
+// ProcessBlock and settle our requests for it
+void static ProcessReceivedBlock(CNode* pfrom, CBlock& block) {
+	CInv inv(MSG_BLOCK, block.GetHash());
+	pfrom->AddInventoryKnown(inv);
+
+	uint256 hash = inv.hash;
+	pfrom->setBlocksInFlight.erase(hash);
+	mapBlocksInFlight.erase(hash);
+	mapPartialBlocks.erase(hash);
+
+	CValidationState state;
+	if (ProcessBlock(state, pfrom, &block) || state.CorruptionPossible()) {
+		mapAlreadyAskedFor.erase(inv);
+		mapAlreadyAskedFor.erase(CInv(MSG_CMPCT_BLOCK, hash));
+	}
+	int nDoS = 0;
+	if (state.IsInvalid(nDoS)) {
+		if (nDoS > 0)
+			pfrom->Misbehaving(nDoS);
+		// A block of the header chain that is invalid as committed to by
+		// its header, not just mangled on the way, makes the chain no good
+		if (nDoS > 0 && fHeadersFirstSync && mapHeaderIndex.count(hash)
+				&& !state.CorruptionPossible()) {
+			EndHeadersSync("invalid block on the header chain");
+			// the download goes on the usual way, from another peer if any
+			CNode* pnodeNext = NULL;
+			LOCK(cs_vNodes);
+			BOOST_FOREACH(CNode* pnode, vNodes)
+				if (!pnode->fClient && !pnode->fDisconnect && pnode->fSuccessfullyConnected
+						&& (pnodeNext == NULL || pnodeNext == pfrom))
+					pnodeNext = pnode;
+			if (pnodeNext != NULL)
+				pnodeNext->PushGetBlocks(pindexBest, uint256(0));
+		}
+	}
+}
+
+// A compact block that could not be completed is fetched whole from the peer
+// that sent it
+void static AskForFullBlock(CNode* pfrom, const uint256& hash) {
+	mapPartialBlocks.erase(hash);
+	pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, hash)));
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand,
 		CDataStream& vRecv) {
 	RandAddSeedPerfmon();
@@ -4026,6 +4994,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand,
 		}
 
 		pfrom->fSuccessfullyConnected = true;
+		pfrom->nBestKnownHeight = pfrom->nStartingHeight;
 
 		printf(
 				"receive version message: %s: version %d, blocks=%d, us=%s, them=%s, peer=%s\n",
@@ -4127,6 +5096,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand,
 				break;
 			}
 		}
+
+		// A lone block is a new tip being announced rather than an answer
+		// to getblocks; most of its transactions are in our pool already
+		unsigned int nBlocks = 0;
+		BOOST_FOREACH(const CInv &inv, vInv)
+			if (inv.type == MSG_BLOCK)
+				nBlocks++;
+		bool fCompact = nBlocks == 1
+				&& pfrom->nVersion >= COMPACT_BLOCKS_VERSION
+				&& !IsInitialBlockDownload();
 		for (unsigned int nInv = 0; nInv < vInv.size(); nInv++) {
 			const CInv &inv = vInv[nInv];
 
@@ -4139,8 +5118,25 @@ bool static ProcessMessage(CNode* pfrom, string strCommand,
 						fAlreadyHave ? "have" : "new");
 
 			if (!fAlreadyHave) {
-				if (!fImporting && !fReindex)
+				if (fImporting || fReindex)
+					;
+				else if (inv.type == MSG_BLOCK && fHeadersFirstSync) {
+					// During headers-first sync blocks come in through
+					// their headers
+					map<uint256, CBlockIndex*>::iterator mi =
+							mapHeaderIndex.find(inv.hash);
+					if (mi != mapHeaderIndex.end())
+						pfrom->nBestKnownHeight = max(pfrom->nBestKnownHeight,
+								(*mi).second->nHeight);
+					else
+						pfrom->PushMessage("getheaders",
+								CBlockLocator(GetBestHeader()), inv.hash);
+				} else if (inv.type == MSG_BLOCK && fCompact)
+					pfrom->AskFor(CInv(MSG_CMPCT_BLOCK, inv.hash));
+				else
 					pfrom->AskFor(inv);
+			} else if (fHeadersFirstSync) {
+				// the getblocks fallbacks below are not needed
 			} else if (inv.type == MSG_BLOCK
 					&& mapOrphanBlocks.count(inv.hash)) {
 				pfrom->PushGetBlocks(pindexBest,
@@ -4232,7 +5228,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand,
 
 		// we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
 		vector<CBlock> vHeaders;
-		int nLimit = 2000;
+		int nLimit = MAX_HEADERS_RESULTS;
 		printf("getheaders %d to %s\n", (pindex ? pindex->nHeight : -1),
 				hashStop.ToString().c_str());
 		for (; pindex; pindex = pindex->pnext) {
@@ -4243,6 +5239,55 @@ bool static ProcessMessage(CNode* pfrom, string strCommand,
 		pfrom->PushMessage("headers", vHeaders);
 	}
 
+	else if (strCommand == "headers" && !fImporting && !fReindex) {
+		vector<CBlock> vHeaders;
+		vRecv >> vHeaders;
+		if (vHeaders.size() > MAX_HEADERS_RESULTS) {
+			pfrom->Misbehaving(20);
+			return error("message headers size() = %"PRIszu"", vHeaders.size());
+		}
+
+		// Only asked for during headers-first sync
+		if (!fHeadersFirstSync)
+			return true;
+
+		// Hash the new headers on the proof-of-work threads before they are
+		// checked in order
+		vector<const CBlock*> vpblock;
+		BOOST_FOREACH(const CBlock& header, vHeaders) {
+			uint256 hash = header.GetHash();
+			if (!mapBlockIndex.count(hash) && !mapHeaderIndex.count(hash))
+				vpblock.push_back(&header);
+		}
+		PrehashPoW(vpblock);
+
+		CBlockIndex* pindexLast = NULL;
+		BOOST_FOREACH(const CBlock& header, vHeaders) {
+			CValidationState state;
+			if (!AcceptBlockHeader(state, header, &pindexLast)) {
+				int nDoS = 0;
+				if (state.IsInvalid(nDoS) && nDoS > 0)
+					pfrom->Misbehaving(nDoS);
+				return error("message headers : header %s rejected",
+						header.GetHash().ToString().c_str());
+			}
+		}
+
+		if (pindexLast != NULL) {
+			pfrom->nBestKnownHeight = max(pfrom->nBestKnownHeight,
+					pindexLast->nHeight);
+			// A full message means there are more where they came from
+			if (vHeaders.size() == MAX_HEADERS_RESULTS)
+				pfrom->PushMessage("getheaders", CBlockLocator(pindexLast),
+						uint256(0));
+		}
+		if (vHeaders.size() < MAX_HEADERS_RESULTS)
+			fHeadersComplete = true;
+		printf("received %"PRIszu" headers from %s, best header %d\n",
+				vHeaders.size(), pfrom->addr.ToString().c_str(),
+				GetBestHeader()->nHeight);
+	}
+
 	else if (strCommand == "tx") {
 		vector<uint256> vWorkQueue;
 		vector<uint256> vEraseQueue;
@@ -4327,16 +5372,149 @@ bool static ProcessMessage(CNode* pfrom, string strCommand,
 		printf("received block %s\n", block.GetHash().ToString().c_str());
 		// block.print();
 
-		CInv inv(MSG_BLOCK, block.GetHash());
-		pfrom->AddInventoryKnown(inv);
+		ProcessReceivedBlock(pfrom, block);
+	}
 
-		CValidationState state;
-		if (ProcessBlock(state, pfrom, &block) || state.CorruptionPossible())
-			mapAlreadyAskedFor.erase(inv);
-		int nDoS = 0;
-		if (state.IsInvalid(nDoS))
-			if (nDoS > 0)
-				pfrom->Misbehaving(nDoS);
+	else if (strCommand == "cmpctblock" && !fImporting && !fReindex) {
+		CCompactBlock cmpctblock;
+		vRecv >> cmpctblock;
+
+		uint256 hash = cmpctblock.header.GetHash();
+		printf("received compact block %s\n", hash.ToString().c_str());
+		pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hash));
+
+		if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+			return true;
+
+		// the block is left to the peer already asked for what it lacks
+		// until that one has taken too long
+		map<uint256, CPartialBlock>::iterator mp = mapPartialBlocks.find(hash);
+		if (mp != mapPartialBlocks.end() && (*mp).second.pfrom != pfrom
+				&& GetTime() - (*mp).second.nTime < BLOCKTXN_TIMEOUT)
+			return true;
+
+		// every transaction takes more than 60 bytes
+		unsigned int nTx = cmpctblock.GetTxCount();
+		if (nTx == 0 || nTx > MAX_BLOCK_SIZE / 60) {
+			pfrom->Misbehaving(100);
+			return error("message cmpctblock tx count = %u", nTx);
+		}
+
+		// Only search the pool for a block that connects and carries its
+		// proof of work, anything else goes the way of a full block
+		map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(
+				cmpctblock.header.hashPrevBlock);
+		if (mi == mapBlockIndex.end()) {
+			AskForFullBlock(pfrom, hash);
+			return true;
+		}
+		if (!cmpctblock.header.CheckProofOfWork((*mi).second->nHeight + 1)) {
+			pfrom->Misbehaving(50);
+			return error("message cmpctblock : proof of work failed");
+		}
+
+		CPartialBlock partial;
+		if (!cmpctblock.FillBlock(partial.block, partial.vMissing, mempool)) {
+			pfrom->Misbehaving(100);
+			return error("message cmpctblock : bad prefilled transaction index");
+		}
+		if (fDebugNet)
+			printf("compact block %s: %u prefilled, %"PRIszu" missing of %u\n",
+					hash.ToString().c_str(), (unsigned int) cmpctblock.vPrefilled.size(),
+					partial.vMissing.size(), nTx);
+
+		if (partial.vMissing.empty()) {
+			// a pool transaction sharing a short id with one of the block
+			// that is not in it gives a wrong merkle root
+			if (partial.block.BuildMerkleTree() != partial.block.hashMerkleRoot)
+				AskForFullBlock(pfrom, hash);
+			else
+				ProcessReceivedBlock(pfrom, partial.block);
+			return true;
+		}
+
+		while (mapPartialBlocks.size() >= MAX_PARTIAL_BLOCKS) {
+			map<uint256, CPartialBlock>::iterator oldest = mapPartialBlocks.begin();
+			for (map<uint256, CPartialBlock>::iterator it = mapPartialBlocks.begin();
+					it != mapPartialBlocks.end(); ++it)
+				if ((*it).second.nTime < (*oldest).second.nTime)
+					oldest = it;
+			mapPartialBlocks.erase(oldest);
+		}
+		CBlockTxnRequest req;
+		req.hash = hash;
+		req.vIndex = partial.vMissing;
+		partial.pfrom = pfrom;
+		partial.nTime = GetTime();
+		mapPartialBlocks[hash] = partial;
+		pfrom->PushMessage("getblocktxn", req);
+	}
+
+	else if (strCommand == "getblocktxn") {
+		CBlockTxnRequest req;
+		vRecv >> req;
+
+		map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.hash);
+		if (mi == mapBlockIndex.end()) {
+			pfrom->PushMessage("notfound",
+					vector<CInv>(1, CInv(MSG_BLOCK, req.hash)));
+			return true;
+		}
+
+		CBlock block;
+		if (!block.ReadFromDisk((*mi).second))
+			return error("message getblocktxn : failed to read block %s",
+					req.hash.ToString().c_str());
+		if ((*mi).second->nHeight < nBestHeight - MAX_BLOCKTXN_DEPTH) {
+			pfrom->PushMessage("block", block);
+			return true;
+		}
+		CBlockTxn resp;
+		resp.hash = req.hash;
+		BOOST_FOREACH(unsigned int nIndex, req.vIndex) {
+			if (nIndex >= block.vtx.size()) {
+				pfrom->Misbehaving(100);
+				return error("message getblocktxn : index %u out of range", nIndex);
+			}
+			resp.vtx.push_back(block.vtx[nIndex]);
+		}
+		pfrom->PushMessage("blocktxn", resp);
+	}
+
+	else if (strCommand == "blocktxn" && !fImporting && !fReindex) {
+		CBlockTxn resp;
+		vRecv >> resp;
+
+		map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.find(resp.hash);
+		if (mi == mapPartialBlocks.end())
+			return true;
+		CPartialBlock &partial = (*mi).second;
+		// a peer asked before the block went to another one may still be
+		// answering, anybody else was not asked at all
+		if (partial.pfrom != pfrom) {
+			if (fDebugNet)
+				printf("ignoring blocktxn for %s from a peer not asked\n",
+						resp.hash.ToString().c_str());
+			return true;
+		}
+		if (resp.vtx.size() != partial.vMissing.size()) {
+			AskForFullBlock(pfrom, resp.hash);
+			pfrom->Misbehaving(20);
+			return error("message blocktxn size() = %"PRIszu", %"PRIszu" asked for",
+					resp.vtx.size(), partial.vMissing.size());
+		}
+		for (unsigned int i = 0; i < resp.vtx.size(); i++)
+			partial.block.vtx[partial.vMissing[i]] = resp.vtx[i];
+
+		// a pool transaction taken for one of the block that is not in it
+		// gives a wrong merkle root as well, so the peer is not blamed
+		CBlock block = partial.block;
+		if (block.BuildMerkleTree() != block.hashMerkleRoot) {
+			AskForFullBlock(pfrom, resp.hash);
+			return true;
+		}
+		printf("received block %s\n", resp.hash.ToString().c_str());
+		ProcessReceivedBlock(pfrom, block);
 	}
 
 	else if (strCommand == "getaddr") {
@@ -4609,12 +5787,19 @@ bool SendMessages(CNode* pto, bool fSendTrickle) {
 				pto->PushMessage("ping");
 		}
 
-		// Start block sync
+		// Start block sync, headers first when far behind
 		if (pto->fStartSync && !fImporting && !fReindex) {
 			pto->fStartSync = false;
-			pto->PushGetBlocks(pindexBest, uint256(0));
+			if (GetBoolArg("-headersfirst", true) && IsInitialBlockDownload())
+				StartHeadersSync(pto);
+			else
+				pto->PushGetBlocks(pindexBest, uint256(0));
 		}
 
+		// Fetch blocks along the header chain from every peer
+		if (fHeadersFirstSync && !fImporting && !fReindex)
+			FetchBlocks(pto);
+
 		// Resend wallet transactions that haven't gotten in a block yet
 		// Except during reindex, importing and IBD, when old wallet
 		// transactions become unconfirmed and spams other nodes.
@@ -4782,32 +5967,11 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit) {
 		((uint32_t*) pstate)[i] = ctx.h[i];
 }
 
-// Some explaining would be appreciated
-class COrphan {
-public:
-	CTransaction* ptx;
-	set<uint256> setDependsOn;
-	double dPriority;
-	double dFeePerKb;
-
-	COrphan(CTransaction* ptxIn) {
-		ptx = ptxIn;
-		dPriority = dFeePerKb = 0;
-	}
-
-	void print() const {
-		printf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-				ptx->GetHash().ToString().c_str(), dPriority, dFeePerKb);
-		BOOST_FOREACH(uint256 hash, setDependsOn)
-			printf("   setDependsOn %s\n", hash.ToString().c_str());
-	}
-};
-
 uint64 nLastBlockTx = 0;
 uint64 nLastBlockSize = 0;
 
 // We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
+typedef boost::tuple<double, double, uint256> TxPriority;
 class TxPriorityCompare {
 	bool byFee;
 public:
@@ -4870,84 +6034,9 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn) {
 		LOCK2(cs_main, mempool.cs);
 		CBlockIndex* pindexPrev = pindexBest;
 		CCoinsViewCache view(*pcoinsTip, true);
-
-		// Priority order to process transactions
-		list<COrphan> vOrphan; // list memory doesn't move
-		map<uint256, vector<COrphan*> > mapDependers;
+		mempool.UpdateEntries(pindexPrev, view);
 		bool fPrintPriority = GetBoolArg("-printpriority");
 
-		// This vector will be sorted into a priority queue:
-		vector<TxPriority> vecPriority;
-		vecPriority.reserve(mempool.mapTx.size());
-		for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin();
-				mi != mempool.mapTx.end(); ++mi) {
-			CTransaction& tx = (*mi).second;
-			if (tx.IsCoinBase() || !tx.IsFinal())
-				continue;
-
-			COrphan* porphan = NULL;
-			double dPriority = 0;
-			int64 nTotalIn = 0;
-			bool fMissingInputs = false;
-			BOOST_FOREACH(const CTxIn& txin, tx.vin) {
-				// Read prev transaction
-				if (!view.HaveCoins(txin.prevout.hash)) {
-					// This should never happen; all transactions in the memory
-					// pool should connect to either transactions in the chain
-					// or other transactions in the memory pool.
-					if (!mempool.mapTx.count(txin.prevout.hash)) {
-						printf("ERROR: mempool transaction missing input\n");
-						if (fDebug)
-							assert("mempool transaction missing input" == 0);
-						fMissingInputs = true;
-						if (porphan)
-							vOrphan.pop_back();
-						break;
-					}
-
-					// Has to wait for dependencies
-					if (!porphan) {
-						// Use list for automatic deletion
-						vOrphan.push_back(COrphan(&tx));
-						porphan = &vOrphan.back();
-					}
-					mapDependers[txin.prevout.hash].push_back(porphan);
-					porphan->setDependsOn.insert(txin.prevout.hash);
-					nTotalIn +=
-							mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-					continue;
-				}
-				const CCoins &coins = view.GetCoins(txin.prevout.hash);
-
-				int64 nValueIn = coins.vout[txin.prevout.n].nValue;
-				nTotalIn += nValueIn;
-
-				int nConf = pindexPrev->nHeight - coins.nHeight + 1;
-
-				dPriority += (double) nValueIn * nConf;
-			}
-			if (fMissingInputs)
-				continue;
-
-			// Priority is sum(valuein * age) / txsize
-			unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK,
-					PROTOCOL_VERSION);
-			dPriority /= nTxSize;
-
-			// This is a more accurate fee-per-kilobyte than is used by the client code, because the
-			// client code rounds up the size to the nearest 1K. That's good, because it gives an
-			// incentive to create smaller transactions.
-			double dFeePerKb = double(nTotalIn - tx.GetValueOut())
-					/ (double(nTxSize) / 1000.0);
-
-			if (porphan) {
-				porphan->dPriority = dPriority;
-				porphan->dFeePerKb = dFeePerKb;
-			} else
-				vecPriority.push_back(
-						TxPriority(dPriority, dFeePerKb, &(*mi).second));
-		}
-
 		// Collect transactions into block
 		map<vector<unsigned char>,uint256> mapTestPool;
 		uint64 nBlockSize = 1000;
@@ -4955,21 +6044,68 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn) {
 		int nBlockSigOps = 100;
 		bool fSortedByFee = (nBlockPrioritySize <= 0);
 
+		// The pool's index is walked from the top in the current order.
+		// A transaction spending pooled outputs waits in mapWaiting until its
+		// parents are in the block, then goes on the vecReady heap.
 		TxPriorityCompare comparer(fSortedByFee);
-		std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+		const set<CTxMemPool::CEntryKey> *psetIndex = fSortedByFee ? &mempool.setByFee : &mempool.setByPriority;
+		set<CTxMemPool::CEntryKey>::const_reverse_iterator itIndex = psetIndex->rbegin();
+		set<uint256> setSeen;
+		set<uint256> setInBlock;
+		map<uint256, set<uint256> > mapWaiting;
+		map<uint256, vector<uint256> > mapDependers;
+		vector<TxPriority> vecReady;
+
+		while (true) {
+			// Skip what was already taken and park what has to wait
+			while (itIndex != psetIndex->rend()) {
+				const uint256 &hash = itIndex->second;
+				if (setSeen.count(hash)) {
+					++itIndex;
+					continue;
+				}
+				const CTxMemPoolEntry &entry = mempool.mapEntry[hash];
+				set<uint256> setDependsOn;
+				BOOST_FOREACH(const uint256 &hashParent, entry.setDependsOn)
+					if (!setInBlock.count(hashParent))
+						setDependsOn.insert(hashParent);
+				if (setDependsOn.empty())
+					break;
+				setSeen.insert(hash);
+				BOOST_FOREACH(const uint256 &hashParent, setDependsOn)
+					mapDependers[hashParent].push_back(hash);
+				mapWaiting[hash].swap(setDependsOn);
+				++itIndex;
+			}
 
-		while (!vecPriority.empty()) {
-			// Take highest priority transaction off the priority queue:
-			double dPriority = vecPriority.front().get<0>();
-			double dFeePerKb = vecPriority.front().get<1>();
-			CTransaction& tx = *(vecPriority.front().get<2>());
+			// Take the highest priority transaction of the two
+			uint256 hash;
+			if (itIndex != psetIndex->rend()) {
+				const CTxMemPoolEntry &entry = mempool.mapEntry[itIndex->second];
+				TxPriority txIndex(entry.dPriority, entry.dFeePerKb, itIndex->second);
+				if (!vecReady.empty() && comparer(txIndex, vecReady.front()))
+					hash = vecReady.front().get<2>();
+				else
+					hash = itIndex->second;
+			} else if (!vecReady.empty())
+				hash = vecReady.front().get<2>();
+			else
+				break;
+			if (!vecReady.empty() && hash == vecReady.front().get<2>()) {
+				std::pop_heap(vecReady.begin(), vecReady.end(), comparer);
+				vecReady.pop_back();
+			}
+			setSeen.insert(hash);
 
-			std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-			vecPriority.pop_back();
+			CTxMemPoolEntry &entry = mempool.mapEntry[hash];
+			CTransaction &tx = mempool.mapTx[hash];
+			double dPriority = entry.dPriority;
+			double dFeePerKb = entry.dFeePerKb;
+			if (!tx.IsFinal())
+				continue;
 
 			// Size limits
-			unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK,
-					PROTOCOL_VERSION);
+			unsigned int nTxSize = entry.nTxSize;
 			if (nBlockSize + nTxSize >= nBlockMaxSize)
 				continue;
 
@@ -4990,30 +6126,54 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn) {
 							|| (dPriority < COIN * 1440 / 250))) {
 				fSortedByFee = true;
 				comparer = TxPriorityCompare(fSortedByFee);
-				std::make_heap(vecPriority.begin(), vecPriority.end(),
-						comparer);
+				std::make_heap(vecReady.begin(), vecReady.end(), comparer);
+				psetIndex = &mempool.setByFee;
+				itIndex = psetIndex->rbegin();
 			}
 
 			if (!tx.HaveInputs(view))
 				continue;
 
-			int64 nTxFees = tx.GetValueIn(view) - tx.GetValueOut();
+			int64 nTxFees = entry.nFee;
 
 			nTxSigOps += tx.GetP2SHSigOpCount(view);
 			if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
 				continue;
 
-	        // for (unsigned int i = 0; i < tx.vin.size(); i++) {
-	        // 	mapTestPool[tx.vin[i].prevout.hash] = tx.GetHash();
-	        // }
-
-	        CValidationState state;
-			if (!tx.CheckInputs(pindexPrev, state, view, true, SCRIPT_VERIFY_P2SH,
-					mapTestPool, NULL, false, true, false))
+			// The input check is remembered until the tip moves. A passing
+			// check is taken again only if a service name it took from
+			// mapTestPool has been taken by another transaction since. A failing
+			// one is kept only when mapTestPool cannot have caused it: a
+			// service transaction may just have lost its name to one before it
+			// in this template, which the next template may not take.
+			bool fClash = false;
+			BOOST_FOREACH(const vector<unsigned char> &vchName, entry.vvchTestPool)
+				if (mapTestPool.count(vchName))
+					fClash = true;
+			CValidationState state;
+			if (entry.nChecked == 0 || (entry.nChecked == 1 && fClash)) {
+				CServiceKey key;
+				bool fPoolFree = mapTestPool.empty() || !GetServiceKey(tx, key);
+				if (!tx.CheckInputs(pindexPrev, state, view, true, SCRIPT_VERIFY_P2SH,
+						mapTestPool, NULL, false, true, false)) {
+					if (fPoolFree)
+						entry.nChecked = -1;
+					continue;
+				}
+				entry.nChecked = 1;
+				entry.vvchTestPool.clear();
+				for (map<vector<unsigned char>,uint256>::const_iterator mi = mapTestPool.begin();
+						mi != mapTestPool.end(); ++mi)
+					if (mi->second == hash)
+						entry.vvchTestPool.push_back(mi->first);
+			} else if (entry.nChecked < 0)
 				continue;
+			else {
+				BOOST_FOREACH(const vector<unsigned char> &vchName, entry.vvchTestPool)
+					mapTestPool[vchName] = hash;
+			}
 
 			CTxUndo txundo;
-			uint256 hash = tx.GetHash();
 			tx.UpdateCoins(state, view, txundo, pindexPrev->nHeight + 1, hash);
 
 			// Added
@@ -5024,23 +6184,25 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn) {
 			++nBlockTx;
 			nBlockSigOps += nTxSigOps;
 			nFees += nTxFees;
+			setInBlock.insert(hash);
 
 			if (fPrintPriority) {
 				printf("priority %.1f feeperkb %.1f txid %s\n", dPriority,
-						dFeePerKb, tx.GetHash().ToString().c_str());
+						dFeePerKb, hash.ToString().c_str());
 			}
 
 			// Add transactions that depend on this one to the priority queue
-			if (mapDependers.count(hash)) {
-				BOOST_FOREACH(COrphan* porphan, mapDependers[hash]) {
-					if (!porphan->setDependsOn.empty()) {
-						porphan->setDependsOn.erase(hash);
-						if (porphan->setDependsOn.empty()) {
-							vecPriority.push_back(
-									TxPriority(porphan->dPriority,
-											porphan->dFeePerKb, porphan->ptx));
-							std::push_heap(vecPriority.begin(),
-									vecPriority.end(), comparer);
+			map<uint256, vector<uint256> >::iterator mi = mapDependers.find(hash);
+			if (mi != mapDependers.end()) {
+				BOOST_FOREACH(const uint256 &hashChild, mi->second) {
+					set<uint256> &setDependsOn = mapWaiting[hashChild];
+					if (!setDependsOn.empty()) {
+						setDependsOn.erase(hash);
+						if (setDependsOn.empty()) {
+							const CTxMemPoolEntry &entryChild = mempool.mapEntry[hashChild];
+							vecReady.push_back(TxPriority(entryChild.dPriority,
+									entryChild.dFeePerKb, hashChild));
+							std::push_heap(vecReady.begin(), vecReady.end(), comparer);
 						}
 					}
 				}
@@ -5218,10 +6380,9 @@ std::string CDiskBlockIndex::ToString() const {
 	str += CBlockIndex::ToString();
 	str +=
 			strprintf(
-					"\n                hashBlock=%s, hashPrev=%s, hashParentBlock=%s)",
+					"\n                hashBlock=%s, hashPrev=%s)",
 					GetBlockHash().ToString().c_str(),
-					hashPrev.ToString().c_str(),
-					(auxpow.get() != NULL) ? auxpow->GetParentBlockHash().ToString().substr(0,20).c_str() : "-");
+					hashPrev.ToString().c_str());
 	return str;
 }
 
@@ -5229,12 +6390,11 @@ CBlockHeader CBlockIndex::GetBlockHeader() const {
 	CBlockHeader block;
 
 	if (nVersion & BLOCK_VERSION_AUXPOW) {
-		CDiskBlockIndex diskblockindex;
-		// auxpow is not in memory, load CDiskBlockHeader
-		// from database to get it
-
-		pblocktree->ReadDiskBlockIndex(*phashBlock, diskblockindex);
-		block.auxpow = diskblockindex.auxpow;
+		// auxpow is not in memory, load it from its own
+		// record in the block tree database
+		boost::shared_ptr<CAuxPow> auxpow(new CAuxPow());
+		if (pblocktree->ReadAuxPow(*phashBlock, *auxpow))
+			block.auxpow = auxpow;
 	}
 
 	block.nVersion = nVersion;
@@ -5247,7 +6407,44 @@ CBlockHeader CBlockIndex::GetBlockHeader() const {
 	return block;
 }
 
-void static ScryptMiner(CWallet *pwallet) {
+// Hashes per second of each miner thread, with the time it was last metered
+static CCriticalSection cs_minerHashesPerSec;
+static vector<pair<int64, double> > vMinerHashesPerSec;
+
+void GetMinerHashesPerSec(vector<double> &vHashesPerSec) {
+	LOCK(cs_minerHashesPerSec);
+	vHashesPerSec.clear();
+	for (unsigned int i = 0; i < vMinerHashesPerSec.size(); i++) {
+		// a thread that has not reported lately is not hashing
+		if (GetTimeMillis() - vMinerHashesPerSec[i].first > 8000)
+			vHashesPerSec.push_back(0.0);
+		else
+			vHashesPerSec.push_back(vMinerHashesPerSec[i].second);
+	}
+}
+
+// Record the hash rate of one miner thread and recompute the total
+static void MeterMinerHashesPerSec(int nThread, double dThreadHashesPerSec) {
+	LOCK(cs_minerHashesPerSec);
+	if (nThread >= (int) vMinerHashesPerSec.size())
+		return;
+	vMinerHashesPerSec[nThread] = make_pair(GetTimeMillis(), dThreadHashesPerSec);
+
+	double dTotal = 0.0;
+	for (unsigned int i = 0; i < vMinerHashesPerSec.size(); i++)
+		if (GetTimeMillis() - vMinerHashesPerSec[i].first <= 8000)
+			dTotal += vMinerHashesPerSec[i].second;
+	dHashesPerSec = dTotal;
+	nHPSTimerStart = GetTimeMillis();
+
+	static int64 nLogTime;
+	if (GetTime() - nLogTime > 30 * 60) {
+		nLogTime = GetTime();
+		printf("hashmeter %6.0f khash/s\n", dHashesPerSec / 1000.0);
+	}
+}
+
+void static ScryptMiner(CWallet *pwallet, int nThread) {
 	printf("SyscoinscryptMiner started\n");
 	SetThreadPriority(THREAD_PRIORITY_LOWEST);
 	RenameThread("syscoin-miner");
@@ -5256,6 +6453,16 @@ void static ScryptMiner(CWallet *pwallet) {
 	CReserveKey reservekey(pwallet);
 	unsigned int nExtraNonce = 0;
 
+	// Each thread hashes a batch of consecutive nonces at a time through the
+	// widest scrypt kernel detected, in a scratchpad kept for its lifetime
+	const unsigned int nWays = scrypt_multi_ways();
+	vector<char> scratchpad(SCRYPT_MULTI_SCRATCHPAD_SIZE);
+	vector<char> vData(80 * nWays);
+	vector<uint256> vHash(nWays);
+
+	int64 nMeterStart = GetTimeMillis();
+	unsigned int nMeterHashes = 0;
+
 	try {
 		loop {
 			while (vNodes.empty())
@@ -5264,8 +6471,10 @@ void static ScryptMiner(CWallet *pwallet) {
 			//
 			// Create new block
 			//
+			unsigned int nBlockChangeLast = nBlockChangeSeq;
 			unsigned int nTransactionsUpdatedLast = nTransactionsUpdated;
 			CBlockIndex* pindexPrev = pindexBest;
+			bool fTxChanged = false;
 
 			auto_ptr<CBlockTemplate> pblocktemplate(
 					CreateNewBlockWithKey(reservekey));
@@ -5279,22 +6488,6 @@ void static ScryptMiner(CWallet *pwallet) {
 					pblock->vtx.size(),
 					::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
 
-			//
-			// Pre-build hash buffers
-			//
-			char pmidstatebuf[32 + 16];
-			char* pmidstate = alignup<16>(pmidstatebuf);
-			char pdatabuf[128 + 16];
-			char* pdata = alignup<16>(pdatabuf);
-			char phash1buf[64 + 16];
-			char* phash1 = alignup<16>(phash1buf);
-
-			FormatHashBuffers(pblock, pmidstate, pdata, phash1);
-
-			unsigned int& nBlockTime = *(unsigned int*) (pdata + 64 + 4);
-			unsigned int& nBlockBits = *(unsigned int*) (pdata + 64 + 8);
-			//unsigned int& nBlockNonce = *(unsigned int*)(pdata + 64 + 12);
-
 			//
 			// Search
 			//
@@ -5302,73 +6495,67 @@ void static ScryptMiner(CWallet *pwallet) {
 			uint256 hashTarget =
 					CBigNum().SetCompact(pblock->nBits).getuint256();
 			loop {
-				unsigned int nHashesDone = 0;
-
-				uint256 thash;
-				char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
-				loop {
-					scrypt_1024_1_1_256_sp_generic(BEGIN(pblock->nVersion),
-							BEGIN(thash), scratchpad);
+				// the header fields from nVersion to nNonce are the 80 bytes
+				// hashed, with the nonce in the last four
+				for (unsigned int i = 0; i < nWays; i++) {
+					memcpy(&vData[80 * i], BEGIN(pblock->nVersion), 80);
+					unsigned int nNonce = pblock->nNonce + i;
+					memcpy(&vData[80 * i + 76], &nNonce, 4);
+				}
+				scrypt_1024_1_1_256_multi_sp(&vData[0], BEGIN(vHash[0]),
+						&scratchpad[0], nWays);
+				nMeterHashes += nWays;
 
-					if (thash <= hashTarget) {
+				bool fFound = false;
+				for (unsigned int i = 0; i < nWays && !fFound; i++) {
+					if (vHash[i] <= hashTarget) {
 						// Found a solution
+						pblock->nNonce += i;
 						SetThreadPriority(THREAD_PRIORITY_NORMAL);
 						CheckWork(pblock, *pwallet, reservekey);
 						SetThreadPriority(THREAD_PRIORITY_LOWEST);
-						break;
+						fFound = true;
 					}
-					pblock->nNonce += 1;
-					nHashesDone += 1;
-					if ((pblock->nNonce & 0xFF) == 0)
-						break;
 				}
+				if (fFound)
+					break;
+				pblock->nNonce += nWays;
 
 				// Meter hashes/sec
-				static int64 nHashCounter;
-				if (nHPSTimerStart == 0) {
-					nHPSTimerStart = GetTimeMillis();
-					nHashCounter = 0;
-				} else
-					nHashCounter += nHashesDone;
-				if (GetTimeMillis() - nHPSTimerStart > 4000) {
-					static CCriticalSection cs;
-					{
-						LOCK(cs);
-						if (GetTimeMillis() - nHPSTimerStart > 4000) {
-							dHashesPerSec = 1000.0 * nHashCounter
-									/ (GetTimeMillis() - nHPSTimerStart);
-							nHPSTimerStart = GetTimeMillis();
-							nHashCounter = 0;
-							static int64 nLogTime;
-							if (GetTime() - nLogTime > 30 * 60) {
-								nLogTime = GetTime();
-								printf("hashmeter %6.0f khash/s\n",
-										dHashesPerSec / 1000.0);
-							}
-						}
-					}
+				if (GetTimeMillis() - nMeterStart > 4000) {
+					MeterMinerHashesPerSec(nThread,
+							1000.0 * nMeterHashes / (GetTimeMillis() - nMeterStart));
+					nMeterStart = GetTimeMillis();
+					nMeterHashes = 0;
 				}
 
-				// Check for stop or if block needs to be rebuilt
+				// Check for stop or if block needs to be rebuilt: at once on
+				// a new best block, once the template has stood a few seconds
+				// on new transactions. The tip and the pool are only looked
+				// at after NotifyBlockChange reported a change to either.
 				boost::this_thread::interruption_point();
 				if (vNodes.empty())
 					break;
 				if (pblock->nNonce >= 0xffff0000)
 					break;
-				if (nTransactionsUpdated != nTransactionsUpdatedLast
-						&& GetTime() - nStart > 60)
-					break;
-				if (pindexPrev != pindexBest)
+				if (nBlockChangeSeq != nBlockChangeLast) {
+					nBlockChangeLast = nBlockChangeSeq;
+					if (pindexPrev != pindexBest)
+						break;
+					if (nTransactionsUpdated != nTransactionsUpdatedLast)
+						fTxChanged = true;
+				}
+				if (fTxChanged && GetTime() - nStart > MINER_TEMPLATE_MIN_AGE)
 					break;
 
 				// Update nTime every few seconds
-				pblock->UpdateTime(pindexPrev);
-				nBlockTime = ByteReverse(pblock->nTime);
-				if (fTestNet || fCakeNet) {
-					// Changing pblock->nTime can change work required on testnet:
-					nBlockBits = ByteReverse(pblock->nBits);
-					hashTarget =
-							CBigNum().SetCompact(pblock->nBits).getuint256();
+				if ((pblock->nNonce & 0xFF) == 0) {
+					pblock->UpdateTime(pindexPrev);
+					if (fTestNet || fCakeNet) {
+						// Changing pblock->nTime can change work required on testnet:
+						hashTarget =
+								CBigNum().SetCompact(pblock->nBits).getuint256();
+					}
 				}
 			}
 		}
@@ -5391,12 +6578,20 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet) {
 		minerThreads = NULL;
 	}
 
+	{
+		LOCK(cs_minerHashesPerSec);
+		vMinerHashesPerSec.clear();
+		dHashesPerSec = 0.0;
+		if (fGenerate)
+			vMinerHashesPerSec.resize(nThreads, make_pair((int64) 0, 0.0));
+	}
+
 	if (nThreads == 0 || !fGenerate)
 		return;
 
 	minerThreads = new boost::thread_group();
 	for (int i = 0; i < nThreads; i++)
-		minerThreads->create_thread(boost::bind(&ScryptMiner, pwallet));
+		minerThreads->create_thread(boost::bind(&ScryptMiner, pwallet, i));
 }
 
 // Amount compression:
@@ -10,6 +10,7 @@
 #include "net.h"
 #include "script.h"
 #include "scrypt.h"
+#include "feewindow.h"
 
 #include <list>
 
@@ -43,6 +44,19 @@ static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
 static const unsigned int MAX_TX_DATA_SIZE = MAX_BLOCK_SIZE/8;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
+/** The maximum number of headers in a 'headers' protocol message */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Blocks past the best block that headers-first sync downloads at once */
+static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Bytes of blocks waiting on their parents past which headers-first sync
+ *  only asks for the next block the chain needs */
+static const unsigned int MAX_ORPHAN_BLOCK_BYTES = 32 * MAX_BLOCK_SIZE;
+/** Blocks asked of a single peer at a time in headers-first sync */
+static const unsigned int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Seconds a peer may hold back a full download window before it is dropped */
+static const int64 BLOCK_STALLING_TIMEOUT = 10;
+/** Seconds a peer may take to deliver a requested block before it is dropped */
+static const int64 BLOCK_DOWNLOAD_TIMEOUT = 120;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -65,8 +79,18 @@ static const int64 MIN_TXOUT_AMOUNT = MIN_TX_FEE;
 static const int COINBASE_MATURITY = 60;
 /** Threshold for nLockTime: below this value it is interpreted as block number, otherwise as UNIX timestamp. */
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
+/** Client version from which block index records carry nChainWork */
+static const int CHAINWORK_VERSION = 80605;
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** Depth below the best block past which service records are pruned */
+static const int SERVICE_PRUNE_DEPTH = 4320;
+/** Seconds between passes of the service record pruner */
+static const int SERVICE_PRUNE_INTERVAL = 600;
+/** Records looked at per database in each pass of the pruner */
+static const unsigned int SERVICE_PRUNE_BATCH = 1000;
+/** Seconds the internal miner keeps a block template when only the memory pool has changed */
+static const int64 MINER_TEMPLATE_MIN_AGE = 5;
 #ifdef USE_UPNP
 static const int fHaveUPnP = true;
 #else
@@ -88,6 +112,9 @@ extern uint256 nBestInvalidWork;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
 extern unsigned int nTransactionsUpdated;
+// signalled when the best chain or the memory pool changes, for long polls
+extern boost::mutex csBestBlock;
+extern boost::condition_variable cvBlockChange;
 extern uint64 nLastBlockTx;
 extern uint64 nLastBlockSize;
 extern const std::string strMessageMagic;
@@ -126,7 +153,9 @@ class CCoins;
 class CTxUndo;
 class CCoinsView;
 class CCoinsViewCache;
+class CServiceDB;
 class CScriptCheck;
+class CBlockHeader;
 class CValidationState;
 
 struct CBlockTemplate;
@@ -139,6 +168,12 @@ void UnregisterWallet(CWallet* pwalletIn);
 void SyncWithWallets(const uint256 &hash, const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false);
 /** Process an incoming block */
 bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL);
+/** Check a header of headers-first sync and index it, without its block */
+bool AcceptBlockHeader(CValidationState &state, const CBlockHeader &header, CBlockIndex** ppindex);
+/** The tip of the best header chain, or of the block chain when it has more work */
+CBlockIndex* GetBestHeader();
+/** Leave headers-first sync and forget the headers whose blocks are not in */
+void EndHeadersSync(const char* pszReason);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64 nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
@@ -165,8 +200,18 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the proof-of-work hashing thread */
+void ThreadPoWCheck();
+/** Run an instance of the thread reading ahead for block connection */
+void ThreadPrefetch();
+/** Compact the alias, offer and cert records that expired below SERVICE_PRUNE_DEPTH */
+void PruneServices();
+/** Hand the service databases, just flushed at the block at nHeight, to the query RPCs */
+void PublishServiceSnapshot(int nHeight);
 /** Run the miner threads */
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
+/** Recent hashes per second of each miner thread, zero for a thread that has not reported lately */
+void GetMinerHashesPerSec(std::vector<double> &vHashesPerSec);
 /** Generate a new block, without valid proof-of-work */
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn);
 CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey);
@@ -181,6 +226,8 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 /** Calculate the minimum amount of work a received block needs, without knowing its direct parent */
 unsigned int ComputeMinWork(unsigned int nBase, int64 nTime);
+/** Calculate the nBits required of the block following pindexLast */
+unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock);
 /** Get the number of active peers */
 int GetNumBlocksOfPeers();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -190,6 +237,10 @@ std::string GetWarnings(std::string strFor);
 int GetOurChainID();
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock, bool fAllowSlow = false);
+/** Height of the main chain block containing a transaction, or 0 if it is not confirmed in the main chain */
+int GetTxHeight(const uint256 &txid);
+/** Height of the main chain block containing the transaction at txPos, or 0 */
+int GetTxPosHeight(const CDiskTxPos &txPos);
 /** Connect/disconnect blocks until pindexNew is the new tip of the active block chain */
 bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew);
 /** Find the best known block, and make it the tip of the block chain */
@@ -258,6 +309,29 @@ struct CDiskTxPos : public CDiskBlockPos
     }
 };
 
+/** Height and hash of the block that confirmed a transaction, kept next to
+ *  its CDiskTxPos so callers need not read the block to learn its height */
+struct CDiskTxHeight
+{
+    int nHeight;
+    uint256 hashBlock;
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(VARINT(nHeight));
+        READWRITE(hashBlock);
+    )
+
+    CDiskTxHeight(int nHeightIn, const uint256 &hashBlockIn) : nHeight(nHeightIn), hashBlock(hashBlockIn) {
+    }
+
+    CDiskTxHeight() {
+        SetNull();
+    }
+
+    void SetNull() { nHeight = -1; hashBlock = 0; }
+    bool IsNull() const { return (nHeight == -1); }
+};
+
 
 /** An inpoint - a combination of a transaction and an index n into its vin */
 class CInPoint
@@ -471,6 +545,34 @@ enum GetMinFee_mode
 };
 
 int64 GetFeeAssign();
+
+class COffer;
+class CCertIssuer;
+
+/** An alias, offer or cert script among a transaction's outputs, as the
+ *  Decode*Tx functions return it */
+class CServiceOp
+{
+public:
+    bool fDecoded; // what Decode*Tx returned
+    int op;
+    int nOut;
+    std::vector<std::vector<unsigned char> > vvch;
+
+    CServiceOp() : fDecoded(false), op(0), nOut(-1) {}
+};
+
+/** The service scripts of a transaction and the offer or cert it carries */
+class CServiceOps
+{
+public:
+    CServiceOp alias;
+    CServiceOp offer;
+    CServiceOp cert;
+    boost::shared_ptr<const COffer> poffer;           // set with offer.fDecoded
+    boost::shared_ptr<const CCertIssuer> pcertissuer; // set with cert.fDecoded
+};
+
 /** The basic transaction that is broadcasted on the network and contained in
  * blocks. A transaction can contain multiple inputs and outputs.
  */
@@ -485,6 +587,10 @@ public:
     std::vector<CTxOut> vout;
     unsigned int nLockTime;
     std::vector<unsigned char> data;
+
+    // (memory only) decoded by GetServiceOps, shared by copies
+    mutable boost::shared_ptr<const CServiceOps> pserviceops;
+
     CTransaction()
     {
         SetNull();
@@ -492,6 +598,8 @@ public:
 
     IMPLEMENT_SERIALIZE
     (
+        if (fRead)
+            pserviceops.reset();
         READWRITE(this->nVersion);
         nVersion = this->nVersion;
         READWRITE(vin);
@@ -508,6 +616,7 @@ public:
         vout.clear();
         nLockTime = 0;
         data.clear();
+        pserviceops.reset();
     }
 
     bool IsNull() const
@@ -515,6 +624,11 @@ public:
         return (vin.empty() && vout.empty());
     }
 
+    // The alias, offer and cert scripts of this transaction and the offer or
+    // cert it carries, decoded on the first call and kept with it. Only for
+    // transactions that are done changing: received, read or pooled ones.
+    const CServiceOps &GetServiceOps() const;
+
     uint256 GetHash() const
     {
         return SerializeHash(*this);
@@ -1160,6 +1274,60 @@ public:
     }
 };
 
+/** Closure hashing a group of proof-of-work headers, each a block's own or
+ *  the parent header of its auxpow, ahead of the blocks being checked. The
+ *  group goes through the multi-lane scrypt kernel together and the hashes
+ *  only go to the cache behind GetPoWHash; CheckProofOfWork still judges them.
+ *  Note that this stores references to the headers */
+class CPoWCheck
+{
+private:
+    std::vector<const CBlockHeader *> vpheader;
+
+public:
+    CPoWCheck() {}
+    CPoWCheck(const std::vector<const CBlockHeader *> &vpheaderIn) : vpheader(vpheaderIn) {}
+
+    bool operator()() const;
+
+    void swap(CPoWCheck &check) {
+        vpheader.swap(check.vpheader);
+    }
+};
+
+/** Closure reading ahead what connecting a block is going to look up: the
+ *  coins of a transaction from a view taking concurrent reads, into *pcoins
+ *  with *pfFound telling whether there were any, or a service record into
+ *  the preload of its database. */
+class CPrefetchCheck
+{
+private:
+    CCoinsView *pcoinsview;
+    uint256 hash;
+    CCoins *pcoins;
+    char *pfFound;
+    CServiceDB *pservicedb;
+    std::string strKey;
+
+public:
+    CPrefetchCheck() : pcoinsview(NULL), pcoins(NULL), pfFound(NULL), pservicedb(NULL) {}
+    CPrefetchCheck(CCoinsView *pcoinsviewIn, const uint256 &hashIn, CCoins *pcoinsIn, char *pfFoundIn) :
+        pcoinsview(pcoinsviewIn), hash(hashIn), pcoins(pcoinsIn), pfFound(pfFoundIn), pservicedb(NULL) {}
+    CPrefetchCheck(CServiceDB *pservicedbIn, const std::string &strKeyIn) :
+        pcoinsview(NULL), pcoins(NULL), pfFound(NULL), pservicedb(pservicedbIn), strKey(strKeyIn) {}
+
+    bool operator()() const;
+
+    void swap(CPrefetchCheck &check) {
+        std::swap(pcoinsview, check.pcoinsview);
+        std::swap(hash, check.hash);
+        std::swap(pcoins, check.pcoins);
+        std::swap(pfFound, check.pfFound);
+        std::swap(pservicedb, check.pservicedb);
+        strKey.swap(check.strKey);
+    }
+};
+
 /** A transaction with a merkle branch linking it to the block chain. */
 class CMerkleTx : public CTransaction
 {
@@ -1374,12 +1542,8 @@ public:
         return nVersion / BLOCK_VERSION_CHAIN_START;
     }
 
-    uint256 GetPoWHash() const
-    {
-        uint256 thash;
-        scrypt_1024_1_1_256(BEGIN(nVersion), BEGIN(thash));
-        return thash;
-    }
+    // scrypt hash of the header, remembered for recently hashed headers
+    uint256 GetPoWHash() const;
 	
     void SetAuxPow(CAuxPow* pow);
 
@@ -1726,7 +1890,8 @@ public:
     // Byte offset within rev?????.dat where this block's undo data is stored
     unsigned int nUndoPos;
 
-    // (memory only) Total amount of work (expected number of hashes) in the chain up to and including this block
+    // Total amount of work (expected number of hashes) in the chain up to and including this block.
+    // Stored with the block index since CHAINWORK_VERSION, 0 when read from an older record
     uint256 nChainWork;
 
     // Number of transactions in this block.
@@ -1739,6 +1904,9 @@ public:
     // Verification status of this block. See enum BlockStatus
     unsigned int nStatus;
 
+    // (memory only) nBits required of a block on top of this one, 0 until computed
+    mutable unsigned int nNextBits;
+
     // block header
     int nVersion;
     uint256 hashMerkleRoot;
@@ -1760,6 +1928,7 @@ public:
         nTx = 0;
         nChainTx = 0;
         nStatus = 0;
+        nNextBits = 0;
 
         nVersion       = 0;
         hashMerkleRoot = 0;
@@ -1768,7 +1937,7 @@ public:
         nNonce         = 0;
     }
 
-    CBlockIndex(CBlockHeader& block)
+    CBlockIndex(const CBlockHeader& block)
     {
         phashBlock = NULL;
         pprev = NULL;
@@ -1781,6 +1950,7 @@ public:
         nTx = 0;
         nChainTx = 0;
         nStatus = 0;
+        nNextBits = 0;
 
         nVersion       = block.nVersion;
         hashMerkleRoot = block.hashMerkleRoot;
@@ -1803,6 +1973,8 @@ public:
             READWRITE(VARINT(nDataPos));
         if (nStatus & BLOCK_HAVE_UNDO)
             READWRITE(VARINT(nUndoPos));
+        if (nVersion >= CHAINWORK_VERSION)
+            READWRITE(nChainWork);
     )
 
     CDiskBlockPos GetBlockPos() const {
@@ -1835,13 +2007,18 @@ public:
         return (int64)nTime;
     }
 
-    CBigNum GetBlockWork() const
+    uint256 GetBlockWork() const
     {
-        CBigNum bnTarget;
-        bnTarget.SetCompact(nBits);
-        if (bnTarget <= 0)
+        uint256 bnTarget;
+        bool fNegative, fOverflow;
+        bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
+        if (fNegative || fOverflow || bnTarget == 0)
             return 0;
-        return (CBigNum(1)<<256) / (bnTarget+1);
+        // 2**256 / (bnTarget+1) does not fit in 256 bits, but it is equal
+        // to ((2**256 - bnTarget - 1) / (bnTarget+1)) + 1, which does
+        uint256 bnWork = ~bnTarget;
+        bnWork /= bnTarget + 1;
+        return bnWork + 1;
     }
 
     bool IsInMainChain() const
@@ -1922,23 +2099,20 @@ struct CBlockIndexWorkComparator
 
 
 
-/** Used to marshal pointers into hashes for db storage. */
+/** Used to marshal pointers into hashes for db storage. The auxpow of a
+ *  merge-mined block is not part of it, CBlockTreeDB keeps it apart so that
+ *  loading the index does not read every proof. */
 class CDiskBlockIndex : public CBlockIndex
 {
 public:
     uint256 hashPrev;
 
-    // if this is an aux work block
-    boost::shared_ptr<CAuxPow> auxpow;
-
     CDiskBlockIndex() {
         hashPrev = 0;
-        auxpow.reset();
     }
 
-    explicit CDiskBlockIndex(CBlockIndex* pindex, boost::shared_ptr<CAuxPow> auxpow) : CBlockIndex(*pindex) {
+    explicit CDiskBlockIndex(CBlockIndex* pindex) : CBlockIndex(*pindex) {
         hashPrev = (pprev ? pprev->GetBlockHash() : 0);
-        this->auxpow = auxpow;
     }
 
     IMPLEMENT_SERIALIZE
@@ -1958,7 +2132,6 @@ public:
         READWRITE(nTime);
         READWRITE(nBits);
         READWRITE(nNonce);
-        ReadWriteAuxPow(s, auxpow, nType, this->nVersion, ser_action);
     )
 
     uint256 CalcBlockHash() const
@@ -2184,12 +2357,66 @@ public:
 
 
 
+/** What a pending service transaction is indexed by in the memory pool */
+enum ServiceKeyType
+{
+    SERVICE_ALIAS,          // alias name, or the hash of an aliasnew
+    SERVICE_OFFER,          // offer guid, or the hash of an offernew
+    SERVICE_OFFER_ACCEPT,   // offer accept guid
+    SERVICE_CERT_ISSUER,    // cert issuer guid, or the hash of a certissuernew
+    SERVICE_CERT_ITEM       // certificate guid
+};
+
+typedef std::pair<int, std::vector<unsigned char> > CServiceKey;
+
+/** The service key of a syscoin transaction, false for other transactions */
+bool GetServiceKey(const CTransaction &tx, CServiceKey &key);
+
+/** What block assembly needs to know of a pooled transaction. It is worked
+ *  out from the inputs once and kept with the pool between templates.
+ */
+class CTxMemPoolEntry
+{
+public:
+    unsigned int nTxSize;
+    int64 nFee;
+    std::vector<std::pair<int64, int> > vInChain; // value and height of inputs in the chain
+    std::set<uint256> setDependsOn;               // inputs still in the pool
+    double dPriority;
+    double dFeePerKb;
+    int nChecked;   // CheckInputs on the current tip: 0 not run, 1 passed, -1 failed
+    std::vector<std::vector<unsigned char> > vvchTestPool; // service names a passing check took
+
+    CTxMemPoolEntry() : nTxSize(0), nFee(0), dPriority(0), dFeePerKb(0), nChecked(0) {}
+
+    // Priority is sum(valuein * age) / txsize for a block on top of nHeight
+    double GetPriority(int nHeight) const
+    {
+        double dResult = 0;
+        for (unsigned int i = 0; i < vInChain.size(); i++)
+            dResult += (double) vInChain[i].first * (nHeight - vInChain[i].second + 1);
+        return dResult / nTxSize;
+    }
+};
+
 class CTxMemPool
 {
 public:
     mutable CCriticalSection cs;
     std::map<uint256, CTransaction> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    std::map<CServiceKey, std::set<uint256> > mapServiceTx;
+
+    // Block assembly index, brought up to date by UpdateEntries
+    typedef std::pair<std::pair<double, double>, uint256> CEntryKey;
+    std::map<uint256, CTxMemPoolEntry> mapEntry;
+    std::set<uint256> setEntryNew;          // added or stale since the last update
+    std::set<CEntryKey> setByPriority;      // (priority, fee per kb)
+    std::set<CEntryKey> setByFee;           // (fee per kb, priority)
+    CBlockIndex *pindexEntries;
+    int nEntriesHeight;
+
+    CTxMemPool() : pindexEntries(NULL), nEntriesHeight(-1) {}
 
     bool accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs);
     bool addUnchecked(const uint256& hash, const CTransaction &tx);
@@ -2198,6 +2425,8 @@ public:
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins &coins);
+    void UpdateEntries(CBlockIndex *pindexPrev, CCoinsViewCache &view);
+    void removeEntry(const uint256 &hash);
 
     unsigned long size()
     {
@@ -2214,6 +2443,18 @@ public:
     {
         return mapTx[hash];
     }
+
+    // the pooled transactions pending on a service name or guid
+    bool GetServiceTxs(int nType, const std::vector<unsigned char> &vchName, std::set<uint256> &setHash)
+    {
+        LOCK(cs);
+        std::map<CServiceKey, std::set<uint256> >::const_iterator mi = mapServiceTx.find(CServiceKey(nType, vchName));
+        if (mi == mapServiceTx.end())
+            setHash.clear();
+        else
+            setHash = mi->second;
+        return !setHash.empty();
+    }
 };
 
 extern CTxMemPool mempool;
@@ -2275,6 +2516,7 @@ public:
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
     void SetBackend(CCoinsView &viewIn);
+    CCoinsView &GetBackend() { return *base; }
     bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
 };
@@ -2309,6 +2551,13 @@ public:
     // Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize();
 
+    // Whether the coins of txid are in this cache, without fetching them
+    bool HaveCoinsInCache(const uint256 &txid) const;
+
+    // Take coins read from the base view into the cache, unless it holds
+    // them already. Leaves coins empty.
+    void CacheCoins(const uint256 &txid, CCoins &coins);
+
 private:
     std::map<uint256,CCoins>::iterator FetchCoins(const uint256 &txid);
 };
@@ -2332,6 +2581,23 @@ extern CCoinsViewCache *pcoinsTip;
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
+/** Changes to the alias, offer and cert databases and their fee windows made
+ *  while it is in scope are dropped unless Commit() is called, as with an
+ *  unflushed CCoinsViewCache */
+class CServiceTxn
+{
+private:
+    bool fCommitted;
+    CFeeWindow::CSnapshot aliasFees;
+    CFeeWindow::CSnapshot offerFees;
+    CFeeWindow::CSnapshot certFees;
+
+public:
+    CServiceTxn();
+    ~CServiceTxn();
+    void Commit();
+};
+
 struct CBlockTemplate
 {
     CBlock block;
@@ -2374,4 +2640,84 @@ public:
     )
 };
 
+
+/** Used to relay blocks as header + short transaction ids to peers that
+ * already hold most of the transactions in their memory pool, so the large
+ * data fields of a block's transactions cross the link once, as "tx".
+ * The ids are salted with a nonce picked per message, which keeps them from
+ * being ground to collide ahead of time.
+ */
+class CCompactBlock
+{
+public:
+    CBlockHeader header;
+    uint64 nNonce;
+    // one for every transaction not prefilled, in block order
+    std::vector<uint64> vShortId;
+    // transactions sent in full with their index in the block, ascending;
+    // always the coinbase, and what the peer is not known to have
+    std::vector<std::pair<unsigned int, CTransaction> > vPrefilled;
+
+    CCompactBlock() : nNonce(0) {}
+
+    // Prefill the coinbase and, given pto, the transactions it has neither
+    // announced to us nor been sent an inventory for
+    CCompactBlock(const CBlock& block, CNode* pto = NULL);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header);
+        READWRITE(nNonce);
+        READWRITE(vShortId);
+        READWRITE(vPrefilled);
+    )
+
+    // hash of the block and nNonce that every short id is keyed with
+    uint256 GetSalt() const;
+    static uint64 GetShortId(const uint256& hashSalt, const uint256& txid);
+
+    unsigned int GetTxCount() const
+    {
+        return vShortId.size() + vPrefilled.size();
+    }
+
+    // Lay out the block with the prefilled transactions and those of pool
+    // that match a short id; vMissing gets the indexes still empty, where no
+    // or more than one pool transaction matched. False if the prefilled
+    // indexes are out of order or out of range.
+    bool FillBlock(CBlock& block, std::vector<unsigned int>& vMissing, CTxMemPool& pool) const;
+};
+
+/** Request for the transactions of a compact block that could not be found
+ * in the memory pool ("getblocktxn"), by index in the block.
+ */
+class CBlockTxnRequest
+{
+public:
+    uint256 hash;
+    std::vector<unsigned int> vIndex;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hash);
+        READWRITE(vIndex);
+    )
+};
+
+/** Answer to a CBlockTxnRequest ("blocktxn"), the transactions in the order
+ * they were asked for.
+ */
+class CBlockTxn
+{
+public:
+    uint256 hash;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hash);
+        READWRITE(vtx);
+    )
+};
+
 #endif
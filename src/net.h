@@ -214,6 +214,11 @@ public:
     int nStartingHeight;
     bool fStartSync;
 
+    // headers-first sync, under cs_main: the best height the node is known
+    // to have and the blocks asked of it
+    int nBestKnownHeight;
+    std::set<uint256> setBlocksInFlight;
+
     // flood relay
     std::vector<CAddress> vAddrToSend;
     std::set<CAddress> setAddrKnown;
@@ -256,6 +261,7 @@ public:
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
         fStartSync = false;
+        nBestKnownHeight = -1;
         fGetAddr = false;
         nMisbehavior = 0;
         fRelayTxes = false;
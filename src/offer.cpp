@@ -18,9 +18,7 @@ template<typename T> void ConvertTo(Value& value, bool fAllowNull = false);
 
 std::map<std::vector<unsigned char>, uint256> mapMyOffers;
 std::map<std::vector<unsigned char>, uint256> mapMyOfferAccepts;
-std::map<std::vector<unsigned char>, std::set<uint256> > mapOfferPending;
-std::map<std::vector<unsigned char>, std::set<uint256> > mapOfferAcceptPending;
-std::list<COfferFee> lstOfferFees;
+CFeeWindow offerFeeWindow(360 * 12);
 
 #ifdef GUI
 extern std::map<uint160, std::vector<unsigned char> > mapMyOfferHashes;
@@ -170,13 +168,11 @@ bool COfferDB::ScanOffers(const std::vector<unsigned char>& vchOffer, unsigned i
                 ssKey >> vchOffer;
                 leveldb::Slice slValue = pcursor->value();
                 CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                vector<COffer> vtxPos;
-                ssValue >> vtxPos;
-                COffer txPos;
-                if (!vtxPos.empty())
-                    txPos = vtxPos.back();
-                offerScan.push_back(make_pair(vchOffer, txPos));
-            }
+                CServiceVersion<COffer> head;
+                ssValue >> head;
+                offerScan.push_back(make_pair(vchOffer, head.value));
+            } else
+                break;
             if (offerScan.size() >= nMax)
                 break;
 
@@ -189,113 +185,365 @@ bool COfferDB::ScanOffers(const std::vector<unsigned char>& vchOffer, unsigned i
     return true;
 }
 
-/**
- * [COfferDB::ReconstructOfferIndex description]
- * @param  pindexRescan [description]
- * @return              [description]
- */
-bool COfferDB::ReconstructOfferIndex(CBlockIndex *pindexRescan) {
-    CBlockIndex* pindex = pindexRescan;
-    
-    {
-	TRY_LOCK(pwalletMain->cs_wallet, cs_trylock);
+// height at which an offer last updated at nHeight expires
+static int64 GetOfferExpiryHeight(int64 nHeight) {
+    return nHeight + GetOfferDisplayExpirationDepth(nHeight);
+}
 
-	uint64 startHeight = pindexRescan->nHeight;
-	while(pindex->pnext != NULL) pindex = pindex->pnext;
-	uint64 endHeight = pindex->nHeight;
+bool COfferDB::WriteOffer(const vector<unsigned char>& name, const COffer& offer) {
+    COffer offerOld;
+    if (ReadOffer(name, offerOld)) {
+        EraseOfferSearch(name, offerOld);
+        EraseExpiry(string("offerx"), GetOfferExpiryHeight(offerOld.nHeight), name);
+    }
+    WriteOfferSearch(name, offer);
+    return PutVersion(string("offeri"), string("offerh"), name, offer.nHeight, offer)
+        && WriteExpiry(string("offerx"), GetOfferExpiryHeight(offer.nHeight), name);
+}
 
-	BOOST_FOREACH(COfferFee &oFee, lstOfferFees) {
-		if (oFee.nHeight >= startHeight && oFee.nHeight < endHeight) {
-			oFee.nFee = 0;
-			break;
-		}
-	}
+bool COfferDB::PopOffer(const vector<unsigned char>& name, const uint256& txHash) {
+    CServiceVersion<COffer> head;
+    if (!ReadHead(string("offeri"), name, head) || head.value.txHash != txHash)
+        return true;
+    EraseOfferSearch(name, head.value);
+    EraseExpiry(string("offerx"), GetOfferExpiryHeight(head.value.nHeight), name);
+    if (!PopVersion(string("offeri"), string("offerh"), name, head))
+        return false;
+    COffer offer;
+    if (ReadOffer(name, offer)) {
+        WriteOfferSearch(name, offer);
+        return WriteExpiry(string("offerx"), GetOfferExpiryHeight(offer.nHeight), name);
+    }
+    return true;
+}
 
-    CBlockIndex* pindex = pindexRescan;
-    while (pindex) {  
+bool COfferDB::EraseOffer(const vector<unsigned char>& name) {
+    COffer offerOld;
+    if (ReadOffer(name, offerOld)) {
+        EraseOfferSearch(name, offerOld);
+        EraseExpiry(string("offerx"), GetOfferExpiryHeight(offerOld.nHeight), name);
+    }
+    return EraseHistory(string("offeri"), string("offerh"), name);
+}
 
-        int nHeight = pindex->nHeight;
-        CBlock block;
-        block.ReadFromDisk(pindex);
-        uint256 txblkhash;
-        
-        BOOST_FOREACH(CTransaction& tx, block.vtx) {
+static bool CompareOfferHeight(const COffer &a, const COffer &b) {
+    return a.nHeight < b.nHeight;
+}
 
-            if (tx.nVersion != SYSCOIN_TX_VERSION)
-                continue;
+bool COfferDB::UpgradeOfferHistory() {
+    int nVersion = 0;
+    if (Read(make_pair(string("offera"), string("offerhist")), nVersion) && nVersion >= 1)
+        return true;
 
-            vector<vector<unsigned char> > vvchArgs;
-            int op, nOut;
+    printf("Moving offer records to versions...\n");
+    leveldb::Iterator *pcursor = NewIterator();
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair(string("offeri"), vector<unsigned char>());
+    pcursor->Seek(ssKeySet.str());
 
-            // decode the offer op, params, height
-            bool o = DecodeOfferTx(tx, op, nOut, vvchArgs, nHeight);
-            if (!o || !IsOfferOp(op)) continue;
-            
-            if (op == OP_OFFER_NEW) continue;
+    unsigned int nOffers = 0;
+    while (pcursor->Valid()) {
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            string strType;
+            ssKey >> strType;
+            if (strType != "offeri")
+                break;
+            vector<unsigned char> vchOffer;
+            ssKey >> vchOffer;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            vector<COffer> vtxPos;
+            ssValue >> vtxPos;
+            stable_sort(vtxPos.begin(), vtxPos.end(), CompareOfferHeight);
+            Erase(make_pair(string("offeri"), vchOffer));
+            BOOST_FOREACH(const COffer &offer, vtxPos)
+                PutVersion(string("offeri"), string("offerh"), vchOffer, offer.nHeight, offer);
+            nOffers++;
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+        pcursor->Next();
+    }
+    delete pcursor;
+
+    // all in one batch, so the upgrade is never left half done
+    if (!Write(make_pair(string("offera"), string("offerhist")), 1))
+        return false;
+    printf("Offer records moved: %u offers\n", nOffers);
+    return Flush();
+}
+
+bool COfferDB::BuildOfferSearch() {
+    int nVersion = 0;
+    if (Read(make_pair(string("offera"), string("offersrch")), nVersion) && nVersion >= 1)
+        return true;
+
+    printf("Building offer search indexes...\n");
+    vector<unsigned char> vchOffer;
+    vector<pair<vector<unsigned char>, COffer> > offerScan;
+    if (!ScanOffers(vchOffer, 100000000, offerScan))
+        return error("BuildOfferSearch() : scan failed");
+    pair<vector<unsigned char>, COffer> pairScan;
+    BOOST_FOREACH(pairScan, offerScan)
+        if (!pairScan.second.IsNull())
+            WriteOfferSearch(pairScan.first, pairScan.second);
+    if (!Write(make_pair(string("offera"), string("offersrch")), 1))
+        return false;
+    printf("Offer search indexes: %"PRIszu" offers\n", offerScan.size());
+    return Flush();
+}
+
+bool COfferDB::BuildOfferExpiry() {
+    int nVersion = 0;
+    if (Read(make_pair(string("offera"), string("offerexp")), nVersion) && nVersion >= 1)
+        return true;
+
+    printf("Building offer expiry index...\n");
+    vector<unsigned char> vchOffer;
+    vector<pair<vector<unsigned char>, COffer> > offerScan;
+    if (!ScanOffers(vchOffer, 100000000, offerScan))
+        return error("BuildOfferExpiry() : scan failed");
+    pair<vector<unsigned char>, COffer> pairScan;
+    BOOST_FOREACH(pairScan, offerScan)
+        WriteExpiry(string("offerx"), GetOfferExpiryHeight(pairScan.second.nHeight), pairScan.first);
+    if (!Write(make_pair(string("offera"), string("offerexp")), 1))
+        return false;
+    printf("Offer expiry index: %"PRIszu" offers\n", offerScan.size());
+    return Flush();
+}
+
+bool COfferDB::ScanOffersSince(int nHeight, vector<pair<vector<unsigned char>, COffer> >& offerScan) {
+    // the expiry height only grows with the update height
+    return ReadHeadsExpiring(string("offeri"), string("offerx"),
+            GetOfferExpiryHeight(max(nHeight, 0)), offerScan);
+}
+
+unsigned int COfferDB::PruneOffers(int nPruneHeight, unsigned int nMax) {
+    vector<vector<unsigned char> > vchOffers;
+    if (!ReadExpiring(string("offerx"), 0, nPruneHeight + 1, vchOffers, nMax))
+        return 0;
+
+    unsigned int nPruned = 0;
+    BOOST_FOREACH(const vector<unsigned char> &vchOffer, vchOffers) {
+        COffer offer;
+        if (!ReadOffer(vchOffer, offer))
+            continue;
+        if ((int64)nPruneHeight - (int64)offer.nHeight <= (int64)GetOfferExpirationDepth(nPruneHeight))
+            continue;
+        // the latest version and the accepts stay, an offerpay can still
+        // refer to them. The older versions and the index entries go.
+        EraseOfferSearch(vchOffer, offer);
+        EraseExpiry(string("offerx"), GetOfferExpiryHeight(offer.nHeight), vchOffer);
+        if (CompactHistory<COffer>(string("offeri"), string("offerh"), vchOffer))
+            nPruned++;
+    }
+    return nPruned;
+}
+
+bool COfferDB::ScanOfferSearch(const string& strPrefix, const string& strStart, const string& strEnd,
+        unsigned int nMax, vector<vector<unsigned char> >& vchOffers, string& strNext) {
+    strNext.clear();
+    leveldb::Iterator *pcursor = NewIterator();
+    pcursor->Seek(strStart);
+
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        leveldb::Slice slKey = pcursor->key();
+        string strKey(slKey.data(), slKey.size());
+        if (strKey.compare(0, strPrefix.size(), strPrefix) != 0
+                || (!strEnd.empty() && strKey >= strEnd))
+            break;
+        if (vchOffers.size() >= nMax) {
+            strNext = strKey;
+            break;
+        }
+        try {
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            vector<unsigned char> vchOffer;
+            ssValue >> vchOffer;
+            vchOffers.push_back(vchOffer);
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+        pcursor->Next();
+    }
+    delete pcursor;
+    return true;
+}
+
+bool COfferDB::PutOfferAccept(const vector<unsigned char>& vchOffer, COffer& offer, const COfferAccept& accept) {
+    COfferAccept acceptOld;
+    if (ReadOfferAcceptRecord(vchOffer, accept.vchRand, acceptOld))
+        offer.nQtyAccepted -= acceptOld.nQty;
+    offer.nQtyAccepted += accept.nQty;
+    return WriteOfferAcceptRecord(vchOffer, accept);
+}
+
+static bool CompareAcceptHeight(const COfferAccept &a, const COfferAccept &b) {
+    return a.nHeight < b.nHeight;
+}
+
+bool COfferDB::ReadOfferAccepts(const vector<unsigned char>& vchOffer, vector<COfferAccept>& vAccepts) {
+    vAccepts.clear();
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair(string("offeracc"), vchOffer);
+    string strPrefix = ssKeySet.str();
+    leveldb::Iterator *pcursor = NewIterator();
+    pcursor->Seek(strPrefix);
+
+    while (pcursor->Valid()) {
+        leveldb::Slice slKey = pcursor->key();
+        if (!slKey.starts_with(strPrefix))
+            break;
+        try {
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            COfferAccept accept;
+            ssValue >> accept;
+            vAccepts.push_back(accept);
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+        pcursor->Next();
+    }
+    delete pcursor;
+    stable_sort(vAccepts.begin(), vAccepts.end(), CompareAcceptHeight);
+    return true;
+}
+
+bool COfferDB::UpgradeOfferAccepts() {
+    int nVersion = 0;
+    if (Read(make_pair(string("offera"), string("offeracc")), nVersion) && nVersion >= 1)
+        return true;
+
+    printf("Moving offer accepts to records of their own...\n");
+    leveldb::Iterator *pcursor = NewIterator();
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair(string("offeri"), vector<unsigned char>());
+    pcursor->Seek(ssKeySet.str());
+
+    unsigned int nOffers = 0, nAccepts = 0;
+    while (pcursor->Valid()) {
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            string strType;
+            ssKey >> strType;
+            if (strType != "offeri")
+                break;
+            vector<unsigned char> vchOffer;
+            ssKey >> vchOffer;
 
-            vector<unsigned char> vchOffer = vvchArgs[0];
+            // records of older versions still hold the accepts, as in the network form
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_NETWORK, CLIENT_VERSION);
+            vector<COffer> vtxPos;
+            ssValue >> vtxPos;
+            BOOST_FOREACH(COffer &offer, vtxPos) {
+                offer.nQtyAccepted = 0;
+                BOOST_FOREACH(const COfferAccept &accept, offer.accepts) {
+                    offer.nQtyAccepted += accept.nQty;
+                    WriteOfferAcceptRecord(vchOffer, accept);
+                    nAccepts++;
+                }
+                offer.accepts.clear();
+            }
+            Write(make_pair(string("offeri"), vchOffer), vtxPos);
+            nOffers++;
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+        pcursor->Next();
+    }
+    delete pcursor;
+
+    // all in one batch, so the upgrade is never left half done
+    if (!Write(make_pair(string("offera"), string("offeracc")), 1))
+        return false;
+    printf("Offer accepts moved: %u offers, %u accepts\n", nOffers, nAccepts);
+    return Flush();
+}
+
+/**
+ * [COfferDB::ReconstructOfferIndex description]
+ * @param  pindex [main chain block index]
+ * @param  block  [the block read from disk]
+ * @return        [description]
+ */
+bool COfferDB::ReconstructOfferIndex(CBlockIndex *pindex, const CBlock &block) {
+    int nHeight = pindex->nHeight;
+
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+
+        if (tx.nVersion != SYSCOIN_TX_VERSION)
+            continue;
+
+        vector<vector<unsigned char> > vvchArgs;
+        int op, nOut;
+
+        // decode the offer op, params, height
+        bool o = DecodeOfferTx(tx, op, nOut, vvchArgs, nHeight);
+        if (!o || !IsOfferOp(op)) continue;
         
-            // get the transaction
-            if(!GetTransaction(tx.GetHash(), tx, txblkhash, true))
-                continue;
+        if (op == OP_OFFER_NEW) continue;
 
-            // attempt to read offer from txn
-            COffer txOffer;
-            COfferAccept txCA;
-            if(!txOffer.UnserializeFromTx(tx))
+        vector<unsigned char> vchOffer = vvchArgs[0];
+
+        // attempt to read offer from txn
+        COffer txOffer;
+        COfferAccept txCA;
+        if(!txOffer.UnserializeFromTx(tx))
 				return error("ReconstructOfferIndex() : failed to unserialize offer from tx");
 
 			// save serialized offer
 			COffer serializedOffer = txOffer;
 
-            // read offer from DB if it exists
-            vector<COffer> vtxPos;
-            if (ExistsOffer(vchOffer)) {
-                if (!ReadOffer(vchOffer, vtxPos))
-                    return error("ReconstructOfferIndex() : failed to read offer from DB");
-                if(vtxPos.size()!=0) {
-                	txOffer.nHeight = nHeight;
-                	txOffer.GetOfferFromList(vtxPos);
-                }
-            }
+        // read offer from DB if it exists
+        if (ExistsOffer(vchOffer)) {
+            if (!ReadOfferAt(vchOffer, nHeight, txOffer))
+                return error("ReconstructOfferIndex() : failed to read offer from DB");
+        }
 
-            // read the offer accept from db if exists
-            if(op == OP_OFFER_ACCEPT || op == OP_OFFER_PAY) {
-            	bool bReadOffer = false;
-            	vector<unsigned char> vchOfferAccept = vvchArgs[1];
-	            if (ExistsOfferAccept(vchOfferAccept)) {
-	                if (!ReadOfferAccept(vchOfferAccept, vchOffer))
-	                    printf("ReconstructOfferIndex() : warning - failed to read offer accept from offer DB\n");
-	                else bReadOffer = true;
-	            }
-				if(!bReadOffer && !txOffer.GetAcceptByHash(vchOfferAccept, txCA))
+        // read the offer accept from db if exists
+        if(op == OP_OFFER_ACCEPT || op == OP_OFFER_PAY) {
+        	vector<unsigned char> vchOfferAccept = vvchArgs[1];
+				// the txn carries the accept, as CheckOfferInputs takes it
+				if(!serializedOffer.GetAcceptByHash(vchOfferAccept, txCA)
+						&& !ReadOfferAcceptRecord(vchOffer, vchOfferAccept, txCA))
 					printf("ReconstructOfferIndex() : failed to read offer accept from offer\n");
 
 				// add txn-specific values to offer accept object
-                txCA.vchRand = vvchArgs[1];
+            txCA.vchRand = vvchArgs[1];
 		        txCA.nTime = pindex->nTime;
 		        txCA.txHash = tx.GetHash();
 		        txCA.nHeight = nHeight;
-				txOffer.PutOfferAccept(txCA);
+				if (!PutOfferAccept(vchOffer, txOffer, txCA))
+					return error("ReconstructOfferIndex() : failed to write offer accept to offer DB");
 			}
 
 			// use the txn offer as master on updates,
 			// but grab the accepts from the DB first
 			if(op == OP_OFFER_UPDATE) {
-				serializedOffer.accepts = txOffer.accepts;
+				serializedOffer.nQtyAccepted = txOffer.nQtyAccepted;
 				txOffer = serializedOffer;
 			}
 
 			// txn-specific values to offer object
-            txOffer.vchRand = vvchArgs[0];
+        txOffer.vchRand = vvchArgs[0];
 			txOffer.txHash = tx.GetHash();
-            txOffer.nHeight = nHeight;
-            txOffer.nTime = pindex->nTime;
-            txOffer.PutToOfferList(vtxPos);
+        txOffer.nHeight = nHeight;
+        txOffer.nTime = pindex->nTime;
 
-            if (!WriteOffer(vchOffer, vtxPos))
-                return error("ReconstructOfferIndex() : failed to write to offer DB");
-            if(op == OP_OFFER_ACCEPT || op == OP_OFFER_PAY)
+        if (!WriteOffer(vchOffer, txOffer))
+            return error("ReconstructOfferIndex() : failed to write to offer DB");
+        if(op == OP_OFFER_ACCEPT || op == OP_OFFER_PAY)
 	            if (!WriteOfferAccept(vvchArgs[1], vvchArgs[0]))
 	                return error("ReconstructOfferIndex() : failed to write to offer DB");
 			
@@ -312,10 +560,6 @@ bool COfferDB::ReconstructOfferIndex(CBlockIndex *pindexRescan) {
 					tx.GetHash().ToString().c_str(), 
 					nHeight,
 					nTheFee);	            
-        }
-        pindex = pindex->pnext;
-        Flush();
-    }
     }
     return true;
 }
@@ -333,87 +577,36 @@ int CheckOfferTransactionAtRelativeDepth(CBlockIndex* pindexBlock,
 }
 
 int GetOfferTxHashHeight(const uint256 txHash) {
-	CDiskTxPos postx;
-	pblocktree->ReadTxIndex(txHash, postx);
-	return GetOfferTxPosHeight(postx);
+	return GetTxHeight(txHash);
 }
 
 uint64 GetOfferFeeSubsidy(unsigned int nHeight) {
-	uint64 hr1 = 1, hr12 = 1;
+	uint64 hr1, hr12;
 	{
 		TRY_LOCK(cs_main, cs_trymain);
-		unsigned int h12 = 360 * 12;
-		unsigned int nTargetTime = 0;
-		unsigned int nTarget1hrTime = 0;
-		unsigned int blk1hrht = nHeight - 1;
-		unsigned int blk12hrht = nHeight - 1;
-		bool bFound = false;
-
-		BOOST_FOREACH(COfferFee &nmFee, lstOfferFees) {
-			if(nmFee.nHeight <= nHeight)
-				bFound = true;
-			if(bFound) {
-				if(nTargetTime==0) {
-					hr1 = hr12 = 0;
-					nTargetTime = nmFee.nTime - h12;
-					nTarget1hrTime = nmFee.nTime - (h12/12);
-				}
-				if(nmFee.nTime > nTargetTime) {
-					hr12 += nmFee.nFee;
-					blk12hrht = nmFee.nHeight;
-					if(nmFee.nTime > nTarget1hrTime) {
-						hr1 += nmFee.nFee;
-						blk1hrht = nmFee.nHeight;
-					}
-				}
-			}
-		}
-		hr12 /= (nHeight - blk12hrht) + 1;
-		hr1 /= (nHeight - blk1hrht) + 1;
+		offerFeeWindow.GetAverages(nHeight, hr1, hr12);
 	}
 	uint64 nSubsidyOut = hr1 > hr12 ? hr1 : hr12;
 	return nSubsidyOut;
 }
 
 bool RemoveOfferFee(COfferFee &txnVal) {
-	{
-		TRY_LOCK(cs_main, cs_trymain);
-
-		COfferFee *theval = NULL;
-
-		BOOST_FOREACH(COfferFee &nmTxnValue, lstOfferFees) {
-			if (txnVal.hash == nmTxnValue.hash
-			 && txnVal.nHeight == nmTxnValue.nHeight) {
-				theval = &nmTxnValue;
-				break;
-			}
-		}
-		if(theval)
-			lstOfferFees.remove(*theval);
-
-		return theval != NULL;
-	}
+	TRY_LOCK(cs_main, cs_trymain);
+	return offerFeeWindow.Remove(txnVal.hash, txnVal.nHeight);
 }
 
 bool InsertOfferFee(CBlockIndex *pindex, uint256 hash, uint64 nValue) {
 	TRY_LOCK(cs_main, cs_trymain);
-	list<COfferFee> txnDup;
-	COfferFee oFee;
-	oFee.nTime = pindex->nTime;
-	oFee.nHeight = pindex->nHeight;
-	oFee.nFee = nValue;
-	bool bFound = false;
-	BOOST_FOREACH(COfferFee &nmFee, lstOfferFees) {
-		if (oFee.hash == nmFee.hash
-				&& oFee.nHeight == nmFee.nHeight) {
-			bFound = true;
-			break;
-		}
-	}
-	if (!bFound)
-		lstOfferFees.push_front(oFee);
+	// offer fees have always been tracked without their tx hash, so only the
+	// first fee at each height counts; the block subsidy depends on this
+	return offerFeeWindow.Insert(0, pindex->nHeight, pindex->nTime, nValue, false);
+}
 
-	return bFound;
+void SetOfferFees(const vector<COfferFee> &vFees) {
+	vector<CFeeWindowEntry> vEntries;
+	BOOST_FOREACH(const COfferFee &oFee, vFees)
+		vEntries.push_back(CFeeWindowEntry(oFee.hash, oFee.nHeight, oFee.nTime, oFee.nFee));
+	offerFeeWindow.SetEntries(vEntries);
 }
 
 int64 GetOfferNetFee(const CTransaction& tx) {
@@ -427,12 +620,10 @@ int64 GetOfferNetFee(const CTransaction& tx) {
 }
 
 int GetOfferHeight(vector<unsigned char> vchOffer) {
-	vector<COffer> vtxPos;
+	COffer txPos;
 	if (pofferdb->ExistsOffer(vchOffer)) {
-		if (!pofferdb->ReadOffer(vchOffer, vtxPos))
+		if (!pofferdb->ReadOffer(vchOffer, txPos))
 			return error("GetOfferHeight() : failed to read from offer DB");
-		if (vtxPos.empty()) return -1;
-		COffer& txPos = vtxPos.back();
 		return txPos.nHeight;
 	}
 	return -1;
@@ -581,11 +772,10 @@ bool GetValueOfOfferTxHash(const uint256 &txHash,
 
 bool GetValueOfOffer(COfferDB& dbOffer, const vector<unsigned char> &vchOffer,
 		vector<unsigned char>& vchValue, int& nHeight) {
-	vector<COffer> vtxPos;
-	if (!pofferdb->ReadOffer(vchOffer, vtxPos) || vtxPos.empty())
+	COffer txPos;
+	if (!pofferdb->ReadOffer(vchOffer, txPos))
 		return false;
 
-	COffer& txPos = vtxPos.back();
 	nHeight = txPos.nHeight;
 	vchValue = txPos.vchRand;
 	return true;
@@ -593,10 +783,9 @@ bool GetValueOfOffer(COfferDB& dbOffer, const vector<unsigned char> &vchOffer,
 
 bool GetTxOfOffer(COfferDB& dbOffer, const vector<unsigned char> &vchOffer,
 		CTransaction& tx) {
-	vector<COffer> vtxPos;
-	if (!pofferdb->ReadOffer(vchOffer, vtxPos) || vtxPos.empty())
+	COffer txPos;
+	if (!pofferdb->ReadOffer(vchOffer, txPos))
 		return false;
-	COffer& txPos = vtxPos.back();
 	int nHeight = txPos.nHeight;
 	if (nHeight + GetOfferExpirationDepth(pindexBest->nHeight)
 			< pindexBest->nHeight) {
@@ -614,11 +803,9 @@ bool GetTxOfOffer(COfferDB& dbOffer, const vector<unsigned char> &vchOffer,
 
 bool GetTxOfOfferAccept(COfferDB& dbOffer, const vector<unsigned char> &vchOfferAccept,
 		COffer &txPos, CTransaction& tx) {
-	vector<COffer> vtxPos;
 	vector<unsigned char> vchOffer;
 	if (!pofferdb->ReadOfferAccept(vchOfferAccept, vchOffer)) return false;
-	if (!pofferdb->ReadOffer(vchOffer, vtxPos)) return false;
-	txPos = vtxPos.back();
+	if (!pofferdb->ReadOffer(vchOffer, txPos)) return false;
 	int nHeight = txPos.nHeight;
 	if (nHeight + GetOfferExpirationDepth(pindexBest->nHeight)
 			< pindexBest->nHeight) {
@@ -1026,18 +1213,17 @@ bool CheckOfferInputs(CBlockIndex *pindexBlock, const CTransaction &tx,
 			return true;
 		}
 
-		vector<vector<unsigned char> > vvchArgs;
-		int op;
-		int nOut;
-		bool good = DecodeOfferTx(tx, op, nOut, vvchArgs, pindexBlock->nHeight);
-		if (!good)
+		const CServiceOps &ops = tx.GetServiceOps();
+		const vector<vector<unsigned char> > &vvchArgs = ops.offer.vvch;
+		int op = ops.offer.op;
+		if (!ops.offer.fDecoded)
 			return error("CheckOfferInputs() : could not decode a syscoin tx");
 		int nPrevHeight;
 		int nDepth;
 		int64 nNetFee;
 
 		// unserialize offer object from txn, check for valid
-		COffer theOffer(tx);
+		COffer theOffer(*ops.poffer);
 		COfferAccept theOfferAccept;
 		if (theOffer.IsNull())
 			error("CheckOfferInputs() : null offer object");
@@ -1250,11 +1436,11 @@ bool CheckOfferInputs(CBlockIndex *pindexBlock, const CTransaction &tx,
 		// save serialized offer for later use
 		COffer serializedOffer = theOffer;
 
-		// if not an offernew, load the offer data from the DB
-		vector<COffer> vtxPos;
+		// if not an offernew, make sure the offer data can be loaded from the DB
 		if(op != OP_OFFER_NEW)
 			if (pofferdb->ExistsOffer(vvchArgs[0])) {
-				if (!pofferdb->ReadOffer(vvchArgs[0], vtxPos))
+				COffer dbOffer;
+				if (!pofferdb->ReadOffer(vvchArgs[0], dbOffer))
 					return error(
 							"CheckOfferInputs() : failed to read from offer DB");
 			}
@@ -1277,13 +1463,13 @@ bool CheckOfferInputs(CBlockIndex *pindexBlock, const CTransaction &tx,
 
 					// get the latest offer from the db
                 	theOffer.nHeight = nHeight;
-                	theOffer.GetOfferFromList(vtxPos);
+                	pofferdb->ReadOfferAt(vvchArgs[0], nHeight, theOffer);
 					
 					// If update, we make the serialized offer the master
 					// but first we assign the accepts from the DB since
 					// they are not shipped in an update txn to keep size down
 					if(op == OP_OFFER_UPDATE) {
-						serializedOffer.accepts = theOffer.accepts;
+						serializedOffer.nQtyAccepted = theOffer.nQtyAccepted;
 						theOffer = serializedOffer;
 					}
 
@@ -1302,13 +1488,6 @@ bool CheckOfferInputs(CBlockIndex *pindexBlock, const CTransaction &tx,
 									theOfferAccept.nQty, 
 									theOffer.GetRemQty(), 
 									stringFromVch(theOfferAccept.vchRand).c_str());
-								{
-									TRY_LOCK(cs_main, cs_trymain);
-									std::map<std::vector<unsigned char>, std::set<uint256> >::iterator mi = 
-										mapOfferAcceptPending.find(vvchArgs[1]);
-									if (mi != mapOfferAcceptPending.end())
-										mi->second.erase(tx.GetHash());
-								}
 								return true;
 							}
 						} 
@@ -1318,7 +1497,7 @@ bool CheckOfferInputs(CBlockIndex *pindexBlock, const CTransaction &tx,
 							// this is one of the ways we validate that the accept
 							// can be fulfilled
 							COfferAccept ca;
-							if(!theOffer.GetAcceptByHash(vvchArgs[1], ca))
+							if(!pofferdb->ReadOfferAcceptRecord(vvchArgs[0], vvchArgs[1], ca))
 								return error("could not read accept from DB offer");
 							// if the accept exists in the database, great. 
 							// we don't need to use it, however, the serialized
@@ -1331,7 +1510,8 @@ bool CheckOfferInputs(CBlockIndex *pindexBlock, const CTransaction &tx,
 						theOfferAccept.txHash = tx.GetHash();
 						theOfferAccept.nTime = pindexBlock->nTime;
 						theOfferAccept.nHeight = nHeight;
-						theOffer.PutOfferAccept(theOfferAccept);
+						if (!pofferdb->PutOfferAccept(vvchArgs[0], theOffer, theOfferAccept))
+							return error( "CheckOfferInputs() : failed to write offer accept to offer DB");
 						mapTestPool[vvchArgs[1]] = tx.GetHash();
 
 						// write the offer / offer accept mapping to the database
@@ -1347,10 +1527,9 @@ bool CheckOfferInputs(CBlockIndex *pindexBlock, const CTransaction &tx,
                     theOffer.vchRand = vvchArgs[0];
 					theOffer.txHash = tx.GetHash();
 					theOffer.nTime = pindexBlock->nTime;
-					theOffer.PutToOfferList(vtxPos);
 
 					// write offer
-					if (!pofferdb->WriteOffer(vvchArgs[0], vtxPos))
+					if (!pofferdb->WriteOffer(vvchArgs[0], theOffer))
 						return error( "CheckOfferInputs() : failed to write to offer DB");
 					mapTestPool[vvchArgs[0]] = tx.GetHash();
 
@@ -1358,26 +1537,6 @@ bool CheckOfferInputs(CBlockIndex *pindexBlock, const CTransaction &tx,
                     int64 nTheFee = GetOfferNetFee(tx);
 					InsertOfferFee(pindexBlock, tx.GetHash(), nTheFee);
 					if(nTheFee > 0) printf("OFFER FEES: Added %lf in fees to track for regeneration.\n", (double) nTheFee / COIN);
-					vector<COfferFee> vOfferFees(lstOfferFees.begin(), lstOfferFees.end());
-					if (!pofferdb->WriteOfferTxFees(vOfferFees))
-						return error( "CheckOfferInputs() : failed to write fees to offer DB");
-
-					// remove offer from pendings
-					// activate or update - seller txn
-                    if (op == OP_OFFER_ACTIVATE || op == OP_OFFER_UPDATE) {
-						vector<unsigned char> vchOffer = op == OP_OFFER_NEW ? vchFromString(HexStr(vvchArgs[0])) : vvchArgs[0];
-						TRY_LOCK(cs_main, cs_trymain);
-						std::map<std::vector<unsigned char>, std::set<uint256> >::iterator mi = mapOfferPending.find(vchOffer);
-						if (mi != mapOfferPending.end())
-							mi->second.erase(tx.GetHash());
-					}
-					// accept or pay - buyer txn
-					else {
-						TRY_LOCK(cs_main, cs_trymain);
-						std::map<std::vector<unsigned char>, std::set<uint256> >::iterator mi = mapOfferAcceptPending.find(vvchArgs[1]);
-						if (mi != mapOfferAcceptPending.end())
-							mi->second.erase(tx.GetHash());
-					}
 
 					// debug
 					printf( "CONNECTED OFFER: op=%s offer=%s title=%s qty=%llu hash=%s height=%d fees=%llu\n",
@@ -1423,21 +1582,8 @@ bool ExtractOfferAddress(const CScript& script, string& address) {
 	return true;
 }
 
-void rescanforoffers(CBlockIndex *pindexRescan) {
-    printf("Scanning blockchain for offers to create fast index...\n");
-    pofferdb->ReconstructOfferIndex(pindexRescan);
-}
-
 int GetOfferTxPosHeight(const CDiskTxPos& txPos) {
-    // Read block header
-    CBlock block;
-    if (!block.ReadFromDisk(txPos)) return 0;
-    // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
-    if (mi == mapBlockIndex.end()) return 0;
-    CBlockIndex* pindex = (*mi).second;
-    if (!pindex || !pindex->IsInMainChain()) return 0;
-    return pindex->nHeight;
+    return GetTxPosHeight(txPos);
 }
 
 int GetOfferTxPosHeight2(const CDiskTxPos& txPos, int nHeight) {
@@ -1588,11 +1734,11 @@ Value offeractivate(const Array& params, bool fHelp) {
 	// check for existing pending offers
 	{
 		LOCK2(cs_main, pwalletMain->cs_wallet);
-		if (mapOfferPending.count(vchOffer)
-				&& mapOfferPending[vchOffer].size()) {
+		set<uint256> setPending;
+		if (mempool.GetServiceTxs(SERVICE_OFFER, vchOffer, setPending)) {
 			error( "offeractivate() : there are %d pending operations on that offer, including %s",
-				   (int) mapOfferPending[vchOffer].size(),
-				   mapOfferPending[vchOffer].begin()->GetHex().c_str());
+				   (int) setPending.size(),
+				   setPending.begin()->GetHex().c_str());
 			throw runtime_error("there are pending operations on that offer");
 		}
 
@@ -1735,8 +1881,8 @@ Value offerupdate(const Array& params, bool fHelp) {
 	{
 		LOCK2(cs_main, pwalletMain->cs_wallet);
 
-		if (mapOfferPending.count(vchOffer)
-				&& mapOfferPending[vchOffer].size()) 
+		set<uint256> setPending;
+		if (mempool.GetServiceTxs(SERVICE_OFFER, vchOffer, setPending)) 
 			throw runtime_error("there are pending operations on that offer");
 
 		EnsureWalletIsUnlocked();
@@ -1757,10 +1903,8 @@ Value offerupdate(const Array& params, bool fHelp) {
 			throw runtime_error("cannot unserialize offer from txn");
 
 		// get the offer from DB
-		vector<COffer> vtxPos;
-		if (!pofferdb->ReadOffer(vchOffer, vtxPos))
+		if (!pofferdb->ReadOffer(vchOffer, theOffer))
 			throw runtime_error("could not read offer from DB");
-		theOffer = vtxPos.back();
 		theOffer.accepts.clear();
 
 		// calculate network fees
@@ -1830,11 +1974,11 @@ Value offeraccept(const Array& params, bool fHelp) {
 	{
 		LOCK2(cs_main, pwalletMain->cs_wallet);
 
-		if (mapOfferPending.count(vchOffer)
-				&& mapOfferPending[vchOffer].size()) {
+		set<uint256> setPending;
+		if (mempool.GetServiceTxs(SERVICE_OFFER, vchOffer, setPending)) {
 			error(  "offeraccept() : there are %d pending operations on that offer, including %s",
-					(int) mapOfferPending[vchOffer].size(),
-					mapOfferPending[vchOffer].begin()->GetHex().c_str());
+					(int) setPending.size(),
+					setPending.begin()->GetHex().c_str());
 			throw runtime_error("there are pending operations on that offer");
 		}
 
@@ -1851,10 +1995,8 @@ Value offeraccept(const Array& params, bool fHelp) {
 			throw runtime_error("could not unserialize offer from txn");
 
 		// get the offer id from DB
-		vector<COffer> vtxPos;
-		if (!pofferdb->ReadOffer(vchOffer, vtxPos))
+		if (!pofferdb->ReadOffer(vchOffer, theOffer))
 			throw runtime_error("could not read offer with this name from DB");
-		theOffer = vtxPos.back();
 
 		if(theOffer.GetRemQty() < nQty)
 			throw runtime_error("not enough remaining quantity to fulfill this orderaccept");
@@ -1911,8 +2053,8 @@ Value offerpay(const Array& params, bool fHelp) {
 	LOCK2(cs_main, pwalletMain->cs_wallet);
 
 	// exit if pending offers
-	if (mapOfferAcceptPending.count(vchRand)
-			&& mapOfferAcceptPending[vchRand].size()) 
+	set<uint256> setPending;
+	if (mempool.GetServiceTxs(SERVICE_OFFER_ACCEPT, vchRand, setPending)) 
 		throw runtime_error( "offerpay() : there are pending operations on that offer" );
 
 	EnsureWalletIsUnlocked();
@@ -1935,7 +2077,7 @@ Value offerpay(const Array& params, bool fHelp) {
 	COfferAccept theOfferAccept;
 	if (!GetTxOfOfferAccept(*pofferdb, vchRand, theOffer, tx))
 		throw runtime_error("could not find an offer with this name");
-    if(!theOffer.GetAcceptByHash(vchRand, theOfferAccept))
+    if(!pofferdb->ReadOfferAcceptRecord(theOffer.vchRand, vchRand, theOfferAccept))
 		throw runtime_error("could not find an offer accept with this hash in DB");
 
 	// check if paid already
@@ -2008,31 +2150,36 @@ Value offerinfo(const Array& params, bool fHelp) {
 		throw runtime_error("offerinfo <guid>\n"
 				"Show values of an offer.\n");
 
+	CServiceReadView view;
+
 	Object oLastOffer;
 	vector<unsigned char> vchOffer = vchFromValue(params[0]);
 	string offer = stringFromVch(vchOffer);
 	{
-		vector<COffer> vtxPos;
-		if (!pofferdb->ReadOffer(vchOffer, vtxPos))
+		COffer theOffer;
+		if (!pofferdb->ReadOffer(vchOffer, theOffer))
 			throw JSONRPCError(RPC_WALLET_ERROR,
 					"failed to read from offer DB");
-		if (vtxPos.size() < 1)
-			throw JSONRPCError(RPC_WALLET_ERROR, "no result returned");
+
+		// the offer came from the snapshot, the chain is only locked for
+		// the lookups that follow
+		LOCK2(cs_main, mempool.cs);
 
         // get transaction pointed to by offer
         CTransaction tx;
         uint256 blockHash;
-        uint256 txHash = vtxPos.back().txHash;
+        uint256 txHash = theOffer.txHash;
         if (!GetTransaction(txHash, tx, blockHash, true))
             throw JSONRPCError(RPC_WALLET_ERROR, "failed to read transaction from disk");
 
-        COffer theOffer = vtxPos.back();
-
 		Object oOffer;
 		vector<unsigned char> vchValue;
 		Array aoOfferAccepts;
-		for(unsigned int i=0;i<theOffer.accepts.size();i++) {
-			COfferAccept ca = theOffer.accepts[i];
+		vector<COfferAccept> vAccepts;
+		if (!pofferdb->ReadOfferAccepts(vchOffer, vAccepts))
+			throw JSONRPCError(RPC_WALLET_ERROR, "failed to read offer accepts from offer DB");
+		for(unsigned int i=0;i<vAccepts.size();i++) {
+			const COfferAccept &ca = vAccepts[i];
 			Object oOfferAccept;
 			string sTime = strprintf("%llu", ca.nTime);
             string sHeight = strprintf("%llu", ca.nHeight);
@@ -2062,9 +2209,9 @@ Value offerinfo(const Array& params, bool fHelp) {
 			oOffer.push_back(
 					Pair("expires_in",
 							nHeight + GetOfferExpirationDepth(nHeight)
-									- pindexBest->nHeight));
+									- view.nHeight));
 			if (nHeight + GetOfferExpirationDepth(nHeight)
-					- pindexBest->nHeight <= 0) {
+					- view.nHeight <= 0) {
 				oOffer.push_back(Pair("expired", 1));
 			}
 			oOffer.push_back(Pair("payment_address", stringFromVch(theOffer.vchPaymentAddress)));
@@ -2074,6 +2221,14 @@ Value offerinfo(const Array& params, bool fHelp) {
 			oOffer.push_back(Pair("price", ValueFromAmount(theOffer.nPrice) ) );
 			oOffer.push_back(Pair("description", stringFromVch(theOffer.sDescription)));
 			oOffer.push_back(Pair("accepts", aoOfferAccepts));
+
+			// updates still in the memory pool
+			set<uint256> setPending;
+			Array aoPending;
+			mempool.GetServiceTxs(SERVICE_OFFER, vchOffer, setPending);
+			BOOST_FOREACH(const uint256 &hashPending, setPending)
+				aoPending.push_back(hashPending.GetHex());
+			oOffer.push_back(Pair("pending", aoPending));
 			oLastOffer = oOffer;
 		}
 	}
@@ -2273,6 +2428,8 @@ Value offerhistory(const Array& params, bool fHelp) {
 		throw runtime_error("offerhistory <offer>\n"
 				"List all stored values of an offer.\n");
 
+	CServiceReadView view;
+
 	Array oRes;
 	vector<unsigned char> vchOffer = vchFromValue(params[0]);
 	string offer = stringFromVch(vchOffer);
@@ -2282,7 +2439,7 @@ Value offerhistory(const Array& params, bool fHelp) {
 		//vector<CDiskTxPos> vtxPos;
 		vector<COffer> vtxPos;
 		//COfferDB dbOffer("r");
-		if (!pofferdb->ReadOffer(vchOffer, vtxPos))
+		if (!pofferdb->ReadOfferHistory(vchOffer, vtxPos))
 			throw JSONRPCError(RPC_WALLET_ERROR,
 					"failed to read from offer DB");
 
@@ -2290,6 +2447,7 @@ Value offerhistory(const Array& params, bool fHelp) {
 		uint256 txHash;
 		uint256 blockHash;
 		BOOST_FOREACH(txPos2, vtxPos) {
+			LOCK2(cs_main, mempool.cs);
 			txHash = txPos2.txHash;
 			CTransaction tx;
 			if (!GetTransaction(txHash, tx, blockHash, true)) {
@@ -2312,9 +2470,9 @@ Value offerhistory(const Array& params, bool fHelp) {
 				oOffer.push_back(
 						Pair("expires_in",
 								nHeight + GetOfferDisplayExpirationDepth(nHeight)
-										- pindexBest->nHeight));
+										- view.nHeight));
 				if (nHeight + GetOfferDisplayExpirationDepth(nHeight)
-						- pindexBest->nHeight <= 0) {
+						- view.nHeight <= 0) {
 					oOffer.push_back(Pair("expired", 1));
 				}
 				oRes.push_back(oOffer);
@@ -2338,6 +2496,8 @@ Value offerfilter(const Array& params, bool fHelp) {
 						"offerfilter \"^offer\" # list all offeres starting with \"offer\"\n"
 						"offerfilter 36000 0 0 stat # display stats (number of offers) on active offeres\n");
 
+	CServiceReadView view;
+
 	string strRegexp;
 	int nFrom = 0;
 	int nNb = 0;
@@ -2364,9 +2524,11 @@ Value offerfilter(const Array& params, bool fHelp) {
 	//COfferDB dbOffer("r");
 	Array oRes;
 
+	// with a max age only the offers the expiry index has as recent
 	vector<unsigned char> vchOffer;
 	vector<pair<vector<unsigned char>, COffer> > offerScan;
-	if (!pofferdb->ScanOffers(vchOffer, 100000000, offerScan))
+	if (nMaxAge != 0 ? !pofferdb->ScanOffersSince(view.nHeight - nMaxAge + 1, offerScan)
+			: !pofferdb->ScanOffers(vchOffer, 100000000, offerScan))
 		throw JSONRPCError(RPC_WALLET_ERROR, "scan failed");
 
 	pair<vector<unsigned char>, COffer> pairScan;
@@ -2384,7 +2546,7 @@ Value offerfilter(const Array& params, bool fHelp) {
 		int nHeight = txOffer.nHeight;
 
 		// max age
-		if (nMaxAge != 0 && pindexBest->nHeight - nHeight >= nMaxAge)
+		if (nMaxAge != 0 && view.nHeight - nHeight >= nMaxAge)
 			continue;
 
 		// from limits
@@ -2392,12 +2554,13 @@ Value offerfilter(const Array& params, bool fHelp) {
 		if (nCountFrom < nFrom + 1)
 			continue;
 
+		LOCK2(cs_main, mempool.cs);
 		Object oOffer;
 		oOffer.push_back(Pair("offer", offer));
 		CTransaction tx;
 		uint256 blockHash;
 		uint256 txHash = txOffer.txHash;
-		if ((nHeight + GetOfferDisplayExpirationDepth(nHeight) - pindexBest->nHeight
+		if ((nHeight + GetOfferDisplayExpirationDepth(nHeight) - view.nHeight
 				<= 0) || !GetTransaction(txHash, tx, blockHash, true)) {
 			oOffer.push_back(Pair("expired", 1));
 		} else {
@@ -2407,7 +2570,7 @@ Value offerfilter(const Array& params, bool fHelp) {
 			oOffer.push_back(
 					Pair("expires_in",
 							nHeight + GetOfferDisplayExpirationDepth(nHeight)
-									- pindexBest->nHeight));
+									- view.nHeight));
 		}
 		oRes.push_back(oOffer);
 
@@ -2419,7 +2582,7 @@ Value offerfilter(const Array& params, bool fHelp) {
 
 	if (fStat) {
 		Object oStat;
-		oStat.push_back(Pair("blocks", (int) nBestHeight));
+		oStat.push_back(Pair("blocks", view.nHeight));
 		oStat.push_back(Pair("count", (int) oRes.size()));
 		//oStat.push_back(Pair("sha256sum", SHA256(oRes), true));
 		return oStat;
@@ -2434,6 +2597,8 @@ Value offerscan(const Array& params, bool fHelp) {
 				"offerscan [<start-offer>] [<max-returned>]\n"
 						"scan all offers, starting at start-offer and returning a maximum number of entries (default 500)\n");
 
+	CServiceReadView view;
+
 	vector<unsigned char> vchOffer;
 	int nMax = 500;
 	if (params.size() > 0) {
@@ -2455,6 +2620,7 @@ Value offerscan(const Array& params, bool fHelp) {
 
 	pair<vector<unsigned char>, COffer> pairScan;
 	BOOST_FOREACH(pairScan, offerScan) {
+		LOCK2(cs_main, mempool.cs);
 		Object oOffer;
 		string offer = stringFromVch(pairScan.first);
 		oOffer.push_back(Pair("offer", offer));
@@ -2464,7 +2630,7 @@ Value offerscan(const Array& params, bool fHelp) {
 
 		int nHeight = txOffer.nHeight;
 		vector<unsigned char> vchValue = txOffer.sTitle;
-		if ((nHeight + GetOfferDisplayExpirationDepth(nHeight) - pindexBest->nHeight
+		if ((nHeight + GetOfferDisplayExpirationDepth(nHeight) - view.nHeight
 				<= 0) || !GetTransaction(txOffer.txHash, tx, blockHash, true)) {
 			oOffer.push_back(Pair("expired", 1));
 		} else {
@@ -2477,7 +2643,7 @@ Value offerscan(const Array& params, bool fHelp) {
 			oOffer.push_back(
 					Pair("expires_in",
 							nHeight + GetOfferDisplayExpirationDepth(nHeight)
-									- pindexBest->nHeight));
+									- view.nHeight));
 		}
 		oRes.push_back(oOffer);
 	}
@@ -2486,6 +2652,92 @@ Value offerscan(const Array& params, bool fHelp) {
 }
 
 
+Value offersearch(const Array& params, bool fHelp) {
+	if (fHelp || params.size() < 2 || params.size() > 4)
+		throw runtime_error(
+				"offersearch <category|price|address> <value> [<max-returned>] [<cursor>]\n"
+						"list offers through the offer search indexes, a page of at most max-returned (default 100) at a time\n"
+						"category <category> : offers in a category\n"
+						"price <min>[-<max>] : offers within a price range, cheapest first\n"
+						"address <address> : offers paying to an address\n"
+						"<cursor> : the \"next\" value of the previous page, to continue from\n");
+
+	CServiceReadView view;
+
+	string strType = params[0].get_str();
+	string strValue = params[1].get_str();
+	unsigned int nMax = 100;
+	if (params.size() > 2) {
+		Value vMax = params[2];
+		ConvertTo<double>(vMax);
+		nMax = (unsigned int) vMax.get_real();
+		if (nMax == 0)
+			throw JSONRPCError(RPC_INVALID_PARAMETER, "max-returned must be positive");
+	}
+
+	CDataStream ssPrefix(SER_DISK, CLIENT_VERSION), ssStart(SER_DISK, CLIENT_VERSION), ssEnd(SER_DISK, CLIENT_VERSION);
+	if (strType == "category") {
+		ssPrefix << make_pair(string("offercat"), vchFromString(strValue));
+		ssStart << make_pair(string("offercat"), vchFromString(strValue));
+	} else if (strType == "address") {
+		ssPrefix << make_pair(string("offeradr"), vchFromString(strValue));
+		ssStart << make_pair(string("offeradr"), vchFromString(strValue));
+	} else if (strType == "price") {
+		size_t nSep = strValue.find('-');
+		int64 nMin = AmountFromValue(Value(atof(strValue.substr(0, nSep).c_str())));
+		ssPrefix << string("offerprc");
+		ssStart << make_pair(string("offerprc"), COfferPriceKey(nMin, vector<unsigned char>()));
+		if (nSep != string::npos) {
+			int64 nMaxPrice = AmountFromValue(Value(atof(strValue.substr(nSep + 1).c_str())));
+			if (nMaxPrice < nMin)
+				throw JSONRPCError(RPC_INVALID_PARAMETER, "invalid price range");
+			ssEnd << make_pair(string("offerprc"), COfferPriceKey(nMaxPrice + 1, vector<unsigned char>()));
+		}
+	} else
+		throw JSONRPCError(RPC_INVALID_PARAMETER, "search by category, price or address");
+
+	string strStart = ssStart.str();
+	if (params.size() > 3) {
+		vector<unsigned char> vchCursor = ParseHex(params[3].get_str());
+		string strCursor(vchCursor.begin(), vchCursor.end());
+		if (strCursor.compare(0, ssPrefix.size(), ssPrefix.str()) != 0 || strCursor < strStart)
+			throw JSONRPCError(RPC_INVALID_PARAMETER, "invalid cursor");
+		strStart = strCursor;
+	}
+
+	vector<vector<unsigned char> > vchOffers;
+	string strNext;
+	if (!pofferdb->ScanOfferSearch(ssPrefix.str(), strStart, ssEnd.str(), nMax, vchOffers, strNext))
+		throw JSONRPCError(RPC_WALLET_ERROR, "scan failed");
+
+	Array oRes;
+	BOOST_FOREACH(const vector<unsigned char> &vchOffer, vchOffers) {
+		COffer txOffer;
+		if (!pofferdb->ReadOffer(vchOffer, txOffer))
+			continue;
+		int nHeight = txOffer.nHeight;
+
+		Object oOffer;
+		oOffer.push_back(Pair("offer", stringFromVch(vchOffer)));
+		oOffer.push_back(Pair("title", stringFromVch(txOffer.sTitle)));
+		oOffer.push_back(Pair("category", stringFromVch(txOffer.sCategory)));
+		oOffer.push_back(Pair("price", ValueFromAmount(txOffer.nPrice)));
+		oOffer.push_back(Pair("payment_address", stringFromVch(txOffer.vchPaymentAddress)));
+		int nExpiresIn = nHeight + GetOfferDisplayExpirationDepth(nHeight) - view.nHeight;
+		if (nExpiresIn <= 0)
+			oOffer.push_back(Pair("expired", 1));
+		else
+			oOffer.push_back(Pair("expires_in", nExpiresIn));
+		oRes.push_back(oOffer);
+	}
+
+	Object oResult;
+	oResult.push_back(Pair("offers", oRes));
+	if (!strNext.empty())
+		oResult.push_back(Pair("next", HexStr(strNext.begin(), strNext.end())));
+	return oResult;
+}
+
  Value offerclean(const Array& params, bool fHelp)
  {
 	if (fHelp || params.size())
@@ -2537,15 +2789,6 @@ Value offerscan(const Array& params, bool fHelp) {
 		 	UnspendInputs(wtx);
 		 	wtx.RemoveFromMemoryPool();
 		 	pwalletMain->EraseFromWallet(wtx.GetHash());
-		 	vector<unsigned char> vchOffer;
-		 	if (GetNameOfOfferTx(wtx, vchOffer) && mapOfferPending.count(vchOffer))
-		 	{
-		 		string offer = stringFromVch(vchOffer);
-		 		printf("offer_clean() : erase %s from pending of offer %s",
-		 			wtx.GetHash().GetHex().c_str(), offer.c_str());
-		 		if (!mapOfferPending[vchOffer].erase(wtx.GetHash()))
-		 			error("offer_clean() : erase but it was not pending");
-		 	}
 		 	wtx.print();
 		}
 
@@ -2,9 +2,11 @@
 #define OFFER_H
 
 #include "bitcoinrpc.h"
-#include "leveldb.h"
+#include "servicedb.h"
+#include "feewindow.h"
 
 class CTransaction;
+class CBlock;
 class CTxOut;
 class CValidationState;
 class CCoinsViewCache;
@@ -43,8 +45,6 @@ std::string offerFromOp(int op);
 
 extern std::map<std::vector<unsigned char>, uint256> mapMyOffers;
 extern std::map<std::vector<unsigned char>, uint256> mapMyOfferAccepts;
-extern std::map<std::vector<unsigned char>, std::set<uint256> > mapOfferPending;
-extern std::map<std::vector<unsigned char>, std::set<uint256> > mapOfferAcceptPending;
 
 class CBitcoinAddress;
 
@@ -136,6 +136,7 @@ public:
 	int64 nQty;
 	uint64 nFee;
 	std::vector<COfferAccept>accepts;
+	int64 nQtyAccepted; // total quantity of the accepts, kept on disk instead of them
 
 	COffer() { 
         SetNull();
@@ -160,7 +161,11 @@ public:
     	READWRITE(nPrice);
     	READWRITE(nQty);
     	READWRITE(nFee);
-    	READWRITE(accepts);
+    	// the database keeps each accept in a record of its own
+    	if (nType & SER_DISK)
+    		READWRITE(nQtyAccepted);
+    	else
+    		READWRITE(accepts);
     )
 
     bool GetAcceptByHash(std::vector<unsigned char> ahash, COfferAccept &ca) {
@@ -209,10 +214,7 @@ public:
     }
 
     int64 GetRemQty() {
-        int64 nRet = nQty;
-        for(unsigned int i=0;i<accepts.size();i++) 
-            nRet -= accepts[i].nQty;
-        return nRet;
+        return nQty - nQtyAccepted;
     }
 
     friend bool operator==(const COffer &a, const COffer &b) {
@@ -230,6 +232,7 @@ public:
         && a.nHeight == b.nHeight
         && a.nTime == b.nTime
         && a.accepts == b.accepts
+        && a.nQtyAccepted == b.nQtyAccepted
         && a.vchPaymentAddress == b.vchPaymentAddress
         );
     }
@@ -248,6 +251,7 @@ public:
         nHeight = b.nHeight;
         nTime = b.nTime;
         accepts = b.accepts;
+        nQtyAccepted = b.nQtyAccepted;
         vchPaymentAddress = b.vchPaymentAddress;
         return *this;
     }
@@ -256,7 +260,7 @@ public:
         return !(a == b);
     }
     
-    void SetNull() { nHeight = n = nPrice = nQty = 0; txHash = hash = 0; accepts.clear(); vchRand.clear(); sTitle.clear(); sDescription.clear();}
+    void SetNull() { nHeight = n = nPrice = nQty = nQtyAccepted = 0; txHash = hash = 0; accepts.clear(); vchRand.clear(); sTitle.clear(); sDescription.clear();}
     bool IsNull() const { return (n == 0 && txHash == 0 && hash == 0 && nHeight == 0 && nPrice == 0 && nQty == 0); }
 
     bool UnserializeFromTx(const CTransaction &tx);
@@ -305,27 +309,106 @@ public:
 };
 bool RemoveOfferFee(COfferFee &txnVal);
 
-class COfferDB : public CLevelDB {
+/** Key of the offer price search index. The price is written big endian so
+ *  that the offers are ordered by price and can be range scanned. */
+class COfferPriceKey {
 public:
-	COfferDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDB(GetDataDir() / "offers", nCacheSize, fMemory, fWipe) {}
+	uint64 nPrice;
+	std::vector<unsigned char> vchOffer;
+
+	COfferPriceKey() {
+		nPrice = 0;
+	}
+
+	COfferPriceKey(uint64 nPriceIn, const std::vector<unsigned char> &vchOfferIn) {
+		nPrice = nPriceIn;
+		vchOffer = vchOfferIn;
+	}
+
+	unsigned int GetSerializeSize(int nType, int nVersion) const {
+		return sizeof(nPrice) + ::GetSerializeSize(vchOffer, nType, nVersion);
+	}
+
+	template<typename Stream>
+	void Serialize(Stream &s, int nType, int nVersion) const {
+		unsigned char buf[sizeof(nPrice)];
+		for (unsigned int i = 0; i < sizeof(nPrice); i++)
+			buf[i] = (nPrice >> (8 * (sizeof(nPrice) - 1 - i))) & 0xff;
+		s.write((char*)buf, sizeof(buf));
+		::Serialize(s, vchOffer, nType, nVersion);
+	}
+
+	template<typename Stream>
+	void Unserialize(Stream &s, int nType, int nVersion) {
+		unsigned char buf[sizeof(nPrice)];
+		s.read((char*)buf, sizeof(buf));
+		nPrice = 0;
+		for (unsigned int i = 0; i < sizeof(nPrice); i++)
+			nPrice = (nPrice << 8) | buf[i];
+		::Unserialize(s, vchOffer, nType, nVersion);
+	}
+};
+
+class COfferDB : public CServiceDB {
+public:
+	COfferDB(size_t nCacheSize, bool fMemory, bool fWipe) : CServiceDB(GetDataDir() / "offers", nCacheSize, fMemory, fWipe) {}
+
+	// the latest version of an offer is kept under "offeri", and each
+	// version under "offerh" by height. Writing or taking off a version also
+	// moves the offer's search and expiry index entries to the latest one.
+
+	bool WriteOffer(const std::vector<unsigned char>& name, const COffer& offer);
+
+	// take off the version a transaction wrote
+	bool PopOffer(const std::vector<unsigned char>& name, const uint256& txHash);
 
-	bool WriteOffer(const std::vector<unsigned char>& name, std::vector<COffer>& vtxPos) {
-		return Write(make_pair(std::string("offeri"), name), vtxPos);
+	bool EraseOffer(const std::vector<unsigned char>& name);
+
+	bool ReadOffer(const std::vector<unsigned char>& name, COffer& offer) {
+		CServiceVersion<COffer> head;
+		if (!ReadHead(std::string("offeri"), name, head))
+			return false;
+		offer = head.value;
+		return true;
 	}
 
-	bool EraseOffer(const std::vector<unsigned char>& name) {
-	    return Erase(make_pair(std::string("offeri"), name));
+	// the version at nHeight if there is one, else the latest
+	bool ReadOfferAt(const std::vector<unsigned char>& name, int64 nHeight, COffer& offer) {
+		CServiceVersion<COffer> version;
+		if (!ReadVersion(std::string("offerh"), name, nHeight, version)
+				&& !ReadHead(std::string("offeri"), name, version))
+			return false;
+		offer = version.value;
+		return true;
 	}
 
-	bool ReadOffer(const std::vector<unsigned char>& name, std::vector<COffer>& vtxPos) {
-		return Read(make_pair(std::string("offeri"), name), vtxPos);
+	bool ReadOfferHistory(const std::vector<unsigned char>& name, std::vector<COffer>& vtxPos) {
+		return ReadHistory(std::string("offerh"), name, vtxPos);
 	}
 
+	// move the offer records of older databases to versions
+	bool UpgradeOfferHistory();
+
+	// index the offers of a database written before the expiry index existed
+	bool BuildOfferExpiry();
+
+	// the latest versions of the offers updated at nHeight or later, along
+	// with some older ones, in the order of ScanOffers
+	bool ScanOffersSince(int nHeight, std::vector<std::pair<std::vector<unsigned char>, COffer> >& offerScan);
+
+	// compact up to about nMax offers that are expired for good at
+	// nPruneHeight, returning how many were
+	unsigned int PruneOffers(int nPruneHeight, unsigned int nMax);
+
 	bool ExistsOffer(const std::vector<unsigned char>& name) {
 	    return Exists(make_pair(std::string("offeri"), name));
 	}
+	// key of the latest version, for Preload
+	static std::string OfferKey(const std::vector<unsigned char>& name) {
+		return KeyString(make_pair(std::string("offeri"), name));
+	}
 
-	bool WriteOfferAccept(const std::vector<unsigned char>& name, std::vector<unsigned char>& vchValue) {
+	bool WriteOfferAccept(const std::vector<unsigned char>& name, const std::vector<unsigned char>& vchValue) {
 		return Write(make_pair(std::string("offera"), name), vchValue);
 	}
 
@@ -341,13 +424,44 @@ public:
 	    return Exists(make_pair(std::string("offera"), name));
 	}
 
-	bool WriteOfferTxFees(std::vector<COfferFee>& vtxPos) {
-		return Write(make_pair(std::string("offera"), std::string("offertxf")), vtxPos);
+	// the accepts of an offer, one record each
+
+	bool WriteOfferAcceptRecord(const std::vector<unsigned char>& vchOffer, const COfferAccept& accept) {
+		return Write(make_pair(std::string("offeracc"), make_pair(vchOffer, accept.vchRand)), accept);
+	}
+
+	bool EraseOfferAcceptRecord(const std::vector<unsigned char>& vchOffer, const std::vector<unsigned char>& vchRand) {
+		return Erase(make_pair(std::string("offeracc"), make_pair(vchOffer, vchRand)));
+	}
+
+	bool ReadOfferAcceptRecord(const std::vector<unsigned char>& vchOffer, const std::vector<unsigned char>& vchRand, COfferAccept& accept) {
+		return Read(make_pair(std::string("offeracc"), make_pair(vchOffer, vchRand)), accept);
 	}
 
+	// store an accept of offer, keeping the offer's accepted quantity in step
+	bool PutOfferAccept(const std::vector<unsigned char>& vchOffer, COffer& offer, const COfferAccept& accept);
+
+	// all accepts of an offer, oldest first
+	bool ReadOfferAccepts(const std::vector<unsigned char>& vchOffer, std::vector<COfferAccept>& vAccepts);
+
+	// move the accepts out of the offer records of older databases
+	bool UpgradeOfferAccepts();
+
+	// fee list as stored before fees were kept one per record
+
 	bool ReadOfferTxFees(std::vector<COfferFee>& vtxPos) {
 		return Read(make_pair(std::string("offera"), std::string("offertxf")), vtxPos);
 	}
+	bool EraseOfferTxFees() {
+		return Erase(make_pair(std::string("offera"), std::string("offertxf")));
+	}
+
+	bool WriteOfferFees(CFeeWindow& window) {
+		return window.Write(*this, std::string("offerfee"));
+	}
+	bool ReadOfferFees(CFeeWindow& window) {
+		return window.Read(*this, std::string("offerfee"));
+	}
 
     bool WriteOfferIndex(std::vector<std::vector<unsigned char> >& vtxPos) {
         return Write(make_pair(std::string("offera"), std::string("offerndx")), vtxPos);
@@ -362,9 +476,35 @@ public:
             unsigned int nMax,
             std::vector<std::pair<std::vector<unsigned char>, COffer> >& offerScan);
 
-    bool ReconstructOfferIndex(CBlockIndex *pindexRescan);
+    // search indexes over the latest version of every offer, each entry
+    // holding the offer name
+
+    void WriteOfferSearch(const std::vector<unsigned char>& name, const COffer& offer) {
+        Write(make_pair(std::string("offercat"), make_pair(offer.sCategory, name)), name);
+        Write(make_pair(std::string("offerprc"), COfferPriceKey(offer.nPrice, name)), name);
+        Write(make_pair(std::string("offeradr"), make_pair(offer.vchPaymentAddress, name)), name);
+    }
+
+    void EraseOfferSearch(const std::vector<unsigned char>& name, const COffer& offer) {
+        Erase(make_pair(std::string("offercat"), make_pair(offer.sCategory, name)));
+        Erase(make_pair(std::string("offerprc"), COfferPriceKey(offer.nPrice, name)));
+        Erase(make_pair(std::string("offeradr"), make_pair(offer.vchPaymentAddress, name)));
+    }
+
+    // index the offers of a database written before the search indexes existed
+    bool BuildOfferSearch();
+
+    // names from the search index entries whose keys start with strPrefix,
+    // from strStart up to strEnd (no limit if empty). strNext is set to the
+    // key to continue from when there are more than nMax.
+    bool ScanOfferSearch(const std::string& strPrefix, const std::string& strStart, const std::string& strEnd,
+            unsigned int nMax, std::vector<std::vector<unsigned char> >& vchOffers, std::string& strNext);
+
+    // apply the offers of a main chain block to the index when rebuilding it
+    bool ReconstructOfferIndex(CBlockIndex *pindex, const CBlock &block);
 };
-extern std::list<COfferFee> lstOfferFees;
+extern CFeeWindow offerFeeWindow;
+void SetOfferFees(const std::vector<COfferFee> &vFees);
 
 
 bool GetTxOfOffer(COfferDB& dbOffer, const std::vector<unsigned char> &vchOffer, CTransaction& tx);
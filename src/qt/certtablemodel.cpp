@@ -97,11 +97,11 @@ public:
                     if(!theCertIssuer.UnserializeFromTx(tx))
                         continue;
 
-                    vector<CCertIssuer> vtxPos;
-                    if(!pcertdb->ReadCertIssuer(theCertIssuer.vchRand, vtxPos))
+                    CCertIssuer dbCertIssuer;
+                    if(!pcertdb->ReadCertIssuer(theCertIssuer.vchRand, dbCertIssuer))
                         continue;
 
-                    int nExpHeight = vtxPos.back().nHeight + GetCertExpirationDepth(vtxPos.back().nHeight);
+                    int nExpHeight = dbCertIssuer.nHeight + GetCertExpirationDepth(dbCertIssuer.nHeight);
 
                     if(theCertIssuer.certs.size()) {
                         theCert = theCertIssuer.certs.back();
@@ -102,11 +102,11 @@ public:
                     if(!theOffer.UnserializeFromTx(tx))
                         continue;
 
-                    vector<COffer> vtxPos;
-                    if(!pofferdb->ReadOffer(theOffer.vchRand, vtxPos))
+                    COffer dbOffer;
+                    if(!pofferdb->ReadOffer(theOffer.vchRand, dbOffer))
                         continue;
 
-                    int nExpHeight = vtxPos.back().nHeight + GetOfferExpirationDepth(vtxPos.back().nHeight);
+                    int nExpHeight = dbOffer.nHeight + GetOfferExpirationDepth(dbOffer.nHeight);
 
                     double nPrice = theOffer.nPrice / COIN;
                     int nQty = theOffer.nQty;
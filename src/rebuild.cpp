@@ -0,0 +1,238 @@
+// Copyright (c) 2014 Syscoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+//
+
+#include "rebuild.h"
+#include "main.h"
+#include "init.h"
+#include "alias.h"
+#include "offer.h"
+#include "cert.h"
+
+using namespace std;
+
+extern CAliasDB *paliasdb;
+extern COfferDB *pofferdb;
+extern CCertDB *pcertdb;
+
+// blocks applied between writes of the rebuilt indexes
+static const int REBUILD_BATCH_BLOCKS = 500;
+// blocks the readers may get ahead of the indexes
+static const unsigned int REBUILD_READ_AHEAD = 64;
+
+CBlockPrefetcher::CBlockPrefetcher(CBlockIndex *pindexStart, int nThreads, unsigned int nMaxAheadIn) {
+    pindexRead = pindexStart;
+    nNextHeight = pindexStart ? pindexStart->nHeight : 0;
+    nEndHeight = nNextHeight - 1;
+    for (CBlockIndex *pindex = pindexStart; pindex; pindex = pindex->pnext)
+        nEndHeight = pindex->nHeight;
+    nMaxAhead = nMaxAheadIn;
+    fQuit = false;
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&CBlockPrefetcher::ThreadRead, this));
+}
+
+CBlockPrefetcher::~CBlockPrefetcher() {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fQuit = true;
+    }
+    condReader.notify_all();
+    threadGroup.join_all();
+}
+
+void CBlockPrefetcher::ThreadRead() {
+    RenameThread("syscoin-prefetch");
+    while (true) {
+        CBlockIndex *pindex;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fQuit && pindexRead && pindexRead->nHeight >= nNextHeight + (int)nMaxAhead)
+                condReader.wait(lock);
+            if (fQuit || !pindexRead)
+                return;
+            pindex = pindexRead;
+            pindexRead = pindexRead->pnext;
+        }
+
+        boost::shared_ptr<CBlock> pblock(new CBlock());
+        if (!pblock->ReadFromDisk(pindex))
+            pblock.reset();
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            mapReady[pindex->nHeight] = make_pair(pindex, pblock);
+        }
+        condNext.notify_one();
+    }
+}
+
+bool CBlockPrefetcher::Next(CBlockIndex *&pindex, boost::shared_ptr<CBlock> &pblock) {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (nNextHeight > nEndHeight)
+        return false;
+    std::map<int, std::pair<CBlockIndex*, boost::shared_ptr<CBlock> > >::iterator it;
+    while ((it = mapReady.find(nNextHeight)) == mapReady.end())
+        condNext.wait(lock);
+    pindex = it->second.first;
+    pblock = it->second.second;
+    mapReady.erase(it);
+    nNextHeight++;
+    condReader.notify_all();
+    return true;
+}
+
+// the block a service index was last saved at during a rebuild, if it is
+// still in the main chain
+static CBlockIndex *ReadRebuildTip(CServiceDB &db) {
+    uint256 hash;
+    if (!db.Read(string("rebuildtip"), hash))
+        return NULL;
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    if (mi == mapBlockIndex.end() || !mi->second->IsInMainChain())
+        return NULL;
+    return mi->second;
+}
+
+static bool WriteRebuildTip(CServiceDB &db, CBlockIndex *pindex, int nFromHeight) {
+    if (pindex == NULL)
+        return db.Erase(string("rebuildtip"));
+    if (pindex->nHeight < nFromHeight)
+        return true; // this index has not been touched yet
+    return db.Write(string("rebuildtip"), pindex->GetBlockHash());
+}
+
+bool IsServiceRebuildPending() {
+    return paliasdb->Exists(string("rebuildtip"))
+            || pofferdb->Exists(string("rebuildtip"))
+            || pcertdb->Exists(string("rebuildtip"));
+}
+
+// Write the indexes as rebuilt up to pindex, or as finished when pindex is
+// NULL, together with the fees and the progress made
+static bool FlushRebuild(CBlockIndex *pindex, int nAliasFrom, int nOfferFrom, int nCertFrom) {
+    if (!paliasdb->WriteAliasFees(aliasFeeWindow)
+            || !pofferdb->WriteOfferFees(offerFeeWindow)
+            || !pcertdb->WriteCertIssuerFees(certFeeWindow))
+        return false;
+    if (!WriteRebuildTip(*paliasdb, pindex, nAliasFrom)
+            || !WriteRebuildTip(*pofferdb, pindex, nOfferFrom)
+            || !WriteRebuildTip(*pcertdb, pindex, nCertFrom))
+        return false;
+    if (pindex == NULL) {
+        // finished, the indexes are at the tip
+        uint256 hashBest = pindexBest->GetBlockHash();
+        return paliasdb->Flush(hashBest) && pofferdb->Flush(hashBest) && pcertdb->Flush(hashBest);
+    }
+    return paliasdb->Flush() && pofferdb->Flush() && pcertdb->Flush();
+}
+
+bool CheckServiceBestBlock() {
+    LOCK(cs_main);
+    if (pindexBest == NULL || IsServiceRebuildPending())
+        return true; // the rebuild under way takes the indexes to the tip
+
+    CServiceDB *vpdb[] = { paliasdb, pofferdb, pcertdb };
+    CBlockIndex *vpindex[] = { pindexBest, pindexBest, pindexBest };
+    bool fBehind = false;
+    for (unsigned int i = 0; i < 3; i++) {
+        uint256 hash;
+        if (!vpdb[i]->ReadBestBlock(hash) || hash == 0 || hash == pindexBest->GetBlockHash())
+            continue; // written before the marker, or up to date
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end() || !mi->second->IsInMainChain())
+            return error("CheckServiceBestBlock() : service index at block %s, which is not in the main chain",
+                    hash.ToString().c_str());
+        printf("CheckServiceBestBlock() : service index at block %d, the coins at %d\n",
+                mi->second->nHeight, pindexBest->nHeight);
+        vpindex[i] = mi->second;
+        fBehind = true;
+    }
+    if (!fBehind)
+        return true;
+
+    // the coins were written and the indexes not: bring the ones behind up
+    // to the tip the way an interrupted rebuild is finished
+    for (unsigned int i = 0; i < 3; i++)
+        if (!WriteRebuildTip(*vpdb[i], vpindex[i], 0) || !vpdb[i]->Flush())
+            return error("CheckServiceBestBlock() : failed to write service indexes");
+    return RebuildServiceIndexes(pindexBest);
+}
+
+bool RebuildServiceIndexes(CBlockIndex *pindexRescan) {
+    LOCK(cs_main);
+
+    // each index picks up after the block it was last saved at
+    CBlockIndex *pindexAlias = ReadRebuildTip(*paliasdb);
+    CBlockIndex *pindexOffer = ReadRebuildTip(*pofferdb);
+    CBlockIndex *pindexCert = ReadRebuildTip(*pcertdb);
+    int nAliasFrom = pindexAlias ? pindexAlias->nHeight + 1 : pindexRescan->nHeight;
+    int nOfferFrom = pindexOffer ? pindexOffer->nHeight + 1 : pindexRescan->nHeight;
+    int nCertFrom = pindexCert ? pindexCert->nHeight + 1 : pindexRescan->nHeight;
+    int nFrom = min(nAliasFrom, min(nOfferFrom, nCertFrom));
+
+    if (!pindexOffer)
+        offerFeeWindow.ZeroFirstInRange(nOfferFrom, nBestHeight);
+
+    printf("Rebuilding service indexes from block %d (aliases %d, offers %d, certs %d)...\n",
+            nFrom, nAliasFrom, nOfferFrom, nCertFrom);
+    int64 nStart = GetTimeMillis();
+
+    CBlockIndex *pindexStart = nFrom <= nBestHeight ? FindBlockByHeight(nFrom) : NULL;
+    CBlockPrefetcher prefetcher(pindexStart, max(nScriptCheckThreads, 1), REBUILD_READ_AHEAD);
+    CBlockIndex *pindex;
+    CBlockIndex *pindexLast = NULL;
+    boost::shared_ptr<CBlock> pblock;
+    int nBlocks = 0;
+    bool fInterrupted = false;
+    while (prefetcher.Next(pindex, pblock)) {
+        if (ShutdownRequested()) {
+            fInterrupted = true;
+            break;
+        }
+        if (!pblock) {
+            if (pindexLast)
+                FlushRebuild(pindexLast, nAliasFrom, nOfferFrom, nCertFrom);
+            return error("RebuildServiceIndexes() : failed to read block %s",
+                    pindex->GetBlockHash().ToString().c_str());
+        }
+
+        // a block either goes in whole or not at all, fees included; what a
+        // failed one wrote is rolled back before the progress is flushed
+        bool fConnected;
+        {
+            CServiceTxn txnServices;
+            fConnected = (pindex->nHeight < nAliasFrom || paliasdb->ReconstructNameIndex(pindex, *pblock))
+                    && (pindex->nHeight < nOfferFrom || pofferdb->ReconstructOfferIndex(pindex, *pblock))
+                    && (pindex->nHeight < nCertFrom || pcertdb->ReconstructCertIndex(pindex, *pblock));
+            if (fConnected)
+                txnServices.Commit();
+        }
+        if (!fConnected) {
+            if (pindexLast)
+                FlushRebuild(pindexLast, nAliasFrom, nOfferFrom, nCertFrom);
+            return error("RebuildServiceIndexes() : failed at block %s",
+                    pindex->GetBlockHash().ToString().c_str());
+        }
+        pindexLast = pindex;
+
+        if (++nBlocks % REBUILD_BATCH_BLOCKS == 0) {
+            if (!FlushRebuild(pindex, nAliasFrom, nOfferFrom, nCertFrom))
+                return error("RebuildServiceIndexes() : failed to write service indexes");
+            printf("Rebuilt service indexes up to block %d\n", pindex->nHeight);
+        }
+    }
+
+    // an interrupted rebuild keeps its progress, to go on at the next start
+    if (fInterrupted) {
+        if (pindexLast && !FlushRebuild(pindexLast, nAliasFrom, nOfferFrom, nCertFrom))
+            return error("RebuildServiceIndexes() : failed to write service indexes");
+        printf("Service index rebuild interrupted at block %d\n", pindexLast ? pindexLast->nHeight : nFrom - 1);
+        return true;
+    }
+    if (!FlushRebuild(NULL, nAliasFrom, nOfferFrom, nCertFrom))
+        return error("RebuildServiceIndexes() : failed to write service indexes");
+    printf(" service rebuild %15"PRI64d"ms (%d blocks)\n", GetTimeMillis() - nStart, nBlocks);
+    return true;
+}
@@ -0,0 +1,58 @@
+// Copyright (c) 2014 Syscoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+//
+#ifndef REBUILD_H
+#define REBUILD_H
+
+#include <map>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+class CBlock;
+class CBlockIndex;
+
+/** Reads the blocks of the main chain from a starting block on, with a pool
+ *  of reader threads working ahead, and hands them out in chain order.
+ */
+class CBlockPrefetcher
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condReader;  // readers wait for room ahead
+    boost::condition_variable condNext;    // Next() waits for its block
+    boost::thread_group threadGroup;
+
+    CBlockIndex *pindexRead;  // next block to hand to a reader
+    int nNextHeight;          // height Next() returns next
+    int nEndHeight;
+    unsigned int nMaxAhead;
+    bool fQuit;
+    // blocks read ahead by height; a null block failed to read
+    std::map<int, std::pair<CBlockIndex*, boost::shared_ptr<CBlock> > > mapReady;
+
+    void ThreadRead();
+
+public:
+    CBlockPrefetcher(CBlockIndex *pindexStart, int nThreads, unsigned int nMaxAheadIn);
+    ~CBlockPrefetcher();
+
+    /** Take the next block. Returns false at the end of the chain; pblock is
+     *  null if the block could not be read. */
+    bool Next(CBlockIndex *&pindex, boost::shared_ptr<CBlock> &pblock);
+};
+
+/** Whether a rebuild of the alias, offer and cert indexes was interrupted */
+bool IsServiceRebuildPending();
+
+/** Rebuild the alias, offer and cert indexes from the blocks after
+ *  pindexRescan, in one pass. Progress is saved as it goes, and a rebuild
+ *  that was interrupted resumes from where it stopped. */
+bool RebuildServiceIndexes(CBlockIndex *pindexRescan);
+
+/** Bring the alias, offer and cert indexes up to the block of the coin
+ *  database if they were left behind it. Fails if one is on another branch. */
+bool CheckServiceBestBlock();
+
+#endif // REBUILD_H
@@ -9,6 +9,10 @@
 #include "bitcoinrpc.h"
 #include "auxpow.h"
 
+#include <deque>
+
+#include <boost/scoped_ptr.hpp>
+
 using namespace json_spirit;
 using namespace std;
 
@@ -69,6 +73,280 @@ Value getnetworkhashps(const Array& params, bool fHelp)
 // Allocated in InitRPCMining, free'd in ShutdownRPCMining
 static CReserveKey* pMiningKey = NULL;
 
+// Work handed out is forgotten oldest first past this many entries
+static const unsigned int MAX_MINING_WORK = 1000;
+
+// A block template shared by all the mining RPCs. It pays a placeholder
+// script; the merkle branch of its coinbase is kept so a request with its
+// own coinbase costs two hashes per level instead of a new template.
+class CSharedTemplate
+{
+public:
+    boost::scoped_ptr<CBlockTemplate> pblocktemplate;
+    CBlockIndex* pindexPrev;
+    int64 nCreated;
+    unsigned int nUpdated;  // nTransactionsUpdated it was built from
+    std::vector<uint256> vCoinbaseBranch;
+    Array transactions;     // getblocktemplate's "transactions", encoded once
+
+    // Names the tip and memory pool epoch, for long polls
+    std::string GetLongPollId() const
+    {
+        return pindexPrev->GetBlockHash().GetHex() + i64tostr(nUpdated);
+    }
+};
+
+// What a mining RPC handed out: a shared template with this request's
+// coinbase and header
+class CMiningWork
+{
+public:
+    boost::shared_ptr<const CSharedTemplate> ptemplate;
+    CBlockHeader header;
+    CTransaction txCoinbase;
+    unsigned int nExtraNonce;
+
+    CMiningWork() : nExtraNonce(0) {}
+
+    // The full block, for submitting
+    void GetBlock(CBlock &block) const
+    {
+        block = CBlock(header);
+        block.vtx = ptemplate->pblocktemplate->block.vtx;
+        block.vtx[0] = txCoinbase;
+    }
+};
+
+// Builds the shared template once per tip and memory pool epoch and keeps
+// the work handed out until it is submitted, evicted or the tip moves.
+// cs_main is only taken to build a template and to stamp a header; the
+// RPCs encode their replies without it.
+class CMiningTemplates
+{
+private:
+    CCriticalSection cs;
+    boost::shared_ptr<const CSharedTemplate> ptemplate;
+    unsigned int nTransactionsUpdatedLast;
+    CBlockIndex* pindexWork;
+    unsigned int nExtraNonce;
+    std::map<uint256, CMiningWork> mapWork;
+    std::deque<uint256> vWorkOrder;
+    std::map<std::string, uint256> mapLastWork;
+
+    // Requires cs
+    boost::shared_ptr<const CSharedTemplate> Update(int64 nMaxAge)
+    {
+        CBlockIndex* pindexBestNow;
+        {
+            LOCK(cs_main);
+            pindexBestNow = pindexBest;
+        }
+        if (pindexWork != pindexBestNow)
+        {
+            // Deallocate old work since it's obsolete now
+            mapWork.clear();
+            vWorkOrder.clear();
+            mapLastWork.clear();
+            nExtraNonce = 0;
+            pindexWork = pindexBestNow;
+        }
+        if (ptemplate && ptemplate->pindexPrev == pindexBestNow &&
+            (nTransactionsUpdated == nTransactionsUpdatedLast || GetTime() - ptemplate->nCreated <= nMaxAge))
+            return ptemplate;
+
+        // Clear the template so future calls make a new one, despite any failures from here on
+        ptemplate.reset();
+        nTransactionsUpdatedLast = nTransactionsUpdated;
+
+        boost::shared_ptr<CSharedTemplate> pnew(new CSharedTemplate());
+        {
+            LOCK(cs_main);
+            CScript scriptDummy = CScript() << OP_TRUE;
+            pnew->pblocktemplate.reset(CreateNewBlock(scriptDummy));
+            if (!pnew->pblocktemplate)
+                throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+            pnew->pindexPrev = pindexBest;
+        }
+        pnew->nCreated = GetTime();
+        pnew->nUpdated = nTransactionsUpdatedLast;
+        const CBlock &block = pnew->pblocktemplate->block;
+        pnew->vCoinbaseBranch = block.GetMerkleBranch(0);
+
+        map<uint256, int64_t> setTxIndex;
+        for (unsigned int i = 0; i < block.vtx.size(); i++)
+        {
+            const CTransaction& tx = block.vtx[i];
+            uint256 txHash = block.GetTxHash(i);
+            setTxIndex[txHash] = i;
+
+            if (tx.IsCoinBase())
+                continue;
+
+            Object entry;
+
+            CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+            ssTx << tx;
+            entry.push_back(Pair("data", HexStr(ssTx.begin(), ssTx.end())));
+
+            entry.push_back(Pair("hash", txHash.GetHex()));
+
+            Array deps;
+            BOOST_FOREACH (const CTxIn &in, tx.vin)
+            {
+                if (setTxIndex.count(in.prevout.hash))
+                    deps.push_back(setTxIndex[in.prevout.hash]);
+            }
+            entry.push_back(Pair("depends", deps));
+
+            entry.push_back(Pair("fee", pnew->pblocktemplate->vTxFees[i]));
+            entry.push_back(Pair("sigops", pnew->pblocktemplate->vTxSigOps[i]));
+
+            pnew->transactions.push_back(entry);
+        }
+
+        ptemplate = pnew;
+        return ptemplate;
+    }
+
+public:
+    CMiningTemplates() : nTransactionsUpdatedLast(0), pindexWork(NULL), nExtraNonce(0) {}
+
+    // The current template, rebuilt if the tip moved or the memory pool
+    // changed more than nMaxAge seconds after it was made
+    boost::shared_ptr<const CSharedTemplate> GetTemplate(int64 nMaxAge)
+    {
+        LOCK(cs);
+        return Update(nMaxAge);
+    }
+
+    // New work on the current template paying to reservekey, with the aux
+    // merkle root in its coinbase when pvchAux is given
+    void NewWork(CReserveKey& reservekey, int64 nMaxAge, CMiningWork& work,
+                 const vector<unsigned char>* pvchAux = NULL)
+    {
+        LOCK(cs);
+        boost::shared_ptr<const CSharedTemplate> p = Update(nMaxAge);
+        CPubKey pubkey;
+        if (!reservekey.GetReservedKey(pubkey))
+            throw JSONRPCError(RPC_WALLET_KEYPOOL_RAN_OUT, "Error: Keypool ran out, please call keypoolrefill first");
+
+        const CBlock& block = p->pblocktemplate->block;
+        work.ptemplate = p;
+        work.header = block.GetBlockHeader();
+        work.txCoinbase = block.vtx[0];
+        work.txCoinbase.vout[0].scriptPubKey = CScript() << pubkey << OP_CHECKSIG;
+        work.nExtraNonce = ++nExtraNonce;
+
+        unsigned int nHeight = p->pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
+        if (pvchAux)
+        {
+            vector<unsigned char> vchAux = *pvchAux;
+            work.txCoinbase.vin[0].scriptSig = MakeCoinbaseWithAux(nHeight, work.nExtraNonce, vchAux);
+        }
+        else
+        {
+            work.txCoinbase.vin[0].scriptSig = (CScript() << nHeight << CBigNum(work.nExtraNonce)) + COINBASE_FLAGS;
+            assert(work.txCoinbase.vin[0].scriptSig.size() <= 100);
+        }
+        work.header.hashMerkleRoot = CBlock::CheckMerkleBranch(work.txCoinbase.GetHash(), p->vCoinbaseBranch, 0);
+        work.header.nNonce = 0;
+        {
+            LOCK(cs_main);
+            work.header.UpdateTime(p->pindexPrev);
+        }
+    }
+
+    // Remember work under hash until it is submitted; strLast names a caller
+    // that hands the same work out again until the template changes
+    void KeepWork(const uint256& hash, const CMiningWork& work, const std::string& strLast = "")
+    {
+        LOCK(cs);
+        if (work.ptemplate->pindexPrev != pindexWork)
+            return;
+        if (mapWork.insert(make_pair(hash, work)).second)
+            vWorkOrder.push_back(hash);
+        while (vWorkOrder.size() > MAX_MINING_WORK)
+        {
+            mapWork.erase(vWorkOrder.front());
+            vWorkOrder.pop_front();
+        }
+        if (!strLast.empty())
+            mapLastWork[strLast] = hash;
+    }
+
+    bool GetWork(const uint256& hash, CMiningWork& work)
+    {
+        LOCK(cs);
+        map<uint256, CMiningWork>::const_iterator mi = mapWork.find(hash);
+        if (mi == mapWork.end())
+            return false;
+        work = mi->second;
+        return true;
+    }
+
+    // The work last kept for strLast, if it is on the current template
+    bool GetLastWork(const std::string& strLast, int64 nMaxAge, CMiningWork& work, uint256& hash)
+    {
+        LOCK(cs);
+        boost::shared_ptr<const CSharedTemplate> p = Update(nMaxAge);
+        map<std::string, uint256>::const_iterator mi = mapLastWork.find(strLast);
+        if (mi == mapLastWork.end())
+            return false;
+        map<uint256, CMiningWork>::const_iterator it = mapWork.find(mi->second);
+        if (it == mapWork.end() || it->second.ptemplate != p)
+            return false;
+        hash = mi->second;
+        work = it->second;
+        return true;
+    }
+
+    // Reserve keys are only used under cs
+    bool SubmitWork(CBlock* pblock, CReserveKey& reservekey)
+    {
+        LOCK(cs);
+        return CheckWork(pblock, *pwalletMain, reservekey);
+    }
+
+    void Clear()
+    {
+        LOCK(cs);
+        ptemplate.reset();
+        mapWork.clear();
+        vWorkOrder.clear();
+        mapLastWork.clear();
+        pindexWork = NULL;
+    }
+};
+
+static CMiningTemplates miningTemplates;
+
+// A long poll is answered when the tip moves, when the memory pool has
+// changed and the poll has waited a minute, or after this many seconds
+static const int64 LONGPOLL_MAX_WAIT = 600;
+
+// Wait until the work named by strLongPollId, from GetLongPollId, is out
+// of date or the long poll times out
+static void WaitForNewWork(const std::string& strLongPollId)
+{
+    if (strLongPollId.size() < 64)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid longpollid");
+    uint256 hashWatched(strLongPollId.substr(0, 64));
+    unsigned int nUpdatedWatched = atoi64(strLongPollId.substr(64));
+
+    boost::system_time timeNow = boost::get_system_time();
+    boost::system_time timeTxs = timeNow + boost::posix_time::minutes(1);
+    boost::system_time timeEnd = timeNow + boost::posix_time::seconds(LONGPOLL_MAX_WAIT);
+    boost::unique_lock<boost::mutex> lock(csBestBlock);
+    while (IsRPCRunning() && hashBestChain == hashWatched)
+    {
+        timeNow = boost::get_system_time();
+        bool fTxsChanged = (nTransactionsUpdated != nUpdatedWatched);
+        if ((fTxsChanged && timeNow >= timeTxs) || timeNow >= timeEnd)
+            break;
+        cvBlockChange.timed_wait(lock, fTxsChanged ? std::min(timeTxs, timeEnd) : timeEnd);
+    }
+}
+
 void InitRPCMining()
 {
     if (!pwalletMain)
@@ -80,6 +358,8 @@ void InitRPCMining()
 
 void ShutdownRPCMining()
 {
+    miningTemplates.Clear();
+
     if (!pMiningKey)
         return;
 
@@ -147,6 +427,12 @@ Value getmininginfo(const Array& params, bool fHelp)
             "getmininginfo\n"
             "Returns an object containing mining-related information.");
 
+    vector<double> vHashesPerSec;
+    GetMinerHashesPerSec(vHashesPerSec);
+    Array threadhashes;
+    BOOST_FOREACH(double dThreadHashesPerSec, vHashesPerSec)
+        threadhashes.push_back((boost::int64_t)dThreadHashesPerSec);
+
     Object obj;
     obj.push_back(Pair("blocks",        (int)nBestHeight));
     obj.push_back(Pair("currentblocksize",(uint64_t)nLastBlockSize));
@@ -156,6 +442,7 @@ Value getmininginfo(const Array& params, bool fHelp)
     obj.push_back(Pair("generate",      GetBoolArg("-gen")));
     obj.push_back(Pair("genproclimit",  (int)GetArg("-genproclimit", -1)));
     obj.push_back(Pair("hashespersec",  gethashespersec(params, false)));
+    obj.push_back(Pair("threadhashespersec", threadhashes));
     obj.push_back(Pair("networkhashps", getnetworkhashps(params, false)));
     obj.push_back(Pair("pooledtx",      (uint64_t)mempool.size()));
     obj.push_back(Pair("testnet",       fTestNet));
@@ -178,82 +465,36 @@ Value getworkex(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Syscoin is downloading blocks...");
 
-    typedef map<uint256, pair<CBlock*, CScript> > mapNewBlock_t;
-    static mapNewBlock_t mapNewBlock;    // FIXME: thread safety
-    static vector<CBlockTemplate*> vNewBlockTemplate;
     static CReserveKey reservekey(pwalletMain);
 
     if (params.size() == 0)
     {
-        // Update block
-        static unsigned int nTransactionsUpdatedLast;
-        static CBlockIndex* pindexPrev;
-        static int64 nStart;
-        static CBlockTemplate* pblocktemplate;
-        if (pindexPrev != pindexBest ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
-        {
-            if (pindexPrev != pindexBest)
-            {
-                // Deallocate old blocks since they're obsolete now
-                mapNewBlock.clear();
-                BOOST_FOREACH(CBlockTemplate* pblocktemplate, vNewBlockTemplate)
-                    delete pblocktemplate;
-                vNewBlockTemplate.clear();
-            }
-
-            // Clear pindexPrev so future getworks make a new block, despite any failures from here on
-            pindexPrev = NULL;
-
-            // Store the pindexBest used before CreateNewBlock, to avoid races
-            nTransactionsUpdatedLast = nTransactionsUpdated;
-            CBlockIndex* pindexPrevNew = pindexBest;
-            nStart = GetTime();
-
-            // Create new block
-            pblocktemplate = CreateNewBlockWithKey(*pMiningKey);
-            if (!pblocktemplate)
-                throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-            vNewBlockTemplate.push_back(pblocktemplate);
-
-            // Need to update only after we know CreateNewBlock succeeded
-            pindexPrev = pindexPrevNew;
-        }
-        CBlock* pblock = &pblocktemplate->block; // pointer for convenience
-
-        // Update nTime
-        pblock->UpdateTime(pindexPrev);
-        pblock->nNonce = 0;
-
-        // Update nExtraNonce
-        static unsigned int nExtraNonce = 0;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+        CMiningWork work;
+        miningTemplates.NewWork(reservekey, 60, work);
 
         // Save
-        mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, pblock->vtx[0].vin[0].scriptSig);
+        miningTemplates.KeepWork(work.header.hashMerkleRoot, work);
 
         // Pre-build hash buffers
         char pmidstate[32];
         char pdata[128];
         char phash1[64];
-        FormatHashBuffers(pblock, pmidstate, pdata, phash1);
-
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        CBlock block(work.header);
+        FormatHashBuffers(&block, pmidstate, pdata, phash1);
 
-        CTransaction coinbaseTx = pblock->vtx[0];
-        std::vector<uint256> merkle = pblock->GetMerkleBranch(0);
+        uint256 hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
 
         Object result;
         result.push_back(Pair("data",     HexStr(BEGIN(pdata), END(pdata))));
         result.push_back(Pair("target",   HexStr(BEGIN(hashTarget), END(hashTarget))));
 
         CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
-        ssTx << coinbaseTx;
+        ssTx << work.txCoinbase;
         result.push_back(Pair("coinbase", HexStr(ssTx.begin(), ssTx.end())));
 
         Array merkle_arr;
 
-        BOOST_FOREACH(uint256 merkleh, merkle) {
+        BOOST_FOREACH(uint256 merkleh, work.ptemplate->vCoinbaseBranch) {
             printf("%s\n", merkleh.ToString().c_str());
             merkle_arr.push_back(HexStr(BEGIN(merkleh), END(merkleh)));
         }
@@ -281,21 +522,21 @@ Value getworkex(const Array& params, bool fHelp)
             ((unsigned int*)pdata)[i] = ByteReverse(((unsigned int*)pdata)[i]);
 
         // Get saved block
-        if (!mapNewBlock.count(pdata->hashMerkleRoot))
+        CMiningWork work;
+        if (!miningTemplates.GetWork(pdata->hashMerkleRoot, work))
             return false;
-        CBlock* pblock = mapNewBlock[pdata->hashMerkleRoot].first;
+        CBlock block;
+        work.GetBlock(block);
 
-        pblock->nTime = pdata->nTime;
-        pblock->nNonce = pdata->nNonce;
+        block.nTime = pdata->nTime;
+        block.nNonce = pdata->nNonce;
 
-        if(coinbase.size() == 0)
-            pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
-        else
-            CDataStream(coinbase, SER_NETWORK, PROTOCOL_VERSION) >> pblock->vtx[0];
+        if(coinbase.size() != 0)
+            CDataStream(coinbase, SER_NETWORK, PROTOCOL_VERSION) >> block.vtx[0];
 
-        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+        block.hashMerkleRoot = block.BuildMerkleTree();
 
-        return CheckWork(pblock, *pwalletMain, reservekey);
+        return miningTemplates.SubmitWork(&block, reservekey);
     }
 }
 
@@ -318,66 +559,22 @@ Value getwork(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Syscoin is downloading blocks...");
 
-    typedef map<uint256, pair<CBlock*, CScript> > mapNewBlock_t;
-    static mapNewBlock_t mapNewBlock;    // FIXME: thread safety
-    static vector<CBlockTemplate*> vNewBlockTemplate;
-
     if (params.size() == 0)
     {
-        // Update block
-        static unsigned int nTransactionsUpdatedLast;
-        static CBlockIndex* pindexPrev;
-        static int64 nStart;
-        static CBlockTemplate* pblocktemplate;
-        if (pindexPrev != pindexBest ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
-        {
-            if (pindexPrev != pindexBest)
-            {
-                // Deallocate old blocks since they're obsolete now
-                mapNewBlock.clear();
-                BOOST_FOREACH(CBlockTemplate* pblocktemplate, vNewBlockTemplate)
-                    delete pblocktemplate;
-                vNewBlockTemplate.clear();
-            }
-
-            // Clear pindexPrev so future getworks make a new block, despite any failures from here on
-            pindexPrev = NULL;
-
-            // Store the pindexBest used before CreateNewBlock, to avoid races
-            nTransactionsUpdatedLast = nTransactionsUpdated;
-            CBlockIndex* pindexPrevNew = pindexBest;
-            nStart = GetTime();
-
-            // Create new block
-            pblocktemplate = CreateNewBlockWithKey(*pMiningKey);
-            if (!pblocktemplate)
-                throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-            vNewBlockTemplate.push_back(pblocktemplate);
-
-            // Need to update only after we know CreateNewBlock succeeded
-            pindexPrev = pindexPrevNew;
-        }
-        CBlock* pblock = &pblocktemplate->block; // pointer for convenience
-
-        // Update nTime
-        pblock->UpdateTime(pindexPrev);
-        pblock->nNonce = 0;
-
-        // Update nExtraNonce
-        static unsigned int nExtraNonce = 0;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+        CMiningWork work;
+        miningTemplates.NewWork(*pMiningKey, 60, work);
 
         // Save
-        mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, pblock->vtx[0].vin[0].scriptSig);
+        miningTemplates.KeepWork(work.header.hashMerkleRoot, work);
 
         // Pre-build hash buffers
         char pmidstate[32];
         char pdata[128];
         char phash1[64];
-        FormatHashBuffers(pblock, pmidstate, pdata, phash1);
+        CBlock block(work.header);
+        FormatHashBuffers(&block, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
 
         Object result;
         result.push_back(Pair("midstate", HexStr(BEGIN(pmidstate), END(pmidstate)))); // deprecated
@@ -399,17 +596,18 @@ Value getwork(const Array& params, bool fHelp)
             ((unsigned int*)pdata)[i] = ByteReverse(((unsigned int*)pdata)[i]);
 
         // Get saved block
-        if (!mapNewBlock.count(pdata->hashMerkleRoot))
+        CMiningWork work;
+        if (!miningTemplates.GetWork(pdata->hashMerkleRoot, work))
             return false;
-        CBlock* pblock = mapNewBlock[pdata->hashMerkleRoot].first;
+        CBlock block;
+        work.GetBlock(block);
 
-        pblock->nTime = pdata->nTime;
-        pblock->nNonce = pdata->nNonce;
-        pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
-        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+        block.nTime = pdata->nTime;
+        block.nNonce = pdata->nNonce;
+        block.hashMerkleRoot = block.BuildMerkleTree();
 
         assert(pwalletMain != NULL);
-        return CheckWork(pblock, *pwalletMain, *pMiningKey);
+        return miningTemplates.SubmitWork(&block, *pMiningKey);
     }
 }
 
@@ -434,12 +632,17 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"sizelimit\" : limit of block size\n"
             "  \"bits\" : compressed target of next block\n"
             "  \"height\" : height of the next block\n"
+            "  \"longpollid\" : pass in [params] as \"longpollid\" to wait until this template is out of date\n"
             "See https://en.bitcoin.it/wiki/BIP_0022 for full specification.");
 
     std::string strMode = "template";
+    std::string strLongPollId;
     if (params.size() > 0)
     {
         const Object& oparam = params[0].get_obj();
+        const Value& lpval = find_value(oparam, "longpollid");
+        if (lpval.type() == str_type)
+            strLongPollId = lpval.get_str();
         const Value& modeval = find_value(oparam, "mode");
         if (modeval.type() == str_type)
             strMode = modeval.get_str();
@@ -460,104 +663,47 @@ Value getblocktemplate(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Syscoin is downloading blocks...");
 
-    // Update block
-    static unsigned int nTransactionsUpdatedLast;
-    static CBlockIndex* pindexPrev;
-    static int64 nStart;
-    static CBlockTemplate* pblocktemplate;
-    if (pindexPrev != pindexBest ||
-        (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 5))
-    {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = NULL;
+    if (!strLongPollId.empty())
+        WaitForNewWork(strLongPollId);
 
-        // Store the pindexBest used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = nTransactionsUpdated;
-        CBlockIndex* pindexPrevNew = pindexBest;
-        nStart = GetTime();
-
-        // Create new block
-        if(pblocktemplate)
-        {
-            delete pblocktemplate;
-            pblocktemplate = NULL;
-        }
-        CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = CreateNewBlock(scriptDummy);
-        if (!pblocktemplate)
-            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
-    }
-    CBlock* pblock = &pblocktemplate->block; // pointer for convenience
+    // Update block
+    boost::shared_ptr<const CSharedTemplate> ptemplate = miningTemplates.GetTemplate(5);
+    CBlockIndex* pindexPrev = ptemplate->pindexPrev;
+    const CBlock& block = ptemplate->pblocktemplate->block;
 
     // Update nTime
-    pblock->UpdateTime(pindexPrev);
-    pblock->nNonce = 0;
-
-    Array transactions;
-    map<uint256, int64_t> setTxIndex;
-    int i = 0;
-    BOOST_FOREACH (CTransaction& tx, pblock->vtx)
+    CBlockHeader header = block.GetBlockHeader();
     {
-        uint256 txHash = tx.GetHash();
-        setTxIndex[txHash] = i++;
-
-        if (tx.IsCoinBase())
-            continue;
-
-        Object entry;
-
-        CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
-        ssTx << tx;
-        entry.push_back(Pair("data", HexStr(ssTx.begin(), ssTx.end())));
-
-        entry.push_back(Pair("hash", txHash.GetHex()));
-
-        Array deps;
-        BOOST_FOREACH (const CTxIn &in, tx.vin)
-        {
-            if (setTxIndex.count(in.prevout.hash))
-                deps.push_back(setTxIndex[in.prevout.hash]);
-        }
-        entry.push_back(Pair("depends", deps));
-
-        int index_in_template = i - 1;
-        entry.push_back(Pair("fee", pblocktemplate->vTxFees[index_in_template]));
-        entry.push_back(Pair("sigops", pblocktemplate->vTxSigOps[index_in_template]));
-
-        transactions.push_back(entry);
+        LOCK(cs_main);
+        header.UpdateTime(pindexPrev);
     }
 
     Object aux;
     aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
 
-    uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+    uint256 hashTarget = CBigNum().SetCompact(header.nBits).getuint256();
 
-    static Array aMutable;
-    if (aMutable.empty())
-    {
-        aMutable.push_back("time");
-        aMutable.push_back("transactions");
-        aMutable.push_back("prevblock");
-    }
+    Array aMutable;
+    aMutable.push_back("time");
+    aMutable.push_back("transactions");
+    aMutable.push_back("prevblock");
 
     Object result;
-    result.push_back(Pair("version", pblock->nVersion));
-    result.push_back(Pair("previousblockhash", pblock->hashPrevBlock.GetHex()));
-    result.push_back(Pair("transactions", transactions));
+    result.push_back(Pair("version", header.nVersion));
+    result.push_back(Pair("previousblockhash", header.hashPrevBlock.GetHex()));
+    result.push_back(Pair("transactions", ptemplate->transactions));
     result.push_back(Pair("coinbaseaux", aux));
-    result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].vout[0].nValue));
+    result.push_back(Pair("coinbasevalue", (int64_t)block.vtx[0].vout[0].nValue));
     result.push_back(Pair("target", hashTarget.GetHex()));
     result.push_back(Pair("mintime", (int64_t)pindexPrev->GetMedianTimePast()+1));
     result.push_back(Pair("mutable", aMutable));
     result.push_back(Pair("noncerange", "00000000ffffffff"));
     result.push_back(Pair("sigoplimit", (int64_t)MAX_BLOCK_SIGOPS));
     result.push_back(Pair("sizelimit", (int64_t)MAX_BLOCK_SIZE));
-    result.push_back(Pair("curtime", (int64_t)pblock->nTime));
-    result.push_back(Pair("bits", HexBits(pblock->nBits)));
+    result.push_back(Pair("curtime", (int64_t)header.nTime));
+    result.push_back(Pair("bits", HexBits(header.nBits)));
     result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
+    result.push_back(Pair("longpollid", ptemplate->GetLongPollId()));
 
     return result;
 }
@@ -623,63 +769,26 @@ Value getworkaux(const Array& params, bool fHelp)
         throw JSONRPCError(RPC_METHOD_NOT_FOUND, "getworkaux method is not available until switch-over block.");
     }
 
-    static map<uint256, pair<CBlock*, unsigned int> > mapNewBlock;
-    static vector<CBlockTemplate*> vNewBlockTemplate;
     static CReserveKey reservekey(pwalletMain);
 
     if (params.size() == 1)
     {
-        static vector<unsigned char> vchAuxPrev;
         vector<unsigned char> vchAux = ParseHex(params[0].get_str());
 
-        // Update block
-        static unsigned int nTransactionsUpdatedLast;
-        static CBlockIndex* pindexPrev;
-        static int64 nStart;
-        static CBlockTemplate* pblocktemplate;
-        if (pindexPrev != pindexBest ||
-            vchAux != vchAuxPrev ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
-        {
-            if (pindexPrev != pindexBest)
-            {
-                // Deallocate old blocks since they're obsolete now
-                mapNewBlock.clear();
-                BOOST_FOREACH(CBlockTemplate* pblocktemplate, vNewBlockTemplate)
-                    delete pblocktemplate;
-                vNewBlockTemplate.clear();
-            }
-            nTransactionsUpdatedLast = nTransactionsUpdated;
-            pindexPrev = pindexBest;
-            vchAuxPrev = vchAux;
-            nStart = GetTime();
-
-            // Create new block
-            pblocktemplate = CreateNewBlockWithKey(reservekey);
-            if (!pblocktemplate)
-                throw JSONRPCError(-7, "Out of memory");
-            vNewBlockTemplate.push_back(pblocktemplate);
-        }
-        CBlock* pblock = &pblocktemplate->block; // pointer for convenience
-
-        // Update nTime
-        pblock->nTime = max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
-        pblock->nNonce = 0;
-
-        // Update nExtraNonce
-        static unsigned int nExtraNonce = 0;
-        IncrementExtraNonceWithAux(pblock, pindexPrev, nExtraNonce, vchAux);
+        CMiningWork work;
+        miningTemplates.NewWork(reservekey, 60, work, &vchAux);
 
         // Save
-        mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, nExtraNonce);
+        miningTemplates.KeepWork(work.header.hashMerkleRoot, work);
 
         // Prebuild hash buffers
         char pmidstate[32];
         char pdata[128];
         char phash1[64];
-        FormatHashBuffers(pblock, pmidstate, pdata, phash1);
+        CBlock block(work.header);
+        FormatHashBuffers(&block, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
 
         Object result;
         result.push_back(Pair("midstate", HexStr(BEGIN(pmidstate), END(pmidstate))));
@@ -703,10 +812,12 @@ Value getworkaux(const Array& params, bool fHelp)
             ((unsigned int*)pdata)[i] = ByteReverse(((unsigned int*)pdata)[i]);
 
         // Get saved block
-        if (!mapNewBlock.count(pdata->hashMerkleRoot))
+        CMiningWork work;
+        if (!miningTemplates.GetWork(pdata->hashMerkleRoot, work))
             return false;
-        CBlock* pblock = mapNewBlock[pdata->hashMerkleRoot].first;
-        unsigned int nExtraNonce = mapNewBlock[pdata->hashMerkleRoot].second;
+        CBlock block;
+        work.GetBlock(block);
+        CBlock* pblock = &block; // pointer for convenience
 
         pblock->nTime = pdata->nTime;
         pblock->nNonce = pdata->nNonce;
@@ -724,8 +835,6 @@ Value getworkaux(const Array& params, bool fHelp)
         script.GetOp(pc, opcode, vchAux);
 
         RemoveMergedMiningHeader(vchAux);
-		unsigned int nHeight = pindexBest->nHeight+1; // Height first in coinbase required for block.version=2
-        pblock->vtx[0].vin[0].scriptSig = MakeCoinbaseWithAux(nHeight, nExtraNonce, vchAux);
         pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 
         if (params.size() > 2)
@@ -742,7 +851,10 @@ Value getworkaux(const Array& params, bool fHelp)
                 pow.vChainMerkleBranch.push_back(nHash);
             }
 
-            pow.SetMerkleBranch(pblock);
+            {
+                LOCK(cs_main);
+                pow.SetMerkleBranch(pblock);
+            }
             pow.nChainIndex = nChainIndex;
             pow.parentBlockHeader = *pblock;
             CDataStream ss(SER_GETHASH | SER_GETAUXHASH, PROTOCOL_VERSION);
@@ -755,7 +867,7 @@ Value getworkaux(const Array& params, bool fHelp)
         {
             if (params[0].get_str() == "submit")
             {
-                return CheckWork(pblock, *pwalletMain, reservekey);
+                return miningTemplates.SubmitWork(pblock, reservekey);
             }
             else
             {
@@ -770,11 +882,13 @@ Value getworkaux(const Array& params, bool fHelp)
 
 Value getauxblock(const Array& params, bool fHelp)
 {
-    if (fHelp || (params.size() != 0 && params.size() != 2))
+    if (fHelp || params.size() > 2)
         throw runtime_error(
             "getauxblock [<hash> <auxpow>]\n"
+            "getauxblock <longpollid>\n"
             " create a new block"
             "If <hash>, <auxpow> is not specified, returns a new block hash.\n"
+            "With <longpollid> from an earlier reply, waits until that block is out of date first.\n"
             "If <hash>, <auxpow> is specified, tries to solve the block based on "
             "the aux proof of work and returns true if it was successful.");
 
@@ -788,61 +902,35 @@ Value getauxblock(const Array& params, bool fHelp)
     if ((pindexBest->nHeight+1) < GetAuxPowStartBlock()) {
         throw JSONRPCError(RPC_METHOD_NOT_FOUND, "getauxblock method is not available until switch-over block.");
     }
-    static map<uint256, CBlock*> mapNewBlock;
-    static vector<CBlockTemplate*> vNewBlockTemplate;
     static CReserveKey reservekey(pwalletMain);
 
-    if (params.size() == 0)
+    if (params.size() < 2)
     {
-        // Update block
-        static unsigned int nTransactionsUpdatedLast;
-        static CBlockIndex* pindexPrev;
-        static int64 nStart;
-	static CBlock* pblock;
-        static CBlockTemplate* pblocktemplate;
-        if (pindexPrev != pindexBest ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
-        {
-            if (pindexPrev != pindexBest)
-            {
-                // Deallocate old blocks since they're obsolete now
-                mapNewBlock.clear();
-                BOOST_FOREACH(CBlockTemplate* pblocktemplate, vNewBlockTemplate)
-                    delete pblocktemplate;
-                vNewBlockTemplate.clear();
-            }
-            nTransactionsUpdatedLast = nTransactionsUpdated;
-            pindexPrev = pindexBest;
-            nStart = GetTime();
-
-            // Create new block with nonce = 0 and extraNonce = 1
-            pblocktemplate = CreateNewBlockWithKey(reservekey);
-            if (!pblocktemplate)
-                throw JSONRPCError(-7, "Out of memory");
+        if (params.size() == 1)
+            WaitForNewWork(params[0].get_str());
 
-	    pblock = &pblocktemplate->block;
-            // Update nTime
-            pblock->nTime = max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
-            pblock->nNonce = 0;
-
-            static unsigned int nExtraNonce = 0;
-            IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+        // The same block is handed out until the template is refreshed
+        CMiningWork work;
+        uint256 hash;
+        if (!miningTemplates.GetLastWork("getauxblock", 60, work, hash))
+        {
+            miningTemplates.NewWork(reservekey, 60, work);
 
             // Sets the version
-            pblock->SetAuxPow(new CAuxPow());
+            work.header.SetAuxPow(new CAuxPow());
 
             // Save
-            mapNewBlock[pblock->GetHash()] = pblock;
-
-            vNewBlockTemplate.push_back(pblocktemplate);
+            hash = work.header.GetHash();
+            miningTemplates.KeepWork(hash, work, "getauxblock");
         }
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = CBigNum().SetCompact(work.header.nBits).getuint256();
 
         Object result;
         result.push_back(Pair("target",   HexStr(BEGIN(hashTarget), END(hashTarget))));
-        result.push_back(Pair("hash", pblock->GetHash().GetHex()));
-        result.push_back(Pair("chainid", pblock->GetChainID()));
+        result.push_back(Pair("hash", hash.GetHex()));
+        result.push_back(Pair("chainid", work.header.GetChainID()));
+        result.push_back(Pair("longpollid", work.ptemplate->GetLongPollId()));
         return result;
     }
     else
@@ -853,13 +941,18 @@ Value getauxblock(const Array& params, bool fHelp)
         CDataStream ss(vchAuxPow, SER_GETHASH | SER_GETAUXHASH, PROTOCOL_VERSION);
         CAuxPow* pow = new CAuxPow();
         ss >> *pow;
-        if (!mapNewBlock.count(hash))
+        CMiningWork work;
+        if (!miningTemplates.GetWork(hash, work))
+        {
+            delete pow;
             return ::error("getauxblock() : block not found");
+        }
 
-        CBlock* pblock = mapNewBlock[hash];
-        pblock->SetAuxPow(pow);
+        CBlock block;
+        work.GetBlock(block);
+        block.SetAuxPow(pow);
 
-        if (!CheckWork(pblock, *pwalletMain, reservekey))
+        if (!miningTemplates.SubmitWork(&block, reservekey))
         {
             return false;
         }
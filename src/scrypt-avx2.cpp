@@ -0,0 +1,117 @@
+/*
+ * Copyright 2009 Colin Percival, 2011 ArtForz, 2012-2013 pooler
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * This file was originally written by Colin Percival as part of the Tarsnap
+ * online backup system.
+ */
+
+#include "scrypt.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <openssl/sha.h>
+
+#include <immintrin.h>
+
+#define ROTL_8WAY(a, b) _mm256_or_si256(_mm256_slli_epi32((a), (b)), _mm256_srli_epi32((a), 32 - (b)))
+#define QR_8WAY(a, b, c, d) \
+	b = _mm256_xor_si256(b, ROTL_8WAY(_mm256_add_epi32(a, d),  7)); \
+	c = _mm256_xor_si256(c, ROTL_8WAY(_mm256_add_epi32(b, a),  9)); \
+	d = _mm256_xor_si256(d, ROTL_8WAY(_mm256_add_epi32(c, b), 13)); \
+	a = _mm256_xor_si256(a, ROTL_8WAY(_mm256_add_epi32(d, c), 18));
+
+/* Salsa20/8 on eight independent states, word k of every state in B[k]. */
+static inline void xor_salsa8_8way(__m256i B[16], const __m256i Bx[16])
+{
+	__m256i x[16];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		x[i] = B[i] = _mm256_xor_si256(B[i], Bx[i]);
+	for (i = 0; i < 8; i += 2) {
+		/* Operate on columns. */
+		QR_8WAY(x[ 0], x[ 4], x[ 8], x[12]);
+		QR_8WAY(x[ 5], x[ 9], x[13], x[ 1]);
+		QR_8WAY(x[10], x[14], x[ 2], x[ 6]);
+		QR_8WAY(x[15], x[ 3], x[ 7], x[11]);
+
+		/* Operate on rows. */
+		QR_8WAY(x[ 0], x[ 1], x[ 2], x[ 3]);
+		QR_8WAY(x[ 5], x[ 6], x[ 7], x[ 4]);
+		QR_8WAY(x[10], x[11], x[ 8], x[ 9]);
+		QR_8WAY(x[15], x[12], x[13], x[14]);
+	}
+	for (i = 0; i < 16; i++)
+		B[i] = _mm256_add_epi32(B[i], x[i]);
+}
+
+/*
+ * Hash eight 80-byte headers laid end to end in input, writing eight 32-byte
+ * hashes to output. Same layout as the SSE2 4-way kernel with twice the
+ * lanes; the scratchpad holds 8 * 128 KiB.
+ */
+void scrypt_1024_1_1_256_sp_avx2_8way(const char *input, char *output, char *scratchpad)
+{
+	uint8_t B[8][128];
+	union {
+		__m256i i256[32];
+		uint32_t u32[32][8];
+	} X;
+	__m256i *V;
+	uint32_t *V32;
+	uint32_t i, j, k, l;
+
+	V = (__m256i *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+	V32 = (uint32_t *)V;
+
+	for (l = 0; l < 8; l++) {
+		PBKDF2_SHA256((const uint8_t *)input + 80 * l, 80, (const uint8_t *)input + 80 * l, 80, 1, B[l], 128);
+		for (k = 0; k < 32; k++)
+			X.u32[k][l] = le32dec(&B[l][4 * k]);
+	}
+
+	for (i = 0; i < 1024; i++) {
+		for (k = 0; k < 32; k++)
+			V[i * 32 + k] = X.i256[k];
+		xor_salsa8_8way(&X.i256[0], &X.i256[16]);
+		xor_salsa8_8way(&X.i256[16], &X.i256[0]);
+	}
+	for (i = 0; i < 1024; i++) {
+		/* Each lane reads its own block, so gather a lane at a time. */
+		for (l = 0; l < 8; l++) {
+			j = 32 * (X.u32[16][l] & 1023);
+			for (k = 0; k < 32; k++)
+				X.u32[k][l] ^= V32[(j + k) * 8 + l];
+		}
+		xor_salsa8_8way(&X.i256[0], &X.i256[16]);
+		xor_salsa8_8way(&X.i256[16], &X.i256[0]);
+	}
+
+	for (l = 0; l < 8; l++) {
+		for (k = 0; k < 32; k++)
+			le32enc(&B[l][4 * k], X.u32[k][l]);
+		PBKDF2_SHA256((const uint8_t *)input + 80 * l, 80, B[l], 128, 1, (uint8_t *)output + 32 * l, 32);
+	}
+}
@@ -134,3 +134,84 @@ void scrypt_1024_1_1_256_sp_sse2(const char *input, char *output, char *scratchp
 
 	PBKDF2_SHA256((const uint8_t *)input, 80, B, 128, 1, (uint8_t *)output, 32);
 }
+
+#define ROTL_4WAY(a, b) _mm_or_si128(_mm_slli_epi32((a), (b)), _mm_srli_epi32((a), 32 - (b)))
+#define QR_4WAY(a, b, c, d) \
+	b = _mm_xor_si128(b, ROTL_4WAY(_mm_add_epi32(a, d),  7)); \
+	c = _mm_xor_si128(c, ROTL_4WAY(_mm_add_epi32(b, a),  9)); \
+	d = _mm_xor_si128(d, ROTL_4WAY(_mm_add_epi32(c, b), 13)); \
+	a = _mm_xor_si128(a, ROTL_4WAY(_mm_add_epi32(d, c), 18));
+
+/* Salsa20/8 on four independent states, word k of every state in B[k]. */
+static inline void xor_salsa8_4way(__m128i B[16], const __m128i Bx[16])
+{
+	__m128i x[16];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		x[i] = B[i] = _mm_xor_si128(B[i], Bx[i]);
+	for (i = 0; i < 8; i += 2) {
+		/* Operate on columns. */
+		QR_4WAY(x[ 0], x[ 4], x[ 8], x[12]);
+		QR_4WAY(x[ 5], x[ 9], x[13], x[ 1]);
+		QR_4WAY(x[10], x[14], x[ 2], x[ 6]);
+		QR_4WAY(x[15], x[ 3], x[ 7], x[11]);
+
+		/* Operate on rows. */
+		QR_4WAY(x[ 0], x[ 1], x[ 2], x[ 3]);
+		QR_4WAY(x[ 5], x[ 6], x[ 7], x[ 4]);
+		QR_4WAY(x[10], x[11], x[ 8], x[ 9]);
+		QR_4WAY(x[15], x[12], x[13], x[14]);
+	}
+	for (i = 0; i < 16; i++)
+		B[i] = _mm_add_epi32(B[i], x[i]);
+}
+
+/*
+ * Hash four 80-byte headers laid end to end in input, writing four 32-byte
+ * hashes to output. The states are interleaved a word per lane, so a single
+ * salsa round advances all four; the scratchpad holds 4 * 128 KiB.
+ */
+void scrypt_1024_1_1_256_sp_sse2_4way(const char *input, char *output, char *scratchpad)
+{
+	uint8_t B[4][128];
+	union {
+		__m128i i128[32];
+		uint32_t u32[32][4];
+	} X;
+	__m128i *V;
+	uint32_t *V32;
+	uint32_t i, j, k, l;
+
+	V = (__m128i *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+	V32 = (uint32_t *)V;
+
+	for (l = 0; l < 4; l++) {
+		PBKDF2_SHA256((const uint8_t *)input + 80 * l, 80, (const uint8_t *)input + 80 * l, 80, 1, B[l], 128);
+		for (k = 0; k < 32; k++)
+			X.u32[k][l] = le32dec(&B[l][4 * k]);
+	}
+
+	for (i = 0; i < 1024; i++) {
+		for (k = 0; k < 32; k++)
+			V[i * 32 + k] = X.i128[k];
+		xor_salsa8_4way(&X.i128[0], &X.i128[16]);
+		xor_salsa8_4way(&X.i128[16], &X.i128[0]);
+	}
+	for (i = 0; i < 1024; i++) {
+		/* Each lane reads its own block, so gather a lane at a time. */
+		for (l = 0; l < 4; l++) {
+			j = 32 * (X.u32[16][l] & 1023);
+			for (k = 0; k < 32; k++)
+				X.u32[k][l] ^= V32[(j + k) * 4 + l];
+		}
+		xor_salsa8_4way(&X.i128[0], &X.i128[16]);
+		xor_salsa8_4way(&X.i128[16], &X.i128[0]);
+	}
+
+	for (l = 0; l < 4; l++) {
+		for (k = 0; k < 32; k++)
+			le32enc(&B[l][4 * k], X.u32[k][l]);
+		PBKDF2_SHA256((const uint8_t *)input + 80 * l, 80, B[l], 128, 1, (uint8_t *)output + 32 * l, 32);
+	}
+}
@@ -32,9 +32,10 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <new>
 #include <openssl/sha.h>
 
-#if defined(USE_SSE2) && !defined(USE_SSE2_ALWAYS)
+#if defined(USE_SSE2) && (!defined(USE_SSE2_ALWAYS) || defined(USE_AVX2))
 #ifdef _MSC_VER
 // MSVC 64bit is unable to use inline asm
 #include <intrin.h>
@@ -286,14 +287,65 @@ void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scrat
 	PBKDF2_SHA256((const uint8_t *)input, 80, B, 128, 1, (uint8_t *)output, 32);
 }
 
+// Multi-lane kernel used by the batch API and the number of headers it takes,
+// one (no kernel) until scrypt_detect_sse2() picks one
+static void (*scrypt_1024_1_1_256_sp_multi_detected)(const char *input, char *output, char *scratchpad) = NULL;
+static int scrypt_multi_detected_ways = 1;
+
 #if defined(USE_SSE2)
 // By default, set to generic scrypt function. This will prevent crash in case when scrypt_detect_sse2() wasn't called
 void (*scrypt_1024_1_1_256_sp_detected)(const char *input, char *output, char *scratchpad) = &scrypt_1024_1_1_256_sp_generic;
 
+#if defined(USE_AVX2)
+// AVX2 needs both CPU support and the OS saving the ymm registers
+static bool scrypt_detect_avx2()
+{
+#if defined(_MSC_VER)
+    int x86cpuid[4];
+    __cpuid(x86cpuid, 0);
+    if (x86cpuid[0] < 7)
+        return false;
+    __cpuid(x86cpuid, 1);
+    if ((x86cpuid[2] & (1<<27 | 1<<28)) != (1<<27 | 1<<28))
+        return false;
+    if ((_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(x86cpuid, 7, 0);
+    return (x86cpuid[1] & 1<<5) != 0;
+#else // _MSC_VER
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid_max(0, NULL) < 7)
+        return false;
+    __cpuid(1, eax, ebx, ecx, edx);
+    if ((ecx & (1<<27 | 1<<28)) != (1<<27 | 1<<28))
+        return false;
+    __asm__ ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    if ((eax & 6) != 6)
+        return false;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & 1<<5) != 0;
+#endif // _MSC_VER
+}
+#endif // USE_AVX2
+
 void scrypt_detect_sse2()
 {
+#if defined(USE_AVX2)
+    if (scrypt_detect_avx2())
+    {
+        scrypt_1024_1_1_256_sp_multi_detected = &scrypt_1024_1_1_256_sp_avx2_8way;
+        scrypt_multi_detected_ways = 8;
+        printf("scrypt: using scrypt-avx2 8-way for batches as detected.\n");
+    }
+#endif // USE_AVX2
+
 #if defined(USE_SSE2_ALWAYS)
     printf("scrypt: using scrypt-sse2 as built.\n");
+    if (scrypt_multi_detected_ways < 4)
+    {
+        scrypt_1024_1_1_256_sp_multi_detected = &scrypt_1024_1_1_256_sp_sse2_4way;
+        scrypt_multi_detected_ways = 4;
+    }
 #else // USE_SSE2_ALWAYS
     // 32bit x86 Linux or Windows, detect cpuid features
     unsigned int cpuid_edx=0;
@@ -312,6 +364,11 @@ void scrypt_detect_sse2()
     {
         scrypt_1024_1_1_256_sp_detected = &scrypt_1024_1_1_256_sp_sse2;
         printf("scrypt: using scrypt-sse2 as detected.\n");
+        if (scrypt_multi_detected_ways < 4)
+        {
+            scrypt_1024_1_1_256_sp_multi_detected = &scrypt_1024_1_1_256_sp_sse2_4way;
+            scrypt_multi_detected_ways = 4;
+        }
     }
     else
     {
@@ -327,3 +384,37 @@ void scrypt_1024_1_1_256(const char *input, char *output)
 	char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
     scrypt_1024_1_1_256_sp(input, output, scratchpad);
 }
+
+int scrypt_multi_ways()
+{
+    return scrypt_multi_detected_ways;
+}
+
+void scrypt_1024_1_1_256_multi_sp(const char *input, char *output, char *scratchpad, unsigned int nCount)
+{
+    unsigned int nWays = scrypt_multi_detected_ways;
+    unsigned int i = 0;
+    if (scrypt_1024_1_1_256_sp_multi_detected != NULL)
+        for (; i + nWays <= nCount; i += nWays)
+            scrypt_1024_1_1_256_sp_multi_detected(input + 80 * i, output + 32 * i, scratchpad);
+    for (; i < nCount; i++)
+        scrypt_1024_1_1_256_sp(input + 80 * i, output + 32 * i, scratchpad);
+}
+
+void scrypt_1024_1_1_256_multi(const char *input, char *output, unsigned int nCount)
+{
+    if (scrypt_1024_1_1_256_sp_multi_detected == NULL || nCount < (unsigned int)scrypt_multi_detected_ways)
+    {
+        char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
+        for (unsigned int i = 0; i < nCount; i++)
+            scrypt_1024_1_1_256_sp(input + 80 * i, output + 32 * i, scratchpad);
+        return;
+    }
+
+    // too big for the stack of every thread, unlike the single-lane scratchpad
+    char *scratchpad = (char *)malloc(SCRYPT_MULTI_SCRATCHPAD_SIZE);
+    if (scratchpad == NULL)
+        throw std::bad_alloc();
+    scrypt_1024_1_1_256_multi_sp(input, output, scratchpad, nCount);
+    free(scratchpad);
+}
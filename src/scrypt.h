@@ -21,11 +21,28 @@ void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scrat
 
 void scrypt_detect_sse2();
 void scrypt_1024_1_1_256_sp_sse2(const char *input, char *output, char *scratchpad);
+void scrypt_1024_1_1_256_sp_sse2_4way(const char *input, char *output, char *scratchpad);
 extern void (*scrypt_1024_1_1_256_sp_detected)(const char *input, char *output, char *scratchpad);
+#if defined(USE_AVX2)
+void scrypt_1024_1_1_256_sp_avx2_8way(const char *input, char *output, char *scratchpad);
+#endif
 #else
+#if defined(USE_AVX2)
+#error "USE_AVX2 requires USE_SSE2"
+#endif
 #define scrypt_1024_1_1_256_sp(input, output, scratchpad) scrypt_1024_1_1_256_sp_generic((input), (output), (scratchpad))
 #endif
 
+// Batch API: hash nCount 80-byte headers laid end to end in input, writing
+// nCount 32-byte hashes to output. Groups of scrypt_multi_ways() headers go
+// through the widest kernel the CPU supports, the rest one at a time.
+static const int SCRYPT_MAX_WAYS = 8;
+static const int SCRYPT_MULTI_SCRATCHPAD_SIZE = SCRYPT_MAX_WAYS * 131072 + 63;
+
+int scrypt_multi_ways();
+void scrypt_1024_1_1_256_multi_sp(const char *input, char *output, char *scratchpad, unsigned int nCount);
+void scrypt_1024_1_1_256_multi(const char *input, char *output, unsigned int nCount);
+
 void
 PBKDF2_SHA256(const uint8_t *passwd, size_t passwdlen, const uint8_t *salt,
     size_t saltlen, uint64_t c, uint8_t *buf, size_t dkLen);
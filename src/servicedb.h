@@ -0,0 +1,595 @@
+// Copyright (c) 2014 Syscoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+//
+#ifndef SERVICEDB_H
+#define SERVICEDB_H
+
+#include "leveldb.h"
+#include "sync.h"
+#include "util.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/tss.hpp>
+
+/** Height in the key of a history row, big-endian so that the rows of a
+ *  record sort by height */
+class CHeightKey {
+public:
+    uint64 nHeight;
+
+    CHeightKey() {
+        nHeight = 0;
+    }
+
+    CHeightKey(uint64 nHeightIn) {
+        nHeight = nHeightIn;
+    }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        return sizeof(nHeight);
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const {
+        unsigned char buf[sizeof(nHeight)];
+        for (unsigned int i = 0; i < sizeof(nHeight); i++)
+            buf[i] = (nHeight >> (8 * (sizeof(nHeight) - 1 - i))) & 0xff;
+        s.write((char*)buf, sizeof(buf));
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        unsigned char buf[sizeof(nHeight)];
+        s.read((char*)buf, sizeof(buf));
+        nHeight = 0;
+        for (unsigned int i = 0; i < sizeof(nHeight); i++)
+            nHeight = (nHeight << 8) | buf[i];
+    }
+};
+
+/** One version of an alias, offer or cert issuer, with the height of the
+ *  version before it (-1 for the first), so the latest version can be taken
+ *  off without looking through the others. */
+template<typename T> class CServiceVersion {
+public:
+    int64 nHeight;
+    int64 nPrevHeight;
+    T value;
+
+    CServiceVersion() {
+        nHeight = nPrevHeight = -1;
+    }
+
+    IMPLEMENT_SERIALIZE (
+        READWRITE(nHeight);
+        READWRITE(nPrevHeight);
+        READWRITE(value);
+    )
+};
+
+/** Snapshots of the service databases taken together, right after all of
+ *  them were flushed at the block at nHeight. The one published last is what
+ *  a CServiceReadView reads. */
+class CServiceSnapshot
+{
+    friend class CServiceReadView;
+
+private:
+    static CCriticalSection &CsPublished() {
+        static CCriticalSection cs;
+        return cs;
+    }
+
+    static boost::shared_ptr<const CServiceSnapshot> &Published() {
+        static boost::shared_ptr<const CServiceSnapshot> psnapshot;
+        return psnapshot;
+    }
+
+    static boost::thread_specific_ptr<boost::shared_ptr<const CServiceSnapshot> > &Bound() {
+        static boost::thread_specific_ptr<boost::shared_ptr<const CServiceSnapshot> > pbound;
+        return pbound;
+    }
+
+public:
+    int nHeight;
+    std::map<const CLevelDB*, boost::shared_ptr<CLevelDBSnapshot> > mapSnapshots;
+
+    CServiceSnapshot() {
+        nHeight = -1;
+    }
+
+    // the snapshot of a database, NULL if it was not taken with the others
+    const CLevelDBSnapshot *Get(const CLevelDB *pdb) const {
+        std::map<const CLevelDB*, boost::shared_ptr<CLevelDBSnapshot> >::const_iterator it = mapSnapshots.find(pdb);
+        return it == mapSnapshots.end() ? NULL : it->second.get();
+    }
+
+    // take a snapshot of each database, with nothing staged in any of them,
+    // and publish them in place of the last ones
+    static void Publish(const std::vector<CLevelDB*> &vpdb, int nHeight) {
+        boost::shared_ptr<CServiceSnapshot> psnapshot(new CServiceSnapshot());
+        psnapshot->nHeight = nHeight;
+        for (unsigned int i = 0; i < vpdb.size(); i++)
+            psnapshot->mapSnapshots[vpdb[i]] = vpdb[i]->GetSnapshot();
+        LOCK(CsPublished());
+        Published() = psnapshot;
+    }
+
+    // drop the published snapshots, before the databases are closed
+    static void Release() {
+        LOCK(CsPublished());
+        Published().reset();
+    }
+
+    // the snapshots reads on this thread go to, NULL if none
+    static const CServiceSnapshot *GetBound() {
+        boost::shared_ptr<const CServiceSnapshot> *pbound = Bound().get();
+        return pbound ? pbound->get() : NULL;
+    }
+};
+
+/** While one is alive, reads on its thread from the service databases, by
+ *  Read, Exists, NewIterator and everything built on them, see the published
+ *  CServiceSnapshot and none of the changes staged since. The query RPCs use
+ *  it to run without cs_main: block connection can go on beside them and all
+ *  they read is as of one block. Views on the same thread nest. */
+class CServiceReadView
+{
+private:
+    bool fBound;
+
+public:
+    int nHeight; // height of the block the reads are as of, -1 if none is published
+
+    CServiceReadView() : fBound(false), nHeight(-1) {
+        const CServiceSnapshot *pbound = CServiceSnapshot::GetBound();
+        if (pbound != NULL) {
+            nHeight = pbound->nHeight;
+            return;
+        }
+        boost::shared_ptr<const CServiceSnapshot> psnapshot;
+        {
+            LOCK(CServiceSnapshot::CsPublished());
+            psnapshot = CServiceSnapshot::Published();
+        }
+        if (!psnapshot)
+            return;
+        nHeight = psnapshot->nHeight;
+        CServiceSnapshot::Bound().reset(new boost::shared_ptr<const CServiceSnapshot>(psnapshot));
+        fBound = true;
+    }
+
+    ~CServiceReadView() {
+        if (fBound)
+            CServiceSnapshot::Bound().reset();
+    }
+};
+
+/** LevelDB store for the alias, offer and cert state that keeps its changes
+ *  in memory until Flush(), in the way CCoinsViewCache sits on top of the
+ *  coin database.
+ *
+ *  Writes and erases are staged and seen by Read and Exists right away; Flush
+ *  commits them to disk as a single batch, so the database only ever holds
+ *  the state as of a whole block. Between TxnBegin and TxnCommit changes go
+ *  to a separate layer that TxnAbort throws away, which lets a failed block
+ *  connect leave nothing behind. Iterators only see what has been flushed.
+ *
+ *  Preload reads records from disk ahead of the reads that want them, from
+ *  any thread; they are served from memory until the next ClearPreload or
+ *  Flush.
+ *
+ *  On a thread with a CServiceReadView, reads skip all of the above and go to
+ *  the published snapshot of the database instead.
+ */
+class CServiceDB : public CLevelDB
+{
+protected:
+    // serialized key -> (fErased, serialized value)
+    typedef std::map<std::string, std::pair<bool, std::string> > cache_map;
+
+    mutable CCriticalSection cs_cache;
+    cache_map mapCache;  // changes not yet written to disk
+    cache_map mapTxn;    // changes since TxnBegin
+    cache_map mapPreload; // records read ahead, (fMissing, value) as on disk
+    bool fTxn;
+
+    template<typename K> static std::string KeyString(const K& key) {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(ssKey.GetSerializeSize(key));
+        ssKey << key;
+        return ssKey.str();
+    }
+
+    // NULL if the key is not cached
+    const std::pair<bool, std::string> *Lookup(const std::string &strKey) const {
+        cache_map::const_iterator it = mapTxn.find(strKey);
+        if (it != mapTxn.end())
+            return &it->second;
+        it = mapCache.find(strKey);
+        if (it != mapCache.end())
+            return &it->second;
+        it = mapPreload.find(strKey);
+        if (it != mapPreload.end())
+            return &it->second;
+        return NULL;
+    }
+
+    // the snapshot reads on this thread go to, NULL for the live state
+    const CLevelDBSnapshot *GetReadSnapshot() const {
+        const CServiceSnapshot *pbound = CServiceSnapshot::GetBound();
+        return pbound ? pbound->Get(this) : NULL;
+    }
+
+    void Stage(const std::string &strKey, bool fErased, const std::string &strValue) {
+        std::pair<bool, std::string> &entry = (fTxn ? mapTxn : mapCache)[strKey];
+        entry.first = fErased;
+        entry.second = strValue;
+    }
+
+    // the first key after all those starting with strPrefix, empty if none
+    static std::string PrefixEnd(std::string strPrefix) {
+        while (!strPrefix.empty() && (unsigned char)strPrefix[strPrefix.size() - 1] == 0xff)
+            strPrefix.erase(strPrefix.size() - 1);
+        if (!strPrefix.empty())
+            strPrefix[strPrefix.size() - 1]++;
+        return strPrefix;
+    }
+
+    // the keys and values from strBegin up to strEnd (no limit if empty),
+    // staged changes included. With nMax set only the first nMax keys on
+    // disk, and the staged ones among them, are read.
+    void ReadRange(const std::string &strBegin, const std::string &strEnd, std::map<std::string, std::string> &mapRange, unsigned int nMax = 0) {
+        mapRange.clear();
+        std::string strLimit = strEnd;
+        const CLevelDBSnapshot *psnapshot = GetReadSnapshot();
+        leveldb::Iterator *pcursor = CLevelDB::NewIterator(psnapshot);
+        for (pcursor->Seek(strBegin); pcursor->Valid(); pcursor->Next()) {
+            std::string strKey = pcursor->key().ToString();
+            if (!strEnd.empty() && strKey >= strEnd)
+                break;
+            if (nMax > 0 && mapRange.size() >= nMax) {
+                strLimit = strKey;
+                break;
+            }
+            mapRange[strKey] = pcursor->value().ToString();
+        }
+        delete pcursor;
+        if (psnapshot)
+            return;
+
+        LOCK(cs_cache);
+        const cache_map *layers[2] = { &mapCache, &mapTxn };
+        for (int i = 0; i < 2; i++) {
+            for (cache_map::const_iterator it = layers[i]->lower_bound(strBegin); it != layers[i]->end(); it++) {
+                if (!strLimit.empty() && it->first >= strLimit)
+                    break;
+                if (it->second.first)
+                    mapRange.erase(it->first);
+                else
+                    mapRange[it->first] = it->second.second;
+            }
+        }
+    }
+
+    // the keys and values under a prefix, staged changes included
+    void ReadRange(const std::string &strPrefix, std::map<std::string, std::string> &mapRange) {
+        ReadRange(strPrefix, PrefixEnd(strPrefix), mapRange);
+    }
+
+    // Versioned records: the latest version of a record is its head under
+    // (strHead, name), and every version is a history row under
+    // (strHist, (name, height)).
+
+    template<typename T> bool ReadHead(const std::string &strHead, const std::vector<unsigned char> &vchName, CServiceVersion<T> &head) {
+        return Read(make_pair(strHead, vchName), head);
+    }
+
+    template<typename T> bool ReadVersion(const std::string &strHist, const std::vector<unsigned char> &vchName, int64 nHeight, CServiceVersion<T> &version) {
+        return Read(make_pair(strHist, make_pair(vchName, CHeightKey(nHeight))), version);
+    }
+
+    // make value the version at nHeight, replacing one already there
+    template<typename T> bool PutVersion(const std::string &strHead, const std::string &strHist, const std::vector<unsigned char> &vchName, int64 nHeight, const T &value) {
+        CServiceVersion<T> head, version;
+        version.nHeight = nHeight;
+        version.value = value;
+        if (ReadHead(strHead, vchName, head)) {
+            if (nHeight < head.nHeight)
+                return error("PutVersion() : %s version at %"PRI64d" is below the head at %"PRI64d,
+                        strHead.c_str(), nHeight, head.nHeight);
+            version.nPrevHeight = nHeight == head.nHeight ? head.nPrevHeight : head.nHeight;
+        }
+        return Write(make_pair(strHist, make_pair(vchName, CHeightKey(nHeight))), version)
+            && Write(make_pair(strHead, vchName), version);
+    }
+
+    // take the head off, making the version before it the head
+    template<typename T> bool PopVersion(const std::string &strHead, const std::string &strHist, const std::vector<unsigned char> &vchName, const CServiceVersion<T> &head) {
+        if (!Erase(make_pair(strHist, make_pair(vchName, CHeightKey(head.nHeight)))))
+            return false;
+        if (head.nPrevHeight < 0)
+            return Erase(make_pair(strHead, vchName));
+        CServiceVersion<T> prev;
+        if (!ReadVersion(strHist, vchName, head.nPrevHeight, prev))
+            return error("PopVersion() : %s version at %"PRI64d" is missing", strHead.c_str(), head.nPrevHeight);
+        return Write(make_pair(strHead, vchName), prev);
+    }
+
+    // all versions of a record, oldest first
+    template<typename T> bool ReadHistory(const std::string &strHist, const std::vector<unsigned char> &vchName, std::vector<T> &vtxPos) {
+        vtxPos.clear();
+        std::map<std::string, std::string> mapRange;
+        ReadRange(KeyString(make_pair(strHist, vchName)), mapRange);
+        for (std::map<std::string, std::string>::const_iterator it = mapRange.begin(); it != mapRange.end(); it++) {
+            try {
+                CDataStream ssValue(it->second.data(), it->second.data() + it->second.size(), SER_DISK, CLIENT_VERSION);
+                CServiceVersion<T> version;
+                ssValue >> version;
+                vtxPos.push_back(version.value);
+            } catch (std::exception &e) {
+                return error("ReadHistory() : deserialize error");
+            }
+        }
+        return true;
+    }
+
+    // erase a record with all of its versions
+    bool EraseHistory(const std::string &strHead, const std::string &strHist, const std::vector<unsigned char> &vchName) {
+        std::map<std::string, std::string> mapRange;
+        ReadRange(KeyString(make_pair(strHist, vchName)), mapRange);
+        LOCK(cs_cache);
+        for (std::map<std::string, std::string>::const_iterator it = mapRange.begin(); it != mapRange.end(); it++)
+            Stage(it->first, true, std::string());
+        Stage(KeyString(make_pair(strHead, vchName)), true, std::string());
+        return true;
+    }
+
+    // drop the versions of a record below its head. Only for a head buried
+    // deeper than any reorg, which is then never taken off.
+    template<typename T> bool CompactHistory(const std::string &strHead, const std::string &strHist, const std::vector<unsigned char> &vchName) {
+        CServiceVersion<T> head;
+        if (!ReadHead(strHead, vchName, head))
+            return false;
+        if (head.nPrevHeight < 0)
+            return true;
+        std::string strHeadRow = KeyString(make_pair(strHist, make_pair(vchName, CHeightKey(head.nHeight))));
+        std::map<std::string, std::string> mapRange;
+        ReadRange(KeyString(make_pair(strHist, vchName)), mapRange);
+        {
+            LOCK(cs_cache);
+            for (std::map<std::string, std::string>::const_iterator it = mapRange.begin(); it != mapRange.end(); it++)
+                if (it->first != strHeadRow)
+                    Stage(it->first, true, std::string());
+        }
+        head.nPrevHeight = -1;
+        return Write(make_pair(strHist, make_pair(vchName, CHeightKey(head.nHeight))), head)
+            && Write(make_pair(strHead, vchName), head);
+    }
+
+    // Expiry index: the names of the records by the height their latest
+    // version expires at, under (strExp, (height, name)).
+
+    bool WriteExpiry(const std::string &strExp, int64 nExpires, const std::vector<unsigned char> &vchName) {
+        return Write(make_pair(strExp, make_pair(CHeightKey(nExpires), vchName)), vchName);
+    }
+
+    bool EraseExpiry(const std::string &strExp, int64 nExpires, const std::vector<unsigned char> &vchName) {
+        return Erase(make_pair(strExp, make_pair(CHeightKey(nExpires), vchName)));
+    }
+
+    // names expiring from nFrom up to nTo (no limit if negative), at most
+    // about nMax of them if set
+    bool ReadExpiring(const std::string &strExp, int64 nFrom, int64 nTo, std::vector<std::vector<unsigned char> > &vchNames, unsigned int nMax = 0) {
+        std::map<std::string, std::string> mapRange;
+        ReadRange(KeyString(make_pair(strExp, CHeightKey(nFrom))),
+                nTo < 0 ? PrefixEnd(KeyString(strExp)) : KeyString(make_pair(strExp, CHeightKey(nTo))), mapRange, nMax);
+        for (std::map<std::string, std::string>::const_iterator it = mapRange.begin(); it != mapRange.end(); it++) {
+            try {
+                CDataStream ssValue(it->second.data(), it->second.data() + it->second.size(), SER_DISK, CLIENT_VERSION);
+                std::vector<unsigned char> vchName;
+                ssValue >> vchName;
+                vchNames.push_back(vchName);
+            } catch (std::exception &e) {
+                return error("ReadExpiring() : deserialize error");
+            }
+        }
+        return true;
+    }
+
+    // the latest versions of the records expiring at nFrom or later, in
+    // the order of their heads on disk
+    template<typename T> bool ReadHeadsExpiring(const std::string &strHead, const std::string &strExp, int64 nFrom,
+            std::vector<std::pair<std::vector<unsigned char>, T> > &vHeads) {
+        std::vector<std::vector<unsigned char> > vchNames;
+        if (!ReadExpiring(strExp, nFrom, -1, vchNames))
+            return false;
+        std::map<std::string, std::pair<std::vector<unsigned char>, T> > mapHeads;
+        for (unsigned int i = 0; i < vchNames.size(); i++) {
+            CServiceVersion<T> head;
+            if (ReadHead(strHead, vchNames[i], head))
+                mapHeads[KeyString(make_pair(strHead, vchNames[i]))] = make_pair(vchNames[i], head.value);
+        }
+        for (typename std::map<std::string, std::pair<std::vector<unsigned char>, T> >::const_iterator it = mapHeads.begin(); it != mapHeads.end(); it++)
+            vHeads.push_back(it->second);
+        return true;
+    }
+
+    class CStageHandler : public leveldb::WriteBatch::Handler
+    {
+    public:
+        CServiceDB *pdb;
+        CStageHandler(CServiceDB *pdbIn) : pdb(pdbIn) {}
+        void Put(const leveldb::Slice &key, const leveldb::Slice &value) {
+            pdb->Stage(key.ToString(), false, value.ToString());
+        }
+        void Delete(const leveldb::Slice &key) {
+            pdb->Stage(key.ToString(), true, std::string());
+        }
+    };
+
+public:
+    CServiceDB(const boost::filesystem::path &path, size_t nCacheSize, bool fMemory = false, bool fWipe = false) :
+        CLevelDB(path, nCacheSize, fMemory, fWipe), fTxn(false) {}
+
+    template<typename K, typename V> bool Read(const K& key, V& value) throw(leveldb_error) {
+        const CLevelDBSnapshot *psnapshot = GetReadSnapshot();
+        if (psnapshot) {
+            std::string strValue;
+            if (!ReadSerialized(KeyString(key), strValue, psnapshot))
+                return false;
+            try {
+                CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+                ssValue >> value;
+            } catch(std::exception &e) {
+                return false;
+            }
+            return true;
+        }
+        {
+            LOCK(cs_cache);
+            const std::pair<bool, std::string> *pentry = Lookup(KeyString(key));
+            if (pentry != NULL) {
+                if (pentry->first)
+                    return false;
+                try {
+                    CDataStream ssValue(pentry->second.data(), pentry->second.data() + pentry->second.size(), SER_DISK, CLIENT_VERSION);
+                    ssValue >> value;
+                } catch(std::exception &e) {
+                    return false;
+                }
+                return true;
+            }
+        }
+        return CLevelDB::Read(key, value);
+    }
+
+    template<typename K, typename V> bool Write(const K& key, const V& value, bool fSync = false) throw(leveldb_error) {
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue.reserve(ssValue.GetSerializeSize(value));
+        ssValue << value;
+        LOCK(cs_cache);
+        Stage(KeyString(key), false, ssValue.str());
+        return true;
+    }
+
+    template<typename K> bool Exists(const K& key) throw(leveldb_error) {
+        const CLevelDBSnapshot *psnapshot = GetReadSnapshot();
+        if (psnapshot) {
+            std::string strValue;
+            return ReadSerialized(KeyString(key), strValue, psnapshot);
+        }
+        {
+            LOCK(cs_cache);
+            const std::pair<bool, std::string> *pentry = Lookup(KeyString(key));
+            if (pentry != NULL)
+                return !pentry->first;
+        }
+        return CLevelDB::Exists(key);
+    }
+
+    template<typename K> bool Erase(const K& key, bool fSync = false) throw(leveldb_error) {
+        LOCK(cs_cache);
+        Stage(KeyString(key), true, std::string());
+        return true;
+    }
+
+    // an iterator over what is on disk, or over the snapshot this thread
+    // reads from
+    leveldb::Iterator *NewIterator() {
+        return CLevelDB::NewIterator(GetReadSnapshot());
+    }
+
+    // stage the contents of a batch with the other changes
+    bool WriteBatch(CLevelDBBatch &batch, bool fSync = false) throw(leveldb_error) {
+        LOCK(cs_cache);
+        CStageHandler handler(this);
+        return batch.batch.Iterate(&handler).ok();
+    }
+
+    // read the record under a serialized key into memory, unless it is
+    // staged or preloaded already
+    void Preload(const std::string &strKey) throw(leveldb_error) {
+        {
+            LOCK(cs_cache);
+            if (Lookup(strKey) != NULL)
+                return;
+        }
+        std::string strValue;
+        bool fFound = ReadSerialized(strKey, strValue);
+        LOCK(cs_cache);
+        if (!mapPreload.count(strKey))
+            mapPreload[strKey] = std::make_pair(!fFound, fFound ? strValue : std::string());
+    }
+
+    void ClearPreload() {
+        LOCK(cs_cache);
+        mapPreload.clear();
+    }
+
+    void TxnBegin() {
+        LOCK(cs_cache);
+        assert(!fTxn);
+        fTxn = true;
+    }
+
+    // keep the changes since TxnBegin, to be written by the next Flush
+    void TxnCommit() {
+        LOCK(cs_cache);
+        assert(fTxn);
+        for (cache_map::iterator it = mapTxn.begin(); it != mapTxn.end(); it++)
+            mapCache[it->first] = it->second;
+        mapTxn.clear();
+        fTxn = false;
+    }
+
+    void TxnAbort() {
+        LOCK(cs_cache);
+        mapTxn.clear();
+        fTxn = false;
+    }
+
+    // number of changes waiting to be written
+    unsigned int GetCacheSize() const {
+        LOCK(cs_cache);
+        return mapCache.size() + mapTxn.size();
+    }
+
+    // write the staged changes, outside of an open transaction, in one batch
+    bool Flush() throw(leveldb_error) {
+        LOCK(cs_cache);
+        mapPreload.clear();
+        if (mapCache.empty())
+            return true;
+        CLevelDBBatch batch;
+        for (cache_map::const_iterator it = mapCache.begin(); it != mapCache.end(); it++) {
+            if (it->second.first)
+                batch.batch.Delete(it->first);
+            else
+                batch.batch.Put(it->first, it->second.second);
+        }
+        if (!CLevelDB::WriteBatch(batch))
+            return false;
+        mapCache.clear();
+        return true;
+    }
+
+    // write the staged changes along with the block they bring the database
+    // to, which is checked against the coin database at startup
+    bool Flush(const uint256 &hashBestBlock) throw(leveldb_error) {
+        if (!Write(std::string("bestblock"), hashBestBlock))
+            return false;
+        return Flush();
+    }
+
+    bool ReadBestBlock(uint256 &hashBestBlock) {
+        return Read(std::string("bestblock"), hashBestBlock);
+    }
+};
+
+#endif // SERVICEDB_H
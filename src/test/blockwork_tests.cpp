@@ -0,0 +1,82 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bignum.h"
+#include "main.h"
+
+using namespace std;
+
+// GetBlockWork as it was computed with CBigNum
+static uint256 RefBlockWork(unsigned int nBits)
+{
+    CBigNum bnTarget;
+    bnTarget.SetCompact(nBits);
+    if (bnTarget <= 0)
+        return 0;
+    CBigNum bnWork = (CBigNum(1)<<256) / (bnTarget+1);
+    if (bnWork > CBigNum(~uint256(0)))
+        return 0;
+    return bnWork.getuint256();
+}
+
+static uint32_t nRand = 0x6c078965;
+static uint32_t Rand(uint32_t nMax)
+{
+    nRand = nRand * 1103515245 + 12345;
+    return ((nRand >> 8) ^ (nRand << 13)) % nMax;
+}
+
+BOOST_AUTO_TEST_SUITE(blockwork_tests)
+
+BOOST_AUTO_TEST_CASE(blockwork_matches_bignum)
+{
+    CBlockIndex index;
+    unsigned int vBits[] = { 0, 0x1e0fffff, 0x1d00ffff, 0x207fffff, 0x01003456,
+                             0x04923456, 0x03800000, 0x22000001, 0x23000100, 0x21010000 };
+    for (unsigned int i = 0; i < sizeof(vBits) / sizeof(vBits[0]); i++) {
+        index.nBits = vBits[i];
+        BOOST_CHECK(index.GetBlockWork() == RefBlockWork(vBits[i]));
+    }
+    for (int i = 0; i < 20000; i++) {
+        index.nBits = (Rand(36) << 24) | Rand(0x1000000);
+        BOOST_CHECK(index.GetBlockWork() == RefBlockWork(index.nBits));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(blockwork_uint256_division)
+{
+    for (int i = 0; i < 2000; i++) {
+        uint256 a, b;
+        a.SetCompact(((1 + Rand(32)) << 24) | Rand(0x800000));
+        b.SetCompact(((1 + Rand(32)) << 24) | (1 + Rand(0x7fffff)));
+        BOOST_CHECK((a / b) == (CBigNum(a) / CBigNum(b)).getuint256());
+    }
+    BOOST_CHECK((uint256(12345) / uint256(0)) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(blockwork_chainwork_record)
+{
+    CBlockIndex index;
+    index.nStatus = BLOCK_HAVE_DATA;
+    index.nDataPos = 1234;
+    index.nChainWork = ~uint256(0) >> 3;
+
+    // stored from CHAINWORK_VERSION on
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << index;
+    CBlockIndex indexRead;
+    ss >> indexRead;
+    BOOST_CHECK(indexRead.nChainWork == index.nChainWork);
+    BOOST_CHECK_EQUAL(indexRead.nDataPos, index.nDataPos);
+    BOOST_CHECK(ss.empty());
+
+    // records from older versions come back without it
+    CDataStream ssOld(SER_DISK, CHAINWORK_VERSION - 1);
+    ssOld << index;
+    CBlockIndex indexOld;
+    ssOld >> indexOld;
+    BOOST_CHECK(indexOld.nChainWork == 0);
+    BOOST_CHECK_EQUAL(indexOld.nDataPos, index.nDataPos);
+    BOOST_CHECK(ssOld.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,124 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include <vector>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+// A block of a coinbase and nTx transactions carrying data payloads
+static CBlock MakeBlock(unsigned int nTx)
+{
+    CBlock block;
+    block.nBits = 0x1e0fffff;
+    block.nTime = 1390000000;
+
+    CTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].prevout.SetNull();
+    txCoinbase.vin[0].scriptSig = CScript() << 1 << OP_0;
+    txCoinbase.vout.resize(1);
+    txCoinbase.vout[0].nValue = 50 * COIN;
+    block.vtx.push_back(txCoinbase);
+
+    for (unsigned int i = 0; i < nTx; i++) {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = txCoinbase.GetHash();
+        tx.vin[0].prevout.n = i;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = COIN;
+        tx.data.assign(1000 + i, (unsigned char)i);
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_SUITE(compactblock_tests)
+
+BOOST_AUTO_TEST_CASE(compactblock_roundtrip)
+{
+    CBlock block = MakeBlock(4);
+    CCompactBlock cmpctblock(block);
+    BOOST_CHECK_EQUAL(cmpctblock.vPrefilled.size(), 1U);
+    BOOST_CHECK_EQUAL(cmpctblock.vPrefilled[0].first, 0U);
+    BOOST_CHECK_EQUAL(cmpctblock.vShortId.size(), 4U);
+
+    // the payloads stay out of the message
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    BOOST_CHECK(ss.size() < ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION) / 4);
+
+    CCompactBlock cmpctblockRead;
+    ss >> cmpctblockRead;
+    BOOST_CHECK(cmpctblockRead.header.GetHash() == block.GetHash());
+    BOOST_CHECK(cmpctblockRead.nNonce == cmpctblock.nNonce);
+    BOOST_CHECK(cmpctblockRead.vShortId == cmpctblock.vShortId);
+    BOOST_CHECK(ss.empty());
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_fill_from_pool)
+{
+    CBlock block = MakeBlock(4);
+    CCompactBlock cmpctblock(block);
+
+    // the pool has two of the block's transactions and one of its own
+    mempool.clear();
+    mempool.addUnchecked(block.vtx[1].GetHash(), block.vtx[1]);
+    mempool.addUnchecked(block.vtx[2].GetHash(), block.vtx[2]);
+    CBlock blockOther = MakeBlock(6);
+    mempool.addUnchecked(blockOther.vtx[6].GetHash(), blockOther.vtx[6]);
+
+    CBlock blockFilled;
+    vector<unsigned int> vMissing;
+    BOOST_CHECK(cmpctblock.FillBlock(blockFilled, vMissing, mempool));
+    BOOST_CHECK_EQUAL(vMissing.size(), 2U);
+    BOOST_CHECK_EQUAL(vMissing[0], 3U);
+    BOOST_CHECK_EQUAL(vMissing[1], 4U);
+    BOOST_CHECK(blockFilled.vtx[1].GetHash() == block.vtx[1].GetHash());
+    BOOST_CHECK(blockFilled.vtx[2].GetHash() == block.vtx[2].GetHash());
+
+    // what a "blocktxn" carries completes it
+    BOOST_FOREACH(unsigned int nIndex, vMissing)
+        blockFilled.vtx[nIndex] = block.vtx[nIndex];
+    BOOST_CHECK(blockFilled.GetHash() == block.GetHash());
+    BOOST_CHECK(blockFilled.BuildMerkleTree() == block.hashMerkleRoot);
+
+    // with everything in the pool nothing is missing
+    mempool.addUnchecked(block.vtx[3].GetHash(), block.vtx[3]);
+    mempool.addUnchecked(block.vtx[4].GetHash(), block.vtx[4]);
+    BOOST_CHECK(cmpctblock.FillBlock(blockFilled, vMissing, mempool));
+    BOOST_CHECK(vMissing.empty());
+    BOOST_CHECK(blockFilled.BuildMerkleTree() == block.hashMerkleRoot);
+
+    // two transactions behind the same short id are asked for
+    cmpctblock.vShortId[1] = cmpctblock.vShortId[0];
+    BOOST_CHECK(cmpctblock.FillBlock(blockFilled, vMissing, mempool));
+    BOOST_CHECK_EQUAL(vMissing.size(), 2U);
+    BOOST_CHECK_EQUAL(vMissing[0], 1U);
+    BOOST_CHECK_EQUAL(vMissing[1], 2U);
+
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_bad_prefilled)
+{
+    CBlock block = MakeBlock(2);
+    CCompactBlock cmpctblock(block);
+    CBlock blockFilled;
+    vector<unsigned int> vMissing;
+
+    CCompactBlock cmpctblockBad = cmpctblock;
+    cmpctblockBad.vPrefilled[0].first = 3;
+    BOOST_CHECK(!cmpctblockBad.FillBlock(blockFilled, vMissing, mempool));
+
+    cmpctblockBad = cmpctblock;
+    cmpctblockBad.vPrefilled.push_back(cmpctblockBad.vPrefilled[0]);
+    cmpctblockBad.vShortId.pop_back();
+    BOOST_CHECK(!cmpctblockBad.FillBlock(blockFilled, vMissing, mempool));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
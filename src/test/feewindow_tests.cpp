@@ -0,0 +1,342 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include <list>
+#include <vector>
+
+#include "feewindow.h"
+#include "servicedb.h"
+
+using namespace std;
+
+// The fee lists and subsidy loop CFeeWindow replaced, kept as the reference
+struct RefFee
+{
+    uint256 hash;
+    uint64 nHeight;
+    uint64 nTime;
+    uint64 nValue;
+};
+
+static bool RefInsert(list<RefFee> &lst, const RefFee &fee, bool fReplace)
+{
+    BOOST_FOREACH(RefFee &f, lst) {
+        if (f.hash == fee.hash && f.nHeight == fee.nHeight) {
+            if (fReplace)
+                f = fee;
+            return true;
+        }
+    }
+    lst.push_front(fee);
+    return false;
+}
+
+static void RefAverages(const list<RefFee> &lst, unsigned int h12, unsigned int nHeight, uint64 &nShort, uint64 &nLong)
+{
+    uint64 hr1 = 1, hr12 = 1;
+    unsigned int nTargetTime = 0;
+    unsigned int nTarget1hrTime = 0;
+    unsigned int blk1hrht = nHeight - 1, blk12hrht = nHeight - 1;
+    bool bFound = false;
+
+    BOOST_FOREACH(const RefFee &f, lst) {
+        if (f.nHeight <= nHeight)
+            bFound = true;
+        if (bFound) {
+            if (nTargetTime == 0) {
+                hr1 = hr12 = 0;
+                nTargetTime = f.nTime - h12;
+                nTarget1hrTime = f.nTime - (h12 / 12);
+            }
+            if (f.nTime > nTargetTime) {
+                hr12 += f.nValue;
+                blk12hrht = f.nHeight;
+                if (f.nTime > nTarget1hrTime) {
+                    hr1 += f.nValue;
+                    blk1hrht = f.nHeight;
+                }
+            }
+        }
+    }
+    // the list walk divided by zero when stale fees sat above nHeight
+    unsigned int nBlocks12 = (nHeight - blk12hrht) + 1, nBlocks1 = (nHeight - blk1hrht) + 1;
+    nLong = hr12 / (nBlocks12 ? nBlocks12 : 1);
+    nShort = hr1 / (nBlocks1 ? nBlocks1 : 1);
+}
+
+// small deterministic generator, so every run replays the same history
+static uint32_t nReplaySeed;
+static uint32_t ReplayRand(uint32_t nMax)
+{
+    nReplaySeed = nReplaySeed * 1103515245 + 12345;
+    return (nReplaySeed >> 8) % nMax;
+}
+
+// Replay a chain of service fees, with reorganizations and out of order
+// block times, checking every subsidy against the list walk.
+static void ReplayFeeHistory(unsigned int h12, bool fHashed, bool fReplace)
+{
+    CFeeWindow window(h12);
+    list<RefFee> lstRef;
+    vector<vector<RefFee> > vBlocks(1);
+    vector<uint64> vTimes(1, 1400000000);
+    nReplaySeed = 42;
+
+    for (int nStep = 0; nStep < 3000; nStep++)
+    {
+        if (vBlocks.size() > 10 && ReplayRand(50) == 0)
+        {
+            // disconnect the tip: its fees are zeroed in place
+            unsigned int nDepth = 1 + ReplayRand(5);
+            for (unsigned int i = 0; i < nDepth; i++)
+            {
+                BOOST_FOREACH(RefFee fee, vBlocks.back()) {
+                    fee.nValue = 0;
+                    BOOST_CHECK_EQUAL(window.Insert(fee.hash, fee.nHeight, fee.nTime, fee.nValue, fReplace), RefInsert(lstRef, fee, fReplace));
+                }
+                vBlocks.pop_back();
+                vTimes.pop_back();
+            }
+        }
+
+        unsigned int nHeight = vBlocks.size();
+        uint64 nTime = vTimes.back() + 60 + ReplayRand(600) - 300;
+        vector<RefFee> vFees;
+        unsigned int nFees = ReplayRand(4);
+        for (unsigned int i = 0; i < nFees; i++)
+        {
+            RefFee fee;
+            fee.hash = fHashed ? uint256(nStep * 4 + i + 1) : 0;
+            fee.nHeight = nHeight;
+            fee.nTime = nTime;
+            fee.nValue = (1 + ReplayRand(1000)) * 1000000;
+            BOOST_CHECK_EQUAL(window.Insert(fee.hash, fee.nHeight, fee.nTime, fee.nValue, fReplace), RefInsert(lstRef, fee, fReplace));
+            vFees.push_back(fee);
+        }
+        vBlocks.push_back(vFees);
+        vTimes.push_back(nTime);
+
+        for (unsigned int nQuery = nHeight; nQuery <= nHeight + 1; nQuery++)
+        {
+            uint64 nShort, nLong, nRefShort, nRefLong;
+            window.GetAverages(nQuery, nShort, nLong);
+            RefAverages(lstRef, h12, nQuery, nRefShort, nRefLong);
+            BOOST_CHECK_EQUAL(nShort, nRefShort);
+            BOOST_CHECK_EQUAL(nLong, nRefLong);
+        }
+    }
+
+    // history outside the window is not kept
+    BOOST_CHECK(window.size() < lstRef.size());
+}
+
+BOOST_AUTO_TEST_SUITE(feewindow_tests)
+
+BOOST_AUTO_TEST_CASE(feewindow_alias_replay)
+{
+    ReplayFeeHistory(60 * 60 * 12, true, true);
+}
+
+BOOST_AUTO_TEST_CASE(feewindow_offer_replay)
+{
+    ReplayFeeHistory(360 * 12, false, false);
+}
+
+BOOST_AUTO_TEST_CASE(feewindow_entries)
+{
+    CFeeWindow window(360 * 12);
+    vector<CFeeWindowEntry> vEntries;
+    for (int i = 0; i < 10; i++)
+        vEntries.push_back(CFeeWindowEntry(uint256(i + 1), 100 - i, 1400000000 - i * 60, i * 1000));
+
+    window.SetEntries(vEntries);
+    BOOST_CHECK(window.Exists(uint256(1), 100));
+    BOOST_CHECK(!window.Exists(uint256(1), 99));
+
+    vector<CFeeWindowEntry> vRead;
+    window.GetEntries(vRead);
+    BOOST_CHECK(vRead.size() == vEntries.size());
+    for (unsigned int i = 0; i < vRead.size(); i++)
+        BOOST_CHECK(vRead[i].hash == vEntries[i].hash && vRead[i].nValue == vEntries[i].nValue);
+
+    BOOST_CHECK(window.ZeroFirstInRange(95, 98));
+    window.GetEntries(vRead);
+    BOOST_CHECK(vRead[3].nValue == 0 && vRead[4].nValue != 0);
+
+    BOOST_CHECK(window.Remove(uint256(1), 100));
+    BOOST_CHECK(!window.Remove(uint256(1), 100));
+    BOOST_CHECK(window.size() == vEntries.size() - 1);
+}
+
+// Old fee lists could hold the same fee twice; lookups see the newest copy
+// and fall back to the older one once it is removed
+BOOST_AUTO_TEST_CASE(feewindow_duplicates)
+{
+    CFeeWindow window(360 * 12);
+    vector<CFeeWindowEntry> vEntries;
+    vEntries.push_back(CFeeWindowEntry(uint256(1), 100, 1400000000, 3000));
+    vEntries.push_back(CFeeWindowEntry(uint256(2), 99, 1399999940, 2000));
+    vEntries.push_back(CFeeWindowEntry(uint256(1), 100, 1399999880, 1000));
+    window.SetEntries(vEntries);
+    BOOST_CHECK(window.size() == 3);
+
+    BOOST_CHECK(window.Remove(uint256(1), 100));
+    BOOST_CHECK(window.Exists(uint256(1), 100));
+    vector<CFeeWindowEntry> vRead;
+    window.GetEntries(vRead);
+    BOOST_CHECK(vRead.size() == 2 && vRead[1].nValue == 1000);
+
+    BOOST_CHECK(window.Remove(uint256(1), 100));
+    BOOST_CHECK(!window.Exists(uint256(1), 100));
+    BOOST_CHECK(window.size() == 1);
+}
+
+// Going back to a snapshot undoes fees added, zeroed and removed since,
+// along with the record changes they would have written
+BOOST_AUTO_TEST_CASE(feewindow_snapshot)
+{
+    CFeeWindow window(360 * 12);
+    for (int i = 0; i < 10; i++)
+        window.Insert(uint256(i + 1), 100 + i, 1400000000 + i * 60, i * 1000, false);
+    vector<CFeeWindowEntry> vWrite, vErase;
+    window.GetChanges(vWrite, vErase);
+    window.Remove(uint256(1), 100);
+
+    CFeeWindow::CSnapshot snapshot;
+    window.GetSnapshot(snapshot);
+    vector<CFeeWindowEntry> vBefore;
+    window.GetEntries(vBefore);
+    uint64 nShort, nLong;
+    window.GetAverages(110, nShort, nLong);
+
+    window.Insert(uint256(11), 110, 1400000600, 5000, false);
+    window.ZeroFirstInRange(105, 110);
+    window.Remove(uint256(3), 102);
+    window.Restore(snapshot);
+
+    vector<CFeeWindowEntry> vAfter;
+    window.GetEntries(vAfter);
+    BOOST_CHECK(vAfter.size() == vBefore.size());
+    for (unsigned int i = 0; i < vAfter.size() && i < vBefore.size(); i++)
+        BOOST_CHECK(vAfter[i].hash == vBefore[i].hash && vAfter[i].nValue == vBefore[i].nValue
+                    && vAfter[i].nSeq == vBefore[i].nSeq);
+    uint64 nShortAfter, nLongAfter;
+    window.GetAverages(110, nShortAfter, nLongAfter);
+    BOOST_CHECK(nShortAfter == nShort && nLongAfter == nLong);
+
+    // only the removal from before the snapshot is left to write
+    window.GetChanges(vWrite, vErase);
+    BOOST_CHECK(vWrite.empty());
+    BOOST_CHECK(vErase.size() == 1 && vErase[0].hash == uint256(1));
+
+    // and new fees are numbered after the ones the window had
+    window.Insert(uint256(12), 111, 1400000660, 1000, false);
+    window.GetEntries(vAfter);
+    BOOST_CHECK(vAfter[0].nSeq > vAfter[1].nSeq);
+}
+
+// Fees written one per record and read back come out in the order they
+// were added, with the same subsidy
+BOOST_AUTO_TEST_CASE(feewindow_records)
+{
+    CServiceDB db(boost::filesystem::path("feewindow_tests"), 1 << 20, true);
+    CFeeWindow window(60 * 60 * 12);
+    nReplaySeed = 7;
+    uint64 nTime = 1400000000;
+    for (int nHeight = 1; nHeight < 2000; nHeight++)
+    {
+        nTime += 60 + ReplayRand(600) - 300;
+        for (unsigned int i = ReplayRand(3); i > 0; i--)
+            window.Insert(uint256(nHeight * 4 + i), nHeight, nTime, (1 + ReplayRand(1000)) * 1000000, true);
+        if (nHeight % 100 == 0)
+        {
+            // disconnect and reconnect the tip at a lower height
+            window.Insert(uint256(nHeight * 4 + 1), nHeight, nTime, 0, true);
+            window.Insert(uint256(nHeight * 4 + 3), nHeight - 1, nTime - 60, 5000000, true);
+        }
+        if (nHeight % 10 == 0)
+            BOOST_CHECK(window.Write(db, "fee"));
+    }
+    BOOST_CHECK(window.Write(db, "fee"));
+    BOOST_CHECK(db.Flush());
+
+    // a key under a prefix sorting after ours must not be picked up
+    db.Write(make_pair(string("fef"), CFeeKey(1999, 0)), CFeeWindowEntry());
+    BOOST_CHECK(db.Flush());
+
+    CFeeWindow windowRead(60 * 60 * 12);
+    BOOST_CHECK(windowRead.Read(db, "fee"));
+
+    vector<CFeeWindowEntry> vEntries, vRead;
+    window.GetEntries(vEntries);
+    windowRead.GetEntries(vRead);
+    BOOST_CHECK(vRead.size() == vEntries.size());
+    for (unsigned int i = 0; i < vRead.size() && i < vEntries.size(); i++)
+        BOOST_CHECK(vRead[i].hash == vEntries[i].hash && vRead[i].nHeight == vEntries[i].nHeight
+                 && vRead[i].nValue == vEntries[i].nValue && vRead[i].nSeq == vEntries[i].nSeq);
+
+    for (unsigned int nHeight = 1990; nHeight <= 2000; nHeight++)
+    {
+        uint64 nShort, nLong, nReadShort, nReadLong;
+        window.GetAverages(nHeight, nShort, nLong);
+        windowRead.GetAverages(nHeight, nReadShort, nReadLong);
+        BOOST_CHECK_EQUAL(nShort, nReadShort);
+        BOOST_CHECK_EQUAL(nLong, nReadLong);
+    }
+
+    // nothing changed since the load, so there is nothing to write
+    vector<CFeeWindowEntry> vWrite, vErase;
+    windowRead.GetChanges(vWrite, vErase);
+    BOOST_CHECK(vWrite.empty() && vErase.empty());
+}
+
+// A node restarted long after the last fee, with older bursts of fees
+// stored behind it, loads the window it was running with
+BOOST_AUTO_TEST_CASE(feewindow_restart_stale)
+{
+    CServiceDB db(boost::filesystem::path("feewindow_tests"), 1 << 20, true);
+    CFeeWindow window(60 * 60 * 12);
+    nReplaySeed = 11;
+    uint64 nTime = 1400000000;
+    for (int nHeight = 1; nHeight < 3000; nHeight++)
+    {
+        // a quiet day between the bursts
+        nTime += nHeight % 1000 < 700 ? 60 : 120;
+        if (nHeight % 1000 < 700 && ReplayRand(2) == 0)
+            window.Insert(uint256(nHeight), nHeight, nTime, (1 + ReplayRand(1000)) * 1000000, true);
+        if (nHeight % 50 == 0)
+            BOOST_CHECK(window.Write(db, "fee"));
+    }
+    BOOST_CHECK(window.Write(db, "fee"));
+    BOOST_CHECK(db.Flush());
+
+    CFeeWindow windowRead(60 * 60 * 12);
+    BOOST_CHECK(windowRead.Read(db, "fee"));
+    BOOST_CHECK(windowRead.size() > 0);
+    BOOST_CHECK_EQUAL(windowRead.size(), window.size());
+
+    // the subsidy of blocks well past the newest fee is the same
+    for (unsigned int nHeight = 3000; nHeight <= 6000; nHeight += 500)
+    {
+        uint64 nShort, nLong, nReadShort, nReadLong;
+        window.GetAverages(nHeight, nShort, nLong);
+        windowRead.GetAverages(nHeight, nReadShort, nReadLong);
+        BOOST_CHECK_EQUAL(nShort, nReadShort);
+        BOOST_CHECK_EQUAL(nLong, nReadLong);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(feewindow_key_order)
+{
+    CDataStream ss1(SER_DISK, CLIENT_VERSION), ss2(SER_DISK, CLIENT_VERSION);
+    ss1 << make_pair(string("fee"), CFeeKey(255, 1));
+    ss2 << make_pair(string("fee"), CFeeKey(256, 0));
+    BOOST_CHECK(ss1.str() < ss2.str());
+
+    string strPrefix;
+    CFeeKey key;
+    ss2 >> strPrefix >> key;
+    BOOST_CHECK(key.nHeight == 256 && key.hash == 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
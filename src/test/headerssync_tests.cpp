@@ -0,0 +1,138 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+// A header on pindexPrev, a minute after it; nBranch tells apart headers on
+// the same parent
+static CBlockHeader MakeHeader(CBlockIndex* pindexPrev, unsigned int nBranch)
+{
+    CBlockHeader header;
+    header.nVersion = 1;
+    header.hashPrevBlock = pindexPrev->GetBlockHash();
+    header.hashMerkleRoot = uint256(nBranch);
+    header.nTime = pindexPrev->nTime + 60;
+    header.nBits = GetNextWorkRequired(pindexPrev, &header);
+    header.nNonce = 0;
+    return header;
+}
+
+static void Mine(CBlockHeader &header)
+{
+    uint256 hashTarget;
+    hashTarget.SetCompact(header.nBits);
+    while (header.GetPoWHash() > hashTarget)
+        header.nNonce++;
+}
+
+static int GetDoS(CValidationState &state)
+{
+    int nDoS = 0;
+    state.IsInvalid(nDoS);
+    return nDoS;
+}
+
+BOOST_AUTO_TEST_SUITE(headerssync_tests)
+
+BOOST_AUTO_TEST_CASE(header_unknown_parent)
+{
+    CBlockHeader header = MakeHeader(pindexGenesisBlock, 1);
+    header.hashPrevBlock = uint256(12345);
+    CValidationState state;
+    CBlockIndex* pindex = NULL;
+    BOOST_CHECK(!AcceptBlockHeader(state, header, &pindex));
+    BOOST_CHECK_EQUAL(GetDoS(state), 10);
+    BOOST_CHECK(pindex == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(header_wrong_bits)
+{
+    CBlockHeader header = MakeHeader(pindexGenesisBlock, 1);
+    header.nBits = 0x1d00ffff;
+    CValidationState state;
+    CBlockIndex* pindex = NULL;
+    BOOST_CHECK(!AcceptBlockHeader(state, header, &pindex));
+    BOOST_CHECK_EQUAL(GetDoS(state), 100);
+
+    // the right bits without the work to show for them
+    header = MakeHeader(pindexGenesisBlock, 1);
+    uint256 hashTarget;
+    hashTarget.SetCompact(header.nBits);
+    while (header.GetPoWHash() <= hashTarget)
+        header.nNonce++;
+    CValidationState stateWork;
+    BOOST_CHECK(!AcceptBlockHeader(stateWork, header, &pindex));
+    BOOST_CHECK_EQUAL(GetDoS(stateWork), 50);
+}
+
+BOOST_AUTO_TEST_CASE(header_before_checkpoint)
+{
+    // pretend the block of the checkpoint at 666 is in
+    uint256 hashCheckpoint("0x3347d1782965ae18ab2cbfeff089ece5b7f9167ef6a843b959e8ee1e5c0849c1");
+    CBlockIndex indexCheckpoint;
+    indexCheckpoint.nHeight = 666;
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hashCheckpoint, &indexCheckpoint)).first;
+    indexCheckpoint.phashBlock = &mi->first;
+    mapArgs["-checkpoints"] = "1";
+
+    CBlockHeader header = MakeHeader(pindexGenesisBlock, 1);
+    CValidationState state;
+    CBlockIndex* pindex = NULL;
+    BOOST_CHECK(!AcceptBlockHeader(state, header, &pindex));
+    BOOST_CHECK_EQUAL(GetDoS(state), 100);
+
+    mapArgs.erase("-checkpoints");
+    mapBlockIndex.erase(hashCheckpoint);
+}
+
+BOOST_AUTO_TEST_CASE(header_best_branch)
+{
+    // cakenet work is cheap to mine; the tip is the genesis block meanwhile
+    CBlockIndex* pindexBestSaved = pindexBest;
+    pindexBest = pindexGenesisBlock;
+    pindexGenesisBlock->nNextBits = 0;
+    fCakeNet = true;
+
+    CValidationState state;
+    CBlockIndex* pindexA1 = NULL;
+    CBlockIndex* pindexA2 = NULL;
+    CBlockHeader header = MakeHeader(pindexGenesisBlock, 1);
+    Mine(header);
+    BOOST_CHECK(AcceptBlockHeader(state, header, &pindexA1));
+    header = MakeHeader(pindexA1, 1);
+    Mine(header);
+    BOOST_CHECK(AcceptBlockHeader(state, header, &pindexA2));
+    BOOST_CHECK(GetBestHeader() == pindexA2);
+    BOOST_CHECK_EQUAL(pindexA2->nHeight, 2);
+
+    // a header seen before comes back as it was indexed
+    CBlockIndex* pindex = NULL;
+    BOOST_CHECK(AcceptBlockHeader(state, header, &pindex));
+    BOOST_CHECK(pindex == pindexA2);
+
+    // the other branch takes over once it has more work, not as much
+    CBlockIndex* pindexB = pindexGenesisBlock;
+    for (int i = 0; i < 2; i++) {
+        header = MakeHeader(pindexB, 2);
+        Mine(header);
+        BOOST_CHECK(AcceptBlockHeader(state, header, &pindexB));
+    }
+    BOOST_CHECK(GetBestHeader() == pindexA2);
+    header = MakeHeader(pindexB, 2);
+    Mine(header);
+    BOOST_CHECK(AcceptBlockHeader(state, header, &pindexB));
+    BOOST_CHECK(GetBestHeader() == pindexB);
+    BOOST_CHECK(pindexB->pprev->pprev->pprev == pindexGenesisBlock);
+
+    // the headers go with the sync
+    EndHeadersSync("test");
+    BOOST_CHECK(GetBestHeader() == pindexGenesisBlock);
+
+    fCakeNet = false;
+    pindexGenesisBlock->nNextBits = 0;
+    pindexBest = pindexBestSaved;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,184 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include <vector>
+
+#include "bignum.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+// The CBigNum Kimoto Gravity Well GetNextWorkRequired ran before it moved
+// to uint256 arithmetic, kept as the reference
+static unsigned int RefKimotoGravityWell(const CBlockIndex* pindexLast,
+        uint64 TargetBlocksSpacingSeconds, uint64 PastBlocksMin, uint64 PastBlocksMax)
+{
+    const CBlockIndex *BlockLastSolved = pindexLast;
+    const CBlockIndex *BlockReading = pindexLast;
+
+    uint64 PastBlocksMass = 0;
+    int64 PastRateActualSeconds = 0;
+    int64 PastRateTargetSeconds = 0;
+    double PastRateAdjustmentRatio = double(1);
+    CBigNum PastDifficultyAverage;
+    CBigNum PastDifficultyAveragePrev;
+    double EventHorizonDeviation;
+    double EventHorizonDeviationFast;
+    double EventHorizonDeviationSlow;
+
+    CBigNum bnPOWLimit = fCakeNet ? CBigNum(~uint256(0) >> 11) : CBigNum(~uint256(0) >> 20);
+    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0
+            || (uint64) BlockLastSolved->nHeight < PastBlocksMin)
+        return bnPOWLimit.GetCompact();
+
+    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
+        if (PastBlocksMax > 0 && i > PastBlocksMax)
+            break;
+        PastBlocksMass++;
+        if (i == 1)
+            PastDifficultyAverage.SetCompact(BlockReading->nBits);
+        else
+            PastDifficultyAverage = ((CBigNum().SetCompact(BlockReading->nBits)
+                    - PastDifficultyAveragePrev) / i) + PastDifficultyAveragePrev;
+        PastDifficultyAveragePrev = PastDifficultyAverage;
+        PastRateActualSeconds = BlockLastSolved->GetBlockTime() - BlockReading->GetBlockTime();
+        PastRateTargetSeconds = TargetBlocksSpacingSeconds * PastBlocksMass;
+        PastRateAdjustmentRatio = double(1);
+        if (PastRateActualSeconds < 0)
+            PastRateActualSeconds = 0;
+        if (PastRateActualSeconds != 0 && PastRateTargetSeconds != 0)
+            PastRateAdjustmentRatio = double(PastRateTargetSeconds) / double(PastRateActualSeconds);
+        EventHorizonDeviation = 1 + (0.7084 * pow((double(PastBlocksMass) / double(144)), -1.228));
+        EventHorizonDeviationFast = EventHorizonDeviation;
+        EventHorizonDeviationSlow = 1 / EventHorizonDeviation;
+        if (PastBlocksMass >= PastBlocksMin) {
+            if ((PastRateAdjustmentRatio <= EventHorizonDeviationSlow)
+                    || (PastRateAdjustmentRatio >= EventHorizonDeviationFast))
+                break;
+        }
+        if (BlockReading->pprev == NULL)
+            break;
+        BlockReading = BlockReading->pprev;
+    }
+
+    CBigNum bnNew(PastDifficultyAverage);
+    if (PastRateActualSeconds != 0 && PastRateTargetSeconds != 0) {
+        bnNew *= PastRateActualSeconds;
+        bnNew /= PastRateTargetSeconds;
+    }
+    if (bnNew > bnPOWLimit)
+        bnNew = bnPOWLimit;
+    return bnNew.GetCompact();
+}
+
+static unsigned int RefNextWork(const CBlockIndex* pindexLast)
+{
+    return RefKimotoGravityWell(pindexLast, 60, 7, 98);
+}
+
+static uint32_t nRand = 0x2545f491;
+static uint32_t Rand(uint32_t nMax)
+{
+    nRand = nRand * 1103515245 + 12345;
+    return ((nRand >> 8) ^ (nRand << 13)) % nMax;
+}
+
+// Block spacing: mostly around the target, with runs of fast blocks, long
+// stalls and timestamps that step backwards
+static unsigned int NextTime(unsigned int nTime, int nHeight)
+{
+    switch ((nHeight / 200) % 5) {
+    case 1:
+        return nTime + Rand(10);
+    case 2:
+        if (Rand(20) == 0)
+            return nTime + 3600 + Rand(200000);
+        break;
+    case 3:
+        if (Rand(4) == 0)
+            return nTime - Rand(600);
+        break;
+    case 4:
+        return nTime + 60 + Rand(240);
+    }
+    return nTime + Rand(120);
+}
+
+// Build a chain on which every block carries what the reference requires of
+// it (fRandomBits false) or an arbitrary target up to 2^255, which walks the
+// average and the final scaling through their whole range
+static void BuildChain(vector<CBlockIndex*> &vChain, int nBlocks, bool fRandomBits)
+{
+    unsigned int nTime = 1390000000;
+    for (int nHeight = 0; nHeight < nBlocks; nHeight++) {
+        CBlockIndex *pindex = new CBlockIndex();
+        pindex->nHeight = nHeight;
+        pindex->pprev = nHeight ? vChain.back() : NULL;
+        nTime = nHeight ? NextTime(nTime, nHeight) : nTime;
+        pindex->nTime = nTime;
+        if (fRandomBits)
+            pindex->nBits = ((1 + Rand(32)) << 24) | Rand(0x800000);
+        else
+            pindex->nBits = RefNextWork(pindex->pprev);
+        vChain.push_back(pindex);
+    }
+}
+
+static void CheckChain(int nBlocks, bool fRandomBits)
+{
+    vector<CBlockIndex*> vChain;
+    BuildChain(vChain, nBlocks, fRandomBits);
+    BOOST_CHECK_EQUAL(GetNextWorkRequired(NULL, NULL), RefNextWork(NULL));
+    BOOST_FOREACH(CBlockIndex *pindex, vChain) {
+        unsigned int nRef = RefNextWork(pindex);
+        BOOST_CHECK_EQUAL(GetNextWorkRequired(pindex, NULL), nRef);
+        // memoized on the index
+        BOOST_CHECK_EQUAL(pindex->nNextBits, nRef);
+        BOOST_CHECK_EQUAL(GetNextWorkRequired(pindex, NULL), nRef);
+    }
+    BOOST_FOREACH(CBlockIndex *pindex, vChain)
+        delete pindex;
+}
+
+BOOST_AUTO_TEST_SUITE(kgw_tests)
+
+BOOST_AUTO_TEST_CASE(kgw_uint256_compact)
+{
+    for (int i = 0; i < 10000; i++) {
+        unsigned int nCompact = ((Rand(33)) << 24) | Rand(0x800000);
+        CBigNum bn;
+        bn.SetCompact(nCompact);
+        uint256 n;
+        n.SetCompact(nCompact);
+        BOOST_CHECK(n == bn.getuint256());
+        BOOST_CHECK_EQUAL(n.GetCompact(), bn.GetCompact());
+
+        uint32_t nFactor = 1 + Rand(0xffffffff);
+        uint256 nProduct = n;
+        nProduct *= nFactor;
+        CBigNum bnProduct = bn * CBigNum(nFactor);
+        if (bnProduct <= CBigNum(~uint256(0)))
+            BOOST_CHECK(nProduct == bnProduct.getuint256());
+        uint256 nQuot = n;
+        nQuot /= nFactor;
+        BOOST_CHECK(nQuot == (bn / CBigNum(nFactor)).getuint256());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(kgw_matches_bignum)
+{
+    bool fCakeNetSave = fCakeNet;
+
+    fCakeNet = false;
+    CheckChain(3000, false);
+    CheckChain(1000, true);
+
+    fCakeNet = true;
+    CheckChain(3000, false);
+    CheckChain(1000, true);
+
+    fCakeNet = fCakeNetSave;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,73 @@
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+#include "lrumap.h"
+#include "util.h"
+
+#define NUM_TESTS 16
+#define MAX_SIZE 100
+
+BOOST_AUTO_TEST_SUITE(lrumap_tests)
+
+// Test that an lrumap behaves like a map, as long as no more than MAX_SIZE elements are in it
+BOOST_AUTO_TEST_CASE(lrumap_like_map)
+{
+    for (int nTest=0; nTest<NUM_TESTS; nTest++)
+    {
+        lrumap<int, int> lru(MAX_SIZE);
+        map<int, int> tester;
+        for (int nAction=0; nAction<MAX_SIZE; nAction++)
+        {
+            int n = GetRandInt(MAX_SIZE);
+            int v = GetRandInt(1000);
+            lru.insert(n, v);
+            tester[n] = v;
+        }
+        BOOST_CHECK(lru.size() == tester.size());
+        for (map<int, int>::iterator it = tester.begin(); it != tester.end(); ++it)
+        {
+            int v;
+            BOOST_CHECK(lru.get(it->first, v));
+            BOOST_CHECK(v == it->second);
+        }
+    }
+}
+
+// Test that an lrumap's size never exceeds its max_size
+BOOST_AUTO_TEST_CASE(lrumap_limited_size)
+{
+    for (int nTest=0; nTest<NUM_TESTS; nTest++)
+    {
+        lrumap<int, int> lru(MAX_SIZE);
+        for (int nAction=0; nAction<3*MAX_SIZE; nAction++)
+        {
+            int n = GetRandInt(2 * MAX_SIZE);
+            lru.insert(n, n);
+            BOOST_CHECK(lru.size() <= MAX_SIZE);
+        }
+    }
+}
+
+// Test that reading an element protects it from eviction
+BOOST_AUTO_TEST_CASE(lrumap_recently_used)
+{
+    lrumap<int, int> lru(MAX_SIZE);
+    for (int n=0; n<MAX_SIZE; n++)
+        lru.insert(n, n);
+
+    int v;
+    BOOST_CHECK(lru.get(0, v));
+    lru.insert(MAX_SIZE, MAX_SIZE);
+
+    // element 1 was the least recently used one
+    BOOST_CHECK(lru.count(0) == 1);
+    BOOST_CHECK(lru.count(1) == 0);
+    BOOST_CHECK(lru.count(MAX_SIZE) == 1);
+
+    lru.erase(0);
+    BOOST_CHECK(!lru.get(0, v));
+    BOOST_CHECK(lru.size() == MAX_SIZE - 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
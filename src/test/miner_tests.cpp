@@ -144,8 +144,20 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     hash = tx.GetHash();
     mempool.addUnchecked(hash, tx);
     BOOST_CHECK(pblocktemplate = CreateNewBlockWithKey(reservekey));
+    // a second template is assembled from the entries kept in the pool
+    // and comes out the same
+    BOOST_CHECK_EQUAL(mempool.mapEntry.size() + mempool.setEntryNew.size(), 2U);
+    {
+        CBlockTemplate *pblocktemplate2 = CreateNewBlockWithKey(reservekey);
+        BOOST_CHECK(pblocktemplate2);
+        BOOST_CHECK_EQUAL(pblocktemplate2->block.vtx.size(), pblocktemplate->block.vtx.size());
+        for (unsigned int i = 1; i < pblocktemplate->block.vtx.size() && i < pblocktemplate2->block.vtx.size(); i++)
+            BOOST_CHECK(pblocktemplate2->block.vtx[i].GetHash() == pblocktemplate->block.vtx[i].GetHash());
+        delete pblocktemplate2;
+    }
     delete pblocktemplate;
     mempool.clear();
+    BOOST_CHECK(mempool.mapEntry.empty() && mempool.setEntryNew.empty());
 
     // coinbase in mempool
     tx.vin.resize(1);
@@ -0,0 +1,261 @@
+#include <boost/test/unit_test.hpp>
+
+#include "servicedb.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(servicedb_tests)
+
+class CTestVersionDB : public CServiceDB
+{
+public:
+    CTestVersionDB() : CServiceDB(boost::filesystem::path("servicedb_tests"), 1 << 20, true) {}
+
+    bool Put(const vector<unsigned char> &vchName, int64 nHeight, int n) {
+        return PutVersion(string("ti"), string("th"), vchName, nHeight, n);
+    }
+    bool Pop(const vector<unsigned char> &vchName) {
+        CServiceVersion<int> head;
+        return ReadHead(string("ti"), vchName, head) && PopVersion(string("ti"), string("th"), vchName, head);
+    }
+    bool Head(const vector<unsigned char> &vchName, int &n) {
+        CServiceVersion<int> head;
+        if (!ReadHead(string("ti"), vchName, head))
+            return false;
+        n = head.value;
+        return true;
+    }
+    bool History(const vector<unsigned char> &vchName, vector<int> &vn) {
+        return ReadHistory(string("th"), vchName, vn);
+    }
+    bool Compact(const vector<unsigned char> &vchName) {
+        return CompactHistory<int>(string("ti"), string("th"), vchName);
+    }
+    bool Expires(const vector<unsigned char> &vchName, int64 nExpires, bool fErase = false) {
+        return fErase ? EraseExpiry(string("tx"), nExpires, vchName) : WriteExpiry(string("tx"), nExpires, vchName);
+    }
+    bool Expiring(int64 nFrom, int64 nTo, vector<vector<unsigned char> > &vchNames, unsigned int nMax = 0) {
+        vchNames.clear();
+        return ReadExpiring(string("tx"), nFrom, nTo, vchNames, nMax);
+    }
+};
+
+// Changes are visible at once but only reach the database on Flush
+BOOST_AUTO_TEST_CASE(servicedb_flush)
+{
+    CServiceDB db(boost::filesystem::path("servicedb_tests"), 1 << 20, true);
+    CLevelDB &dbDisk = db;
+    int n;
+
+    BOOST_CHECK(db.Write(string("a"), 1));
+    BOOST_CHECK(db.Write(string("b"), 2));
+    BOOST_CHECK(db.Read(string("a"), n) && n == 1);
+    BOOST_CHECK(db.Exists(string("b")));
+    BOOST_CHECK(!dbDisk.Exists(string("a")));
+    BOOST_CHECK(db.GetCacheSize() == 2);
+
+    BOOST_CHECK(db.Flush());
+    BOOST_CHECK(db.GetCacheSize() == 0);
+    BOOST_CHECK(dbDisk.Read(string("a"), n) && n == 1);
+
+    // an erase hides the value on disk until it is flushed too
+    BOOST_CHECK(db.Erase(string("a")));
+    BOOST_CHECK(!db.Exists(string("a")) && !db.Read(string("a"), n));
+    BOOST_CHECK(dbDisk.Exists(string("a")));
+    BOOST_CHECK(db.Flush());
+    BOOST_CHECK(!dbDisk.Exists(string("a")));
+    BOOST_CHECK(dbDisk.Read(string("b"), n) && n == 2);
+}
+
+// Changes made inside an aborted transaction are dropped, committed ones kept
+BOOST_AUTO_TEST_CASE(servicedb_txn)
+{
+    CServiceDB db(boost::filesystem::path("servicedb_tests"), 1 << 20, true);
+    int n;
+
+    BOOST_CHECK(db.Write(string("a"), 1));
+    db.TxnBegin();
+    BOOST_CHECK(db.Write(string("a"), 2));
+    BOOST_CHECK(db.Write(string("b"), 3));
+    BOOST_CHECK(db.Read(string("a"), n) && n == 2);
+    db.TxnAbort();
+    BOOST_CHECK(db.Read(string("a"), n) && n == 1);
+    BOOST_CHECK(!db.Exists(string("b")));
+
+    db.TxnBegin();
+    BOOST_CHECK(db.Erase(string("a")));
+    CLevelDBBatch batch;
+    batch.Write(string("c"), 4);
+    BOOST_CHECK(db.WriteBatch(batch));
+    db.TxnCommit();
+    BOOST_CHECK(db.Flush());
+
+    CLevelDB &dbDisk = db;
+    BOOST_CHECK(!dbDisk.Exists(string("a")));
+    BOOST_CHECK(dbDisk.Read(string("c"), n) && n == 4);
+}
+
+static string SerializedKey(const string &strKey)
+{
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << strKey;
+    return ssKey.str();
+}
+
+// Preloaded records, found or not, are served from memory behind any staged
+// change until the preload is cleared or the changes are flushed
+BOOST_AUTO_TEST_CASE(servicedb_preload)
+{
+    CServiceDB db(boost::filesystem::path("servicedb_tests"), 1 << 20, true);
+    CLevelDB &dbDisk = db;
+    int n;
+
+    BOOST_CHECK(dbDisk.Write(string("a"), 1));
+    db.Preload(SerializedKey("a"));
+    db.Preload(SerializedKey("c"));
+    BOOST_CHECK(dbDisk.Write(string("a"), 5));
+    BOOST_CHECK(dbDisk.Write(string("c"), 6));
+    BOOST_CHECK(db.Read(string("a"), n) && n == 1);
+    BOOST_CHECK(!db.Exists(string("c")) && !db.Read(string("c"), n));
+    BOOST_CHECK(db.GetCacheSize() == 0);
+
+    db.ClearPreload();
+    BOOST_CHECK(db.Read(string("a"), n) && n == 5);
+    BOOST_CHECK(db.Read(string("c"), n) && n == 6);
+
+    db.Preload(SerializedKey("a"));
+    BOOST_CHECK(db.Write(string("a"), 2));
+    BOOST_CHECK(db.Read(string("a"), n) && n == 2);
+    BOOST_CHECK(db.Erase(string("c")));
+    db.Preload(SerializedKey("c"));
+    BOOST_CHECK(!db.Exists(string("c")));
+    BOOST_CHECK(db.Flush());
+    BOOST_CHECK(dbDisk.Write(string("a"), 7));
+    BOOST_CHECK(db.Read(string("a"), n) && n == 7);
+}
+
+// Versions replace at the same height, pop back to the one below, and list
+// in height order whether or not they have been flushed
+BOOST_AUTO_TEST_CASE(servicedb_versions)
+{
+    CTestVersionDB db;
+    vector<unsigned char> vchA(1, 'a'), vchB(1, 'b');
+    vector<int> vn;
+    int n;
+
+    BOOST_CHECK(db.Put(vchA, 5, 1));
+    BOOST_CHECK(db.Put(vchA, 300, 2));
+    BOOST_CHECK(db.Flush());
+    BOOST_CHECK(db.Put(vchA, 300, 3));
+    BOOST_CHECK(db.Put(vchA, 70000, 4));
+    BOOST_CHECK(db.Put(vchB, 10, 9));
+    BOOST_CHECK(!db.Put(vchA, 6, 5));
+
+    BOOST_CHECK(db.Head(vchA, n) && n == 4);
+    BOOST_CHECK(db.History(vchA, vn));
+    BOOST_CHECK(vn.size() == 3 && vn[0] == 1 && vn[1] == 3 && vn[2] == 4);
+
+    BOOST_CHECK(db.Pop(vchA));
+    BOOST_CHECK(db.Head(vchA, n) && n == 3);
+    BOOST_CHECK(db.Flush());
+    BOOST_CHECK(db.Pop(vchA));
+    BOOST_CHECK(db.Head(vchA, n) && n == 1);
+    BOOST_CHECK(db.Pop(vchA));
+    BOOST_CHECK(!db.Head(vchA, n));
+    vn.clear();
+    BOOST_CHECK(db.History(vchA, vn) && vn.empty());
+    BOOST_CHECK(db.History(vchB, vn) && vn.size() == 1 && vn[0] == 9);
+}
+
+// The expiry index lists names by height, flushed or not, and compacting a
+// record leaves only its head
+BOOST_AUTO_TEST_CASE(servicedb_expiry)
+{
+    CTestVersionDB db;
+    vector<unsigned char> vchA(1, 'a'), vchB(1, 'b'), vchC(1, 'c');
+    vector<vector<unsigned char> > vchNames;
+    vector<int> vn;
+    int n;
+
+    BOOST_CHECK(db.Expires(vchA, 300));
+    BOOST_CHECK(db.Expires(vchB, 5));
+    BOOST_CHECK(db.Flush());
+    BOOST_CHECK(db.Expires(vchC, 70000));
+    BOOST_CHECK(db.Expiring(0, 301, vchNames));
+    BOOST_CHECK(vchNames.size() == 2 && vchNames[0] == vchB && vchNames[1] == vchA);
+    BOOST_CHECK(db.Expiring(6, -1, vchNames));
+    BOOST_CHECK(vchNames.size() == 2 && vchNames[0] == vchA && vchNames[1] == vchC);
+    BOOST_CHECK(db.Expiring(0, -1, vchNames, 1));
+    BOOST_CHECK(vchNames.size() == 1 && vchNames[0] == vchB);
+    BOOST_CHECK(db.Expires(vchB, 5, true));
+    BOOST_CHECK(db.Expiring(0, 301, vchNames));
+    BOOST_CHECK(vchNames.size() == 1 && vchNames[0] == vchA);
+
+    BOOST_CHECK(db.Put(vchA, 5, 1));
+    BOOST_CHECK(db.Put(vchA, 300, 2));
+    BOOST_CHECK(db.Flush());
+    BOOST_CHECK(db.Put(vchA, 400, 3));
+    BOOST_CHECK(db.Compact(vchA));
+    BOOST_CHECK(db.History(vchA, vn) && vn.size() == 1 && vn[0] == 3);
+    BOOST_CHECK(db.Flush());
+    BOOST_CHECK(db.Head(vchA, n) && n == 3);
+    BOOST_CHECK(db.Pop(vchA));
+    BOOST_CHECK(!db.Head(vchA, n));
+}
+
+// Under a read view reads, history included, see the databases as they were
+// published, and neither later flushes nor staged changes
+BOOST_AUTO_TEST_CASE(servicedb_snapshot)
+{
+    CTestVersionDB db, db2;
+    vector<unsigned char> vchA(1, 'a');
+    vector<int> vn;
+    int n;
+
+    {
+        CServiceReadView view;
+        BOOST_CHECK(view.nHeight == -1);
+    }
+
+    BOOST_CHECK(db.Put(vchA, 5, 1));
+    BOOST_CHECK(db2.Write(string("b"), 1));
+    BOOST_CHECK(db.Flush() && db2.Flush());
+    vector<CLevelDB*> vpdb;
+    vpdb.push_back(&db);
+    vpdb.push_back(&db2);
+    CServiceSnapshot::Publish(vpdb, 5);
+
+    BOOST_CHECK(db.Put(vchA, 6, 2));
+    BOOST_CHECK(db2.Erase(string("b")));
+    BOOST_CHECK(db.Flush() && db2.Flush());
+    BOOST_CHECK(db.Put(vchA, 7, 3));
+    BOOST_CHECK(db2.Write(string("c"), 3));
+
+    {
+        CServiceReadView view;
+        BOOST_CHECK(view.nHeight == 5);
+        BOOST_CHECK(db.Head(vchA, n) && n == 1);
+        BOOST_CHECK(db.History(vchA, vn) && vn.size() == 1 && vn[0] == 1);
+        BOOST_CHECK(db2.Read(string("b"), n) && n == 1);
+        BOOST_CHECK(!db2.Exists(string("c")));
+        {
+            CServiceReadView viewInner;
+            BOOST_CHECK(viewInner.nHeight == 5);
+        }
+        BOOST_CHECK(db2.Exists(string("b")));
+    }
+
+    // without a view the live state, staged changes included
+    BOOST_CHECK(db.Head(vchA, n) && n == 3);
+    BOOST_CHECK(!db2.Exists(string("b")));
+    BOOST_CHECK(db2.Read(string("c"), n) && n == 3);
+
+    CServiceSnapshot::Release();
+    {
+        CServiceReadView view;
+        BOOST_CHECK(view.nHeight == -1);
+        BOOST_CHECK(db.Head(vchA, n) && n == 3);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
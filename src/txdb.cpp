@@ -79,10 +79,26 @@ bool CBlockTreeDB::WriteBlockIndex(const CBlockIndex& blockindex)
     return Write(boost::tuples::make_tuple('b', blockindex.GetBlockHash(), 'b'), blockindex);
 }
 
+bool CBlockTreeDB::WriteBlockIndexes(const std::vector<CBlockIndex*> &vIndex)
+{
+    CLevelDBBatch batch;
+    for (std::vector<CBlockIndex*>::const_iterator it=vIndex.begin(); it!=vIndex.end(); it++)
+        batch.Write(boost::tuples::make_tuple('b', (*it)->GetBlockHash(), 'b'), **it);
+    return WriteBatch(batch);
+}
+
 bool CBlockTreeDB::ReadDiskBlockIndex(const uint256 &blkid, CDiskBlockIndex &diskblockindex) {
     return Read(boost::tuples::make_tuple('b', blkid, 'a'), diskblockindex);
 }
 
+bool CBlockTreeDB::WriteAuxPow(const uint256 &blkid, const CAuxPow& auxpow) {
+    return Write(make_pair('p', blkid), auxpow);
+}
+
+bool CBlockTreeDB::ReadAuxPow(const uint256 &blkid, CAuxPow& auxpow) {
+    return Read(make_pair('p', blkid), auxpow);
+}
+
 bool CBlockTreeDB::ReadBestInvalidWork(CBigNum& bnBestInvalidWork)
 {
     return Read('I', bnBestInvalidWork);
@@ -176,13 +192,19 @@ bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
     return Read(make_pair('t', txid), pos);
 }
 
-bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >&vect) {
+bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >&vect, const CDiskTxHeight &height) {
     CLevelDBBatch batch;
-    for (std::vector<std::pair<uint256,CDiskTxPos> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
+    for (std::vector<std::pair<uint256,CDiskTxPos> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
         batch.Write(make_pair('t', it->first), it->second);
+        batch.Write(make_pair('h', it->first), height);
+    }
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::ReadTxHeight(const uint256 &txid, CDiskTxHeight &height) {
+    return Read(make_pair('h', txid), height);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair('F', name), fValue ? '1' : '0');
 }
@@ -205,6 +227,14 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
     char cType;
     pcursor->Seek(ssKeySet.str());
 
+    // Block index records written by older versions carry the auxpow of
+    // merge-mined blocks at their end. Those proofs are moved to records of
+    // their own, in batches, which a restart simply carries on with.
+    bool fAuxPowMoved = false;
+    ReadFlag("auxpowapart", fAuxPowMoved);
+    CLevelDBBatch batchAuxPow;
+    unsigned int nAuxPowBatch = 0, nAuxPowMoved = 0;
+
     // Load mapBlockIndex
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
@@ -244,6 +274,20 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
                 if (!diskindex.CheckIndex())
                     return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString().c_str());
 
+                if (!fAuxPowMoved && !ssValue_immutable.empty()) {
+                    CAuxPow auxpow;
+                    ssValue_immutable >> auxpow;
+                    batchAuxPow.Write(make_pair('p', hash), auxpow);
+                    batchAuxPow.Write(boost::tuples::make_tuple('b', hash, 'a'), diskindex);
+                    nAuxPowMoved++;
+                    if (++nAuxPowBatch >= 1000) {
+                        if (!WriteBatch(batchAuxPow))
+                            return error("LoadBlockIndex() : failed to move auxpow");
+                        batchAuxPow = CLevelDBBatch();
+                        nAuxPowBatch = 0;
+                    }
+                }
+
                 pcursor->Next(); // now we should be on the 'b' subkey
 
                 assert(pcursor->Valid());
@@ -261,5 +305,12 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
         }
     }
 
+    if (!fAuxPowMoved) {
+        batchAuxPow.Write(std::make_pair('F', std::string("auxpowapart")), '1');
+        if (!WriteBatch(batchAuxPow, true))
+            return error("LoadBlockIndex() : failed to move auxpow");
+        printf("LoadBlockIndex(): moved the auxpow of %u blocks out of the block index\n", nAuxPowMoved);
+    }
+
     return true;
 }
@@ -36,7 +36,10 @@ private:
 public:
     bool WriteDiskBlockIndex(const CDiskBlockIndex& diskblockindex);
     bool WriteBlockIndex(const CBlockIndex& blockindex);
+    bool WriteBlockIndexes(const std::vector<CBlockIndex*> &vIndex);
     bool ReadDiskBlockIndex(const uint256 &blkid, CDiskBlockIndex& diskblockindex);
+    bool WriteAuxPow(const uint256 &blkid, const CAuxPow& auxpow);
+    bool ReadAuxPow(const uint256 &blkid, CAuxPow& auxpow);
     bool ReadBestInvalidWork(CBigNum& bnBestInvalidWork);
     bool WriteBestInvalidWork(const CBigNum& bnBestInvalidWork);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
@@ -46,7 +49,8 @@ public:
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool &fReindex);
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
-    bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list, const CDiskTxHeight &height);
+    bool ReadTxHeight(const uint256 &txid, CDiskTxHeight &height);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts();
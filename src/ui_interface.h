@@ -85,6 +85,9 @@ public:
     /** Block chain changed. */
     boost::signals2::signal<void ()> NotifyBlocksChanged;
 
+    /** New best block, outside the initial block download. */
+    boost::signals2::signal<void (const uint256 &hash, int nHeight)> NotifyBestChain;
+
     /** Number of network connections changed. */
     boost::signals2::signal<void (int newNumConnections)> NotifyNumConnectionsChanged;
 
@@ -179,6 +179,118 @@ public:
         return *this;
     }
 
+    base_uint& operator*=(uint32_t b32)
+    {
+        uint64 carry = 0;
+        for (int i = 0; i < WIDTH; i++)
+        {
+            uint64 n = carry + (uint64)b32 * pn[i];
+            pn[i] = n & 0xffffffff;
+            carry = n >> 32;
+        }
+        return *this;
+    }
+
+    base_uint& operator/=(uint32_t b32)
+    {
+        uint64 rem = 0;
+        for (int i = WIDTH - 1; i >= 0; i--)
+        {
+            uint64 n = (rem << 32) | pn[i];
+            pn[i] = n / b32;
+            rem = n % b32;
+        }
+        return *this;
+    }
+
+    // Long division; leaves 0 when b is 0
+    base_uint& operator/=(const base_uint& b)
+    {
+        base_uint div = b;
+        base_uint num = *this;
+        *this = 0;
+        int num_bits = num.bits();
+        int div_bits = div.bits();
+        if (div_bits == 0 || div_bits > num_bits)
+            return *this;
+        int shift = num_bits - div_bits;
+        div <<= shift;
+        while (shift >= 0)
+        {
+            if (num >= div)
+            {
+                num -= div;
+                pn[shift / 32] |= (1U << (shift & 31));
+            }
+            div >>= 1;
+            shift--;
+        }
+        return *this;
+    }
+
+    // number of significant bits
+    unsigned int bits() const
+    {
+        for (int pos = WIDTH - 1; pos >= 0; pos--)
+        {
+            if (pn[pos])
+            {
+                for (int nbits = 31; nbits > 0; nbits--)
+                    if (pn[pos] & (1U << nbits))
+                        return 32 * pos + nbits + 1;
+                return 32 * pos + 1;
+            }
+        }
+        return 0;
+    }
+
+    // The compact form of nBits, as CBigNum reads and writes it for the
+    // non-negative numbers that targets are. A set sign bit or a value past
+    // 256 bits is reported through pfNegative and pfOverflow.
+    base_uint& SetCompact(unsigned int nCompact, bool *pfNegative = NULL, bool *pfOverflow = NULL)
+    {
+        unsigned int nSize = nCompact >> 24;
+        uint32_t nWord = nCompact & 0x007fffff;
+        if (pfNegative)
+            *pfNegative = nWord != 0 && (nCompact & 0x00800000) != 0;
+        if (pfOverflow)
+            *pfOverflow = nWord != 0 && ((nSize > 34) ||
+                                         (nWord > 0xff && nSize > 33) ||
+                                         (nWord > 0xffff && nSize > 32));
+        *this = 0;
+        if (nSize <= 3)
+            pn[0] = nWord >> 8 * (3 - nSize);
+        else
+        {
+            pn[0] = nWord;
+            *this <<= 8 * (nSize - 3);
+        }
+        return *this;
+    }
+
+    unsigned int GetCompact() const
+    {
+        unsigned int nSize = (bits() + 7) / 8;
+        uint32_t nCompact = 0;
+        if (nSize <= 3)
+            nCompact = pn[0] << 8 * (3 - nSize);
+        else
+        {
+            base_uint bn = *this;
+            bn >>= 8 * (nSize - 3);
+            nCompact = bn.pn[0];
+        }
+        // The 0x00800000 bit denotes the sign.
+        // Thus, if it is already set, divide the mantissa by 256 and increase the exponent.
+        if (nCompact & 0x00800000)
+        {
+            nCompact >>= 8;
+            nSize++;
+        }
+        nCompact |= nSize << 24;
+        return nCompact;
+    }
+
 
     base_uint& operator++()
     {
@@ -601,6 +713,9 @@ inline const uint256 operator&(const base_uint256& a, const base_uint256& b) { r
 inline const uint256 operator|(const base_uint256& a, const base_uint256& b) { return uint256(a) |= b; }
 inline const uint256 operator+(const base_uint256& a, const base_uint256& b) { return uint256(a) += b; }
 inline const uint256 operator-(const base_uint256& a, const base_uint256& b) { return uint256(a) -= b; }
+inline const uint256 operator*(const base_uint256& a, uint32_t b)            { return uint256(a) *= b; }
+inline const uint256 operator/(const base_uint256& a, uint32_t b)            { return uint256(a) /= b; }
+inline const uint256 operator/(const base_uint256& a, const base_uint256& b) { return uint256(a) /= b; }
 
 inline bool operator<(const base_uint256& a, const uint256& b)          { return (base_uint256)a <  (base_uint256)b; }
 inline bool operator<=(const base_uint256& a, const uint256& b)         { return (base_uint256)a <= (base_uint256)b; }
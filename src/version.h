@@ -29,7 +29,8 @@ extern const std::string CLIENT_DATE;
 //70003 = r0.1.2
 //70004 = r0.1.3
 //70005 = r0.1.4, r0.1.5.1, r1.5.1.1
-static const int PROTOCOL_VERSION = 70005;
+//70006 = compact blocks
+static const int PROTOCOL_VERSION = 70006;
 
 // intial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -51,4 +52,7 @@ static const int BIP0031_VERSION = 60000;
 // "mempool" command, enhanced "getdata" behavior starts with this version:
 static const int MEMPOOL_GD_VERSION = 60002;
 
+// "cmpctblock", "getblocktxn" and "blocktxn" commands start with this version
+static const int COMPACT_BLOCKS_VERSION = 70006;
+
 #endif
@@ -183,6 +183,9 @@ HEADERS += src/qt/bitcoingui.h \
     src/alias.h \
     src/offer.h \
     src/cert.h \
+    src/feewindow.h \
+    src/servicedb.h \
+    src/rebuild.h \
     src/json/json_spirit_writer_template.h \
     src/json/json_spirit_writer.h \
     src/json/json_spirit_value.h \
@@ -234,6 +237,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/leveldb.h \
     src/threadsafety.h \
     src/limitedmap.h \
+    src/lrumap.h \
     src/qt/macnotificationhandler.h \
     src/qt/splashscreen.h \
     src/qt/aliastablemodel.h \
@@ -282,6 +286,8 @@ SOURCES += src/qt/bitcoin.cpp \
     src/alias.cpp \
     src/offer.cpp \
     src/cert.cpp \
+    src/feewindow.cpp \
+    src/rebuild.cpp \
     src/walletdb.cpp \
     src/qt/clientmodel.cpp \
     src/qt/guiutil.cpp \
@@ -391,6 +397,15 @@ QMAKE_EXTRA_COMPILERS += gccsse2
 SOURCES_SSE2 += src/scrypt-sse2.cpp
 }
 
+contains(USE_AVX2, 1) {
+DEFINES += USE_AVX2
+gccavx2.input  = SOURCES_AVX2
+gccavx2.output = $$PWD/build/${QMAKE_FILE_BASE}.o
+gccavx2.commands = $(CXX) -c $(CXXFLAGS) $(INCPATH) -o ${QMAKE_FILE_OUT} ${QMAKE_FILE_NAME} -mavx2 -mstackrealign
+QMAKE_EXTRA_COMPILERS += gccavx2
+SOURCES_AVX2 += src/scrypt-avx2.cpp
+}
+
 # Todo: Remove this line when switching to Qt5, as that option was removed
 CODECFORTR = UTF-8
 